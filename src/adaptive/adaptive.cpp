@@ -0,0 +1,252 @@
+// Copyright <disenone>
+
+#include "adaptive.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#include "common/aoi_snapshot.hpp"
+
+namespace aoi { namespace adaptive {
+
+namespace {
+
+// cross 的 beacon 也在玩家列表里，不算场景里的玩家
+template <typename PlayerAoi>
+bool IsScenePlayer(const PlayerAoi &player) {
+  return !player.GetFlag_Removed();
+}
+
+bool IsScenePlayer(const cross::PlayerAoi &player) {
+  return !player.GetFlag_Removed() && !player.GetFlag_Beacon();
+}
+
+
+template <typename PlayerAoi, typename Func>
+void ForEachSensor(const PlayerAoi &player, Func func) {
+  for (const auto &sensor : player.sensors) func(sensor);
+}
+
+template <typename Func>
+void ForEachSensor(const cross::PlayerAoi &player, Func func) {
+  if (!player.observer) return;
+  for (const auto &sensor : player.observer->sensors) func(sensor);
+}
+
+
+// 各个算法的事件换成 squares 的类型，enters、leaves 直接搬过去
+template <typename UpdateInfos>
+AoiUpdateInfos ConvertInfos(UpdateInfos &&engine_infos) {
+  AoiUpdateInfos update_infos;
+  update_infos.reserve(engine_infos.size());
+  for (auto &elem : engine_infos) {
+    auto &update_info = update_infos[elem.first];
+    update_info.nuid = elem.first;
+    for (auto &sensor_info : elem.second.sensor_update_list) {
+      update_info.sensor_update_list.push_back({sensor_info.sensor_id,
+                                                std::move(sensor_info.enters),
+                                                std::move(sensor_info.leaves)});
+    }
+  }
+  return update_infos;
+}
+
+AoiUpdateInfos ConvertInfos(squares::AoiUpdateInfos &&engine_infos) {
+  return std::move(engine_infos);
+}
+
+}  // namespace
+
+
+const char* EngineKindName(EngineKind kind) {
+  switch (kind) {
+    case kEngineBrute: return "brute";
+    case kEngineSquares: return "squares";
+    case kEngineCross: return "cross";
+  }
+  return "unknown";
+}
+
+
+AdaptiveAoi::AdaptiveAoi(const AdaptiveConfig &config /*= AdaptiveConfig()*/,
+                         EngineKind kind /*= kEngineBrute*/,
+                         MemoryResource *resource /*= nullptr*/)
+    : config_(config), resource_(resource) {
+  _CreateEngine(kind);
+}
+
+
+void AdaptiveAoi::_CreateEngine(EngineKind kind) {
+  brute_.reset();
+  squares_.reset();
+  cross_.reset();
+  kind_ = kind;
+  switch (kind_) {
+    case kEngineBrute:
+      brute_.reset(new simd_brute::SimdBruteAoi(resource_));
+      break;
+    case kEngineSquares:
+      squares_.reset(new squares::SquareAoi(config_.square_size, resource_));
+      break;
+    case kEngineCross:
+      cross_.reset(new cross::CrossAoi(config_.map_bound_xmin, config_.map_bound_xmax,
+                                       config_.map_bound_zmin, config_.map_bound_zmax,
+                                       config_.beacon_x, config_.beacon_z,
+                                       config_.beacon_radius, resource_));
+      break;
+  }
+}
+
+
+AdaptiveAoi::~AdaptiveAoi() {
+}
+
+
+void AdaptiveAoi::AddPlayer(Nuid nuid, float x, float y, float z) {
+  _ForEngine([=](auto &aoi) { aoi.AddPlayer(nuid, x, y, z); });
+}
+
+
+void AdaptiveAoi::RemovePlayer(Nuid nuid) {
+  _ForEngine([=](auto &aoi) { aoi.RemovePlayer(nuid); });
+}
+
+
+void AdaptiveAoi::AddSensor(Nuid nuid, Nuid sensor_id, float radius) {
+  _ForEngine([=](auto &aoi) { aoi.AddSensor(nuid, sensor_id, radius); });
+}
+
+
+void AdaptiveAoi::UpdatePos(Nuid nuid, float x, float y, float z) {
+  _ForEngine([=](auto &aoi) { aoi.UpdatePos(nuid, x, y, z); });
+}
+
+
+void AdaptiveAoi::AddStaticEntity(Nuid nuid, float x, float y, float z) {
+  _ForEngine([=](auto &aoi) { aoi.AddStaticEntity(nuid, x, y, z); });
+}
+
+
+void AdaptiveAoi::SetSensorMaxVisible(Nuid nuid, Nuid sensor_id, Uint32 max_visible) {
+  _ForEngine([=](auto &aoi) { aoi.SetSensorMaxVisible(nuid, sensor_id, max_visible); });
+}
+
+
+void AdaptiveAoi::SetSensorLeaveRadius(Nuid nuid, Nuid sensor_id, float leave_radius) {
+  _ForEngine([=](auto &aoi) { aoi.SetSensorLeaveRadius(nuid, sensor_id, leave_radius); });
+}
+
+
+void AdaptiveAoi::SetSensorInterval(Nuid nuid, Nuid sensor_id, Uint32 interval) {
+  _ForEngine([=](auto &aoi) { aoi.SetSensorInterval(nuid, sensor_id, interval); });
+}
+
+
+void AdaptiveAoi::SetPlayerCategory(Nuid nuid, Uint32 category) {
+  _ForEngine([=](auto &aoi) { aoi.SetPlayerCategory(nuid, category); });
+}
+
+
+void AdaptiveAoi::SetSensorInterest(Nuid nuid, Nuid sensor_id, Uint32 interest) {
+  _ForEngine([=](auto &aoi) { aoi.SetSensorInterest(nuid, sensor_id, interest); });
+}
+
+
+void AdaptiveAoi::SetTraceWriter(TraceWriter *writer) {
+  trace_writer_ = writer;
+  _ForEngine([writer](auto &aoi) { aoi.SetTraceWriter(writer); });
+}
+
+
+MemoryUsage AdaptiveAoi::GetMemoryUsage() const {
+  MemoryUsage usage;
+  _ForEngine([&usage](const auto &aoi) { usage = aoi.GetMemoryUsage(); });
+  return usage;
+}
+
+
+AoiUpdateInfos AdaptiveAoi::Tick() {
+  AoiUpdateInfos update_infos;
+  _ForEngine([&update_infos](auto &aoi) { update_infos = ConvertInfos(aoi.Tick()); });
+  ++tick_count_;
+
+  EngineKind kind = kind_;
+  if (switch_requested_) {
+    kind = requested_kind_;
+    switch_requested_ = false;
+  } else if (config_.check_interval > 0 && tick_count_ % config_.check_interval == 0) {
+    _MeasureScene();
+    kind = ChooseEngine(config_, kind_, shape_);
+  }
+  if (kind != kind_) _Migrate(kind);
+  return update_infos;
+}
+
+
+EngineKind AdaptiveAoi::ChooseEngine(const AdaptiveConfig &config, EngineKind current,
+                                     const SceneShape &shape) {
+  float stay = 1 + config.hysteresis;
+  float keep = current == kEngineBrute ? stay : 1;
+  if (shape.player_num <= config.brute_max_players * keep) return kEngineBrute;
+  if (shape.neighbours * keep >= config.brute_min_visible_ratio * shape.player_num) {
+    return kEngineBrute;
+  }
+
+  float squares_min = config.squares_min_players;
+  if (current == kEngineSquares) squares_min /= stay;
+  if (current == kEngineCross) squares_min *= stay;
+  return shape.player_num >= squares_min ? kEngineSquares : kEngineCross;
+}
+
+
+void AdaptiveAoi::_MeasureScene() {
+  SceneShape shape;
+  float min_x = 0, max_x = 0, min_z = 0, max_z = 0;
+  double radius_sum = 0;
+  _ForEngine([&](const auto &aoi) {
+    for (const auto &elem : aoi.GetPlayerMap()) {
+      const auto &player = *elem.second;
+      if (!IsScenePlayer(player)) continue;
+
+      if (shape.player_num == 0) {
+        min_x = max_x = player.pos.x;
+        min_z = max_z = player.pos.z;
+      } else {
+        min_x = std::min(min_x, player.pos.x);
+        max_x = std::max(max_x, player.pos.x);
+        min_z = std::min(min_z, player.pos.z);
+        max_z = std::max(max_z, player.pos.z);
+      }
+      ++shape.player_num;
+      ForEachSensor(player, [&](const auto &sensor) {
+        ++shape.sensor_num;
+        radius_sum += sensor.radius;
+      });
+    }
+  });
+
+  if (shape.sensor_num > 0) {
+    shape.mean_radius = radius_sum / shape.sensor_num;
+    // 包围盒比 sensor 范围还小时，每个 sensor 都能看到所有玩家
+    double sensor_area = M_PI * shape.mean_radius * shape.mean_radius;
+    double area = std::max<double>((max_x - min_x) * (max_z - min_z), sensor_area);
+    shape.neighbours = shape.player_num * sensor_area / area;
+  }
+  shape_ = shape;
+}
+
+
+void AdaptiveAoi::_Migrate(EngineKind kind) {
+  AoiSnapshot snapshot;
+  _ForEngine([&snapshot](const auto &aoi) { aoi.ExportSnapshot(&snapshot); });
+  _CreateEngine(kind);
+  _ForEngine([&snapshot](auto &aoi) { ImportSnapshot(snapshot, &aoi); });
+  // 搬完再接上 trace，搬过去的操作不记录
+  if (trace_writer_) SetTraceWriter(trace_writer_);
+  ++switch_count_;
+}
+
+}  // namespace adaptive
+
+}  // namespace aoi
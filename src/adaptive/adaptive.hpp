@@ -0,0 +1,163 @@
+// Copyright <disenone>
+#pragma once
+
+#include <memory>
+
+#include "common/base_types.hpp"
+#include "common/memory_resource.hpp"
+#include "common/memory_usage.hpp"
+#include "cross/cross.hpp"
+#include "simd_brute/simd_brute.hpp"
+#include "squares/squares.hpp"
+
+namespace aoi {
+
+class TraceWriter;
+
+namespace adaptive {
+
+// 按人数和密度自动选择算法的前端：人少、或者每个 sensor 都能看到场景里很大一部分玩家时用
+// simd_brute（格子裁剪不掉多少，不如直接扫），其余按人数在 cross（人不多时最快）和 squares
+// （人多时 cross 的 UpdatePos 越来越慢）之间选。每隔 check_interval 次 Tick 在 Tick 结束时评估一次，
+// 要换算法时导出 AoiSnapshot，连同每个 sensor 上一次的 aoi 列表和计算相位一起搬到新的算法上，
+// 调用者看到的进出事件和一直用同一种算法一样，不会因为切换多出或者少掉事件。
+// Front end that picks brute / squares / cross by population and density and migrates the
+// scene, including every sensor's visible set, so switching emits no spurious events.
+
+// 事件的类型和 squares 一样，用 squares 时不用转换
+typedef squares::PlayerNuids PlayerNuids;
+typedef squares::SensorUpdateInfo SensorUpdateInfo;
+typedef squares::AoiUpdateInfo AoiUpdateInfo;
+typedef squares::AoiUpdateInfos AoiUpdateInfos;
+
+enum EngineKind {
+  kEngineBrute,
+  kEngineSquares,
+  kEngineCross,
+};
+
+const char* EngineKindName(EngineKind kind);
+
+
+struct AdaptiveConfig {
+  float square_size = 200;
+  // cross 的地图边界和 beacon，默认不用 beacon
+  float map_bound_xmin = 0;
+  float map_bound_xmax = 0;
+  float map_bound_zmin = 0;
+  float map_bound_zmax = 0;
+  size_t beacon_x = 0;
+  size_t beacon_z = 0;
+  float beacon_radius = 0;
+
+  // 默认值来自 aoi_bench 所有玩家都移动、sensor 半径 100 的结果，算的是 UpdatePos 加 Tick
+  size_t brute_max_players = 128;       // 玩家数不超过它时用 simd_brute
+  float brute_min_visible_ratio = 0.1f; // 每个 sensor 平均看到的玩家占比不低于它时也用 simd_brute
+  size_t squares_min_players = 4000;    // 其余玩家数不少于它时用 squares，否则 cross
+  float hysteresis = 0.25f;             // 离开当前算法的门槛放宽这个比例，免得在边界上来回切
+  Uint32 check_interval = 16;           // 每隔几次 Tick 评估一次，0 不自动切换
+};
+
+
+// 评估时的场景形状，由当前算法的玩家列表算出来
+struct SceneShape {
+  size_t player_num = 0;
+  size_t sensor_num = 0;
+  float mean_radius = 0;    // sensor 的平均进入半径
+  float neighbours = 0;     // 假设玩家在包围盒里均匀分布，一个 sensor 范围内的平均玩家数
+};
+
+
+class AdaptiveAoi {
+ public:
+  // resource 不为空时所有算法都从它分配，要比 AdaptiveAoi 活得久
+  explicit AdaptiveAoi(const AdaptiveConfig &config = AdaptiveConfig(),
+                       EngineKind kind = kEngineBrute, MemoryResource *resource = nullptr);
+  ~AdaptiveAoi();
+
+  void AddPlayer(Nuid nuid, float x, float y, float z);
+  void RemovePlayer(Nuid nuid);
+  void AddSensor(Nuid nuid, Nuid sensor_id, float radius);
+  void UpdatePos(Nuid nuid, float x, float y, float z);
+  void AddStaticEntity(Nuid nuid, float x, float y, float z);
+  void SetSensorMaxVisible(Nuid nuid, Nuid sensor_id, Uint32 max_visible);
+  void SetSensorLeaveRadius(Nuid nuid, Nuid sensor_id, float leave_radius);
+  void SetSensorInterval(Nuid nuid, Nuid sensor_id, Uint32 interval);
+  void SetPlayerCategory(Nuid nuid, Uint32 category);
+  void SetSensorInterest(Nuid nuid, Nuid sensor_id, Uint32 interest);
+  // 当前算法的 Tick，结束时按需切换算法
+  AoiUpdateInfos Tick();
+  // 下一次 Tick 结束时搬到 kind 上，不管自动选择的结果，之后仍然自动选择
+  void RequestSwitch(EngineKind kind) {
+    requested_kind_ = kind;
+    switch_requested_ = true;
+  }
+  EngineKind GetEngineKind() const {
+    return kind_;
+  }
+  // 切换过几次算法
+  size_t GetSwitchCount() const {
+    return switch_count_;
+  }
+  // 最近一次评估时的场景形状
+  const SceneShape& GetSceneShape() const {
+    return shape_;
+  }
+  MemoryUsage GetMemoryUsage() const;
+  // 记录之后的操作，切换算法时搬过去的状态不记录
+  void SetTraceWriter(TraceWriter *writer);
+
+  // 按场景形状选算法，current 是当前的算法，用来放宽离开它的门槛
+  static EngineKind ChooseEngine(const AdaptiveConfig &config, EngineKind current,
+                                 const SceneShape &shape);
+
+ protected:
+  // 对当前的算法调用 func(aoi)
+  template <typename Func>
+  void _ForEngine(Func func);
+  template <typename Func>
+  void _ForEngine(Func func) const;
+  // 换成一个空的 kind 算法
+  void _CreateEngine(EngineKind kind);
+  void _MeasureScene();
+  void _Migrate(EngineKind kind);
+
+ protected:
+  AdaptiveConfig config_;
+  MemoryResource *resource_;
+  EngineKind kind_;
+  // 只有 kind_ 对应的一个不为空
+  std::unique_ptr<simd_brute::SimdBruteAoi> brute_;
+  std::unique_ptr<squares::SquareAoi> squares_;
+  std::unique_ptr<cross::CrossAoi> cross_;
+
+  TraceWriter *trace_writer_ = nullptr;
+  Uint64 tick_count_ = 0;
+  size_t switch_count_ = 0;
+  SceneShape shape_;
+  EngineKind requested_kind_ = kEngineBrute;
+  bool switch_requested_ = false;
+};
+
+
+template <typename Func>
+void AdaptiveAoi::_ForEngine(Func func) {
+  switch (kind_) {
+    case kEngineBrute: func(*brute_); break;
+    case kEngineSquares: func(*squares_); break;
+    case kEngineCross: func(*cross_); break;
+  }
+}
+
+
+template <typename Func>
+void AdaptiveAoi::_ForEngine(Func func) const {
+  switch (kind_) {
+    case kEngineBrute: func(static_cast<const simd_brute::SimdBruteAoi&>(*brute_)); break;
+    case kEngineSquares: func(static_cast<const squares::SquareAoi&>(*squares_)); break;
+    case kEngineCross: func(static_cast<const cross::CrossAoi&>(*cross_)); break;
+  }
+}
+
+}   // namespace adaptive
+}   // namespace aoi
@@ -0,0 +1,243 @@
+// Copyright <disenone>
+
+#include "brute.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <tuple>
+#include <utility>
+
+#include "common/visible_cap.hpp"
+
+namespace aoi { namespace brute {
+
+void BruteAoi::AddPlayer(Nuid nuid, float x, float y, float z) {
+  auto piter = player_map_.find(nuid);
+  if (piter != player_map_.end()) {
+    auto &player = *piter->second;
+    player.UnsetFlag_Removed();
+    player.pos.Set(x, y, z);
+    return;
+  }
+
+  player_map_.emplace(nuid, std::make_shared<PlayerAoi>(nuid, x, y, z));
+}
+
+
+void BruteAoi::RemovePlayer(Nuid nuid) {
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  piter->second->SetFlag_Removed();
+}
+
+
+void BruteAoi::AddSensor(Nuid nuid, Nuid sensor_id, float radius) {
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  auto &player = *piter->second;
+  for (const auto &sensor : player.sensors) {
+    if (sensor.sensor_id == sensor_id) return;
+  }
+  player.sensors.emplace_back(sensor_id, radius);
+}
+
+
+void BruteAoi::UpdatePos(Nuid nuid, float x, float y, float z) {
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  piter->second->pos.Set(x, y, z);
+}
+
+
+void BruteAoi::AddStaticEntity(Nuid nuid, float x, float y, float z) {
+  static_entities_.emplace_back(nuid, Pos(x, y, z));
+}
+
+
+void BruteAoi::SetSensorMaxVisible(Nuid nuid, Nuid sensor_id, Uint32 max_visible) {
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.max_visible = max_visible;
+      sensor.changed = true;
+    }
+  }
+}
+
+
+void BruteAoi::SetSensorLeaveRadius(Nuid nuid, Nuid sensor_id, float leave_radius) {
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      leave_radius = std::max(leave_radius, sensor.radius);
+      sensor.leave_radius_square = leave_radius * leave_radius;
+      sensor.changed = true;
+    }
+  }
+}
+
+
+void BruteAoi::SetSensorInterval(Nuid nuid, Nuid sensor_id, Uint32 interval) {
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.interval = std::max<Uint32>(interval, 1);
+      sensor.phase = interval_schedule_.AllocPhase(sensor.interval);
+      sensor.changed = true;
+    }
+  }
+}
+
+
+void BruteAoi::SetPlayerCategory(Nuid nuid, Uint32 category) {
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  piter->second->category = category;
+}
+
+
+void BruteAoi::SetSensorInterest(Nuid nuid, Nuid sensor_id, Uint32 interest) {
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.interest = interest;
+      sensor.changed = true;
+    }
+  }
+}
+
+
+AoiUpdateInfos BruteAoi::Tick() {
+  AoiUpdateInfos update_infos;
+  PlayerNuids new_aoi;
+  PlayerNuids new_static;
+
+  for (auto &elem : player_map_) {
+    auto &player = *elem.second;
+    if (player.GetFlag_Removed()) continue;
+
+    AoiUpdateInfo aoi_update_info;
+    aoi_update_info.nuid = player.nuid;
+    for (auto &sensor : player.sensors) {
+      if (!sensor.changed &&
+          !IntervalSchedule::IsDue(tick_count_, sensor.interval, sensor.phase)) continue;
+      sensor.changed = false;
+      _CalcAoiPlayers(player, sensor, &new_aoi);
+
+      SensorUpdateInfo update_info;
+      update_info.sensor_id = sensor.sensor_id;
+      std::set_difference(new_aoi.begin(), new_aoi.end(),
+                          sensor.aoi_players.begin(), sensor.aoi_players.end(),
+                          std::back_inserter(update_info.enters));
+      std::set_difference(sensor.aoi_players.begin(), sensor.aoi_players.end(),
+                          new_aoi.begin(), new_aoi.end(),
+                          std::back_inserter(update_info.leaves));
+      std::swap(sensor.aoi_players, new_aoi);
+
+      // 静态实体单独算，不参与 max_visible 和离开半径
+      _CalcStaticPlayers(player, sensor, &new_static);
+      std::set_difference(new_static.begin(), new_static.end(),
+                          sensor.static_players.begin(), sensor.static_players.end(),
+                          std::back_inserter(update_info.enters));
+      std::set_difference(sensor.static_players.begin(), sensor.static_players.end(),
+                          new_static.begin(), new_static.end(),
+                          std::back_inserter(update_info.leaves));
+      std::swap(sensor.static_players, new_static);
+
+      if (update_info.enters.empty() && update_info.leaves.empty()) continue;
+      aoi_update_info.sensor_update_list.push_back(std::move(update_info));
+    }
+
+    if (!aoi_update_info.sensor_update_list.empty()) {
+      update_infos.emplace(player.nuid, std::move(aoi_update_info));
+    }
+  }
+
+  for (auto iter = player_map_.begin(); iter != player_map_.end();) {
+    if (iter->second->GetFlag_Removed()) {
+      iter = player_map_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+  ++tick_count_;
+  return update_infos;
+}
+
+
+void BruteAoi::_CalcAoiPlayers(const PlayerAoi& player, const Sensor& sensor,
+                               PlayerNuids* aoi_players) {
+  aoi_players->clear();
+  float pos_x = player.pos.x;
+  float pos_z = player.pos.z;
+  float radius_square = sensor.radius_square;
+
+  for (const auto &elem : player_map_) {
+    const auto &other = *elem.second;
+    if (other.nuid == player.nuid || other.GetFlag_Removed()) continue;
+    if (!(other.category & sensor.interest)) continue;
+
+    float dx = pos_x - other.pos.x;
+    float dz = pos_z - other.pos.z;
+    float dist = dx * dx + dz * dz;
+    if (dist < radius_square) {
+      aoi_players->push_back(other.nuid);
+    } else if (dist < sensor.leave_radius_square &&
+               std::binary_search(sensor.aoi_players.begin(), sensor.aoi_players.end(),
+                                  other.nuid)) {
+      aoi_players->push_back(other.nuid);
+    }
+  }
+
+  if (sensor.max_visible > 0 && aoi_players->size() > sensor.max_visible) {
+    // 全排序后取最近的 max_visible 个，上一次看到的玩家距离打折
+    std::vector<std::tuple<float, Nuid>> keys;
+    for (auto nuid : *aoi_players) {
+      const auto &other = *player_map_.find(nuid)->second;
+      float dx = other.pos.x - pos_x;
+      float dz = other.pos.z - pos_z;
+      float dist = dx * dx + dz * dz;
+      if (std::binary_search(sensor.aoi_players.begin(), sensor.aoi_players.end(), nuid)) {
+        dist *= kVisibleIncumbentScale * kVisibleIncumbentScale;
+      }
+      keys.emplace_back(dist, nuid);
+    }
+    std::sort(keys.begin(), keys.end());
+    aoi_players->clear();
+    for (size_t i = 0; i < sensor.max_visible; ++i) {
+      aoi_players->push_back(std::get<1>(keys[i]));
+    }
+  }
+  std::sort(aoi_players->begin(), aoi_players->end());
+}
+
+
+void BruteAoi::_CalcStaticPlayers(const PlayerAoi& player, const Sensor& sensor,
+                                  PlayerNuids* nuids) {
+  nuids->clear();
+  // 静态实体的 category 是 kDefaultCategory
+  if (!(sensor.interest & kDefaultCategory)) return;
+  for (const auto &elem : static_entities_) {
+    float dx = elem.second.x - player.pos.x;
+    float dz = elem.second.z - player.pos.z;
+    if (dx * dx + dz * dz < sensor.radius_square) {
+      nuids->push_back(elem.first);
+    }
+  }
+  std::sort(nuids->begin(), nuids->end());
+}
+
+}  // namespace brute
+}  // namespace aoi
@@ -0,0 +1,115 @@
+// Copyright <disenone>
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <utility>
+
+#include "common/base_types.hpp"
+#include "common/sensor_interval.hpp"
+
+namespace aoi { namespace brute {
+
+// 暴力 O(n^2) 的 aoi，每次 Tick 对每个 sensor 检查所有玩家，用集合的差来算进出事件。
+// 实现简单，作为 squares / cross 的参照（oracle）。
+// Brute-force O(n^2) reference engine: enters/leaves are plain set differences between
+// the aoi sets of two consecutive ticks.
+
+class PlayerAoi;
+typedef std::unordered_map<Nuid, std::shared_ptr<PlayerAoi>> PlayerMap;
+typedef std::vector<Nuid> PlayerNuids;
+
+
+struct Pos {
+  Pos(float _x, float _y, float _z)
+      : x(_x), y(_y), z(_z) {}
+
+  void Set(float _x, float _y, float _z) {
+    x = _x;
+    y = _y;
+    z = _z;
+  }
+
+  float x, y, z;
+};
+
+
+struct Sensor {
+  Sensor(Nuid _sensor_id, float _radius)
+      : sensor_id(_sensor_id), radius(_radius), radius_square(_radius * _radius),
+        leave_radius_square(_radius * _radius), max_visible(0) {}
+
+  Nuid sensor_id;
+  float radius;
+  float radius_square;
+  float leave_radius_square;  // 已经看到的玩家在这个范围内就不离开
+  Uint32 max_visible;         // 0 不限制
+  Uint32 interval = 1;
+  Uint32 phase = 0;
+  Uint32 interest = kAllCategories;
+  bool changed = true;        // 新加的或者参数变过，下次 Tick 不管间隔都要计算
+  PlayerNuids aoi_players;    // 有序
+  PlayerNuids static_players; // 有序
+};
+
+
+struct PlayerAoi {
+  PlayerAoi(Uint64 _nuid, float _x, float _y, float _z)
+      : nuid(_nuid), pos(_x, _y, _z), flags(0) {}
+
+  AOI_CLASS_ADD_FLAG(Removed, 0, flags);
+
+  Nuid nuid;
+  Pos pos;
+  Uint32 flags;
+  Uint32 category = kDefaultCategory;
+  std::vector<Sensor> sensors;
+};
+
+
+struct SensorUpdateInfo {
+  Nuid sensor_id;
+  PlayerNuids enters;
+  PlayerNuids leaves;
+};
+
+
+struct AoiUpdateInfo {
+  Nuid nuid;
+  std::vector<SensorUpdateInfo> sensor_update_list;
+};
+
+typedef std::unordered_map<Nuid, AoiUpdateInfo> AoiUpdateInfos;
+
+
+class BruteAoi {
+ public:
+  void AddPlayer(Nuid nuid, float x, float y, float z);
+  void RemovePlayer(Nuid nuid);
+  void AddSensor(Nuid nuid, Nuid sensor_id, float radius);
+  void UpdatePos(Nuid nuid, float x, float y, float z);
+  void AddStaticEntity(Nuid nuid, float x, float y, float z);
+  void SetSensorMaxVisible(Nuid nuid, Nuid sensor_id, Uint32 max_visible);
+  void SetSensorLeaveRadius(Nuid nuid, Nuid sensor_id, float leave_radius);
+  void SetSensorInterval(Nuid nuid, Nuid sensor_id, Uint32 interval);
+  void SetPlayerCategory(Nuid nuid, Uint32 category);
+  void SetSensorInterest(Nuid nuid, Nuid sensor_id, Uint32 interest);
+  AoiUpdateInfos Tick();
+  const PlayerMap& GetPlayerMap() const {
+    return player_map_;
+  }
+
+ protected:
+  void _CalcAoiPlayers(const PlayerAoi& player, const Sensor& sensor, PlayerNuids* aoi_players);
+  void _CalcStaticPlayers(const PlayerAoi& player, const Sensor& sensor, PlayerNuids* nuids);
+
+ protected:
+  PlayerMap player_map_;
+  std::vector<std::pair<Nuid, Pos>> static_entities_;
+  Uint64 tick_count_ = 0;
+  IntervalSchedule interval_schedule_;
+};
+
+}   // namespace brute
+}   // namespace aoi
@@ -0,0 +1,425 @@
+// Copyright <disenone>
+
+#include "bvh.hpp"
+
+#include <algorithm>
+#include <utility>
+
+#include "common/aoi_diff.hpp"
+#include "common/trace.hpp"
+#include "common/visible_cap.hpp"
+
+namespace aoi { namespace bvh {
+
+// 静态实体索引的格子不要太小，否则半径小的 sensor 会让格子数爆炸
+constexpr float kMinStaticCellSize = 32;
+
+
+BvhAoi::BvhAoi(float margin /*= 10*/, MemoryResource *resource /*= nullptr*/)
+    : resource_(resource),
+      player_map_(PlayerMap::allocator_type(resource)),
+      player_tree_(margin, resource),
+      sensor_tree_(margin, resource),
+      remove_list_(PlayerPtrList::allocator_type(resource)) {
+  player_map_.reserve(100);
+}
+
+
+void BvhAoi::_AddProxies(PlayerAoi *pptr) {
+  const auto &pos = pptr->pos;
+  pptr->proxy = player_tree_.CreateProxy(Aabb::Around(pos.x, pos.z, 0), pptr);
+  for (Uint32 i = 0; i < pptr->sensors.size(); ++i) {
+    auto &sensor = pptr->sensors[i];
+    sensor.proxy = sensor_tree_.CreateProxy(Aabb::Around(pos.x, pos.z, sensor.radius), pptr, i);
+  }
+}
+
+
+void BvhAoi::_RemoveProxies(PlayerAoi *pptr) {
+  if (pptr->proxy == kNullNode) return;
+
+  player_tree_.DestroyProxy(pptr->proxy);
+  pptr->proxy = kNullNode;
+  for (auto &sensor : pptr->sensors) {
+    sensor_tree_.DestroyProxy(sensor.proxy);
+    sensor.proxy = kNullNode;
+  }
+}
+
+
+void BvhAoi::_MoveProxy(DynamicTree *tree, int proxy, const Aabb &aabb) {
+  auto move = tree->MoveProxy(proxy, aabb);
+  if (move == kProxyRefit) {
+    AOI_STATS_INC(stats_, proxies_refit);
+  } else if (move == kProxyReinserted) {
+    AOI_STATS_INC(stats_, proxies_reinserted);
+  }
+}
+
+
+void BvhAoi::AddPlayer(Nuid nuid, float x, float y, float z) {
+  if (trace_writer_) trace_writer_->AddPlayer(nuid, x, y, z);
+
+  auto piter = player_map_.find(nuid);
+  PlayerAoi* pptr = nullptr;
+
+  if (piter != player_map_.end()) {
+    pptr = piter->second.get();
+    _RemoveProxies(pptr);
+    pptr->pos.Set(x, y, z);
+    pptr->UnsetFlag_Removed();
+  } else {
+    auto ret = player_map_.emplace(nuid, std::allocate_shared<PlayerAoi>(
+        ResourceAllocator<PlayerAoi>(resource_), nuid, x, y, z, resource_));
+    pptr = ret.first->second.get();
+    pptr->SetFlag_New();
+  }
+
+  _AddProxies(pptr);
+}
+
+
+void BvhAoi::RemovePlayer(Nuid nuid) {
+  if (trace_writer_) trace_writer_->RemovePlayer(nuid);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  auto &player = *piter->second;
+  _RemoveProxies(&player);
+  player.SetFlag_Removed();
+  if (!player.GetFlag_PendingErase()) {
+    player.SetFlag_PendingErase();
+    remove_list_.push_back(&player);
+  }
+}
+
+
+void BvhAoi::AddSensor(Nuid nuid, Nuid sensor_id, float radius) {
+  if (trace_writer_) trace_writer_->AddSensor(nuid, sensor_id, radius);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  auto &player = *piter->second;
+  for (const auto &sensor : player.sensors) {
+    if (sensor.sensor_id == sensor_id) return;
+  }
+  player.sensors.emplace_back(sensor_id, radius, resource_);
+  max_sensor_radius_ = std::max(max_sensor_radius_, radius);
+  // 已经移除的玩家重新加入时才放进树里
+  if (player.proxy != kNullNode) {
+    player.sensors.back().proxy = sensor_tree_.CreateProxy(
+        Aabb::Around(player.pos.x, player.pos.z, radius), &player, player.sensors.size() - 1);
+  }
+}
+
+
+void BvhAoi::UpdatePos(Nuid nuid, float x, float y, float z) {
+  if (trace_writer_) trace_writer_->UpdatePos(nuid, x, y, z);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  auto &player = *piter->second;
+  player.pos.Set(x, y, z);
+  if (player.proxy == kNullNode) return;
+
+  _MoveProxy(&player_tree_, player.proxy, Aabb::Around(x, z, 0));
+  for (const auto &sensor : player.sensors) {
+    _MoveProxy(&sensor_tree_, sensor.proxy, Aabb::Around(x, z, sensor.radius));
+  }
+}
+
+
+void BvhAoi::AddStaticEntity(Nuid nuid, float x, float y, float z) {
+  if (trace_writer_) trace_writer_->AddStaticEntity(nuid, x, y, z);
+
+  static_index_.Add(nuid, x, z);
+}
+
+
+void BvhAoi::SetSensorMaxVisible(Nuid nuid, Nuid sensor_id, Uint32 max_visible) {
+  if (trace_writer_) trace_writer_->SetSensorMaxVisible(nuid, sensor_id, max_visible);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.max_visible = max_visible;
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+void BvhAoi::SetSensorLeaveRadius(Nuid nuid, Nuid sensor_id, float leave_radius) {
+  if (trace_writer_) trace_writer_->SetSensorLeaveRadius(nuid, sensor_id, leave_radius);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.leave_radius = std::max(leave_radius, sensor.radius);
+      sensor.leave_radius_square = sensor.leave_radius * sensor.leave_radius;
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+void BvhAoi::SetSensorInterval(Nuid nuid, Nuid sensor_id, Uint32 interval) {
+  if (trace_writer_) trace_writer_->SetSensorInterval(nuid, sensor_id, interval);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.interval = std::max<Uint32>(interval, 1);
+      sensor.phase = interval_schedule_.AllocPhase(sensor.interval);
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+void BvhAoi::SetPlayerCategory(Nuid nuid, Uint32 category) {
+  if (trace_writer_) trace_writer_->SetPlayerCategory(nuid, category);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  auto &player = *piter->second;
+  if (player.category == category) return;
+
+  player.category = category;
+}
+
+
+void BvhAoi::SetSensorInterest(Nuid nuid, Nuid sensor_id, Uint32 interest) {
+  if (trace_writer_) trace_writer_->SetSensorInterest(nuid, sensor_id, interest);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.interest = interest;
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+AoiUpdateInfos BvhAoi::Tick() {
+  if (trace_writer_) trace_writer_->Tick();
+  if (static_index_.IsDirty()) {
+    static_index_.Build(std::max(max_sensor_radius_, kMinStaticCellSize));
+  }
+
+  // 一次树对树的遍历找出所有这次要计算的 sensor 的候选玩家，直接追加到新的列表里
+  Uint32 new_aoi_map_idx = 1 - cur_aoi_map_idx_;
+  sensor_tree_.QueryPairs(player_tree_, [this, new_aoi_map_idx](int sensor_proxy,
+                                                                int player_proxy) {
+    AOI_STATS_INC(stats_, pairs_found);
+    auto owner = static_cast<PlayerAoi*>(sensor_tree_.GetUserData(sensor_proxy));
+    auto other = static_cast<PlayerAoi*>(player_tree_.GetUserData(player_proxy));
+    auto &sensor = owner->sensors[sensor_tree_.GetUserTag(sensor_proxy)];
+    if (owner == other || !(other->category & sensor.interest)) return;
+    if (sensor.interval > 1 && !sensor.IsDue(tick_count_)) return;
+
+    float dx = other->pos.x - owner->pos.x;
+    float dz = other->pos.z - owner->pos.z;
+    if (dx * dx + dz * dz < sensor.radius_square) {
+      sensor.aoi_players[new_aoi_map_idx].push_back(other);
+      AOI_STATS_INC(stats_, candidates_accepted);
+    }
+  });
+
+  AoiUpdateInfos update_infos;
+  for (auto &elem : player_map_) {
+    auto &player = *elem.second;
+    // 移除的玩家不在树里，Tick 结束时删掉
+    if (player.GetFlag_Removed() || player.sensors.empty()) continue;
+
+    auto update_info = _UpdatePlayerAoi(&player);
+    if (!update_info.sensor_update_list.empty()) {
+      update_infos.emplace(update_info.nuid, std::move(update_info));
+    }
+  }
+
+  // 移除之后又加回来的玩家不删
+  for (auto pptr : remove_list_) {
+    pptr->UnsetFlag_PendingErase();
+    if (pptr->GetFlag_Removed()) _ErasePlayer(pptr);
+  }
+  remove_list_.clear();
+  for (auto &elem : player_map_) {
+    auto &player = *elem.second;
+    player.last_pos = player.pos;
+    player.last_category = player.category;
+    player.UnsetFlag_New();
+  }
+
+  cur_aoi_map_idx_ = new_aoi_map_idx;
+  graveyard_.Release(tick_count_++);
+  tick_stats_ = stats_;
+  stats_ = AoiStats();
+  return update_infos;
+}
+
+
+void BvhAoi::_ErasePlayer(PlayerAoi *pptr) {
+  auto piter = player_map_.find(pptr->nuid);
+  // 低频 sensor 最多再过 max_interval 次 Tick 就会重新计算，不再引用这个玩家
+  Uint32 max_interval = interval_schedule_.GetMaxInterval();
+  if (max_interval > 1) {
+    graveyard_.Bury(std::move(piter->second), tick_count_ + max_interval);
+  }
+  player_map_.erase(piter);
+}
+
+
+AoiUpdateInfo BvhAoi::_UpdatePlayerAoi(PlayerAoi *pptr) {
+  AoiUpdateInfo aoi_update_info;
+  aoi_update_info.nuid = pptr->nuid;
+  Uint32 new_aoi_map_idx = 1 - cur_aoi_map_idx_;
+
+  for (auto &sensor : pptr->sensors) {
+    auto &old_aoi = sensor.aoi_players[cur_aoi_map_idx_];
+    auto &new_aoi = sensor.aoi_players[new_aoi_map_idx];
+    if (!sensor.IsDue(tick_count_)) {
+      // 没到计算的时候，上一次的列表原样留给下一次
+      std::swap(old_aoi, new_aoi);
+      old_aoi.clear();
+      AOI_STATS_INC(stats_, sensors_skipped);
+      continue;
+    }
+    bool need_diff = sensor.NeedDiff();
+    // 用 last_pos 算进出时，离开半径内的旧玩家由 _CheckLeave 加回新的列表，不用排序
+    if (need_diff && sensor.leave_radius > sensor.radius) {
+      KeepIncumbents(pptr->pos, sensor.leave_radius_square, sensor.interest, &old_aoi, &new_aoi);
+    }
+    KeepNearest(pptr->pos, sensor.max_visible, &old_aoi, &new_aoi);
+
+    SensorUpdateInfo update_info;
+    auto &enters = update_info.enters;
+    auto &leaves = update_info.leaves;
+    if (need_diff) {
+      DiffAoiPlayers(&old_aoi, &new_aoi, &enters, &leaves);
+    } else {
+      // 先算 enter，这时新的列表里只有半径内的玩家
+      _CheckEnter(*pptr, sensor, new_aoi, &old_aoi, &enters);
+      _CheckLeave(*pptr, sensor, old_aoi, &new_aoi, &leaves);
+    }
+    // 下一次 Tick 往这个列表里追加
+    old_aoi.clear();
+    if (sensor.interest & kDefaultCategory) {
+      sensor.static_aoi.Update(static_index_, pptr->pos.x, pptr->pos.z, sensor.radius,
+                               &enters, &leaves);
+    } else {
+      sensor.static_aoi.Clear(&leaves);
+    }
+    sensor.UnsetFlag_New();
+    sensor.UnsetFlag_Diff();
+    AOI_STATS_ADD(stats_, enters, enters.size());
+    AOI_STATS_ADD(stats_, leaves, leaves.size());
+
+    if (enters.empty() && leaves.empty()) continue;
+
+    update_info.sensor_id = sensor.sensor_id;
+    aoi_update_info.sensor_update_list.push_back(std::move(update_info));
+  }
+
+  return aoi_update_info;
+}
+
+
+void BvhAoi::_CheckLeave(const PlayerAoi &player, const Sensor &sensor,
+                         const PlayerPtrList &aoi_players, PlayerPtrList *new_players,
+                         PlayerNuids *leaves) {
+  float pos_x = player.pos.x;
+  float pos_z = player.pos.z;
+  float radius_square = sensor.radius_square;
+  float leave_radius_square = sensor.leave_radius_square;
+  Uint32 interest = sensor.interest;
+  for (auto old_player_ptr : aoi_players) {
+    float dx = old_player_ptr->pos.x - pos_x;
+    float dz = old_player_ptr->pos.z - pos_z;
+    float dist_square = dx * dx + dz * dz;
+    // 改成了不感兴趣的 category，不管距离都离开
+    if (old_player_ptr->GetFlag_Removed() || !(old_player_ptr->category & interest)) {
+      leaves->push_back(old_player_ptr->nuid);
+    } else if (dist_square >= radius_square) {
+      // 出了进入半径、还在离开半径内的继续看到
+      if (dist_square < leave_radius_square) {
+        new_players->push_back(old_player_ptr);
+      } else {
+        leaves->push_back(old_player_ptr->nuid);
+      }
+    }
+  }
+}
+
+
+void BvhAoi::_CheckEnter(const PlayerAoi &player, const Sensor &sensor,
+                         const PlayerPtrList &aoi_players, PlayerPtrList *old_players,
+                         PlayerNuids *enters) {
+  if (player.GetFlag_New() || sensor.GetFlag_New()) {
+    enters->reserve(aoi_players.size());
+    for (auto new_player_ptr : aoi_players) {
+      enters->push_back(new_player_ptr->nuid);
+    }
+    return;
+  }
+
+  // 上一次 Tick 时不在半径内或者 category 不感兴趣的就是新进来的，除非是离开半径内留下来的旧玩家
+  float pos_x = player.last_pos.x;
+  float pos_z = player.last_pos.z;
+  float radius_square = sensor.radius_square;
+  float leave_radius_square = sensor.leave_radius_square;
+  Uint32 interest = sensor.interest;
+  IncumbentLookup<PlayerPtrList> incumbents(old_players);
+  for (auto new_player_ptr : aoi_players) {
+    if (!(new_player_ptr->last_category & interest)) {
+      enters->push_back(new_player_ptr->nuid);
+      continue;
+    }
+    float dx = new_player_ptr->last_pos.x - pos_x;
+    float dz = new_player_ptr->last_pos.z - pos_z;
+    float dist_square = dx * dx + dz * dz;
+    if (dist_square < radius_square) continue;
+    if (dist_square < leave_radius_square && incumbents.Contains(new_player_ptr)) continue;
+    enters->push_back(new_player_ptr->nuid);
+  }
+}
+
+
+MemoryUsage BvhAoi::GetMemoryUsage() const {
+  MemoryUsage usage;
+  usage.player_map = HashMapBytes(player_map_) + VectorBytes(remove_list_);
+  usage.static_entities = static_index_.MemoryBytes();
+  usage.cells = player_tree_.MemoryBytes() + sensor_tree_.MemoryBytes();
+
+  for (const auto &elem : player_map_) {
+    const auto &player = *elem.second;
+    usage.players += sizeof(PlayerAoi);
+    usage.sensors += VectorBytes(player.sensors);
+    for (const auto &sensor : player.sensors) {
+      usage.aoi_lists += VectorBytes(sensor.aoi_players[0]) + VectorBytes(sensor.aoi_players[1]);
+      usage.static_entities += VectorBytes(sensor.static_aoi.nuids);
+    }
+  }
+  return usage;
+}
+
+}  // namespace bvh
+
+}  // namespace aoi
@@ -0,0 +1,224 @@
+// Copyright <disenone>
+#pragma once
+
+#include <limits>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+
+#include "common/base_types.hpp"
+#include "common/memory_resource.hpp"
+#include "common/memory_usage.hpp"
+#include "common/sensor_interval.hpp"
+#include "common/static_index.hpp"
+#include "common/stats.hpp"
+#include "bvh/dynamic_tree.hpp"
+
+namespace aoi {
+
+class TraceWriter;
+
+namespace bvh {
+
+// 动态包围盒树的 aoi：玩家和 sensor 各放一棵树，Tick 时两棵树同时往下走找出包围盒相交的
+// (sensor, 玩家) 对，再精确判断距离。覆盖整个战场的 sensor 和只看几米的 sensor 都只是一个叶子，
+// 半径差别很大时不像格子那样要扫大量格子。叶子的包围盒放大了 margin，小幅移动不用调整树。
+// 进出事件的算法和 squares 一样：平时用 last_pos 判断，参数变化时用前后两次 aoi 集合的差。
+// Dynamic AABB tree engine: sensor tree vs player tree pair finding, same events as squares.
+
+class PlayerAoi;
+typedef std::unordered_map<Nuid, std::shared_ptr<PlayerAoi>, std::hash<Nuid>, std::equal_to<Nuid>,
+                           ResourceAllocator<std::pair<const Nuid, std::shared_ptr<PlayerAoi>>>>
+    PlayerMap;
+typedef std::vector<Nuid> PlayerNuids;
+typedef std::vector<PlayerAoi*, ResourceAllocator<PlayerAoi*>> PlayerPtrList;
+
+#define AOI_FLOAT_MAX std::numeric_limits<float>::max()
+#undef AOI_INF_POS
+#define AOI_INF_POS AOI_FLOAT_MAX, AOI_FLOAT_MAX, AOI_FLOAT_MAX
+
+
+struct Pos {
+  Pos(float _x, float _y, float _z)
+      : x(_x), y(_y), z(_z) {}
+
+  void Set(float _x, float _y, float _z) {
+    x = _x;
+    y = _y;
+    z = _z;
+  }
+
+  float x, y, z;
+};
+
+
+struct Sensor {
+  Sensor(Nuid _sensor_id, float _radius, MemoryResource *resource = nullptr)
+      : sensor_id(_sensor_id), radius(_radius), radius_square(_radius * _radius),
+        leave_radius(_radius), leave_radius_square(_radius * _radius), flags(0),
+        aoi_players{PlayerPtrList(ResourceAllocator<PlayerAoi*>(resource)),
+                    PlayerPtrList(ResourceAllocator<PlayerAoi*>(resource))} {
+    SetFlag_New();
+  }
+
+  // 新加的 sensor 不管间隔，下次 Tick 马上计算
+  AOI_CLASS_ADD_FLAG(New, 0, flags);
+  // 参数变了，下次 Tick 马上计算，用集合差算进出
+  AOI_CLASS_ADD_FLAG(Diff, 1, flags);
+
+  // 只看到最近的几个玩家，或者上一次计算时的 last_pos 已经对不上
+  bool NeedDiff() const {
+    return max_visible > 0 || interval > 1 || GetFlag_Diff();
+  }
+  bool IsDue(Uint64 tick) const {
+    return GetFlag_New() || GetFlag_Diff() || IntervalSchedule::IsDue(tick, interval, phase);
+  }
+
+  Nuid sensor_id;
+  float radius;               // 进入半径
+  float radius_square;
+  float leave_radius;         // 离开半径，不小于 radius
+  float leave_radius_square;
+  Uint32 flags;
+  Uint32 max_visible = 0;     // 最多看到几个玩家，0 不限制
+  Uint32 interval = 1;        // 每隔几次 Tick 计算一次
+  Uint32 phase = 0;
+  Uint32 interest = kAllCategories;   // 只看 category 和它有交集的玩家
+  int proxy = kNullNode;      // 在 sensor 树里的叶子，玩家移除之后为 kNullNode
+  // aoi_players[1 - cur] 在 Tick 开始时总是空的，找到的玩家直接追加进去
+  PlayerPtrList aoi_players[2];
+  StaticAoi static_aoi;       // 看到的静态实体
+};
+
+
+struct PlayerAoi {
+  PlayerAoi(Uint64 _nuid, float _x, float _y, float _z, MemoryResource *resource = nullptr)
+      : nuid(_nuid), pos(_x, _y, _z), flags(0), last_pos(AOI_INF_POS),
+        sensors(ResourceAllocator<Sensor>(resource)) {}
+
+  AOI_CLASS_ADD_FLAG(Removed, 0, flags);
+  AOI_CLASS_ADD_FLAG(New, 1, flags);
+  // 已经放进 remove_list_，Tick 结束时检查要不要真正删除
+  AOI_CLASS_ADD_FLAG(PendingErase, 2, flags);
+
+  // 判断距离时访问的字段放在最前面
+  Nuid nuid;
+  Pos pos;
+  Uint32 flags;
+  Uint32 category = kDefaultCategory;
+  Pos last_pos;                     // 上一次 Tick 结束时的位置
+  Uint32 last_category = kDefaultCategory;
+  // 只有自己移动或者 Tick 时访问
+  int proxy = kNullNode;            // 在玩家树里的叶子，移除之后为 kNullNode
+  std::vector<Sensor, ResourceAllocator<Sensor>> sensors;
+};
+
+
+struct SensorUpdateInfo {
+  Nuid sensor_id;
+  PlayerNuids enters;
+  PlayerNuids leaves;
+};
+
+
+struct AoiUpdateInfo {
+  Nuid nuid;
+  std::vector<SensorUpdateInfo> sensor_update_list;
+};
+
+typedef std::unordered_map<Nuid, AoiUpdateInfo> AoiUpdateInfos;
+
+
+// 只有定义了 AOI_ENABLE_STATS 才会计数
+struct AoiStats {
+  Uint64 pairs_found = 0;           // 两棵树包围盒相交的 (sensor, 玩家) 对
+  Uint64 candidates_accepted = 0;   // 在半径内的玩家数
+  Uint64 proxies_refit = 0;         // 移动后原地换盒子的叶子
+  Uint64 proxies_reinserted = 0;    // 移动后重新插入的叶子
+  Uint64 enters = 0;
+  Uint64 leaves = 0;
+  Uint64 sensors_skipped = 0;       // 没到计算间隔跳过的 sensor 数
+};
+
+
+class BvhAoi {
+ public:
+  // 叶子的包围盒四边各放大 margin，一次 Tick 里移动不超过 margin 的玩家不用调整树。
+  // resource 不为空时玩家、树节点和 aoi 列表都从 resource 分配，resource 要比 BvhAoi 活得久
+  explicit BvhAoi(float margin = 10, MemoryResource *resource = nullptr);
+
+  void AddPlayer(Nuid nuid, float x, float y, float z);
+  void RemovePlayer(Nuid nuid);
+  void AddSensor(Nuid nuid, Nuid sensor_id, float radius);
+  void UpdatePos(Nuid nuid, float x, float y, float z);
+  // 不会移动、也不会被移除的实体，不进树，下次 Tick 时建成只读索引
+  void AddStaticEntity(Nuid nuid, float x, float y, float z);
+  // sensor 最多只看到最近的 max_visible 个玩家，0 不限制
+  void SetSensorMaxVisible(Nuid nuid, Nuid sensor_id, Uint32 max_visible);
+  // 已经看到的玩家走出 leave_radius 才离开，小于进入半径时按进入半径算
+  void SetSensorLeaveRadius(Nuid nuid, Nuid sensor_id, float leave_radius);
+  // sensor 每隔 interval 次 Tick 才计算一次（0 和 1 都是每次）
+  void SetSensorInterval(Nuid nuid, Nuid sensor_id, Uint32 interval);
+  // 玩家的 category 位掩码，默认 kDefaultCategory
+  void SetPlayerCategory(Nuid nuid, Uint32 category);
+  // sensor 只看 category 和 interest 有交集的玩家，默认 kAllCategories
+  void SetSensorInterest(Nuid nuid, Nuid sensor_id, Uint32 interest);
+  AoiUpdateInfos Tick();
+  const PlayerMap& GetPlayerMap() const {
+    return player_map_;
+  }
+  MemoryResource* GetMemoryResource() const {
+    return resource_;
+  }
+  const DynamicTree& GetPlayerTree() const {
+    return player_tree_;
+  }
+  const DynamicTree& GetSensorTree() const {
+    return sensor_tree_;
+  }
+  // 当前各类数据结构占用的内存，遍历所有玩家，不要每次 Tick 都调用
+  MemoryUsage GetMemoryUsage() const;
+  // 上一次 Tick 结束时统计的计数，包括这次 Tick 以及之前的 UpdatePos
+  const AoiStats& GetTickStats() const {
+    return tick_stats_;
+  }
+  // 记录之后的操作，writer 由调用者持有，传 nullptr 关闭记录
+  void SetTraceWriter(TraceWriter *writer) {
+    trace_writer_ = writer;
+  }
+
+ protected:
+  // 把玩家和它的 sensor 放进两棵树 / 从两棵树里拿出来
+  void _AddProxies(PlayerAoi *pptr);
+  void _RemoveProxies(PlayerAoi *pptr);
+  void _MoveProxy(DynamicTree *tree, int proxy, const Aabb &aabb);
+  void _ErasePlayer(PlayerAoi *pptr);
+  AoiUpdateInfo _UpdatePlayerAoi(PlayerAoi *pptr);
+  // 出了进入半径、还在离开半径内的旧玩家不算离开，追加到 new_players
+  void _CheckLeave(const PlayerAoi &player, const Sensor &sensor,
+                   const PlayerPtrList &aoi_players, PlayerPtrList *new_players,
+                   PlayerNuids *leaves);
+  void _CheckEnter(const PlayerAoi &player, const Sensor &sensor,
+                   const PlayerPtrList &aoi_players, PlayerPtrList *old_players,
+                   PlayerNuids *enters);
+
+ protected:
+  MemoryResource *resource_;
+  PlayerMap player_map_;
+  DynamicTree player_tree_;
+  DynamicTree sensor_tree_;
+  PlayerPtrList remove_list_;             // 调用过 RemovePlayer 的玩家
+  Uint32 cur_aoi_map_idx_ = 0;
+  float max_sensor_radius_ = 0;
+  TraceWriter *trace_writer_ = nullptr;
+  AoiStats stats_;
+  AoiStats tick_stats_;
+
+  Uint64 tick_count_ = 0;
+  IntervalSchedule interval_schedule_;
+  PlayerGraveyard<std::shared_ptr<PlayerAoi>> graveyard_;
+  StaticIndex static_index_;
+};
+
+}   // namespace bvh
+}   // namespace aoi
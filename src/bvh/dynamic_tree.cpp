@@ -0,0 +1,246 @@
+// Copyright <disenone>
+
+#include "dynamic_tree.hpp"
+
+#include <algorithm>
+#include <vector>
+
+namespace aoi { namespace bvh {
+
+DynamicTree::DynamicTree(float margin /*= 0*/, MemoryResource *resource /*= nullptr*/)
+    : margin_(margin), nodes_(ResourceAllocator<TreeNode>(resource)) {
+  nodes_.reserve(16);
+}
+
+
+int DynamicTree::_AllocNode() {
+  if (free_list_ == kNullNode) {
+    nodes_.emplace_back();
+    return nodes_.size() - 1;
+  }
+  int index = free_list_;
+  free_list_ = nodes_[index].parent;
+  nodes_[index] = TreeNode();
+  return index;
+}
+
+
+void DynamicTree::_FreeNode(int index) {
+  nodes_[index].parent = free_list_;
+  nodes_[index].height = -1;
+  free_list_ = index;
+}
+
+
+int DynamicTree::CreateProxy(const Aabb &aabb, void *user_data, Uint32 user_tag /*= 0*/) {
+  int proxy = _AllocNode();
+  auto &node = nodes_[proxy];
+  node.aabb = Aabb(aabb.min_x - margin_, aabb.min_z - margin_,
+                   aabb.max_x + margin_, aabb.max_z + margin_);
+  node.user_data = user_data;
+  node.user_tag = user_tag;
+  _InsertLeaf(proxy);
+  ++proxy_num_;
+  return proxy;
+}
+
+
+void DynamicTree::DestroyProxy(int proxy) {
+  _RemoveLeaf(proxy);
+  _FreeNode(proxy);
+  --proxy_num_;
+}
+
+
+ProxyMove DynamicTree::MoveProxy(int proxy, const Aabb &aabb) {
+  auto &node = nodes_[proxy];
+  if (node.aabb.Contains(aabb)) return kProxyKept;
+
+  Aabb fat_aabb(aabb.min_x - margin_, aabb.min_z - margin_,
+                aabb.max_x + margin_, aabb.max_z + margin_);
+  // 父节点的盒子还包得住，祖先都包得住，只换叶子的盒子。祖先的盒子可能比需要的松，
+  // 之后经过它们的插入、删除会重新算紧
+  if (node.parent != kNullNode && nodes_[node.parent].aabb.Contains(fat_aabb)) {
+    node.aabb = fat_aabb;
+    return kProxyRefit;
+  }
+
+  _RemoveLeaf(proxy);
+  nodes_[proxy].aabb = fat_aabb;
+  _InsertLeaf(proxy);
+  return kProxyReinserted;
+}
+
+
+void DynamicTree::_InsertLeaf(int leaf) {
+  if (root_ == kNullNode) {
+    root_ = leaf;
+    nodes_[root_].parent = kNullNode;
+    return;
+  }
+
+  // 往下找兄弟节点：新建一个父节点的代价是合并后的周长，往下走的每一层都要为扩大的盒子付代价
+  Aabb leaf_aabb = nodes_[leaf].aabb;
+  int index = root_;
+  while (!nodes_[index].IsLeaf()) {
+    const auto &node = nodes_[index];
+    float perimeter = node.aabb.Perimeter();
+    float combined_perimeter = Aabb::Combine(node.aabb, leaf_aabb).Perimeter();
+    float cost = 2 * combined_perimeter;
+    float inheritance_cost = 2 * (combined_perimeter - perimeter);
+
+    auto child_cost = [&](int child_index) {
+      const auto &child = nodes_[child_index];
+      float child_perimeter = Aabb::Combine(leaf_aabb, child.aabb).Perimeter();
+      if (!child.IsLeaf()) child_perimeter -= child.aabb.Perimeter();
+      return child_perimeter + inheritance_cost;
+    };
+    float cost1 = child_cost(node.child1);
+    float cost2 = child_cost(node.child2);
+    if (cost < cost1 && cost < cost2) break;
+    index = cost1 < cost2 ? node.child1 : node.child2;
+  }
+
+  int sibling = index;
+  int old_parent = nodes_[sibling].parent;
+  int new_parent = _AllocNode();
+  auto &parent = nodes_[new_parent];
+  parent.parent = old_parent;
+  parent.aabb = Aabb::Combine(leaf_aabb, nodes_[sibling].aabb);
+  parent.height = nodes_[sibling].height + 1;
+  parent.child1 = sibling;
+  parent.child2 = leaf;
+  nodes_[sibling].parent = new_parent;
+  nodes_[leaf].parent = new_parent;
+
+  if (old_parent == kNullNode) {
+    root_ = new_parent;
+  } else if (nodes_[old_parent].child1 == sibling) {
+    nodes_[old_parent].child1 = new_parent;
+  } else {
+    nodes_[old_parent].child2 = new_parent;
+  }
+
+  _Refit(new_parent);
+}
+
+
+void DynamicTree::_RemoveLeaf(int leaf) {
+  if (leaf == root_) {
+    root_ = kNullNode;
+    return;
+  }
+
+  int parent = nodes_[leaf].parent;
+  int grand_parent = nodes_[parent].parent;
+  int sibling = nodes_[parent].child1 == leaf ? nodes_[parent].child2 : nodes_[parent].child1;
+  _FreeNode(parent);
+
+  if (grand_parent == kNullNode) {
+    root_ = sibling;
+    nodes_[sibling].parent = kNullNode;
+    return;
+  }
+  // 兄弟节点顶替父节点的位置
+  if (nodes_[grand_parent].child1 == parent) {
+    nodes_[grand_parent].child1 = sibling;
+  } else {
+    nodes_[grand_parent].child2 = sibling;
+  }
+  nodes_[sibling].parent = grand_parent;
+  _Refit(grand_parent);
+}
+
+
+void DynamicTree::_Refit(int index) {
+  while (index != kNullNode) {
+    index = _Balance(index);
+    auto &node = nodes_[index];
+    const auto &child1 = nodes_[node.child1];
+    const auto &child2 = nodes_[node.child2];
+    node.height = 1 + std::max(child1.height, child2.height);
+    node.aabb = Aabb::Combine(child1.aabb, child2.aabb);
+    index = node.parent;
+  }
+}
+
+
+int DynamicTree::_Balance(int index_a) {
+  auto &a = nodes_[index_a];
+  if (a.IsLeaf() || a.height < 2) return index_a;
+
+  int index_b = a.child1;
+  int index_c = a.child2;
+  auto &b = nodes_[index_b];
+  auto &c = nodes_[index_c];
+  int balance = c.height - b.height;
+  if (balance >= -1 && balance <= 1) return index_a;
+
+  // 高的一边（up）转到 a 的位置，a 变成它的孩子；up 的两个孩子里高的留在 up 下面，矮的给 a
+  bool rotate_c = balance > 1;
+  int index_up = rotate_c ? index_c : index_b;
+  int index_other = rotate_c ? index_b : index_c;
+  auto &up = nodes_[index_up];
+  auto &other = nodes_[index_other];
+  int index_f = up.child1;
+  int index_g = up.child2;
+  if (nodes_[index_f].height < nodes_[index_g].height) std::swap(index_f, index_g);
+  auto &f = nodes_[index_f];
+  auto &g = nodes_[index_g];
+
+  up.child1 = index_a;
+  up.child2 = index_f;
+  up.parent = a.parent;
+  a.parent = index_up;
+  if (up.parent == kNullNode) {
+    root_ = index_up;
+  } else if (nodes_[up.parent].child1 == index_a) {
+    nodes_[up.parent].child1 = index_up;
+  } else {
+    nodes_[up.parent].child2 = index_up;
+  }
+
+  if (rotate_c) {
+    a.child2 = index_g;
+  } else {
+    a.child1 = index_g;
+  }
+  g.parent = index_a;
+
+  a.aabb = Aabb::Combine(other.aabb, g.aabb);
+  a.height = 1 + std::max(other.height, g.height);
+  up.aabb = Aabb::Combine(a.aabb, f.aabb);
+  up.height = 1 + std::max(a.height, f.height);
+  return index_up;
+}
+
+
+bool DynamicTree::IsValid() const {
+  if (root_ == kNullNode) return proxy_num_ == 0;
+  if (nodes_[root_].parent != kNullNode) return false;
+
+  size_t leaf_num = 0;
+  std::vector<int> stack{root_};
+  while (!stack.empty()) {
+    int index = stack.back();
+    stack.pop_back();
+    const auto &node = nodes_[index];
+    if (node.IsLeaf()) {
+      if (node.height != 0 || node.child2 != kNullNode) return false;
+      ++leaf_num;
+      continue;
+    }
+    const auto &child1 = nodes_[node.child1];
+    const auto &child2 = nodes_[node.child2];
+    if (child1.parent != index || child2.parent != index) return false;
+    if (node.height != 1 + std::max(child1.height, child2.height)) return false;
+    if (!node.aabb.Contains(child1.aabb) || !node.aabb.Contains(child2.aabb)) return false;
+    stack.push_back(node.child1);
+    stack.push_back(node.child2);
+  }
+  return leaf_num == proxy_num_;
+}
+
+}  // namespace bvh
+
+}  // namespace aoi
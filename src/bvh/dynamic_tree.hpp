@@ -0,0 +1,190 @@
+// Copyright <disenone>
+#pragma once
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "common/base_types.hpp"
+#include "common/memory_resource.hpp"
+
+namespace aoi { namespace bvh {
+
+// xz 平面上的轴对齐包围盒
+struct Aabb {
+  Aabb() = default;
+  Aabb(float _min_x, float _min_z, float _max_x, float _max_z)
+      : min_x(_min_x), min_z(_min_z), max_x(_max_x), max_z(_max_z) {}
+
+  // 以 (x, z) 为中心、半边长 half 的正方形
+  static Aabb Around(float x, float z, float half) {
+    return Aabb(x - half, z - half, x + half, z + half);
+  }
+  static Aabb Combine(const Aabb &left, const Aabb &right) {
+    return Aabb(std::min(left.min_x, right.min_x), std::min(left.min_z, right.min_z),
+                std::max(left.max_x, right.max_x), std::max(left.max_z, right.max_z));
+  }
+
+  // 插入时用周长估计代价，和面积相比对细长的盒子更公平
+  float Perimeter() const {
+    return 2 * (max_x - min_x + max_z - min_z);
+  }
+  bool Contains(const Aabb &other) const {
+    return min_x <= other.min_x && min_z <= other.min_z &&
+           other.max_x <= max_x && other.max_z <= max_z;
+  }
+  bool Overlaps(const Aabb &other) const {
+    return min_x <= other.max_x && other.min_x <= max_x &&
+           min_z <= other.max_z && other.min_z <= max_z;
+  }
+
+  float min_x = 0;
+  float min_z = 0;
+  float max_x = 0;
+  float max_z = 0;
+};
+
+
+constexpr int kNullNode = -1;
+
+// MoveProxy 的结果
+enum ProxyMove {
+  kProxyKept = 0,       // 还在放大的包围盒里，什么都不做
+  kProxyRefit = 1,      // 出了自己的盒子但还在父节点里，原地换盒子，不改树的结构
+  kProxyReinserted = 2, // 拿出来重新插入，沿途的祖先重新计算包围盒、做旋转平衡
+};
+
+
+// 动态包围盒树：每个叶子是一个代理（玩家或者 sensor），存放大了 margin 的包围盒，
+// 小幅移动不用调整树。插入时按周长代价找兄弟节点，向上回溯时用 AVL 式的旋转保持平衡。
+// 节点放在一个数组里，空闲节点串成链表复用。
+// Dynamic AABB tree with fattened leaves, SAH-style insertion and AVL rotations.
+class DynamicTree {
+ public:
+  explicit DynamicTree(float margin = 0, MemoryResource *resource = nullptr);
+
+  // aabb 是紧的包围盒，树里存的是放大了 margin 的。user_data、user_tag 原样返回给调用者
+  int CreateProxy(const Aabb &aabb, void *user_data, Uint32 user_tag = 0);
+  void DestroyProxy(int proxy);
+  ProxyMove MoveProxy(int proxy, const Aabb &aabb);
+
+  const Aabb& GetFatAabb(int proxy) const {
+    return nodes_[proxy].aabb;
+  }
+  void* GetUserData(int proxy) const {
+    return nodes_[proxy].user_data;
+  }
+  Uint32 GetUserTag(int proxy) const {
+    return nodes_[proxy].user_tag;
+  }
+  size_t GetProxyNum() const {
+    return proxy_num_;
+  }
+  // 根节点的高度，叶子为 0，空树为 -1
+  int GetHeight() const {
+    return root_ == kNullNode ? -1 : nodes_[root_].height;
+  }
+  size_t MemoryBytes() const {
+    return nodes_.capacity() * sizeof(TreeNode) + stack_.capacity() * sizeof(int);
+  }
+  // 检查父子关系、高度和包围盒是否一致，测试用
+  bool IsValid() const;
+
+  // 包围盒和 aabb 相交的代理，callback(proxy)
+  template <typename Callback>
+  void Query(const Aabb &aabb, Callback callback) const;
+
+  // 两棵树里包围盒相交的代理对，callback(this 的代理, other 的代理)。
+  // 两边同时往下走，不相交的子树整个跳过
+  template <typename Callback>
+  void QueryPairs(const DynamicTree &other, Callback callback) const;
+
+ private:
+  struct TreeNode {
+    bool IsLeaf() const {
+      return child1 == kNullNode;
+    }
+
+    Aabb aabb;
+    void *user_data = nullptr;
+    Uint32 user_tag = 0;
+    int parent = kNullNode;   // 空闲节点用它串成链表
+    int child1 = kNullNode;
+    int child2 = kNullNode;
+    int height = 0;           // 叶子为 0，空闲节点为 -1
+  };
+
+  int _AllocNode();
+  void _FreeNode(int index);
+  void _InsertLeaf(int leaf);
+  void _RemoveLeaf(int leaf);
+  // 从 index 往上重新计算包围盒和高度，顺便做旋转平衡
+  void _Refit(int index);
+  // 左右子树高度差超过 1 时把高的一边转上来，返回转完之后这个位置上的节点
+  int _Balance(int index);
+
+  float margin_;
+  int root_ = kNullNode;
+  int free_list_ = kNullNode;
+  size_t proxy_num_ = 0;
+  std::vector<TreeNode, ResourceAllocator<TreeNode>> nodes_;
+  mutable std::vector<int> stack_;
+};
+
+
+template <typename Callback>
+void DynamicTree::Query(const Aabb &aabb, Callback callback) const {
+  if (root_ == kNullNode) return;
+  // 热循环里直接用裸指针和栈顶下标，少调用 vector 的成员函数
+  const TreeNode *nodes = nodes_.data();
+  stack_.resize(std::max<size_t>(stack_.size(), 64));
+  int top = 0;
+  stack_[top++] = root_;
+  while (top > 0) {
+    int index = stack_[--top];
+    const auto &node = nodes[index];
+    if (!node.aabb.Overlaps(aabb)) continue;
+    if (node.IsLeaf()) {
+      callback(index);
+      continue;
+    }
+    if (top + 2 > static_cast<int>(stack_.size())) stack_.resize(stack_.size() * 2);
+    stack_[top++] = node.child1;
+    stack_[top++] = node.child2;
+  }
+}
+
+
+template <typename Callback>
+void DynamicTree::QueryPairs(const DynamicTree &other, Callback callback) const {
+  if (root_ == kNullNode || other.root_ == kNullNode) return;
+  const TreeNode *left_nodes = nodes_.data();
+  const TreeNode *right_nodes = other.nodes_.data();
+  std::vector<std::pair<int, int>> stack(64);
+  int top = 0;
+  stack[top++] = {root_, other.root_};
+  while (top > 0) {
+    int left_index = stack[--top].first;
+    int right_index = stack[top].second;
+    const auto &left = left_nodes[left_index];
+    const auto &right = right_nodes[right_index];
+    if (!left.aabb.Overlaps(right.aabb)) continue;
+
+    if (left.IsLeaf() && right.IsLeaf()) {
+      callback(left_index, right_index);
+      continue;
+    }
+    if (top + 2 > static_cast<int>(stack.size())) stack.resize(stack.size() * 2);
+    if (right.IsLeaf() || (!left.IsLeaf() && left.aabb.Perimeter() > right.aabb.Perimeter())) {
+      // 先拆大的一边，大 sensor 的盒子很快就被拆到和玩家的子树差不多大
+      stack[top++] = {left.child1, right_index};
+      stack[top++] = {left.child2, right_index};
+    } else {
+      stack[top++] = {left_index, right.child1};
+      stack[top++] = {left_index, right.child2};
+    }
+  }
+}
+
+}  // namespace bvh
+}  // namespace aoi
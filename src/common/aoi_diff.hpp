@@ -0,0 +1,97 @@
+// Copyright <disenone>
+#pragma once
+
+#include <algorithm>
+
+#include "common/base_types.hpp"
+
+namespace aoi {
+
+// 用前后两次的 aoi 集合求差算进出事件，不依赖上一次 Tick 的位置。
+// 两个列表都会被原地按 nuid 排序，列表元素是带 nuid 成员的玩家指针。
+// Enter/leave events as the set difference of two aoi lists; both lists get sorted by nuid.
+template <typename PlayerPtrList, typename PlayerNuids>
+void DiffAoiPlayers(PlayerPtrList *old_players, PlayerPtrList *new_players,
+                    PlayerNuids *enters, PlayerNuids *leaves) {
+  typedef typename PlayerPtrList::value_type PlayerPtr;
+  auto nuid_less = [](PlayerPtr left, PlayerPtr right) { return left->nuid < right->nuid; };
+  std::sort(old_players->begin(), old_players->end(), nuid_less);
+  std::sort(new_players->begin(), new_players->end(), nuid_less);
+
+  auto old_iter = old_players->begin();
+  auto new_iter = new_players->begin();
+  while (old_iter != old_players->end() && new_iter != new_players->end()) {
+    if ((*old_iter)->nuid < (*new_iter)->nuid) {
+      leaves->push_back((*old_iter++)->nuid);
+    } else if ((*new_iter)->nuid < (*old_iter)->nuid) {
+      enters->push_back((*new_iter++)->nuid);
+    } else {
+      ++old_iter;
+      ++new_iter;
+    }
+  }
+  for (; old_iter != old_players->end(); ++old_iter) {
+    leaves->push_back((*old_iter)->nuid);
+  }
+  for (; new_iter != new_players->end(); ++new_iter) {
+    enters->push_back((*new_iter)->nuid);
+  }
+}
+
+
+// 离开半径比进入半径大时，上一次看到、还在离开半径内、category 仍然感兴趣的玩家继续留在
+// 新的列表里。两个列表都会被原地按 nuid 排序，留下的玩家追加在 aoi_players 末尾。
+// 只在用集合差算进出时使用，用 last_pos 的时候由各个算法的 _CheckLeave 处理。
+// Keeps incumbents that are still inside the leave radius.
+template <typename PlayerPtrList, typename Pos, typename Real>
+void KeepIncumbents(const Pos &pos, Real leave_radius_square, Uint32 interest,
+                    PlayerPtrList *incumbents, PlayerPtrList *aoi_players) {
+  typedef typename PlayerPtrList::value_type PlayerPtr;
+  auto nuid_less = [](PlayerPtr left, PlayerPtr right) { return left->nuid < right->nuid; };
+  std::sort(incumbents->begin(), incumbents->end(), nuid_less);
+  std::sort(aoi_players->begin(), aoi_players->end(), nuid_less);
+
+  size_t size = aoi_players->size();
+  size_t i = 0;
+  for (auto old_ptr : *incumbents) {
+    if (old_ptr->GetFlag_Removed() || !(old_ptr->category & interest)) continue;
+    while (i < size && (*aoi_players)[i]->nuid < old_ptr->nuid) ++i;
+    if (i < size && (*aoi_players)[i]->nuid == old_ptr->nuid) continue;
+
+    Real dx = static_cast<Real>(old_ptr->pos.x) - pos.x;
+    Real dz = static_cast<Real>(old_ptr->pos.z) - pos.z;
+    if (dx * dx + dz * dz < leave_radius_square) {
+      aoi_players->push_back(old_ptr);
+    }
+  }
+}
+
+
+// 有离开半径的 sensor 用 last_pos 算 enter 时，上一次在进入半径内的玩家一定已经看到了，在离开半径外的
+// 一定没看到，只有落在两个半径之间的要到上一次的列表里查。第一次查的时候才把列表按 nuid 排序。
+// Lazily sorted membership test on the previous aoi list, for players last seen in the band.
+template <typename PlayerPtrList>
+class IncumbentLookup {
+ public:
+  typedef typename PlayerPtrList::value_type PlayerPtr;
+
+  explicit IncumbentLookup(PlayerPtrList *incumbents) : incumbents_(incumbents) {}
+
+  bool Contains(PlayerPtr player_ptr) {
+    if (!sorted_) {
+      std::sort(incumbents_->begin(), incumbents_->end(), NuidLess);
+      sorted_ = true;
+    }
+    return std::binary_search(incumbents_->begin(), incumbents_->end(), player_ptr, NuidLess);
+  }
+
+ private:
+  static bool NuidLess(PlayerPtr left, PlayerPtr right) {
+    return left->nuid < right->nuid;
+  }
+
+  PlayerPtrList *incumbents_;
+  bool sorted_ = false;
+};
+
+}  // namespace aoi
@@ -0,0 +1,107 @@
+// Copyright <disenone>
+#pragma once
+
+#include <unordered_set>
+#include <vector>
+
+#include "common/base_types.hpp"
+#include "common/sensor_interval.hpp"
+
+namespace aoi {
+
+// 一个 aoi 实例在两次 Tick 之间的完整状态：玩家、sensor 的参数和计算相位、每个 sensor 上一次
+// Tick 之后看到的玩家和静态实体，以及所有静态实体。用来把场景从一种算法搬到另一种算法上：
+// 新的实例 ImportSnapshot 之后，之后每次 Tick 的进出事件都和原来的实例继续 Tick 一样
+// （离开半径、max_visible 按搬过来的列表判断，低频 sensor 按原来的相位计算），不会多出或者少掉事件。
+// Engine-neutral scene state, used to migrate a scene between engines without spurious events.
+
+struct SensorSnapshot {
+  Nuid sensor_id;
+  float radius;
+  float leave_radius;
+  Uint32 max_visible;
+  Uint32 interval;
+  Uint32 phase;                         // IntervalSchedule 分配的相位
+  Uint32 interest;
+  std::vector<Nuid> aoi_players;        // 上一次 Tick 之后看到的玩家，无序
+  std::vector<Nuid> static_entities;    // 上一次 Tick 之后看到的静态实体，按 nuid 排序
+};
+
+
+struct PlayerSnapshot {
+  Nuid nuid;
+  float x, y, z;
+  Uint32 category;
+  std::vector<SensorSnapshot> sensors;
+};
+
+
+struct StaticEntitySnapshot {
+  Nuid nuid;
+  float x, z;
+};
+
+
+struct AoiSnapshot {
+  std::vector<PlayerSnapshot> players;  // 不包括已经移除的玩家
+  std::vector<StaticEntitySnapshot> static_entities;
+  Uint64 tick_count = 0;                // 已经 Tick 过的次数
+  IntervalSchedule interval_schedule;
+};
+
+
+// 把 snapshot 放进一个空的 aoi 实例。Aoi 要有和 squares 一样的接口，再加上 RestoreSensor、
+// RestoreSchedule。已经移除、还留在低频 sensor 列表里的玩家先加进来再移除，
+// 和原来的实例一样等到 sensor 下一次计算时才离开
+template <typename Aoi>
+void ImportSnapshot(const AoiSnapshot &snapshot, Aoi *aoi) {
+  for (const auto &entity : snapshot.static_entities) {
+    aoi->AddStaticEntity(entity.nuid, entity.x, 0, entity.z);
+  }
+  std::unordered_set<Nuid> nuids;
+  nuids.reserve(snapshot.players.size());
+  for (const auto &player : snapshot.players) {
+    aoi->AddPlayer(player.nuid, player.x, player.y, player.z);
+    if (player.category != kDefaultCategory) aoi->SetPlayerCategory(player.nuid, player.category);
+    nuids.insert(player.nuid);
+  }
+  std::vector<Nuid> removed;
+  for (const auto &player : snapshot.players) {
+    for (const auto &sensor : player.sensors) {
+      for (auto other_nuid : sensor.aoi_players) {
+        if (nuids.insert(other_nuid).second) removed.push_back(other_nuid);
+      }
+    }
+  }
+  // 移除的玩家不会被任何 sensor 重新看到，位置无所谓
+  for (auto nuid : removed) {
+    aoi->AddPlayer(nuid, 0, 0, 0);
+  }
+
+  // 所有玩家都加进去之后才能把列表里的 nuid 换成玩家
+  for (const auto &player : snapshot.players) {
+    for (const auto &sensor : player.sensors) {
+      aoi->AddSensor(player.nuid, sensor.sensor_id, sensor.radius);
+      if (sensor.max_visible > 0) {
+        aoi->SetSensorMaxVisible(player.nuid, sensor.sensor_id, sensor.max_visible);
+      }
+      if (sensor.leave_radius > sensor.radius) {
+        aoi->SetSensorLeaveRadius(player.nuid, sensor.sensor_id, sensor.leave_radius);
+      }
+      if (sensor.interval > 1) {
+        aoi->SetSensorInterval(player.nuid, sensor.sensor_id, sensor.interval);
+      }
+      if (sensor.interest != kAllCategories) {
+        aoi->SetSensorInterest(player.nuid, sensor.sensor_id, sensor.interest);
+      }
+      aoi->RestoreSensor(player.nuid, sensor);
+    }
+  }
+  // 上面的 SetSensorInterval 会分配相位，最后再换回原来的分配
+  aoi->RestoreSchedule(snapshot.tick_count, snapshot.interval_schedule);
+  for (auto nuid : removed) {
+    aoi->RemovePlayer(nuid);
+  }
+}
+
+}  // namespace aoi
@@ -0,0 +1,72 @@
+// Copyright <disenone>
+
+#include "arena.hpp"
+
+#include <sys/mman.h>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+
+namespace aoi {
+
+constexpr size_t Arena::kDefaultChunkSize;
+constexpr size_t Arena::kHugePageSize;
+
+Arena::Arena(size_t chunk_size /*= kDefaultChunkSize*/, bool huge_pages /*= false*/)
+    : chunk_size_(chunk_size), huge_pages_(huge_pages) {
+  if (huge_pages_) {
+    // 大页要求整块对齐、大小是 2MB 的整数倍
+    chunk_size_ = (std::max(chunk_size_, kHugePageSize) + kHugePageSize - 1)
+                  / kHugePageSize * kHugePageSize;
+  }
+}
+
+
+Arena::~Arena() {
+  for (auto chunk : chunks_) {
+    std::free(chunk);
+  }
+}
+
+
+void* Arena::Allocate(size_t bytes, size_t alignment /*= alignof(std::max_align_t)*/) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto aligned = [alignment](char *ptr) {
+    auto value = reinterpret_cast<uintptr_t>(ptr);
+    return reinterpret_cast<char*>((value + alignment - 1) & ~(alignment - 1));
+  };
+
+  char *ptr = aligned(cur_);
+  if (!cur_ || ptr + bytes > end_) {
+    _NewChunk(bytes + alignment);
+    ptr = aligned(cur_);
+  }
+  used_bytes_ += ptr + bytes - cur_;
+  cur_ = ptr + bytes;
+  return ptr;
+}
+
+
+void Arena::_NewChunk(size_t min_bytes) {
+  size_t size = chunk_size_;
+  if (min_bytes > size) {
+    // 特别大的分配单独一块，大小仍然是块大小的整数倍
+    size = (min_bytes + chunk_size_ - 1) / chunk_size_ * chunk_size_;
+  }
+
+  void *chunk = nullptr;
+  size_t alignment = huge_pages_ ? kHugePageSize : alignof(std::max_align_t);
+  if (posix_memalign(&chunk, std::max(alignment, sizeof(void*)), size) != 0) {
+    throw std::bad_alloc();
+  }
+#ifdef MADV_HUGEPAGE
+  if (huge_pages_) madvise(chunk, size, MADV_HUGEPAGE);
+#endif
+
+  chunks_.push_back(chunk);
+  reserved_bytes_ += size;
+  cur_ = static_cast<char*>(chunk);
+  end_ = cur_ + size;
+}
+
+}  // namespace aoi
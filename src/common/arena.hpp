@@ -0,0 +1,66 @@
+// Copyright <disenone>
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#include "common/memory_resource.hpp"
+
+namespace aoi {
+
+// 场景级的内存池：按块（默认 2MB）顺序切分，单个释放什么都不做，Arena 析构时整块归还。
+// 一个场景的玩家、格子、aoi 列表都从同一个 Arena 分配，关闭场景时不再有成千上万次 free。
+// 不会复用释放掉的内存，适合生命周期有限的副本场景，长期运行、玩家不停进出的大地图用普通堆。
+// 分配加锁，分区并行 Tick 时多个线程可以同时往自己负责的列表里分配。
+// Scene-owned bump arena: deallocation is a no-op and all chunks are returned at once.
+class Arena : public MemoryResource {
+ public:
+  // huge_pages 为 true 时每块按 2MB 对齐，并用 madvise 建议内核使用透明大页
+  explicit Arena(size_t chunk_size = kDefaultChunkSize, bool huge_pages = false);
+  ~Arena();
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  void* Allocate(size_t bytes, size_t alignment = alignof(std::max_align_t));
+
+  // 已经分出去的字节数（包括对齐浪费的部分）和向系统申请的字节数
+  size_t GetUsedBytes() const {
+    return used_bytes_;
+  }
+  size_t GetReservedBytes() const {
+    return reserved_bytes_;
+  }
+  size_t GetChunkNum() const {
+    return chunks_.size();
+  }
+  bool IsHugePages() const {
+    return huge_pages_;
+  }
+
+  static constexpr size_t kDefaultChunkSize = 2 * 1024 * 1024;
+  static constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+ protected:
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    return Allocate(bytes, alignment);
+  }
+  void do_deallocate(void*, size_t, size_t) override {}
+  bool do_is_equal(const MemoryResource &other) const noexcept override {
+    return this == &other;
+  }
+
+ private:
+  void _NewChunk(size_t min_bytes);
+
+  size_t chunk_size_;
+  bool huge_pages_;
+  std::vector<void*> chunks_;
+  char *cur_ = nullptr;
+  char *end_ = nullptr;
+  size_t used_bytes_ = 0;
+  size_t reserved_bytes_ = 0;
+  std::mutex mutex_;
+};
+
+}  // namespace aoi
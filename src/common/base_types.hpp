@@ -12,6 +12,11 @@ typedef uint64_t Uint64;
 typedef Uint64 Nuid;
 
 typedef int16_t Int16;
+typedef int64_t Int64;
+
+// 玩家的 category 和 sensor 的 interest 都是位掩码，有交集时 sensor 才能看到玩家
+constexpr Uint32 kDefaultCategory = 1;
+constexpr Uint32 kAllCategories = 0xFFFFFFFF;
 
 #define AOI_CLASS_ADD_FLAG(flag_name, flag_idx, flags_name)   \
   inline void SetFlag_##flag_name() {flags_name |= 1 << flag_idx;}   \
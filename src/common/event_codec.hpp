@@ -0,0 +1,201 @@
+// Copyright <disenone>
+#pragma once
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "common/base_types.hpp"
+
+namespace aoi {
+
+// 一次 Tick 的进出事件的紧凑二进制格式，直接写进调用者给的 buffer，不经过中间的列表。
+// 整数都是 varint（LEB128，每字节 7 位，高位为 1 表示后面还有），nuid 都按升序排列后只写差值：
+//   watcher_num
+//   每个 watcher：nuid 和上一个 watcher 的差（第一个和 0 比），sensor_num
+//     每个 sensor：sensor_id 和上一个 sensor（不管属于哪个 watcher，第一个和 0 比）的差，
+//                 可能是负数，用 zigzag 编码；enter_num，leave_num，
+//                 enters 逐个和前一个的差，leaves 逐个和前一个的差（都从 0 开始）
+// 按顺序分配的 nuid 排序之后差值大多只要 1 到 2 个字节，原来每个要 8 个字节。
+// sensor_id 不管是跟着玩家分配、还是每个玩家各自从小数字编号，和上一个 sensor 的差都很小。
+// Varint + delta encoded enter/leave stream, grouped per watcher and sensor, see above.
+
+constexpr size_t kMaxVarintBytes = 10;
+
+// 写一个 varint，空间不够时返回 nullptr
+inline Uint8* EncodeVarint(Uint64 value, Uint8 *pos, Uint8 *end) {
+  while (value >= 0x80) {
+    if (pos == end) return nullptr;
+    *pos++ = static_cast<Uint8>(value) | 0x80;
+    value >>= 7;
+  }
+  if (pos == end) return nullptr;
+  *pos++ = static_cast<Uint8>(value);
+  return pos;
+}
+
+
+// 有符号的差值映射到无符号：0, -1, 1, -2, ... 依次是 0, 1, 2, 3, ...
+inline Uint64 ZigZagEncode(Uint64 delta) {
+  return (delta << 1) ^ static_cast<Uint64>(static_cast<Int64>(delta) >> 63);
+}
+
+inline Uint64 ZigZagDecode(Uint64 value) {
+  return (value >> 1) ^ (~(value & 1) + 1);
+}
+
+
+// 读一个 varint，数据不完整或者超过 64 位时返回 nullptr
+inline const Uint8* DecodeVarint(const Uint8 *pos, const Uint8 *end, Uint64 *value) {
+  Uint64 result = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (pos == end) return nullptr;
+    Uint8 byte = *pos++;
+    result |= static_cast<Uint64>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *value = result;
+      return pos;
+    }
+  }
+  return nullptr;
+}
+
+
+class EventEncoder {
+ public:
+  // 编码 update_infos 最多需要的字节数，按每个整数 kMaxVarintBytes 算
+  template <typename AoiUpdateInfos>
+  static size_t MaxEncodedSize(const AoiUpdateInfos &update_infos) {
+    size_t varints = 1;
+    for (const auto &elem : update_infos) {
+      varints += 2;
+      for (const auto &sensor_info : elem.second.sensor_update_list) {
+        varints += 3 + sensor_info.enters.size() + sensor_info.leaves.size();
+      }
+    }
+    return varints * kMaxVarintBytes;
+  }
+
+  // 把一次 Tick 的事件写进 buffer，返回写入的字节数；capacity 不够时返回 0，buffer 里的内容作废。
+  // 每个 sensor 的 enters、leaves 和每个 watcher 的 sensor_update_list 会被原地排序
+  template <typename AoiUpdateInfos>
+  size_t Encode(AoiUpdateInfos *update_infos, Uint8 *buffer, size_t capacity);
+
+ private:
+  template <typename PlayerNuids>
+  static Uint8* _EncodeNuids(PlayerNuids *nuids, Uint8 *pos, Uint8 *end);
+
+  // 按 nuid 排序的 watcher，只在 Encode 里用，留着复用内存
+  std::vector<std::pair<Nuid, void*>> watchers_;
+};
+
+
+template <typename PlayerNuids>
+Uint8* EventEncoder::_EncodeNuids(PlayerNuids *nuids, Uint8 *pos, Uint8 *end) {
+  std::sort(nuids->begin(), nuids->end());
+  Nuid last = 0;
+  for (auto nuid : *nuids) {
+    pos = EncodeVarint(nuid - last, pos, end);
+    if (!pos) return nullptr;
+    last = nuid;
+  }
+  return pos;
+}
+
+
+template <typename AoiUpdateInfos>
+size_t EventEncoder::Encode(AoiUpdateInfos *update_infos, Uint8 *buffer, size_t capacity) {
+  typedef typename AoiUpdateInfos::mapped_type AoiUpdateInfo;
+  typedef typename decltype(AoiUpdateInfo::sensor_update_list)::value_type SensorUpdateInfo;
+
+  watchers_.clear();
+  for (auto &elem : *update_infos) {
+    watchers_.emplace_back(elem.first, &elem.second);
+  }
+  std::sort(watchers_.begin(), watchers_.end(),
+            [](const std::pair<Nuid, void*> &left, const std::pair<Nuid, void*> &right) {
+              return left.first < right.first;
+            });
+
+  Uint8 *pos = buffer;
+  Uint8 *end = buffer + capacity;
+  pos = EncodeVarint(watchers_.size(), pos, end);
+  Nuid last_watcher = 0;
+  Nuid last_sensor = 0;
+  for (const auto &watcher : watchers_) {
+    if (!pos) return 0;
+    auto &sensor_list = static_cast<AoiUpdateInfo*>(watcher.second)->sensor_update_list;
+    std::sort(sensor_list.begin(), sensor_list.end(),
+              [](const SensorUpdateInfo &left, const SensorUpdateInfo &right) {
+                return left.sensor_id < right.sensor_id;
+              });
+    pos = EncodeVarint(watcher.first - last_watcher, pos, end);
+    if (pos) pos = EncodeVarint(sensor_list.size(), pos, end);
+    last_watcher = watcher.first;
+
+    for (auto &sensor_info : sensor_list) {
+      if (!pos) return 0;
+      pos = EncodeVarint(ZigZagEncode(sensor_info.sensor_id - last_sensor), pos, end);
+      if (pos) pos = EncodeVarint(sensor_info.enters.size(), pos, end);
+      if (pos) pos = EncodeVarint(sensor_info.leaves.size(), pos, end);
+      if (pos) pos = _EncodeNuids(&sensor_info.enters, pos, end);
+      if (pos) pos = _EncodeNuids(&sensor_info.leaves, pos, end);
+      last_sensor = sensor_info.sensor_id;
+    }
+  }
+  return pos ? pos - buffer : 0;
+}
+
+
+// 把 EventEncoder 写出的一次 Tick 的事件读回 update_infos（先清空），数据损坏时返回 false。
+// 给客户端和测试用，服务端不需要
+template <typename AoiUpdateInfos>
+bool DecodeEvents(const Uint8 *data, size_t size, AoiUpdateInfos *update_infos) {
+  update_infos->clear();
+  const Uint8 *pos = data;
+  const Uint8 *end = data + size;
+  Uint64 watcher_num = 0;
+  pos = DecodeVarint(pos, end, &watcher_num);
+  if (!pos) return false;
+
+  Nuid watcher = 0;
+  Nuid sensor_id = 0;
+  for (Uint64 w = 0; w < watcher_num; ++w) {
+    Uint64 delta = 0, sensor_num = 0;
+    pos = DecodeVarint(pos, end, &delta);
+    if (pos) pos = DecodeVarint(pos, end, &sensor_num);
+    if (!pos) return false;
+    watcher += delta;
+
+    auto &update_info = (*update_infos)[watcher];
+    update_info.nuid = watcher;
+    auto &sensor_list = update_info.sensor_update_list;
+    for (Uint64 s = 0; s < sensor_num; ++s) {
+      Uint64 enter_num = 0, leave_num = 0;
+      pos = DecodeVarint(pos, end, &delta);
+      if (pos) pos = DecodeVarint(pos, end, &enter_num);
+      if (pos) pos = DecodeVarint(pos, end, &leave_num);
+      // 每个 nuid 至少一个字节，先挡住损坏的数量，免得 reserve 一个巨大的数
+      if (!pos || enter_num + leave_num > static_cast<Uint64>(end - pos)) return false;
+      sensor_id += ZigZagDecode(delta);
+
+      sensor_list.emplace_back();
+      auto &sensor_info = sensor_list.back();
+      sensor_info.sensor_id = sensor_id;
+      for (auto *nuids : {&sensor_info.enters, &sensor_info.leaves}) {
+        Uint64 num = nuids == &sensor_info.enters ? enter_num : leave_num;
+        nuids->reserve(num);
+        Nuid nuid = 0;
+        for (Uint64 i = 0; i < num; ++i) {
+          pos = DecodeVarint(pos, end, &delta);
+          if (!pos) return false;
+          nuid += delta;
+          nuids->push_back(nuid);
+        }
+      }
+    }
+  }
+  return pos == end;
+}
+
+}  // namespace aoi
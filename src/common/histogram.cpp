@@ -0,0 +1,46 @@
+// Copyright <disenone>
+
+#include "histogram.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+namespace aoi {
+
+constexpr size_t Log2Histogram::kBucketNum;
+
+void Log2Histogram::Merge(const Log2Histogram &other) {
+  for (size_t i = 0; i < kBucketNum; ++i) {
+    buckets_[i] += other.buckets_[i];
+  }
+  count_ += other.count_;
+  sum_ += other.sum_;
+  max_ = std::max(max_, other.max_);
+}
+
+Uint64 Log2Histogram::Percentile(double p) const {
+  if (count_ == 0) return 0;
+  auto rank = static_cast<Uint64>(std::ceil(p / 100 * count_));
+  rank = std::min(std::max<Uint64>(rank, 1), count_);
+  Uint64 seen = 0;
+  for (size_t i = 0; i < kBucketNum; ++i) {
+    seen += buckets_[i];
+    if (seen >= rank) return std::min(BucketUpper(i), max_);
+  }
+  return max_;
+}
+
+std::string Log2Histogram::Format() const {
+  char buf[256];
+  std::snprintf(buf, sizeof(buf),
+                "n=%llu mean=%.2f p50<=%llu p90<=%llu p99<=%llu max=%llu",
+                static_cast<unsigned long long>(Count()), Mean(),
+                static_cast<unsigned long long>(Percentile(50)),
+                static_cast<unsigned long long>(Percentile(90)),
+                static_cast<unsigned long long>(Percentile(99)),
+                static_cast<unsigned long long>(Max()));
+  return buf;
+}
+
+}  // namespace aoi
@@ -0,0 +1,89 @@
+// Copyright <disenone>
+#pragma once
+
+#include <string>
+
+#include "common/base_types.hpp"
+
+namespace aoi {
+
+// 按 2 的幂分桶的计数直方图：第 0 桶是 0，第 i 桶是 [2^(i-1), 2^i)，最后一桶放所有更大的值。
+// Add 只是一次前导零计数加几次自增，不分配内存，可以一直开着。
+// Power-of-two bucketed counter histogram, cheap enough to leave on in production.
+class Log2Histogram {
+ public:
+  static constexpr size_t kBucketNum = 32;
+
+  static size_t Bucket(Uint64 value) {
+    if (value == 0) return 0;
+    size_t bucket = 64 - __builtin_clzll(value);
+    return bucket < kBucketNum ? bucket : kBucketNum - 1;
+  }
+  // 第 bucket 桶里最大的值，最后一桶没有上限
+  static Uint64 BucketUpper(size_t bucket) {
+    if (bucket == 0) return 0;
+    if (bucket >= kBucketNum - 1) return ~Uint64(0);
+    return (Uint64(1) << bucket) - 1;
+  }
+
+  void Add(Uint64 value) {
+    ++buckets_[Bucket(value)];
+    ++count_;
+    sum_ += value;
+    if (value > max_) max_ = value;
+  }
+  void Merge(const Log2Histogram &other);
+  void Clear() {
+    *this = Log2Histogram();
+  }
+
+  Uint64 Count() const {
+    return count_;
+  }
+  Uint64 Sum() const {
+    return sum_;
+  }
+  Uint64 Max() const {
+    return max_;
+  }
+  double Mean() const {
+    return count_ ? static_cast<double>(sum_) / count_ : 0;
+  }
+  Uint64 BucketCount(size_t bucket) const {
+    return buckets_[bucket];
+  }
+  // p 取值 [0, 100]，返回第 p 百分位所在桶的上界（不超过 Max）
+  Uint64 Percentile(double p) const;
+
+  // "n=... mean=... p50<=... p90<=... p99<=... max=..."
+  std::string Format() const;
+
+ private:
+  Uint64 buckets_[kBucketNum] = {};
+  Uint64 count_ = 0;
+  Uint64 sum_ = 0;
+  Uint64 max_ = 0;
+};
+
+
+// 一个场景的形状：每次 Tick 各个 aoi 算法按自己的数据结构填
+struct SceneHistograms {
+  Log2Histogram visible;      // 每个计算过的 sensor 看到的玩家数
+  Log2Histogram candidates;   // 每个计算过的 sensor 检查过的候选玩家数
+  Log2Histogram occupancy;    // Tick 结束时每个非空格子里的玩家数，没有格子的算法为空
+  Log2Histogram enters;       // 每次 Tick 的进入事件总数
+  Log2Histogram leaves;       // 每次 Tick 的离开事件总数
+
+  void Merge(const SceneHistograms &other) {
+    visible.Merge(other.visible);
+    candidates.Merge(other.candidates);
+    occupancy.Merge(other.occupancy);
+    enters.Merge(other.enters);
+    leaves.Merge(other.leaves);
+  }
+  void Clear() {
+    *this = SceneHistograms();
+  }
+};
+
+}  // namespace aoi
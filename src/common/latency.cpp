@@ -0,0 +1,50 @@
+// Copyright <disenone>
+
+#include "latency.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <numeric>
+
+namespace aoi {
+
+void LatencyStats::_Sort() {
+  if (sorted_) return;
+  std::sort(samples_.begin(), samples_.end());
+  sorted_ = true;
+}
+
+double LatencyStats::Sum() const {
+  return std::accumulate(samples_.begin(), samples_.end(), 0.0);
+}
+
+double LatencyStats::Mean() const {
+  if (samples_.empty()) return 0;
+  return Sum() / samples_.size();
+}
+
+double LatencyStats::Max() {
+  if (samples_.empty()) return 0;
+  _Sort();
+  return samples_.back();
+}
+
+double LatencyStats::Percentile(double p) {
+  if (samples_.empty()) return 0;
+  _Sort();
+  auto rank = static_cast<size_t>(std::ceil(p / 100 * samples_.size()));
+  rank = std::min(std::max<size_t>(rank, 1), samples_.size());
+  return samples_[rank - 1];
+}
+
+std::string LatencyStats::Format() {
+  char buf[256];
+  std::snprintf(buf, sizeof(buf),
+                "n=%zu mean=%.6fms p50=%.6fms p90=%.6fms p99=%.6fms max=%.6fms",
+                Count(), Mean() * 1e3, Percentile(50) * 1e3, Percentile(90) * 1e3,
+                Percentile(99) * 1e3, Max() * 1e3);
+  return buf;
+}
+
+}  // namespace aoi
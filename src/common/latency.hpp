@@ -0,0 +1,40 @@
+// Copyright <disenone>
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace aoi {
+
+// 收集耗时样本（秒），用于统计分布
+class LatencyStats {
+ public:
+  void Add(double seconds) {
+    samples_.push_back(seconds);
+    sorted_ = false;
+  }
+  void Clear() {
+    samples_.clear();
+    sorted_ = true;
+  }
+
+  size_t Count() const {
+    return samples_.size();
+  }
+  double Sum() const;
+  double Mean() const;
+  double Max();
+  // p 取值 [0, 100]，最近秩（nearest-rank）百分位
+  double Percentile(double p);
+
+  // "n=... mean=...ms p50=...ms p90=...ms p99=...ms max=...ms"
+  std::string Format();
+
+ private:
+  void _Sort();
+
+  std::vector<double> samples_;
+  bool sorted_ = true;
+};
+
+}  // namespace aoi
@@ -0,0 +1,68 @@
+// Copyright <disenone>
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+#include <boost/container/pmr/memory_resource.hpp>
+
+namespace aoi {
+
+// 引擎的容器都可以从调用者提供的 memory_resource 分配：场景的 Arena、monotonic、
+// 池化或者 NUMA 本地的 resource 都行。C++14 没有 std::pmr，用 boost.container 的实现。
+typedef boost::container::pmr::memory_resource MemoryResource;
+
+
+// 从 MemoryResource 分配的标准分配器，resource 为空时退回 operator new / delete。
+// 和 polymorphic_allocator 不同，移动和交换时分配器跟着内存走；拷贝出来的容器用普通堆，
+// 临时拷贝不会占住场景的 resource。
+// Standard allocator over a MemoryResource; null means the global heap.
+template <typename T>
+class ResourceAllocator {
+ public:
+  typedef T value_type;
+  typedef std::false_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  ResourceAllocator() = default;
+  explicit ResourceAllocator(MemoryResource *resource) : resource_(resource) {}
+  template <typename U>
+  ResourceAllocator(const ResourceAllocator<U> &other) : resource_(other.GetResource()) {}  // NOLINT
+
+  T* allocate(size_t n) {
+    if (!resource_) return static_cast<T*>(::operator new(n * sizeof(T)));
+    return static_cast<T*>(resource_->allocate(n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T *ptr, size_t n) {
+    if (!resource_) {
+      ::operator delete(ptr);
+    } else {
+      resource_->deallocate(ptr, n * sizeof(T), alignof(T));
+    }
+  }
+
+  ResourceAllocator select_on_container_copy_construction() const {
+    return ResourceAllocator();
+  }
+
+  MemoryResource* GetResource() const {
+    return resource_;
+  }
+
+ private:
+  MemoryResource *resource_ = nullptr;
+};
+
+template <typename T, typename U>
+bool operator==(const ResourceAllocator<T> &left, const ResourceAllocator<U> &right) {
+  return left.GetResource() == right.GetResource();
+}
+
+template <typename T, typename U>
+bool operator!=(const ResourceAllocator<T> &left, const ResourceAllocator<U> &right) {
+  return !(left == right);
+}
+
+}  // namespace aoi
@@ -0,0 +1,40 @@
+// Copyright <disenone>
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace aoi {
+
+// 按数据结构分类统计的内存占用（字节），vector 按容量算，哈希表按桶数和节点数估算，
+// 不包括内存分配器自己的开销。用来估算一个场景能放多少玩家。
+// Approximate bytes held per structure category, for capacity planning.
+struct MemoryUsage {
+  size_t players = 0;           // 玩家对象本身
+  size_t sensors = 0;           // sensor 对象本身
+  size_t aoi_lists = 0;         // sensor 上一次和这一次的 aoi 列表
+  size_t candidates = 0;        // cross: sensor 的 candidates 哈希表
+  size_t cells = 0;             // squares: 格子，quadtree、bvh: 节点，sorted_grid: 快照
+  size_t player_map = 0;        // nuid 到玩家的哈希表和其它玩家索引
+  size_t static_entities = 0;   // 静态实体索引和 sensor 看到的静态实体
+
+  size_t Total() const {
+    return players + sensors + aoi_lists + candidates + cells + player_map + static_entities;
+  }
+};
+
+
+template <typename T, typename Alloc>
+size_t VectorBytes(const std::vector<T, Alloc> &values) {
+  return values.capacity() * sizeof(T);
+}
+
+
+// 节点式的哈希表：每个桶一个指针，每个元素一个带 next 指针的节点
+template <typename Map>
+size_t HashMapBytes(const Map &map) {
+  return map.bucket_count() * sizeof(void*)
+         + map.size() * (sizeof(typename Map::value_type) + sizeof(void*));
+}
+
+}  // namespace aoi
@@ -0,0 +1,43 @@
+// Copyright <disenone>
+
+#include "phase_timer.hpp"
+
+#include <cstdio>
+#include <thread>
+
+namespace aoi {
+
+const char* TickPhaseName(TickPhase phase) {
+  static const char *names[kTickPhaseNum] = {
+    "calc_aoi", "check_leave", "check_enter", "diff", "remove", "last_pos",
+  };
+  return phase < kTickPhaseNum ? names[phase] : "unknown";
+}
+
+double CycleCounterRate() {
+  static const double rate = [] {
+    auto begin_time = std::chrono::steady_clock::now();
+    Uint64 begin = ReadCycleCounter();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    Uint64 end = ReadCycleCounter();
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - begin_time;
+    return (end - begin) / seconds.count();
+  }();
+  return rate;
+}
+
+std::string PhaseCycles::Format() const {
+  double ms_per_cycle = 1000 / CycleCounterRate();
+  Uint64 total = Total();
+  std::string ret;
+  char buf[96];
+  for (Uint32 i = 0; i < kTickPhaseNum; ++i) {
+    std::snprintf(buf, sizeof(buf), "%s%s=%.3fms(%.1f%%)", i ? " " : "",
+                  TickPhaseName(static_cast<TickPhase>(i)), cycles[i] * ms_per_cycle,
+                  total ? 100.0 * cycles[i] / total : 0.0);
+    ret += buf;
+  }
+  return ret;
+}
+
+}  // namespace aoi
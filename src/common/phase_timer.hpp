@@ -0,0 +1,105 @@
+// Copyright <disenone>
+#pragma once
+
+#include <chrono>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "common/base_types.hpp"
+
+// Tick 内部各阶段的 CPU 周期计数，编译时定义 AOI_ENABLE_PHASE_TIMER 才会计时
+// （b2 define=AOI_ENABLE_PHASE_TIMER），否则计时宏为空，计数始终为 0。
+// 每个 aoi 对象（包括分区并行时每个区域）有自己的计数，只由正在算它的线程写，
+// Tick 结束时由 Tick 所在的线程合并，不需要锁和原子操作。
+// Per-phase cycle counters inside Tick, compiled in only when AOI_ENABLE_PHASE_TIMER is defined.
+
+namespace aoi {
+
+#ifdef AOI_ENABLE_PHASE_TIMER
+constexpr bool kAoiPhaseTimerEnabled = true;
+#else
+constexpr bool kAoiPhaseTimerEnabled = false;
+#endif
+
+enum TickPhase : Uint32 {
+  kPhaseCalcAoi = 0,    // _CalcAoiPlayers：收集候选玩家、算出新的列表
+  kPhaseCheckLeave,     // _CheckLeave
+  kPhaseCheckEnter,     // _CheckEnter
+  kPhaseDiff,           // 需要集合差的 sensor 用 DiffAoiPlayers 代替上面两步
+  kPhaseRemove,         // Tick 结束时真正移除玩家
+  kPhaseLastPos,        // Tick 结束时把 pos 复制到 last_pos
+  kTickPhaseNum,
+};
+
+const char* TickPhaseName(TickPhase phase);
+
+// 读 CPU 的时间戳计数器，不是 x86 时退回 steady_clock 的纳秒数
+inline Uint64 ReadCycleCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// ReadCycleCounter 每秒增加多少，第一次调用时用 steady_clock 校准约 20ms
+double CycleCounterRate();
+
+
+struct PhaseCycles {
+  Uint64 cycles[kTickPhaseNum] = {};
+  Uint64 calls[kTickPhaseNum] = {};
+
+  void Add(TickPhase phase, Uint64 n) {
+    cycles[phase] += n;
+    ++calls[phase];
+  }
+  void Merge(const PhaseCycles &other) {
+    for (Uint32 i = 0; i < kTickPhaseNum; ++i) {
+      cycles[i] += other.cycles[i];
+      calls[i] += other.calls[i];
+    }
+  }
+  Uint64 Total() const {
+    Uint64 total = 0;
+    for (auto n : cycles) total += n;
+    return total;
+  }
+
+  // "calc_aoi=...ms(..%) check_leave=...ms(..%) ..."，百分比是占所有阶段之和的比例
+  std::string Format() const;
+};
+
+
+// 作用域内的周期数记到 phase 上
+class PhaseScope {
+ public:
+  PhaseScope(PhaseCycles *cycles, TickPhase phase)
+      : cycles_(cycles), phase_(phase), begin_(ReadCycleCounter()) {}
+  ~PhaseScope() {
+    cycles_->Add(phase_, ReadCycleCounter() - begin_);
+  }
+  PhaseScope(const PhaseScope&) = delete;
+  PhaseScope& operator=(const PhaseScope&) = delete;
+
+ private:
+  PhaseCycles *cycles_;
+  TickPhase phase_;
+  Uint64 begin_;
+};
+
+#define AOI_PHASE_CONCAT_IMPL(a, b) a##b
+#define AOI_PHASE_CONCAT(a, b) AOI_PHASE_CONCAT_IMPL(a, b)
+
+#ifdef AOI_ENABLE_PHASE_TIMER
+#define AOI_PHASE_SCOPE(cycles, phase) \
+  ::aoi::PhaseScope AOI_PHASE_CONCAT(aoi_phase_scope_, __LINE__)(&(cycles), (phase))
+#else
+#define AOI_PHASE_SCOPE(cycles, phase) ((void)0)
+#endif
+
+}  // namespace aoi
@@ -0,0 +1,67 @@
+// Copyright <disenone>
+#pragma once
+
+#include <deque>
+#include <unordered_map>
+#include <utility>
+
+#include "common/base_types.hpp"
+
+namespace aoi {
+
+// 每隔 interval 次 Tick 才计算一次的 sensor 的相位分配：同一个间隔的 sensor 依次落到
+// 0 ~ interval-1 号桶里，第 tick 次 Tick 只计算 (tick + phase) % interval == 0 的桶，
+// 计算量平摊到每次 Tick 上，不会集中在同一次。
+// Staggers low-frequency sensors round-robin over interval buckets.
+class IntervalSchedule {
+ public:
+  Uint32 AllocPhase(Uint32 interval) {
+    if (interval > max_interval_) max_interval_ = interval;
+    if (interval <= 1) return 0;
+    auto &next = next_phase_[interval];
+    Uint32 phase = next;
+    next = (next + 1) % interval;
+    return phase;
+  }
+
+  static bool IsDue(Uint64 tick, Uint32 interval, Uint32 phase) {
+    return interval <= 1 || (tick + phase) % interval == 0;
+  }
+
+  // 设置过的最大间隔，只增不减
+  Uint32 GetMaxInterval() const {
+    return max_interval_;
+  }
+
+ private:
+  Uint32 max_interval_ = 1;
+  std::unordered_map<Uint32, Uint32> next_phase_;
+};
+
+
+// 移除的玩家可能还在低频 sensor 上一次的列表里，先留着它的内存，
+// 等到所有 sensor 都至少又计算过一次之后再释放。
+// Keeps removed players alive until every low-frequency sensor has dropped them.
+template <typename PlayerSharedPtr>
+class PlayerGraveyard {
+ public:
+  // 第 release_tick 次 Tick 结束之后释放，release_tick 要按顺序递增
+  void Bury(PlayerSharedPtr player, Uint64 release_tick) {
+    players_.emplace_back(release_tick, std::move(player));
+  }
+
+  void Release(Uint64 tick) {
+    while (!players_.empty() && players_.front().first <= tick) {
+      players_.pop_front();
+    }
+  }
+
+  size_t Size() const {
+    return players_.size();
+  }
+
+ private:
+  std::deque<std::pair<Uint64, PlayerSharedPtr>> players_;
+};
+
+}  // namespace aoi
@@ -0,0 +1,86 @@
+// Copyright <disenone>
+
+#include "static_index.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+
+namespace aoi {
+
+Uint64 StaticIndex::_CellKey(int xi, int zi) const {
+  // 有符号的格子坐标翻转符号位，保证 key 的大小顺序和 (xi, zi) 的字典序一致
+  return (static_cast<Uint64>(static_cast<Uint32>(xi) ^ 0x80000000u) << 32) |
+         (static_cast<Uint32>(zi) ^ 0x80000000u);
+}
+
+
+int StaticIndex::_CoordToCell(float coord) const {
+  return static_cast<int>(std::floor(coord * inverse_cell_size_));
+}
+
+
+void StaticIndex::Build(float cell_size) {
+  inverse_cell_size_ = 1 / cell_size;
+  entries_.insert(entries_.end(), pending_.begin(), pending_.end());
+  pending_.clear();
+  pending_.shrink_to_fit();
+
+  for (auto &entry : entries_) {
+    entry.cell = _CellKey(_CoordToCell(entry.x), _CoordToCell(entry.z));
+  }
+  std::sort(entries_.begin(), entries_.end(), [](const Entry &left, const Entry &right) {
+    if (left.cell != right.cell) return left.cell < right.cell;
+    return left.nuid < right.nuid;
+  });
+  entries_.shrink_to_fit();
+  ++version_;
+}
+
+
+void StaticIndex::Query(float x, float z, float radius, std::vector<Nuid> *nuids) const {
+  nuids->clear();
+  if (entries_.empty()) return;
+
+  float radius_square = radius * radius;
+  int minxi = _CoordToCell(x - radius);
+  int maxxi = _CoordToCell(x + radius);
+  int minzi = _CoordToCell(z - radius);
+  int maxzi = _CoordToCell(z + radius);
+
+  auto cell_less = [](const Entry &entry, Uint64 cell) { return entry.cell < cell; };
+  for (int xi = minxi; xi <= maxxi; ++xi) {
+    Uint64 last_cell = _CellKey(xi, maxzi);
+    auto iter = std::lower_bound(entries_.begin(), entries_.end(), _CellKey(xi, minzi),
+                                 cell_less);
+    for (; iter != entries_.end() && iter->cell <= last_cell; ++iter) {
+      float dx = iter->x - x;
+      float dz = iter->z - z;
+      if (dx * dx + dz * dz < radius_square) {
+        nuids->push_back(iter->nuid);
+      }
+    }
+  }
+  std::sort(nuids->begin(), nuids->end());
+}
+
+
+void StaticAoi::Update(const StaticIndex &index, float _x, float _z, float radius,
+                       std::vector<Nuid> *enters, std::vector<Nuid> *leaves) {
+  // 实体只增不减，索引为空时一定什么都没看到
+  if (index.Size() == 0) return;
+  if (version == index.GetVersion() && x == _x && z == _z) return;
+  version = index.GetVersion();
+  x = _x;
+  z = _z;
+
+  std::vector<Nuid> new_nuids;
+  index.Query(x, z, radius, &new_nuids);
+  std::set_difference(new_nuids.begin(), new_nuids.end(), nuids.begin(), nuids.end(),
+                      std::back_inserter(*enters));
+  std::set_difference(nuids.begin(), nuids.end(), new_nuids.begin(), new_nuids.end(),
+                      std::back_inserter(*leaves));
+  nuids.swap(new_nuids);
+}
+
+}  // namespace aoi
@@ -0,0 +1,83 @@
+// Copyright <disenone>
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "common/base_types.hpp"
+
+namespace aoi {
+
+// 不会移动的实体（资源点、门、掉落物）的只读空间索引：所有实体按 (格子 x, 格子 z, nuid)
+// 排序放在一个连续数组里，查询时每一列格子二分找到起点顺序扫描。实体只能添加，添加之后
+// 要重新 Build 才能查到，Build 会增加版本号。
+// Immutable sorted-cell-array index for entities that never move.
+class StaticIndex {
+ public:
+  // nuid 不能和玩家或者其它静态实体重复
+  void Add(Nuid nuid, float x, float z) {
+    pending_.push_back({0, x, z, nuid});
+  }
+
+  // 有没有还没 Build 进索引的实体
+  bool IsDirty() const {
+    return !pending_.empty();
+  }
+
+  void Build(float cell_size);
+
+  // 距离 (x, z) 小于 radius 的实体，结果按 nuid 排序
+  void Query(float x, float z, float radius, std::vector<Nuid> *nuids) const;
+
+  size_t Size() const {
+    return entries_.size();
+  }
+  // 所有实体，包括还没 Build 进索引的，func(nuid, x, z)
+  template <typename Func>
+  void ForEach(Func func) const {
+    for (const auto &entry : entries_) func(entry.nuid, entry.x, entry.z);
+    for (const auto &entry : pending_) func(entry.nuid, entry.x, entry.z);
+  }
+  Uint32 GetVersion() const {
+    return version_;
+  }
+  size_t MemoryBytes() const {
+    return (entries_.capacity() + pending_.capacity()) * sizeof(Entry);
+  }
+
+ private:
+  struct Entry {
+    Uint64 cell;
+    float x, z;
+    Nuid nuid;
+  };
+
+  Uint64 _CellKey(int xi, int zi) const;
+  int _CoordToCell(float coord) const;
+
+  std::vector<Entry> entries_;
+  std::vector<Entry> pending_;
+  float inverse_cell_size_ = 1;
+  Uint32 version_ = 0;
+};
+
+
+// 一个 sensor 看到的静态实体：只有 sensor 移动过或者索引重建过才重新查询
+struct StaticAoi {
+  // 重新查询并和上一次的结果求差，把进出追加到 enters、leaves
+  void Update(const StaticIndex &index, float x, float z, float radius,
+              std::vector<Nuid> *enters, std::vector<Nuid> *leaves);
+  // 不再关心静态实体：看到的全部离开，之后的 Update 重新查询
+  void Clear(std::vector<Nuid> *leaves) {
+    leaves->insert(leaves->end(), nuids.begin(), nuids.end());
+    nuids.clear();
+    version = 0;
+  }
+
+  std::vector<Nuid> nuids;    // 按 nuid 排序
+  float x = 0;
+  float z = 0;
+  Uint32 version = 0;         // 查询时索引的版本，0 表示还没查询过
+};
+
+}  // namespace aoi
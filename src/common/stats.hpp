@@ -0,0 +1,20 @@
+// Copyright <disenone>
+#pragma once
+
+// 热点路径计数器，编译时定义 AOI_ENABLE_STATS 才会统计（b2 define=AOI_ENABLE_STATS），
+// 否则计数宏为空，统计结构体始终为 0。
+// Hot-path counters, compiled in only when AOI_ENABLE_STATS is defined.
+
+namespace aoi {
+
+#ifdef AOI_ENABLE_STATS
+constexpr bool kAoiStatsEnabled = true;
+#define AOI_STATS_ADD(stats, field, n) ((stats).field += (n))
+#else
+constexpr bool kAoiStatsEnabled = false;
+#define AOI_STATS_ADD(stats, field, n) ((void)(stats))
+#endif
+
+#define AOI_STATS_INC(stats, field) AOI_STATS_ADD(stats, field, 1)
+
+}  // namespace aoi
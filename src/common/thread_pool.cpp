@@ -0,0 +1,114 @@
+// Copyright <disenone>
+
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace aoi {
+
+ThreadPool::ThreadPool(size_t thread_num /*= 0*/)
+    : queued_(0) {
+  if (thread_num == 0) {
+    thread_num = std::max(1U, std::thread::hardware_concurrency());
+  }
+
+  for (size_t i = 0; i < thread_num; ++i) {
+    workers_.emplace_back(new Worker());
+  }
+  for (size_t i = 0; i < thread_num; ++i) {
+    threads_.emplace_back(&ThreadPool::_Run, this, i);
+  }
+}
+
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  task_cv_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+}
+
+
+void ThreadPool::Submit(size_t worker, Task task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++pending_;
+  }
+
+  auto &queue = *workers_[worker % workers_.size()];
+  {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_back(std::move(task));
+  }
+
+  {
+    // 持锁修改 queued_，避免 worker 检查完条件、还没睡下时漏掉通知
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++queued_;
+  }
+  task_cv_.notify_one();
+}
+
+
+void ThreadPool::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this] { return pending_ == 0; });
+}
+
+
+bool ThreadPool::_PopTask(size_t index, Task *task) {
+  // 先取自己队列的队头
+  {
+    auto &queue = *workers_[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+      *task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+      return true;
+    }
+  }
+
+  // 再从其它队列的队尾偷
+  for (size_t i = 1; i < workers_.size(); ++i) {
+    auto &queue = *workers_[(index + i) % workers_.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+      *task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+
+void ThreadPool::_Run(size_t index) {
+  Task task;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      task_cv_.wait(lock, [this] { return stop_ || queued_ > 0; });
+      if (stop_ && queued_ == 0) return;
+    }
+
+    if (!_PopTask(index, &task)) continue;
+    --queued_;
+
+    task();
+    task = nullptr;
+
+    bool done;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done = --pending_ == 0;
+    }
+    if (done) done_cv_.notify_all();
+  }
+}
+
+}  // namespace aoi
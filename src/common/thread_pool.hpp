@@ -0,0 +1,58 @@
+// Copyright <disenone>
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace aoi {
+
+// 简单的 work-stealing 线程池：每个 worker 有自己的任务队列，按提交顺序从队头取任务，
+// 自己的队列空了就从其它 worker 的队尾偷任务。
+// Work-stealing pool: a worker runs its own queue front to back and steals from the
+// back of the other queues once its own queue is empty.
+class ThreadPool {
+ public:
+  typedef std::function<void()> Task;
+
+  // thread_num 为 0 时使用 std::thread::hardware_concurrency()
+  explicit ThreadPool(size_t thread_num = 0);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  size_t Size() const {
+    return workers_.size();
+  }
+
+  // 把任务放到第 worker 个队列，worker 会对 Size() 取模
+  void Submit(size_t worker, Task task);
+  // 阻塞直到所有已提交的任务执行完
+  void Wait();
+
+ private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  void _Run(size_t index);
+  bool _PopTask(size_t index, Task *task);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+
+  std::mutex mutex_;
+  std::condition_variable task_cv_;
+  std::condition_variable done_cv_;
+  std::atomic<size_t> queued_;
+  size_t pending_ = 0;
+  bool stop_ = false;
+};
+
+}  // namespace aoi
@@ -0,0 +1,183 @@
+// Copyright <disenone>
+
+#include "trace.hpp"
+
+#include <cstring>
+
+namespace aoi {
+
+constexpr size_t kTraceFlushSize = 64 * 1024;
+
+//--------------------------------------------------------------------------------------------------
+TraceWriter::TraceWriter(const std::string &path)
+    : file_(std::fopen(path.c_str(), "wb")) {
+  buffer_.reserve(kTraceFlushSize + sizeof(TraceOp));
+  if (!file_) return;
+
+  buffer_.insert(buffer_.end(), kTraceMagic, kTraceMagic + sizeof(kTraceMagic));
+  _Append(kTraceVersion);
+}
+
+TraceWriter::~TraceWriter() {
+  Close();
+}
+
+template <typename T>
+inline void TraceWriter::_Append(const T &value) {
+  auto ptr = reinterpret_cast<const Uint8*>(&value);
+  buffer_.insert(buffer_.end(), ptr, ptr + sizeof(T));
+}
+
+void TraceWriter::Write(const TraceOp &op) {
+  if (!file_) return;
+
+  _Append(op.type);
+  switch (op.type) {
+    case kTraceAddPlayer:
+    case kTraceUpdatePos:
+    case kTraceAddStaticEntity:
+      _Append(op.nuid);
+      _Append(op.x);
+      _Append(op.y);
+      _Append(op.z);
+      break;
+    case kTraceAddSensor:
+    case kTraceSetLeaveRadius:
+      _Append(op.nuid);
+      _Append(op.sensor_id);
+      _Append(op.x);
+      break;
+    case kTraceSetMaxVisible:
+    case kTraceSetInterval:
+      _Append(op.nuid);
+      _Append(op.sensor_id);
+      _Append(op.mask);
+      break;
+    case kTraceSetPlayerCategory:
+      _Append(op.nuid);
+      _Append(op.mask);
+      break;
+    case kTraceSetSensorInterest:
+      _Append(op.nuid);
+      _Append(op.sensor_id);
+      _Append(op.mask);
+      break;
+    case kTraceRemoveSensor:
+      _Append(op.nuid);
+      _Append(op.sensor_id);
+      break;
+    case kTraceRemovePlayer:
+      _Append(op.nuid);
+      break;
+  }
+
+  if (buffer_.size() >= kTraceFlushSize) {
+    Flush();
+  }
+}
+
+void TraceWriter::Flush() {
+  if (!file_) return;
+
+  if (!buffer_.empty()) {
+    std::fwrite(buffer_.data(), 1, buffer_.size(), file_);
+    buffer_.clear();
+  }
+  std::fflush(file_);
+}
+
+void TraceWriter::Close() {
+  if (!file_) return;
+
+  Flush();
+  std::fclose(file_);
+  file_ = nullptr;
+}
+
+//--------------------------------------------------------------------------------------------------
+TraceReader::TraceReader(const std::string &path)
+    : file_(std::fopen(path.c_str(), "rb")) {
+  if (!file_) return;
+
+  char magic[sizeof(kTraceMagic)];
+  if (std::fread(magic, 1, sizeof(magic), file_) != sizeof(magic)
+      || std::memcmp(magic, kTraceMagic, sizeof(magic)) != 0
+      || !_Read(&version_) || version_ < 1 || version_ > kTraceVersion) {
+    std::fclose(file_);
+    file_ = nullptr;
+  }
+}
+
+TraceReader::~TraceReader() {
+  if (file_) std::fclose(file_);
+}
+
+template <typename T>
+inline bool TraceReader::_Read(T *value) {
+  return std::fread(value, sizeof(T), 1, file_) == 1;
+}
+
+inline bool TraceReader::_ReadCount(Uint32 *value) {
+  if (version_ > 1) return _Read(value);
+
+  float count;
+  if (!_Read(&count)) return false;
+  *value = static_cast<Uint32>(count);
+  return true;
+}
+
+bool TraceReader::Next(TraceOp *op) {
+  if (!file_) return false;
+
+  *op = TraceOp();
+  if (!_Read(&op->type)) return false;
+
+  switch (op->type) {
+    case kTraceAddPlayer:
+    case kTraceUpdatePos:
+    case kTraceAddStaticEntity:
+      return _Read(&op->nuid) && _Read(&op->x) && _Read(&op->y) && _Read(&op->z);
+    case kTraceAddSensor:
+    case kTraceSetLeaveRadius:
+      return _Read(&op->nuid) && _Read(&op->sensor_id) && _Read(&op->x);
+    case kTraceSetMaxVisible:
+    case kTraceSetInterval:
+      return _Read(&op->nuid) && _Read(&op->sensor_id) && _ReadCount(&op->mask);
+    case kTraceSetPlayerCategory:
+      return _Read(&op->nuid) && _Read(&op->mask);
+    case kTraceSetSensorInterest:
+      return _Read(&op->nuid) && _Read(&op->sensor_id) && _Read(&op->mask);
+    case kTraceRemoveSensor:
+      return _Read(&op->nuid) && _Read(&op->sensor_id);
+    case kTraceRemovePlayer:
+      return _Read(&op->nuid);
+    case kTraceTick:
+      return true;
+  }
+  return false;
+}
+
+//--------------------------------------------------------------------------------------------------
+bool LoadTrace(const std::string &path, TraceOps *ops) {
+  TraceReader reader(path);
+  if (!reader.IsOpen()) return false;
+
+  TraceOp op;
+  while (reader.Next(&op)) {
+    ops->push_back(op);
+  }
+  return true;
+}
+
+bool SaveTrace(const std::string &path, const TraceOps &ops) {
+  TraceWriter writer(path);
+  if (!writer.IsOpen()) return false;
+
+  for (const auto &op : ops) {
+    writer.Write(op);
+  }
+  writer.Close();
+  return true;
+}
+
+}  // namespace aoi
@@ -0,0 +1,214 @@
+// Copyright <disenone>
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "common/base_types.hpp"
+
+namespace aoi {
+
+// 操作记录文件格式: 文件头 kTraceMagic + kTraceVersion，之后是连续的操作记录。
+// 每条记录以 1 字节的操作类型开头，字段按本机字节序（little-endian）紧密排列：
+//   AddPlayer / UpdatePos / AddStaticEntity: nuid(8) x(4) y(4) z(4)
+//   AddSensor:             nuid(8) sensor_id(8) radius(4)
+//   SetMaxVisible:         nuid(8) sensor_id(8) max_visible(4)
+//   SetLeaveRadius:        nuid(8) sensor_id(8) leave_radius(4)
+//   SetInterval:           nuid(8) sensor_id(8) interval(4)
+//   SetPlayerCategory:     nuid(8) mask(4)
+//   SetSensorInterest:     nuid(8) sensor_id(8) mask(4)
+//   RemovePlayer:          nuid(8)
+//   RemoveSensor:          nuid(8) sensor_id(8)
+//   Tick:                  无
+// Trace file layout: header, then tightly packed records, see above.
+// 版本 1 里 max_visible 和 interval 存成 float，读的时候转换成整数。
+
+enum TraceOpType : Uint8 {
+  kTraceAddPlayer = 1,
+  kTraceRemovePlayer = 2,
+  kTraceAddSensor = 3,
+  kTraceUpdatePos = 4,
+  kTraceTick = 5,
+  kTraceSetMaxVisible = 6,
+  kTraceSetLeaveRadius = 7,
+  kTraceSetInterval = 8,
+  kTraceAddStaticEntity = 9,
+  kTraceSetPlayerCategory = 10,
+  kTraceSetSensorInterest = 11,
+  kTraceRemoveSensor = 12,
+};
+
+constexpr char kTraceMagic[8] = {'A', 'O', 'I', 'T', 'R', 'A', 'C', 'E'};
+constexpr Uint32 kTraceVersion = 2;
+
+struct TraceOp {
+  TraceOp() : type(0), nuid(0), sensor_id(0), x(0), y(0), z(0), mask(0) {}
+  TraceOp(Uint8 _type, Nuid _nuid, Nuid _sensor_id, float _x, float _y, float _z,
+          Uint32 _mask = 0)
+      : type(_type), nuid(_nuid), sensor_id(_sensor_id), x(_x), y(_y), z(_z), mask(_mask) {}
+
+  // AddSensor、SetLeaveRadius 的半径放在 x 中
+  float radius() const {
+    return x;
+  }
+  // SetMaxVisible 的数量放在 mask 中，超过 2^24 也不会丢精度
+  Uint32 max_visible() const {
+    return mask;
+  }
+  // SetInterval 的间隔（Tick 数）也放在 mask 中
+  Uint32 interval() const {
+    return mask;
+  }
+
+  Uint8 type;
+  Nuid nuid;
+  Nuid sensor_id;
+  float x, y, z;
+  Uint32 mask;    // SetPlayerCategory 的类别、SetSensorInterest 的兴趣掩码、SetMaxVisible 和 SetInterval 的数量
+};
+
+typedef std::vector<TraceOp> TraceOps;
+
+
+class TraceWriter {
+ public:
+  explicit TraceWriter(const std::string &path);
+  ~TraceWriter();
+  TraceWriter(const TraceWriter&) = delete;
+  TraceWriter& operator=(const TraceWriter&) = delete;
+
+  bool IsOpen() const {
+    return file_ != nullptr;
+  }
+
+  void AddPlayer(Nuid nuid, float x, float y, float z) {
+    Write(TraceOp(kTraceAddPlayer, nuid, 0, x, y, z));
+  }
+  void RemovePlayer(Nuid nuid) {
+    Write(TraceOp(kTraceRemovePlayer, nuid, 0, 0, 0, 0));
+  }
+  void AddSensor(Nuid nuid, Nuid sensor_id, float radius) {
+    Write(TraceOp(kTraceAddSensor, nuid, sensor_id, radius, 0, 0));
+  }
+  void UpdatePos(Nuid nuid, float x, float y, float z) {
+    Write(TraceOp(kTraceUpdatePos, nuid, 0, x, y, z));
+  }
+  void Tick() {
+    Write(TraceOp(kTraceTick, 0, 0, 0, 0, 0));
+  }
+  void SetSensorMaxVisible(Nuid nuid, Nuid sensor_id, Uint32 max_visible) {
+    Write(TraceOp(kTraceSetMaxVisible, nuid, sensor_id, 0, 0, 0, max_visible));
+  }
+  void SetSensorLeaveRadius(Nuid nuid, Nuid sensor_id, float leave_radius) {
+    Write(TraceOp(kTraceSetLeaveRadius, nuid, sensor_id, leave_radius, 0, 0));
+  }
+  void SetSensorInterval(Nuid nuid, Nuid sensor_id, Uint32 interval) {
+    Write(TraceOp(kTraceSetInterval, nuid, sensor_id, 0, 0, 0, interval));
+  }
+  void AddStaticEntity(Nuid nuid, float x, float y, float z) {
+    Write(TraceOp(kTraceAddStaticEntity, nuid, 0, x, y, z));
+  }
+  void SetPlayerCategory(Nuid nuid, Uint32 category) {
+    Write(TraceOp(kTraceSetPlayerCategory, nuid, 0, 0, 0, 0, category));
+  }
+  void SetSensorInterest(Nuid nuid, Nuid sensor_id, Uint32 interest) {
+    Write(TraceOp(kTraceSetSensorInterest, nuid, sensor_id, 0, 0, 0, interest));
+  }
+  void RemoveSensor(Nuid nuid, Nuid sensor_id) {
+    Write(TraceOp(kTraceRemoveSensor, nuid, sensor_id, 0, 0, 0));
+  }
+
+  void Write(const TraceOp &op);
+  void Flush();
+  void Close();
+
+ private:
+  template <typename T>
+  inline void _Append(const T &value);
+
+  std::FILE *file_;
+  std::vector<Uint8> buffer_;
+};
+
+
+class TraceReader {
+ public:
+  explicit TraceReader(const std::string &path);
+  ~TraceReader();
+  TraceReader(const TraceReader&) = delete;
+  TraceReader& operator=(const TraceReader&) = delete;
+
+  bool IsOpen() const {
+    return file_ != nullptr;
+  }
+
+  // 读完或者遇到损坏的记录时返回 false
+  bool Next(TraceOp *op);
+
+ private:
+  template <typename T>
+  inline bool _Read(T *value);
+  // 版本 1 里存成 float 的整数
+  inline bool _ReadCount(Uint32 *value);
+
+  std::FILE *file_;
+  Uint32 version_ = 0;
+};
+
+
+bool LoadTrace(const std::string &path, TraceOps *ops);
+bool SaveTrace(const std::string &path, const TraceOps &ops);
+
+
+// 只有 cross 能删除 sensor，其它算法的 trace 里不会有这个操作
+template <typename Aoi>
+auto ApplyRemoveSensor(Aoi *aoi, const TraceOp &op, int)
+    -> decltype(aoi->RemoveSensor(op.nuid, op.sensor_id), void()) {
+  aoi->RemoveSensor(op.nuid, op.sensor_id);
+}
+template <typename Aoi>
+void ApplyRemoveSensor(Aoi*, const TraceOp&, long) {}
+
+
+// 把一条非 Tick 的操作作用到 aoi 上，Tick 由调用者自己处理（需要计时或者收集结果）
+template <typename Aoi>
+void ApplyTraceOp(Aoi *aoi, const TraceOp &op) {
+  switch (op.type) {
+    case kTraceAddPlayer:
+      aoi->AddPlayer(op.nuid, op.x, op.y, op.z);
+      break;
+    case kTraceRemovePlayer:
+      aoi->RemovePlayer(op.nuid);
+      break;
+    case kTraceAddSensor:
+      aoi->AddSensor(op.nuid, op.sensor_id, op.radius());
+      break;
+    case kTraceUpdatePos:
+      aoi->UpdatePos(op.nuid, op.x, op.y, op.z);
+      break;
+    case kTraceSetMaxVisible:
+      aoi->SetSensorMaxVisible(op.nuid, op.sensor_id, op.max_visible());
+      break;
+    case kTraceSetLeaveRadius:
+      aoi->SetSensorLeaveRadius(op.nuid, op.sensor_id, op.radius());
+      break;
+    case kTraceSetInterval:
+      aoi->SetSensorInterval(op.nuid, op.sensor_id, op.interval());
+      break;
+    case kTraceAddStaticEntity:
+      aoi->AddStaticEntity(op.nuid, op.x, op.y, op.z);
+      break;
+    case kTraceSetPlayerCategory:
+      aoi->SetPlayerCategory(op.nuid, op.mask);
+      break;
+    case kTraceSetSensorInterest:
+      aoi->SetSensorInterest(op.nuid, op.sensor_id, op.mask);
+      break;
+    case kTraceRemoveSensor:
+      ApplyRemoveSensor(aoi, op, 0);
+      break;
+  }
+}
+
+}  // namespace aoi
@@ -0,0 +1,124 @@
+// Copyright <disenone>
+#pragma once
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace aoi {
+
+// 上一次已经看到的玩家，距离按这个比例打折再参与比较：新玩家要比它近 10% 以上才能把它挤掉，
+// 边界上距离差不多的两个玩家不会每次 Tick 都换来换去。
+// Incumbents compete with their distance scaled down, so the boundary member does not flicker.
+constexpr float kVisibleIncumbentScale = 0.9f;
+
+// sensor 最多只看到 max_visible 个玩家时，从 aoi_players 里只保留最近的 max_visible 个，
+// 用 nth_element 做部分选择，距离相同时 nuid 小的优先。incumbents 是上一次的列表，会被按 nuid 排序。
+// 查找时已经用 NearestSelector 选过的话，这里只剩 KeepIncumbents 加回来的几个玩家要处理；
+// bvh 的候选在树对树的遍历里一起攒出来，仍然在这里整表选。
+// Keeps the max_visible nearest players (partial selection, ties broken by nuid).
+template <typename PlayerPtrList, typename Pos>
+void KeepNearest(const Pos &pos, size_t max_visible, PlayerPtrList *incumbents,
+                 PlayerPtrList *aoi_players) {
+  if (max_visible == 0 || aoi_players->size() <= max_visible) return;
+
+  typedef typename PlayerPtrList::value_type PlayerPtr;
+  auto nuid_less = [](PlayerPtr left, PlayerPtr right) { return left->nuid < right->nuid; };
+  std::sort(incumbents->begin(), incumbents->end(), nuid_less);
+
+  constexpr float incumbent_scale = kVisibleIncumbentScale * kVisibleIncumbentScale;
+  std::vector<std::pair<float, PlayerPtr>> keys;
+  keys.reserve(aoi_players->size());
+  for (auto other_ptr : *aoi_players) {
+    float dx = other_ptr->pos.x - pos.x;
+    float dz = other_ptr->pos.z - pos.z;
+    float dist = dx * dx + dz * dz;
+    if (std::binary_search(incumbents->begin(), incumbents->end(), other_ptr, nuid_less)) {
+      dist *= incumbent_scale;
+    }
+    keys.emplace_back(dist, other_ptr);
+  }
+
+  std::nth_element(keys.begin(), keys.begin() + max_visible, keys.end(),
+                   [](const std::pair<float, PlayerPtr> &left,
+                      const std::pair<float, PlayerPtr> &right) {
+                     if (left.first != right.first) return left.first < right.first;
+                     return left.second->nuid < right.second->nuid;
+                   });
+
+  aoi_players->resize(max_visible);
+  for (size_t i = 0; i < max_visible; ++i) {
+    (*aoi_players)[i] = keys[i].second;
+  }
+}
+
+
+// 边查找边选：sensor 有 max_visible 时，_CalcAoiPlayers 把通过距离检查的玩家交给它，只用一个
+// 大小为 max_visible 的大顶堆留下目前最近的几个，候选玩家再多也不会先攒出完整的列表。
+// 打折和 nuid 次序都和 KeepNearest 一样，选出来的玩家也完全一样。
+// Bounded top-k selection inside the query, equivalent to KeepNearest on the full list.
+template <typename PlayerPtr>
+class NearestSelector {
+ public:
+  // 开始一个 sensor 的查找，incumbents 是上一次的列表，会被按 nuid 排序
+  template <typename PlayerPtrList>
+  void Reset(float pos_x, float pos_z, size_t max_visible, PlayerPtrList *incumbents) {
+    std::sort(incumbents->begin(), incumbents->end(), NuidLess);
+    pos_x_ = pos_x;
+    pos_z_ = pos_z;
+    max_visible_ = max_visible;
+    incumbents_begin_ = incumbents->data();
+    incumbents_end_ = incumbents->data() + incumbents->size();
+    heap_.clear();
+  }
+
+  void Offer(PlayerPtr other_ptr) {
+    float dx = other_ptr->pos.x - pos_x_;
+    float dz = other_ptr->pos.z - pos_z_;
+    float dist = dx * dx + dz * dz;
+    // 打折之后也比堆顶远，一定选不上，不用再查是不是 incumbent
+    if (heap_.size() == max_visible_ && dist * kIncumbentScale > heap_.front().first) return;
+    if (std::binary_search(incumbents_begin_, incumbents_end_, other_ptr, NuidLess)) {
+      dist *= kIncumbentScale;
+    }
+
+    Key key(dist, other_ptr);
+    if (heap_.size() < max_visible_) {
+      heap_.push_back(key);
+      std::push_heap(heap_.begin(), heap_.end(), KeyLess);
+    } else if (KeyLess(key, heap_.front())) {
+      std::pop_heap(heap_.begin(), heap_.end(), KeyLess);
+      heap_.back() = key;
+      std::push_heap(heap_.begin(), heap_.end(), KeyLess);
+    }
+  }
+
+  // 选中的玩家追加到 aoi_players 末尾，顺序不定
+  template <typename PlayerPtrList>
+  void Finish(PlayerPtrList *aoi_players) const {
+    for (const auto &key : heap_) {
+      aoi_players->push_back(key.second);
+    }
+  }
+
+ private:
+  typedef std::pair<float, PlayerPtr> Key;
+  static constexpr float kIncumbentScale = kVisibleIncumbentScale * kVisibleIncumbentScale;
+
+  static bool NuidLess(PlayerPtr left, PlayerPtr right) {
+    return left->nuid < right->nuid;
+  }
+  static bool KeyLess(const Key &left, const Key &right) {
+    if (left.first != right.first) return left.first < right.first;
+    return left.second->nuid < right.second->nuid;
+  }
+
+  float pos_x_ = 0;
+  float pos_z_ = 0;
+  size_t max_visible_ = 0;
+  const PlayerPtr *incumbents_begin_ = nullptr;
+  const PlayerPtr *incumbents_end_ = nullptr;
+  std::vector<Key> heap_;     // 复用，不用每个 sensor 都分配
+};
+
+}  // namespace aoi
@@ -8,12 +8,17 @@
 #include <boost/range/irange.hpp>
 
 #include "cross.hpp"
+#include "common/aoi_diff.hpp"
+#include "common/trace.hpp"
 
 namespace aoi { namespace cross {
 
 #define MOVE_DIRECTION_LEFT 0
 #define MOVE_DIRECTION_RIGHT 1
 
+// 静态索引的格子不小于这个值，避免 sensor 都还没加时建出过细的格子
+constexpr float kMinStaticCellSize = 32;
+
 #define IfInXZRadiusSquare(dx, dz, x0, z0, x1, z1, radius_square) \
   dx = x0 - x1; \
   dz = z0 - z1; \
@@ -25,26 +30,25 @@ namespace aoi { namespace cross {
   if (dx * dx + dz * dz > radius_square) \
 
 //--------------------------------------------------------------------------------------------------
-class KHashDeleter {
- public:
-  void operator()(khash_t(SensorHashMap) *ptr) {
-    kh_destroy(SensorHashMap, ptr);
-  }
-};
-
-Sensor::Sensor(Nuid _sensor_id, float _radius, PlayerAoi *_pplayer)
-    : sensor_id(_sensor_id), radius(_radius),
-      radius_square(_radius * _radius), pplayer(_pplayer),
-      left_x(COORD_TYPE_GUARD_LEFT, _pplayer->pos.x - _radius, _pplayer, this),
-      right_x(COORD_TYPE_GUARD_RIGHT, _pplayer->pos.x + _radius, _pplayer, this),
-      left_z(COORD_TYPE_GUARD_LEFT, _pplayer->pos.z - radius, _pplayer, this),
-      right_z(COORD_TYPE_GUARD_RIGHT, _pplayer->pos.z + radius, _pplayer, this),
-      aoi_player_candidates(kh_init(SensorHashMap), KHashDeleter()) {
-    kh_resize(SensorHashMap, aoi_player_candidates.get(), 100);
+// candidates 不预分配，大部分 sensor 只框住几个玩家，按需增长
+Sensor::Sensor(Nuid _sensor_id, float _radius, PlayerAoi *_pplayer,
+               MemoryResource *resource /*= nullptr*/)
+    : pplayer(_pplayer), aoi_player_candidates(kh_init(SensorHashMap)), radius(_radius),
+      radius_square(_radius * _radius), leave_radius(_radius),
+      leave_radius_square(_radius * _radius), flags(0), sensor_id(_sensor_id),
+      left_x(COORD_TYPE_GUARD_LEFT, _pplayer->pos.x - _radius, this),
+      right_x(COORD_TYPE_GUARD_RIGHT, _pplayer->pos.x + _radius, this),
+      left_z(COORD_TYPE_GUARD_LEFT, _pplayer->pos.z - radius, this),
+      right_z(COORD_TYPE_GUARD_RIGHT, _pplayer->pos.z + radius, this),
+      aoi_players{PlayerPtrList(ResourceAllocator<PlayerAoi*>(resource)),
+                  PlayerPtrList(ResourceAllocator<PlayerAoi*>(resource))} {
+    SetFlag_New();
   }
 
 inline void Sensor::AddCandidate(PlayerAoi* other_pplayer) {
   if (pplayer->nuid == other_pplayer->nuid) return;
+  // beacon 总是要记下来，AddPlayer 和 AddSensor 靠它复制 candidates
+  if (!(other_pplayer->category & interest) && !other_pplayer->GetFlag_Beacon()) return;
 
   auto candidates = aoi_player_candidates.get();
   if (kh_get(SensorHashMap, candidates, other_pplayer->nuid) == kh_end(candidates)) {
@@ -53,8 +57,8 @@ inline void Sensor::AddCandidate(PlayerAoi* other_pplayer) {
     assert(ret != -1);
     kh_value(candidates, k) = other_pplayer;
 
-    if (other_pplayer->detected_by) {
-      (*other_pplayer->detected_by)[pplayer->nuid].push_back(sensor_id);
+    if (other_pplayer->GetFlag_Beacon()) {
+      (*other_pplayer->observer->detected_by)[pplayer->nuid].push_back(sensor_id);
     }
   }
 }
@@ -65,9 +69,11 @@ inline void Sensor::RemoveCandidate(PlayerAoi* other_pplayer) {
   if (k != kh_end(candidates)) {
     kh_del(SensorHashMap, candidates, k);
 
-    if (other_pplayer->detected_by) {
-      auto &sensor_ids = (*other_pplayer->detected_by)[pplayer->nuid];
+    if (other_pplayer->GetFlag_Beacon()) {
+      auto &detected_by = *other_pplayer->observer->detected_by;
+      auto &sensor_ids = detected_by[pplayer->nuid];
       sensor_ids.erase(std::find(sensor_ids.begin(), sensor_ids.end(), sensor_id));
+      if (sensor_ids.empty()) detected_by.erase(pplayer->nuid);
     }
   }
 }
@@ -95,7 +101,8 @@ void CoordNode::PrintLog() {
       printf("right");
       break;
   }
-  printf(" %lu, %f", pplayer->nuid, value);
+  auto owner = type == COORD_TYPE_PLAYER ? pplayer : psensor->pplayer;
+  printf(" %lu, %f", owner->nuid, value);
   printf("), ");
 }
 
@@ -148,58 +155,63 @@ inline void ListRemove(CoordNode **list, CoordNode *pos) {
 }
 
 //--------------------------------------------------------------------------------------------------
-inline void MoveIn(CoordNode *player_node, CoordNode *sensor_node) {
-  if (player_node->pplayer->nuid == sensor_node->pplayer->nuid) return;
+inline void MoveIn(CoordNode *player_node, CoordNode *sensor_node, AoiStats *stats) {
+  AOI_STATS_INC(*stats, move_ins);
+  auto psensor = sensor_node->psensor;
+  if (player_node->pplayer == psensor->pplayer) return;
   const auto &pos = player_node->pplayer->pos;
-  const auto &other_pos = sensor_node->pplayer->pos;
-  auto radius = sensor_node->psensor->radius;
+  const auto &other_pos = psensor->pplayer->pos;
+  auto radius = psensor->radius;
 
   if (fabs(pos.x - other_pos.x) < radius && fabs(pos.z - other_pos.z) < radius) {
     sensor_node->psensor->AddCandidate(player_node->pplayer);
   }
 }
 
-inline void MoveOut(CoordNode *player_node, CoordNode *sensor_node) {
+inline void MoveOut(CoordNode *player_node, CoordNode *sensor_node, AoiStats *stats) {
+  AOI_STATS_INC(*stats, move_outs);
   sensor_node->psensor->RemoveCandidate(player_node->pplayer);
 }
 
 #define MOVE_CROSS_ID(dir, type1, type2) ((dir << 16) + (type1 << 8) + type2)
 
-inline void MoveCross(Uint32 dir, CoordNode *moving_node, CoordNode *static_node) {
+inline void MoveCross(Uint32 dir, CoordNode *moving_node, CoordNode *static_node,
+                      AoiStats *stats) {
   Uint32 cross_id = MOVE_CROSS_ID(dir, (Uint32)moving_node->type, (Uint32)static_node->type);
 
   switch (cross_id) {
     case MOVE_CROSS_ID(MOVE_DIRECTION_LEFT, COORD_TYPE_PLAYER, COORD_TYPE_GUARD_RIGHT):
     case MOVE_CROSS_ID(MOVE_DIRECTION_RIGHT, COORD_TYPE_PLAYER, COORD_TYPE_GUARD_LEFT):
-      MoveIn(moving_node, static_node);
+      MoveIn(moving_node, static_node, stats);
       break;
 
     case MOVE_CROSS_ID(MOVE_DIRECTION_LEFT, COORD_TYPE_GUARD_LEFT, COORD_TYPE_PLAYER):
     case MOVE_CROSS_ID(MOVE_DIRECTION_RIGHT, COORD_TYPE_GUARD_RIGHT, COORD_TYPE_PLAYER):
-      MoveIn(static_node, moving_node);
+      MoveIn(static_node, moving_node, stats);
       break;
 
     case MOVE_CROSS_ID(MOVE_DIRECTION_LEFT, COORD_TYPE_PLAYER, COORD_TYPE_GUARD_LEFT):
     case MOVE_CROSS_ID(MOVE_DIRECTION_RIGHT, COORD_TYPE_PLAYER, COORD_TYPE_GUARD_RIGHT):
-      MoveOut(moving_node, static_node);
+      MoveOut(moving_node, static_node, stats);
       break;
 
     case MOVE_CROSS_ID(MOVE_DIRECTION_LEFT, COORD_TYPE_GUARD_RIGHT, COORD_TYPE_PLAYER):
     case MOVE_CROSS_ID(MOVE_DIRECTION_RIGHT, COORD_TYPE_GUARD_LEFT, COORD_TYPE_PLAYER):
-      MoveOut(static_node, moving_node);
+      MoveOut(static_node, moving_node, stats);
       break;
   }
 }
 
 //--------------------------------------------------------------------------------------------------
-void ListUpdateNode(CoordNode **list, CoordNode *pnode) {
+void ListUpdateNode(CoordNode **list, CoordNode *pnode, AoiStats *stats) {
   float value = pnode->value;
 
   if (pnode->next && pnode->next->value < value) {
     // move right
     auto cur_node = pnode->next;
     while (1) {
-      MoveCross(MOVE_DIRECTION_RIGHT, pnode, cur_node);
+      AOI_STATS_INC(*stats, nodes_crossed);
+      MoveCross(MOVE_DIRECTION_RIGHT, pnode, cur_node, stats);
       if (!cur_node->next || cur_node->next->value >= value) break;
       cur_node = cur_node->next;
     }
@@ -211,7 +223,8 @@ void ListUpdateNode(CoordNode **list, CoordNode *pnode) {
     // move left
     auto cur_node = pnode->prev;
     while (1) {
-      MoveCross(MOVE_DIRECTION_LEFT, pnode, cur_node);
+      AOI_STATS_INC(*stats, nodes_crossed);
+      MoveCross(MOVE_DIRECTION_LEFT, pnode, cur_node, stats);
       if (!cur_node->prev || cur_node->prev->value <= value) break;
       cur_node = cur_node->prev;
     }
@@ -223,7 +236,9 @@ void ListUpdateNode(CoordNode **list, CoordNode *pnode) {
 
 //--------------------------------------------------------------------------------------------------
 CrossAoi::CrossAoi(float map_bound_xmin, float map_bound_xmax, float map_bound_zmin,
-                   float map_bound_zmax, size_t beacon_x, size_t beacon_z, float beacon_radius) {
+                   float map_bound_zmax, size_t beacon_x, size_t beacon_z, float beacon_radius,
+                   MemoryResource *resource /*= nullptr*/)
+    : resource_(resource), player_map_(PlayerMap::allocator_type(resource)) {
   if (beacon_x == 0 && beacon_z == 0) return;
 
   assert(map_bound_xmax > map_bound_xmin);
@@ -235,11 +250,11 @@ CrossAoi::CrossAoi(float map_bound_xmin, float map_bound_xmax, float map_bound_z
       float pos_x = map_bound_xmin + step_x * (x * 2 + 1);
       float pos_z = map_bound_zmin + step_z * (z * 2 + 1);
       auto nuid = GenNuid();
-      AddPlayerNoBeacon(nuid, pos_x, 0, pos_z);
-      AddSensorNoBeacon(nuid, GenNuid(), beacon_radius);
+      _AddPlayerNoBeacon(nuid, pos_x, 0, pos_z);
+      _AddSensorNoBeacon(nuid, GenNuid(), beacon_radius);
       auto &beacon = *player_map_[nuid];
       beacon.SetFlag_Beacon();
-      beacon.detected_by.reset(new boost::unordered_map<Nuid, std::vector<Nuid>>());
+      beacon.observer->detected_by.reset(new boost::unordered_map<Nuid, std::vector<Nuid>>());
       beacons.push_back(&beacon);
     }
   }
@@ -247,18 +262,21 @@ CrossAoi::CrossAoi(float map_bound_xmin, float map_bound_xmax, float map_bound_z
 
 //--------------------------------------------------------------------------------------------------
 void CrossAoi::AddPlayer(Nuid nuid, float x, float y, float z) {
+  if (trace_writer_) trace_writer_->AddPlayer(nuid, x, y, z);
+
   if (beacons.empty()) {
-    AddPlayerNoBeacon(nuid, x, y, z);
+    _AddPlayerNoBeacon(nuid, x, y, z);
     return;
   }
 
   auto piter = player_map_.find(nuid);
   if (piter != player_map_.end()) {
-    AddPlayerNoBeacon(nuid, x, y, z);
+    _AddPlayerNoBeacon(nuid, x, y, z);
     return;
   }
 
-  auto ret = player_map_.emplace(nuid, new PlayerAoi(nuid, x, y, z));
+  auto ret = player_map_.emplace(nuid, std::allocate_shared<PlayerAoi>(
+      ResourceAllocator<PlayerAoi>(resource_), nuid, x, y, z));
   auto &player = *ret.first->second;
   player.SetFlag_New();
 
@@ -277,37 +295,41 @@ void CrossAoi::AddPlayer(Nuid nuid, float x, float y, float z) {
   assert(best_beacon);
 
   // 复制 detected_by
-  for (auto &elem : *best_beacon->detected_by) {
-    auto other_nuid = elem.first;
-    auto &other_player = *player_map_[other_nuid];
+  for (auto &elem : *best_beacon->observer->detected_by) {
+    auto &other_player = *player_map_.find(elem.first)->second;
     for (auto sensor_id : elem.second) {
-      for (auto &sensor : other_player.sensors) {
+      for (auto &sensor : other_player.observer->sensors) {
         if (sensor.sensor_id == sensor_id) {
           sensor.AddCandidate(&player);
         }
       }
     }
   }
-  if (!best_beacon->sensors.empty()) {
-    for (auto &sensor : best_beacon->sensors) {
-      sensor.AddCandidate(&player);
-    }
+  for (auto &sensor : best_beacon->observer->sensors) {
+    sensor.AddCandidate(&player);
   }
 
   ListInsertBefore(&coord_list_x_, &best_beacon->node_x, &player.node_x);
   ListInsertBefore(&coord_list_z_, &best_beacon->node_z, &player.node_z);
-  UpdatePos(nuid, x, y, z);
+  _UpdatePos(nuid, x, y, z);
 }
 
 //--------------------------------------------------------------------------------------------------
 void CrossAoi::AddPlayerNoBeacon(Nuid nuid, float x, float y, float z) {
+  if (trace_writer_) trace_writer_->AddPlayer(nuid, x, y, z);
+
+  _AddPlayerNoBeacon(nuid, x, y, z);
+}
+
+void CrossAoi::_AddPlayerNoBeacon(Nuid nuid, float x, float y, float z) {
   auto piter = player_map_.find(nuid);
 
   if (piter == player_map_.end()) {
     auto ret = player_map_.emplace(
       std::piecewise_construct,
       std::forward_as_tuple(nuid),
-      std::forward_as_tuple(new PlayerAoi(nuid, x, y, z)));
+      std::forward_as_tuple(std::allocate_shared<PlayerAoi>(
+          ResourceAllocator<PlayerAoi>(resource_), nuid, x, y, z)));
     auto &player = *ret.first->second;
     player.SetFlag_New();
     ListInsertBefore(&coord_list_x_, coord_list_x_, &player.node_x);
@@ -315,11 +337,13 @@ void CrossAoi::AddPlayerNoBeacon(Nuid nuid, float x, float y, float z) {
   } else {
     piter->second->UnsetFlag_Removed();
   }
-  UpdatePos(nuid, x, y, z);
+  _UpdatePos(nuid, x, y, z);
 }
 
 //--------------------------------------------------------------------------------------------------
 void CrossAoi::RemovePlayer(Nuid nuid) {
+  if (trace_writer_) trace_writer_->RemovePlayer(nuid);
+
   auto piter = player_map_.find(nuid);
   if (piter == player_map_.end()) return;
 
@@ -334,23 +358,41 @@ void CrossAoi::_RemovePlayer(Nuid nuid) {
 
   auto &player = *piter->second;
   std::vector<Nuid> sensor_ids;
-  for (auto siter = player.sensors.rbegin(); siter != player.sensors.rend(); ++siter) {
-    sensor_ids.push_back(siter->sensor_id);
+  if (player.observer) {
+    auto &sensors = player.observer->sensors;
+    for (auto siter = sensors.rbegin(); siter != sensors.rend(); ++siter) {
+      sensor_ids.push_back(siter->sensor_id);
+    }
   }
 
   for (auto sensor_id : sensor_ids) {
-    RemoveSensor(nuid, sensor_id);
+    _RemoveSensor(nuid, sensor_id);
+  }
+
+  // 从其它 sensor 的 candidates 里删掉自己，
+  // 包含自己的 sensor 的 right_x 一定在 node_x 右边 2 * max_sensor_radius_ 以内
+  float limit = player.node_x.value + 2 * max_sensor_radius_;
+  for (auto node = player.node_x.next; node && node->value <= limit; node = node->next) {
+    if (node->type == COORD_TYPE_GUARD_RIGHT) {
+      node->psensor->RemoveCandidate(&player);
+    }
   }
 
   ListRemove(&coord_list_x_, &player.node_x);
   ListRemove(&coord_list_z_, &player.node_z);
-  player_map_.erase(nuid);
+  Uint32 max_interval = interval_schedule_.GetMaxInterval();
+  if (max_interval > 1) {
+    graveyard_.Bury(std::move(piter->second), tick_count_ + max_interval);
+  }
+  player_map_.erase(piter);
 }
 
 //--------------------------------------------------------------------------------------------------
 void CrossAoi::AddSensor(Nuid nuid, Nuid sensor_id, float radius) {
+  if (trace_writer_) trace_writer_->AddSensor(nuid, sensor_id, radius);
+
   if (beacons.empty()) {
-    return AddSensorNoBeacon(nuid, sensor_id, radius);
+    return _AddSensorNoBeacon(nuid, sensor_id, radius);
   }
 
   auto piter = player_map_.find(nuid);
@@ -371,14 +413,16 @@ void CrossAoi::AddSensor(Nuid nuid, Nuid sensor_id, float radius) {
   }
   assert(best_beacon);
 
-  auto &best_sensor = best_beacon->sensors[0];
+  auto &best_sensor = best_beacon->observer->sensors.front();
   float dr = best_sensor.radius - radius;
   if (dr * dr + min_dist > radius) {
-    return AddSensorNoBeacon(nuid, sensor_id, radius);
+    return _AddSensorNoBeacon(nuid, sensor_id, radius);
   }
 
-  player.sensors.emplace_back(sensor_id, radius, &player);
-  auto &sensor = player.sensors[player.sensors.size() - 1];
+  auto &sensors = player.UpgradeObserver(resource_).sensors;
+  sensors.emplace_back(sensor_id, radius, &player, resource_);
+  auto &sensor = sensors.back();
+  max_sensor_radius_ = std::max(max_sensor_radius_, radius);
   auto size = kh_size(best_sensor.aoi_player_candidates.get());
   kh_resize(SensorHashMap, sensor.aoi_player_candidates.get(), size);
   PlayerAoi *val;
@@ -398,12 +442,20 @@ void CrossAoi::AddSensor(Nuid nuid, Nuid sensor_id, float radius) {
 
 //--------------------------------------------------------------------------------------------------
 void CrossAoi::AddSensorNoBeacon(Nuid nuid, Nuid sensor_id, float radius) {
+  if (trace_writer_) trace_writer_->AddSensor(nuid, sensor_id, radius);
+
+  _AddSensorNoBeacon(nuid, sensor_id, radius);
+}
+
+void CrossAoi::_AddSensorNoBeacon(Nuid nuid, Nuid sensor_id, float radius) {
   auto piter = player_map_.find(nuid);
   if (piter == player_map_.end()) return;
 
   auto &player = *piter->second;
-  player.sensors.emplace_back(sensor_id, radius, &player);
-  auto &sensor = player.sensors[player.sensors.size() - 1];
+  auto &sensors = player.UpgradeObserver(resource_).sensors;
+  sensors.emplace_back(sensor_id, radius, &player, resource_);
+  auto &sensor = sensors.back();
+  max_sensor_radius_ = std::max(max_sensor_radius_, radius);
 
   ListInsertBefore(&coord_list_x_, &player.node_x, &sensor.left_x);
   ListInsertAfter(&coord_list_x_, &player.node_x, &sensor.right_x);
@@ -416,34 +468,59 @@ void CrossAoi::AddSensorNoBeacon(Nuid nuid, Nuid sensor_id, float radius) {
 
 //--------------------------------------------------------------------------------------------------
 void CrossAoi::RemoveSensor(Nuid nuid, Nuid sensor_id) {
+  if (trace_writer_) trace_writer_->RemoveSensor(nuid, sensor_id);
+
+  _RemoveSensor(nuid, sensor_id);
+}
+
+void CrossAoi::_RemoveSensor(Nuid nuid, Nuid sensor_id) {
   auto piter = player_map_.find(nuid);
   if (piter == player_map_.end()) return;
 
   auto &player = *piter->second;
-  if (player.sensors.size() > 1) {
-    auto &last_sensor = player.sensors[player.sensors.size() - 1];
-    if (last_sensor.sensor_id != sensor_id) {
-      for (auto &sensor : player.sensors) {
-        if (sensor.sensor_id == sensor_id) {
-          std::swap(sensor, last_sensor);
-          break;
-        }
-      }
-    }
+  if (!player.observer) return;
+  auto &sensors = player.observer->sensors;
+  auto siter = std::find_if(sensors.begin(), sensors.end(),
+                            [sensor_id](const Sensor &sensor) {
+                              return sensor.sensor_id == sensor_id;
+                            });
+  if (siter == sensors.end()) return;
+
+  auto &sensor = *siter;
+  // beacon 的 detected_by 记录了这个 sensor，要一起删掉
+  PlayerAoi *other_ptr;
+  std::vector<PlayerAoi*> beacon_candidates;
+  kh_foreach_value(sensor.aoi_player_candidates.get(), other_ptr,
+    if (other_ptr->GetFlag_Beacon()) beacon_candidates.push_back(other_ptr);
+  )
+  for (auto beacon : beacon_candidates) {
+    sensor.RemoveCandidate(beacon);
   }
 
-  auto &last_sensor = player.sensors[player.sensors.size() - 1];
-  if (last_sensor.sensor_id != sensor_id) return;
+  ListRemove(&coord_list_x_, &sensor.left_x);
+  ListRemove(&coord_list_x_, &sensor.right_x);
+  ListRemove(&coord_list_z_, &sensor.left_z);
+  ListRemove(&coord_list_z_, &sensor.right_z);
+  sensors.erase(siter);
+  // 最后一个 sensor 删掉之后退回只被观察的形式
+  if (sensors.empty() && !player.observer->detected_by) player.observer.reset();
+}
 
-  ListRemove(&coord_list_x_, &last_sensor.left_x);
-  ListRemove(&coord_list_x_, &last_sensor.right_x);
-  ListRemove(&coord_list_z_, &last_sensor.left_z);
-  ListRemove(&coord_list_z_, &last_sensor.right_z);
-  player.sensors.pop_back();
+//--------------------------------------------------------------------------------------------------
+void CrossAoi::AddStaticEntity(Nuid nuid, float x, float y, float z) {
+  if (trace_writer_) trace_writer_->AddStaticEntity(nuid, x, y, z);
+
+  static_index_.Add(nuid, x, z);
 }
 
 //--------------------------------------------------------------------------------------------------
 void CrossAoi::UpdatePos(Nuid nuid, float x, float y, float z) {
+  if (trace_writer_) trace_writer_->UpdatePos(nuid, x, y, z);
+
+  _UpdatePos(nuid, x, y, z);
+}
+
+void CrossAoi::_UpdatePos(Nuid nuid, float x, float y, float z) {
   auto piter = player_map_.find(nuid);
   if (piter == player_map_.end()) return;
 
@@ -452,13 +529,13 @@ void CrossAoi::UpdatePos(Nuid nuid, float x, float y, float z) {
   player.SetFlag_Dirty();
 
   player.node_x.value = player.pos.x;
-  ListUpdateNode(&coord_list_x_, &player.node_x);
+  ListUpdateNode(&coord_list_x_, &player.node_x, &stats_);
 
   player.node_z.value = player.pos.z;
-  ListUpdateNode(&coord_list_z_, &player.node_z);
+  ListUpdateNode(&coord_list_z_, &player.node_z, &stats_);
 
-  if (!player.sensors.empty()) {
-    for (auto &sensor : player.sensors) {
+  if (player.observer) {
+    for (auto &sensor : player.observer->sensors) {
       UpdateSensorPos(player, &sensor);
     }
   }
@@ -468,20 +545,202 @@ void CrossAoi::UpdatePos(Nuid nuid, float x, float y, float z) {
 void CrossAoi::UpdateSensorPos(const PlayerAoi &player, Sensor *psensor) {
   auto radius = psensor->radius;
   psensor->right_x.value = player.pos.x + radius;
-  ListUpdateNode(&coord_list_x_, &psensor->right_x);
+  ListUpdateNode(&coord_list_x_, &psensor->right_x, &stats_);
 
   psensor->left_x.value = player.pos.x - radius;
-  ListUpdateNode(&coord_list_x_, &psensor->left_x);
+  ListUpdateNode(&coord_list_x_, &psensor->left_x, &stats_);
 
   psensor->right_z.value = player.pos.z + radius;
-  ListUpdateNode(&coord_list_z_, &psensor->right_z);
+  ListUpdateNode(&coord_list_z_, &psensor->right_z, &stats_);
 
   psensor->left_z.value = player.pos.z - radius;
-  ListUpdateNode(&coord_list_z_, &psensor->left_z);
+  ListUpdateNode(&coord_list_z_, &psensor->left_z, &stats_);
+}
+
+//--------------------------------------------------------------------------------------------------
+void CrossAoi::SetSensorMaxVisible(Nuid nuid, Nuid sensor_id, Uint32 max_visible) {
+  if (trace_writer_) trace_writer_->SetSensorMaxVisible(nuid, sensor_id, max_visible);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end() || !piter->second->observer) return;
+
+  for (auto &sensor : piter->second->observer->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.max_visible = max_visible;
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+void CrossAoi::SetSensorLeaveRadius(Nuid nuid, Nuid sensor_id, float leave_radius) {
+  if (trace_writer_) trace_writer_->SetSensorLeaveRadius(nuid, sensor_id, leave_radius);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end() || !piter->second->observer) return;
+
+  for (auto &sensor : piter->second->observer->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.leave_radius = std::max(leave_radius, sensor.radius);
+      sensor.leave_radius_square = sensor.leave_radius * sensor.leave_radius;
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+void CrossAoi::SetSensorInterval(Nuid nuid, Nuid sensor_id, Uint32 interval) {
+  if (trace_writer_) trace_writer_->SetSensorInterval(nuid, sensor_id, interval);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end() || !piter->second->observer) return;
+
+  for (auto &sensor : piter->second->observer->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.interval = std::max<Uint32>(interval, 1);
+      sensor.phase = interval_schedule_.AllocPhase(sensor.interval);
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+void CrossAoi::SetPlayerCategory(Nuid nuid, Uint32 category) {
+  if (trace_writer_) trace_writer_->SetPlayerCategory(nuid, category);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  auto &player = *piter->second;
+  if (player.category == category) return;
+  player.category = category;
+
+  // 和 _RemovePlayer 一样，框住自己的 sensor 的 right_x 在 node_x 右边 2 * max_sensor_radius_ 以内
+  const auto &pos = player.pos;
+  float limit = player.node_x.value + 2 * max_sensor_radius_;
+  for (auto node = player.node_x.next; node && node->value <= limit; node = node->next) {
+    if (node->type != COORD_TYPE_GUARD_RIGHT) continue;
+
+    auto psensor = node->psensor;
+    const auto &other_pos = psensor->pplayer->pos;
+    auto radius = psensor->radius;
+    if ((category & psensor->interest) && fabs(pos.x - other_pos.x) < radius
+        && fabs(pos.z - other_pos.z) < radius) {
+      psensor->AddCandidate(&player);
+    } else {
+      psensor->RemoveCandidate(&player);
+    }
+  }
+  // 进出事件由 _CheckEnter、_CheckLeave 对比 last_category 算出，别的 sensor 不用集合差
+}
+
+//--------------------------------------------------------------------------------------------------
+void CrossAoi::SetSensorInterest(Nuid nuid, Nuid sensor_id, Uint32 interest) {
+  if (trace_writer_) trace_writer_->SetSensorInterest(nuid, sensor_id, interest);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end() || !piter->second->observer) return;
+
+  for (auto &sensor : piter->second->observer->sensors) {
+    if (sensor.sensor_id != sensor_id) continue;
+
+    sensor.interest = interest;
+    // 按新的 interest 重建 candidates：beacon 留着，其它玩家从 left_x 到 right_x 之间重新找
+    PlayerAoi *other_ptr;
+    std::vector<PlayerAoi*> remove_players;
+    kh_foreach_value(sensor.aoi_player_candidates.get(), other_ptr,
+      if (!other_ptr->GetFlag_Beacon()) remove_players.push_back(other_ptr);
+    )
+    for (auto pother : remove_players) {
+      sensor.RemoveCandidate(pother);
+    }
+
+    const auto &pos = piter->second->pos;
+    auto radius = sensor.radius;
+    for (auto node = sensor.left_x.next; node && node != &sensor.right_x; node = node->next) {
+      if (node->type != COORD_TYPE_PLAYER) continue;
+
+      const auto &other_pos = node->pplayer->pos;
+      if (fabs(pos.x - other_pos.x) < radius && fabs(pos.z - other_pos.z) < radius) {
+        sensor.AddCandidate(node->pplayer);
+      }
+    }
+    sensor.SetFlag_Diff();
+    return;
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+void CrossAoi::ExportSnapshot(AoiSnapshot *snapshot) const {
+  snapshot->players.clear();
+  snapshot->static_entities.clear();
+  snapshot->tick_count = tick_count_;
+  snapshot->interval_schedule = interval_schedule_;
+  static_index_.ForEach([snapshot](Nuid nuid, float x, float z) {
+    snapshot->static_entities.push_back({nuid, x, z});
+  });
+
+  snapshot->players.reserve(player_map_.size());
+  for (const auto &elem : player_map_) {
+    const auto &player = *elem.second;
+    if (player.GetFlag_Beacon() || player.GetFlag_Removed()) continue;
+
+    snapshot->players.push_back({player.nuid, player.pos.x, player.pos.y, player.pos.z,
+                                 player.category, {}});
+    if (!player.observer) continue;
+
+    auto &sensors = snapshot->players.back().sensors;
+    for (const auto &sensor : player.observer->sensors) {
+      sensors.push_back({sensor.sensor_id, sensor.radius, sensor.leave_radius, sensor.max_visible,
+                         sensor.interval, sensor.phase, sensor.interest, {},
+                         sensor.static_aoi.nuids});
+      auto &aoi_players = sensors.back().aoi_players;
+      for (auto other_ptr : sensor.aoi_players[cur_aoi_map_idx_]) {
+        aoi_players.push_back(other_ptr->nuid);
+      }
+    }
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+void CrossAoi::RestoreSensor(Nuid nuid, const SensorSnapshot &snapshot) {
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end() || !piter->second->observer) return;
+
+  for (auto &sensor : piter->second->observer->sensors) {
+    if (sensor.sensor_id != snapshot.sensor_id) continue;
+
+    auto &aoi_players = sensor.aoi_players[cur_aoi_map_idx_];
+    aoi_players.clear();
+    for (auto other_nuid : snapshot.aoi_players) {
+      auto other_iter = player_map_.find(other_nuid);
+      if (other_iter == player_map_.end()) continue;
+      auto other_ptr = other_iter->second.get();
+      if (other_ptr->GetFlag_Beacon() || other_ptr->GetFlag_Removed()) continue;
+      aoi_players.push_back(other_ptr);
+    }
+    // 版本号清零，下次 Tick 一定重新查询静态实体
+    sensor.static_aoi.nuids = snapshot.static_entities;
+    sensor.static_aoi.version = 0;
+    // 不是新加的 sensor，按原来的相位计算，没到时间的照样跳过；这次 Tick 整体用集合差算进出事件
+    sensor.phase = snapshot.phase;
+    sensor.UnsetFlag_New();
+    sensor.UnsetFlag_Diff();
+    diff_aoi_ = true;
+    return;
+  }
 }
 
 //--------------------------------------------------------------------------------------------------
 AoiUpdateInfos CrossAoi::Tick() {
+  if (trace_writer_) trace_writer_->Tick();
+  if (static_index_.IsDirty()) {
+    static_index_.Build(std::max(max_sensor_radius_, kMinStaticCellSize));
+  }
+
   // 全量做一遍 aoi
   AoiUpdateInfos update_infos;
   PlayerPtrList remove_list;
@@ -495,7 +754,7 @@ AoiUpdateInfos CrossAoi::Tick() {
       continue;
     }
 
-    if (!player.sensors.empty()) {
+    if (player.HasSensor()) {
       auto update_info = _UpdatePlayerAoi(cur_aoi_map_idx_, &player);
       if (!update_info.sensor_update_list.empty()) {
         update_infos.emplace(update_info.nuid, std::move(update_info));
@@ -505,18 +764,43 @@ AoiUpdateInfos CrossAoi::Tick() {
     player.UnsetFlag_New();
   }
 
-  for (auto pptr : remove_list) {
-    _RemovePlayer(pptr->nuid);
+  {
+    AOI_PHASE_SCOPE(phase_cycles_, kPhaseRemove);
+    for (auto pptr : remove_list) {
+      _RemovePlayer(pptr->nuid);
+    }
   }
-
-  for (auto& elem : player_map_) {
-    auto& player = *elem.second;
-    player.last_pos = player.pos;
+  {
+    AOI_PHASE_SCOPE(phase_cycles_, kPhaseLastPos);
+    for (auto& elem : player_map_) {
+      auto& player = *elem.second;
+      player.last_pos = player.pos;
+      player.last_category = player.category;
+    }
   }
   cur_aoi_map_idx_ = 1 - cur_aoi_map_idx_;
+  graveyard_.Release(tick_count_++);
+  diff_aoi_ = false;
+  tick_stats_ = stats_;
+  stats_ = AoiStats();
+  tick_phase_cycles_ = phase_cycles_;
+  phase_cycles_ = PhaseCycles();
+  if (histograms_enabled_) _EndTickHistograms();
   return update_infos;
 }
 
+
+void CrossAoi::_EndTickHistograms() {
+  histograms_.enters.Add(histogram_enters_);
+  histograms_.leaves.Add(histogram_leaves_);
+  histogram_enters_ = 0;
+  histogram_leaves_ = 0;
+
+  tick_histograms_ = histograms_;
+  window_histograms_.Merge(histograms_);
+  histograms_.Clear();
+}
+
 //--------------------------------------------------------------------------------------------------
 AoiUpdateInfo CrossAoi::_UpdatePlayerAoi(Uint32 cur_aoi_map_idx,
                                           PlayerAoi* pptr) {
@@ -524,19 +808,55 @@ AoiUpdateInfo CrossAoi::_UpdatePlayerAoi(Uint32 cur_aoi_map_idx,
   aoi_update_info.nuid = pptr->nuid;
   Uint32 new_aoi_map_idx = 1 - cur_aoi_map_idx;
 
-  for (auto& sensor : pptr->sensors) {
+  for (auto& sensor : pptr->observer->sensors) {
     auto& old_aoi = sensor.aoi_players[cur_aoi_map_idx];
     auto& new_aoi = sensor.aoi_players[new_aoi_map_idx];
+    if (!sensor.IsDue(tick_count_)) {
+      // 没到计算的时候，上一次的列表原样留给下一次
+      std::swap(old_aoi, new_aoi);
+      AOI_STATS_INC(stats_, sensors_skipped);
+      continue;
+    }
+    if (sensor.max_visible > 0) {
+      nearest_.Reset(pptr->pos.x, pptr->pos.z, sensor.max_visible, &old_aoi);
+    }
     _CalcAoiPlayers(*pptr, sensor, &new_aoi);
+    // 离开半径内的旧玩家直接从上一次的列表里找，不需要更大的 candidates 范围。
+    // 用 last_pos 算进出时由 _CheckLeave 加回新的列表，不用排序
+    bool need_diff = diff_aoi_ || sensor.NeedDiff();
+    if (need_diff && sensor.leave_radius > sensor.radius) {
+      KeepIncumbents(pptr->pos, sensor.leave_radius_square, sensor.interest, &old_aoi, &new_aoi);
+    }
+    KeepNearest(pptr->pos, sensor.max_visible, &old_aoi, &new_aoi);
 
     SensorUpdateInfo update_info;
 
     auto& enters = update_info.enters;
     auto& leaves = update_info.leaves;
-    float radius_square = sensor.radius_square;
 
-    _CheckLeave(pptr, radius_square, old_aoi, &leaves);
-    _CheckEnter(pptr, radius_square, new_aoi, &enters);
+    if (need_diff) {
+      AOI_PHASE_SCOPE(phase_cycles_, kPhaseDiff);
+      DiffAoiPlayers(&old_aoi, &new_aoi, &enters, &leaves);
+    } else {
+      // 先算 enter，这时新的列表里只有半径内的玩家
+      _CheckEnter(pptr, sensor, new_aoi, &old_aoi, &enters);
+      _CheckLeave(pptr, sensor, old_aoi, &new_aoi, &leaves);
+    }
+    if (sensor.interest & kDefaultCategory) {
+      sensor.static_aoi.Update(static_index_, pptr->pos.x, pptr->pos.z, sensor.radius,
+                               &enters, &leaves);
+    } else {
+      sensor.static_aoi.Clear(&leaves);
+    }
+    sensor.UnsetFlag_New();
+    sensor.UnsetFlag_Diff();
+    AOI_STATS_ADD(stats_, enters, enters.size());
+    AOI_STATS_ADD(stats_, leaves, leaves.size());
+    if (histograms_enabled_) {
+      histograms_.visible.Add(new_aoi.size());
+      histogram_enters_ += enters.size();
+      histogram_leaves_ += leaves.size();
+    }
 
     if (enters.empty() && leaves.empty()) {
       continue;
@@ -552,9 +872,14 @@ AoiUpdateInfo CrossAoi::_UpdatePlayerAoi(Uint32 cur_aoi_map_idx,
 //--------------------------------------------------------------------------------------------------
 void CrossAoi::_CalcAoiPlayers(const PlayerAoi& player, const Sensor& sensor,
                                 PlayerPtrList* aoi_map) {
+  AOI_PHASE_SCOPE(phase_cycles_, kPhaseCalcAoi);
   aoi_map->clear();
   auto candidates = sensor.aoi_player_candidates.get();
-  aoi_map->reserve(kh_size(candidates));
+  // 有上限时只把通过检查的玩家交给 nearest_，最后只有选中的进列表
+  bool capped = sensor.max_visible > 0;
+  if (!capped) aoi_map->reserve(kh_size(candidates));
+  AOI_STATS_ADD(stats_, candidates_scanned, kh_size(candidates));
+  if (histograms_enabled_) histograms_.candidates.Add(kh_size(candidates));
 
   auto pos = player.pos;
   auto radius = sensor.radius;
@@ -570,38 +895,58 @@ void CrossAoi::_CalcAoiPlayers(const PlayerAoi& player, const Sensor& sensor,
       continue;
     }
     IfInXZRadiusSquare(dx, dz, other_ptr->pos.x, other_ptr->pos.z, pos.x, pos.z, radius_suqare) {
-      aoi_map->emplace_back(other_ptr);
+      if (capped) {
+        nearest_.Offer(other_ptr);
+      } else {
+        aoi_map->emplace_back(other_ptr);
+      }
     }
   )
+  if (capped) nearest_.Finish(aoi_map);
+  AOI_STATS_ADD(stats_, candidates_accepted, aoi_map->size());
 }
 
 //--------------------------------------------------------------------------------------------------
-void CrossAoi::_CheckLeave(PlayerAoi* pptr, float radius_square,
-                             const PlayerPtrList &aoi_players, PlayerNuids *leaves) {
+void CrossAoi::_CheckLeave(PlayerAoi* pptr, const Sensor &sensor,
+                             const PlayerPtrList &aoi_players, PlayerPtrList *new_players,
+                             PlayerNuids *leaves) {
+  AOI_PHASE_SCOPE(phase_cycles_, kPhaseCheckLeave);
   const auto &player_pos = pptr->pos;
   float dx, dz;
   float pos_x = player_pos.x;
   float pos_z = player_pos.z;
+  float radius_square = sensor.radius_square;
+  float leave_radius_square = sensor.leave_radius_square;
+  Uint32 interest = sensor.interest;
   for (auto old_player_ptr : aoi_players) {
-    if (old_player_ptr->GetFlag_Removed()) {
+    // 改成了不感兴趣的 category，不管距离都离开
+    if (old_player_ptr->GetFlag_Removed() || !(old_player_ptr->category & interest)) {
       leaves->push_back(old_player_ptr->nuid);
     } else {
       IfNotInXZRadiusSquare(dx, dz, old_player_ptr->pos.x, old_player_ptr->pos.z,
                             pos_x, pos_z, radius_square) {
-        leaves->push_back(old_player_ptr->nuid);
+        // 出了进入半径、还在离开半径内的继续看到
+        if (dx * dx + dz * dz < leave_radius_square) {
+          new_players->push_back(old_player_ptr);
+        } else {
+          leaves->push_back(old_player_ptr->nuid);
+        }
       }
     }
   }
 }
 
 //--------------------------------------------------------------------------------------------------
-void CrossAoi::_CheckEnter(PlayerAoi* pptr, float radius_square,
-                             const PlayerPtrList &aoi_players, PlayerNuids *enters) {
+void CrossAoi::_CheckEnter(PlayerAoi* pptr, const Sensor &sensor,
+                             const PlayerPtrList &aoi_players, PlayerPtrList *old_players,
+                             PlayerNuids *enters) {
+  AOI_PHASE_SCOPE(phase_cycles_, kPhaseCheckEnter);
   const auto &player_last_pos = pptr->last_pos;
   float pos_x = player_last_pos.x;
   float pos_z = player_last_pos.z;
+  float radius_square = sensor.radius_square;
 
-  if (pptr->GetFlag_New()) {
+  if (pptr->GetFlag_New() || sensor.GetFlag_New()) {
     enters->reserve(aoi_players.size());
     for (auto new_player_ptr : aoi_players) {
       enters->push_back(new_player_ptr->nuid);
@@ -609,15 +954,55 @@ void CrossAoi::_CheckEnter(PlayerAoi* pptr, float radius_square,
     return;
   }
 
+  // 上一次在离开半径内的可能是留下来的旧玩家，到上一次的列表里查
+  float leave_radius_square = sensor.leave_radius_square;
+  Uint32 interest = sensor.interest;
+  IncumbentLookup<PlayerPtrList> incumbents(old_players);
   float dx, dz;
   for (auto new_player_ptr : aoi_players) {
+    // 上一次 Tick 时的 category 不感兴趣，一定是新进来的
+    if (!(new_player_ptr->last_category & interest)) {
+      enters->push_back(new_player_ptr->nuid);
+      continue;
+    }
     IfNotInXZRadiusSquare(dx, dz, new_player_ptr->last_pos.x, new_player_ptr->last_pos.z,
                           pos_x, pos_z, radius_square) {
+      if (dx * dx + dz * dz < leave_radius_square && incumbents.Contains(new_player_ptr)) {
+        continue;
+      }
       enters->push_back(new_player_ptr->nuid);
     }
   }
 }
 
+//--------------------------------------------------------------------------------------------------
+MemoryUsage CrossAoi::GetMemoryUsage() const {
+  MemoryUsage usage;
+  usage.player_map = HashMapBytes(player_map_) + VectorBytes(beacons);
+  usage.static_entities = static_index_.MemoryBytes();
+
+  for (const auto &elem : player_map_) {
+    const auto &player = *elem.second;
+    usage.players += sizeof(PlayerAoi);
+    if (!player.observer) continue;
+
+    usage.players += sizeof(ObserverPart);
+    if (player.observer->detected_by) usage.players += HashMapBytes(*player.observer->detected_by);
+    for (const auto &sensor : player.observer->sensors) {
+      // list 的节点多两个指针
+      usage.sensors += sizeof(Sensor) + 2 * sizeof(void*);
+      usage.aoi_lists += VectorBytes(sensor.aoi_players[0]) + VectorBytes(sensor.aoi_players[1]);
+      usage.static_entities += VectorBytes(sensor.static_aoi.nuids);
+
+      auto candidates = sensor.aoi_player_candidates.get();
+      usage.candidates += sizeof(*candidates)
+                          + candidates->n_buckets * (sizeof(khint64_t) + sizeof(PlayerAoi*))
+                          + __ac_fsize(candidates->n_buckets) * sizeof(khint32_t);
+    }
+  }
+  return usage;
+}
+
 //--------------------------------------------------------------------------------------------------
 void CrossAoi::_PrintNodeList(CoordNode *list) {
   printf("[");
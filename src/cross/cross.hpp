@@ -3,30 +3,47 @@
 #pragma once
 
 #include <limits>
+#include <list>
 #include <vector>
 #include <memory>
 #include <boost/unordered_map.hpp>
 
+#include "common/memory_resource.hpp"
 #include "common/khash.h"
 #include "common/nuid.hpp"
+#include "common/aoi_snapshot.hpp"
 #include "common/base_types.hpp"
+#include "common/histogram.hpp"
+#include "common/memory_usage.hpp"
+#include "common/phase_timer.hpp"
+#include "common/sensor_interval.hpp"
+#include "common/static_index.hpp"
+#include "common/stats.hpp"
+#include "common/visible_cap.hpp"
 
-namespace aoi { namespace cross {
+namespace aoi {
+
+class TraceWriter;
+
+namespace cross {
 
 #define COORD_TYPE_PLAYER   1
 #define COORD_TYPE_GUARD_LEFT   2
 #define COORD_TYPE_GUARD_RIGHT  3
 #define AOI_FLOAT_LOWEST std::numeric_limits<float>::lowest()
+#undef AOI_INF_POS
 #define AOI_INF_POS AOI_FLOAT_LOWEST, AOI_FLOAT_LOWEST, AOI_FLOAT_LOWEST
 
 class PlayerAoi;
 class Sensor;
 
 #define AOI_HASH_MAP boost::unordered_map
-typedef AOI_HASH_MAP<Nuid, std::shared_ptr<PlayerAoi>> PlayerMap;
+// 玩家、sensor 和 aoi 列表都从 CrossAoi 的 MemoryResource 分配，没有时就是普通的堆分配
+typedef AOI_HASH_MAP<Nuid, std::shared_ptr<PlayerAoi>, boost::hash<Nuid>, std::equal_to<Nuid>,
+                     ResourceAllocator<std::pair<const Nuid, std::shared_ptr<PlayerAoi>>>> PlayerMap;
 typedef AOI_HASH_MAP<Nuid, PlayerAoi*> PlayerPtrMap;
 typedef std::vector<Nuid> PlayerNuids;
-typedef std::vector<PlayerAoi*> PlayerPtrList;
+typedef std::vector<PlayerAoi*, ResourceAllocator<PlayerAoi*>> PlayerPtrList;
 
 
 struct Pos {
@@ -44,17 +61,22 @@ struct Pos {
 
 
 struct CoordNode {
-  CoordNode(Uint8 _coord_type, float _coord_value,
-            PlayerAoi *_pplayer = nullptr, Sensor *_psensor = nullptr)
-    : type(_coord_type), value(_coord_value), pplayer(_pplayer), psensor(_psensor)
+  CoordNode(Uint8 _coord_type, float _coord_value, PlayerAoi *_pplayer)
+    : type(_coord_type), value(_coord_value), pplayer(_pplayer)
+  {}
+  CoordNode(Uint8 _coord_type, float _coord_value, Sensor *_psensor)
+    : type(_coord_type), value(_coord_value), psensor(_psensor)
   {}
 
   Uint8 type;
   float value;
   CoordNode *prev = nullptr;
   CoordNode *next = nullptr;
-  PlayerAoi *pplayer;
-  Sensor *psensor;
+  // 玩家节点用 pplayer，guard 节点用 psensor（所属的玩家是 psensor->pplayer）
+  union {
+    PlayerAoi *pplayer;
+    Sensor *psensor;
+  };
 
   void PrintLog();
 };
@@ -62,23 +84,79 @@ struct CoordNode {
 
 KHASH_MAP_INIT_INT64(SensorHashMap, PlayerAoi*);
 
+struct KHashDeleter {
+  void operator()(khash_t(SensorHashMap) *ptr) const {
+    kh_destroy(SensorHashMap, ptr);
+  }
+};
+
 struct Sensor {
-  Sensor(Nuid _sensor_id, float _radius, PlayerAoi *_pplayer);
+  Sensor(Nuid _sensor_id, float _radius, PlayerAoi *_pplayer, MemoryResource *resource = nullptr);
+  // CoordNode 的地址挂在链表上，不能拷贝
+  Sensor(const Sensor&) = delete;
+  Sensor& operator=(const Sensor&) = delete;
   inline void AddCandidate(PlayerAoi* other_pplayer);
   inline void RemoveCandidate(PlayerAoi* other_pplayer);
   inline void PrintCandidate();
 
-  Nuid sensor_id;
-  float radius;
-  float radius_square;
+  // 新加的 sensor 还没有上一次的 aoi 列表，Tick 时全部算 enter
+  AOI_CLASS_ADD_FLAG(New, 0, flags);
+  // 参数变了，aoi 列表和 last_pos 对不上，下次 Tick 用集合差算进出
+  AOI_CLASS_ADD_FLAG(Diff, 1, flags);
+
+  // 只看到最近的几个玩家时，不能用 last_pos 判断进出；离开半径在 _CheckEnter、_CheckLeave 里处理
+  // 隔几次 Tick 才计算的 sensor，上一次计算时的 last_pos 也已经对不上了
+  bool NeedDiff() const {
+    return max_visible > 0 || interval > 1 || GetFlag_Diff();
+  }
+
+  // 新加的、参数刚变过的 sensor 马上计算，其它的按间隔和相位
+  bool IsDue(Uint64 tick) const {
+    return GetFlag_New() || GetFlag_Diff() || IntervalSchedule::IsDue(tick, interval, phase);
+  }
+
+  // 节点移动时（MoveIn / MoveOut）访问的字段放在最前面
   PlayerAoi *pplayer;
+  std::unique_ptr<khash_t(SensorHashMap), KHashDeleter> aoi_player_candidates;
+  float radius;               // 进入半径，guard 节点也按它放
+  Uint32 interest = kAllCategories;   // 只把 category 和它有交集的玩家放进 candidates
+  // 只在 Tick 时访问
+  float radius_square;
+  float leave_radius;         // 离开半径，不小于 radius
+  float leave_radius_square;
+  Uint32 flags;
+  Uint32 max_visible = 0;   // 最多看到几个玩家，0 不限制
+  Uint32 interval = 1;      // 每隔几次 Tick 计算一次
+  Uint32 phase = 0;
+  Nuid sensor_id;
   CoordNode left_x;
   CoordNode right_x;
   CoordNode left_z;
   CoordNode right_z;
   PlayerPtrList aoi_players[2];
+  StaticAoi static_aoi;       // 看到的静态实体
+};
+
 
-  std::shared_ptr<khash_t(SensorHashMap)> aoi_player_candidates;
+// 有 sensor 的玩家才分配的部分，只被观察的实体（大部分 NPC）只多一个空指针。
+// Allocated on the first AddSensor; observed-only entities carry just a null pointer.
+struct ObserverPart {
+  explicit ObserverPart(MemoryResource *_resource)
+      : sensors(ResourceAllocator<Sensor>(_resource)), resource(_resource) {}
+
+  std::list<Sensor, ResourceAllocator<Sensor>> sensors;    // 用 list 保证 Sensor 的地址不变
+  // 只有 beacon 有：哪些玩家的哪些 sensor 的 candidates 里有它
+  std::unique_ptr<boost::unordered_map<Nuid, std::vector<Nuid>>> detected_by;
+  MemoryResource *resource;     // 自己是从哪里分配的
+};
+
+// 把 ObserverPart 还给分配它的 resource，deleter 不带状态，PlayerAoi 不会变大
+struct ObserverDeleter {
+  void operator()(ObserverPart *observer) const {
+    ResourceAllocator<ObserverPart> allocator(observer->resource);
+    observer->~ObserverPart();
+    allocator.deallocate(observer, 1);
+  }
 };
 
 
@@ -94,14 +172,27 @@ struct PlayerAoi {
   AOI_CLASS_ADD_FLAG(New, 2, flags);
   AOI_CLASS_ADD_FLAG(Beacon, 3, flags);
 
+  bool HasSensor() const {
+    return observer && !observer->sensors.empty();
+  }
+  // 第一次加 sensor 时分配
+  ObserverPart& UpgradeObserver(MemoryResource *resource) {
+    if (!observer) {
+      auto ptr = ResourceAllocator<ObserverPart>(resource).allocate(1);
+      observer.reset(new (ptr) ObserverPart(resource));
+    }
+    return *observer;
+  }
+
   Nuid nuid;
   Pos pos;
   Pos last_pos;
   Uint32 flags;
+  Uint32 category = kDefaultCategory;
+  Uint32 last_category = kDefaultCategory;   // 上一次 Tick 结束时的 category
   CoordNode node_x;
   CoordNode node_z;
-  std::vector<Sensor> sensors;
-  std::shared_ptr<boost::unordered_map<Nuid, std::vector<Nuid>>> detected_by;
+  std::unique_ptr<ObserverPart, ObserverDeleter> observer;
 };
 
 
@@ -119,10 +210,26 @@ struct AoiUpdateInfo {
 
 typedef AOI_HASH_MAP<Nuid, AoiUpdateInfo> AoiUpdateInfos;
 
+
+// 只有定义了 AOI_ENABLE_STATS 才会计数
+struct AoiStats {
+  Uint64 nodes_crossed = 0;         // ListUpdateNode 中跨过的节点数
+  Uint64 move_ins = 0;              // MoveIn 调用次数
+  Uint64 move_outs = 0;             // MoveOut 调用次数
+  Uint64 candidates_scanned = 0;    // _CalcAoiPlayers 检查的 candidates 总数
+  Uint64 candidates_accepted = 0;   // 在半径内的玩家数
+  Uint64 enters = 0;
+  Uint64 leaves = 0;
+  Uint64 sensors_skipped = 0;       // 没到计算间隔跳过的 sensor 数
+};
+
 class CrossAoi {
  public:
+  // resource 不为空时玩家、sensor 和 aoi 列表都从 resource 分配（比如场景的 Arena），
+  // resource 要比 CrossAoi 活得久。candidates 的 khash 用 realloc 扩容，仍然用普通堆
   CrossAoi(float map_bound_xmin, float map_bound_xmax, float map_bound_zmin,
-           float map_bound_zmax, size_t beacon_x, size_t beacon_z, float beacon_radius);
+           float map_bound_zmax, size_t beacon_x, size_t beacon_z, float beacon_radius,
+           MemoryResource *resource = nullptr);
 
   void AddPlayer(Nuid nuid, float x, float y, float z);
   void AddPlayerNoBeacon(Nuid nuid, float x, float y, float z);
@@ -131,28 +238,117 @@ class CrossAoi {
   void AddSensorNoBeacon(Nuid nuid, Nuid sensor_id, float radius);
   void RemoveSensor(Nuid nuid, Nuid sensor_id);
   void UpdatePos(Nuid nuid, float x, float y, float z);
+  // 不会移动、也不会被移除的实体，不进十字链表，下次 Tick 时建成只读索引。
+  // sensor 移动之后才重新查询静态实体，只按进入半径算，不受 max_visible 和离开半径影响
+  void AddStaticEntity(Nuid nuid, float x, float y, float z);
+  // sensor 最多只看到最近的 max_visible 个玩家，0 不限制
+  void SetSensorMaxVisible(Nuid nuid, Nuid sensor_id, Uint32 max_visible);
+  // 已经看到的玩家走出 leave_radius 才离开，小于进入半径时按进入半径算
+  void SetSensorLeaveRadius(Nuid nuid, Nuid sensor_id, float leave_radius);
+  // sensor 每隔 interval 次 Tick 才计算一次（0 和 1 都是每次），同一个间隔的 sensor 错开到
+  // 不同的 Tick 上。没计算的 Tick 不产生事件，下次计算时和上一次的列表比较
+  void SetSensorInterval(Nuid nuid, Nuid sensor_id, Uint32 interval);
+  // 玩家的 category 位掩码，默认 kDefaultCategory。改变之后下次 Tick 用集合差算进出
+  void SetPlayerCategory(Nuid nuid, Uint32 category);
+  // sensor 只看 category 和 interest 有交集的玩家，默认 kAllCategories。
+  // 静态实体的 category 是 kDefaultCategory
+  void SetSensorInterest(Nuid nuid, Nuid sensor_id, Uint32 interest);
+  // 导出所有玩家、sensor 参数和上一次 Tick 之后的 aoi 列表，在 Tick 之后、下一次操作之前调用
+  void ExportSnapshot(AoiSnapshot *snapshot) const;
+  // 按 snapshot 接上 sensor：换成搬过来的 aoi 列表和静态实体，沿用原来的计算相位，
+  // 下次 Tick 和列表求差算进出事件。不在场景里的玩家会被忽略。ImportSnapshot 用它从别的算法接手，
+  // 不记录到 trace
+  void RestoreSensor(Nuid nuid, const SensorSnapshot &snapshot);
+  // 接上原来的 Tick 计数和低频 sensor 的相位分配，之后新设置的间隔和原来分到一样的相位
+  void RestoreSchedule(Uint64 tick_count, const IntervalSchedule &schedule) {
+    tick_count_ = tick_count;
+    interval_schedule_ = schedule;
+  }
   AoiUpdateInfos Tick();
   const PlayerMap& GetPlayerMap() const {
     return player_map_;
   }
+  MemoryResource* GetMemoryResource() const {
+    return resource_;
+  }
+  // 当前各类数据结构占用的内存，遍历所有玩家，不要每次 Tick 都调用
+  MemoryUsage GetMemoryUsage() const;
+  // 上一次 Tick 结束时统计的计数，包括这次 Tick 以及之前的 AddPlayer、UpdatePos 等
+  const AoiStats& GetTickStats() const {
+    return tick_stats_;
+  }
+  // 打开后每次 Tick 统计可见数、候选数和进出事件数的分布；十字链表没有格子，occupancy 一直为空
+  void EnableHistograms(bool enable) {
+    histograms_enabled_ = enable;
+  }
+  // 上一次 Tick 的直方图
+  const SceneHistograms& GetTickHistograms() const {
+    return tick_histograms_;
+  }
+  // 上一次取出之后所有 Tick 累计的直方图，取出后重新累计
+  SceneHistograms TakeWindowHistograms() {
+    SceneHistograms histograms = window_histograms_;
+    window_histograms_.Clear();
+    return histograms;
+  }
+  // 上一次 Tick 各阶段的周期数，只在定义了 AOI_ENABLE_PHASE_TIMER 时计时
+  const PhaseCycles& GetTickPhaseCycles() const {
+    return tick_phase_cycles_;
+  }
+  // 记录之后的操作，writer 由调用者持有，传 nullptr 关闭记录
+  void SetTraceWriter(TraceWriter *writer) {
+    trace_writer_ = writer;
+  }
 
  protected:
+  void _AddPlayerNoBeacon(Nuid nuid, float x, float y, float z);
   void _RemovePlayer(Nuid nuid);
+  void _AddSensorNoBeacon(Nuid nuid, Nuid sensor_id, float radius);
+  void _RemoveSensor(Nuid nuid, Nuid sensor_id);
+  void _UpdatePos(Nuid nuid, float x, float y, float z);
   void UpdateSensorPos(const PlayerAoi &player, Sensor *sensor);
   void MovePlayerNode(CoordNode **list, CoordNode *pnode);
   AoiUpdateInfo _UpdatePlayerAoi(Uint32 cur_aoi_map_idx, PlayerAoi* player);
   void _CalcAoiPlayers(const PlayerAoi& player, const Sensor& sensor, PlayerPtrList* aoi_map);
-  void _CheckLeave(PlayerAoi* pptr, float radius_square,
-                    const PlayerPtrList &aoi_players, PlayerNuids *leaves);
-  void _CheckEnter(PlayerAoi* pptr, float radius_square,
-                    const PlayerPtrList &aoi_players, PlayerNuids *leaves);
+  // 出了进入半径、还在离开半径内的旧玩家不算离开，追加到 new_players。
+  // 两个都按 category 和 last_category 处理改过 category 的玩家
+  void _CheckLeave(PlayerAoi* pptr, const Sensor &sensor,
+                    const PlayerPtrList &aoi_players, PlayerPtrList *new_players,
+                    PlayerNuids *leaves);
+  void _CheckEnter(PlayerAoi* pptr, const Sensor &sensor,
+                    const PlayerPtrList &aoi_players, PlayerPtrList *old_players,
+                    PlayerNuids *enters);
+  // 这次 Tick 的直方图存到 tick_histograms_ 并累计到 window_histograms_
+  void _EndTickHistograms();
 
  protected:
     CoordNode* coord_list_x_ = nullptr;
     CoordNode* coord_list_z_ = nullptr;
+    MemoryResource *resource_;
     PlayerMap player_map_;
     Uint32 cur_aoi_map_idx_ = 0;
     std::vector<PlayerAoi*> beacons;
+    float max_sensor_radius_ = 0;
+    TraceWriter *trace_writer_ = nullptr;
+    AoiStats stats_;
+    AoiStats tick_stats_;
+    bool histograms_enabled_ = false;
+    SceneHistograms histograms_;        // 这次 Tick 正在统计的
+    SceneHistograms tick_histograms_;
+    SceneHistograms window_histograms_;
+    Uint64 histogram_enters_ = 0;       // 这次 Tick 到目前为止的进出事件数
+    Uint64 histogram_leaves_ = 0;
+    PhaseCycles phase_cycles_;
+    PhaseCycles tick_phase_cycles_;
+    // 有 max_visible 的 sensor 在 _CalcAoiPlayers 里边查找边选
+    NearestSelector<PlayerAoi*> nearest_;
+    Uint64 tick_count_ = 0;
+    IntervalSchedule interval_schedule_;
+    // 移除的玩家可能还在低频 sensor 的列表里，晚一点再释放
+    PlayerGraveyard<std::shared_ptr<PlayerAoi>> graveyard_;
+    StaticIndex static_index_;
+    // 从别的算法导入了状态，上一次的列表和 last_pos 对不上，这次 Tick 全部用集合差
+    bool diff_aoi_ = false;
 
  public:
   void _PrintNodeList(CoordNode *list);
@@ -0,0 +1,578 @@
+// Copyright <disenone>
+
+#include "quadtree.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#include "common/aoi_diff.hpp"
+#include "common/trace.hpp"
+
+namespace aoi { namespace quadtree {
+
+// 静态实体索引的格子不要太小，否则半径小的 sensor 会让格子数爆炸
+constexpr float kMinStaticCellSize = 32;
+
+
+QuadTreeAoi::QuadTreeAoi(float world_size /*= 20000*/, Uint32 split_threshold /*= 16*/,
+                         Uint32 max_depth /*= 12*/, MemoryResource *resource /*= nullptr*/)
+    : split_threshold_(std::max<Uint32>(split_threshold, 1)),
+      max_depth_(max_depth),
+      resource_(resource),
+      player_map_(PlayerMap::allocator_type(resource)),
+      nodes_(ResourceAllocator<QuadNode>(resource)),
+      remove_list_(PlayerPtrList::allocator_type(resource)) {
+  player_map_.reserve(100);
+  nodes_.emplace_back(resource_);
+  nodes_[kRootNode].half = world_size / 2;
+}
+
+
+Uint32 QuadTreeAoi::GetMaxDepth() const {
+  Uint32 max_depth = 0;
+  std::vector<NodeIndex> stack{kRootNode};
+  while (!stack.empty()) {
+    const auto &node = nodes_[stack.back()];
+    stack.pop_back();
+    max_depth = std::max(max_depth, node.depth);
+    if (node.IsLeaf()) continue;
+    for (Uint32 i = 0; i < 4; ++i) stack.push_back(node.children + i);
+  }
+  return max_depth;
+}
+
+
+void QuadTreeAoi::_InsertPlayer(PlayerAoi *pptr) {
+  // 一路往下走到松边界包含它的最深的节点，经过的节点都计数
+  NodeIndex index = kRootNode;
+  while (true) {
+    auto &node = nodes_[index];
+    ++node.count;
+    if (node.IsLeaf()) break;
+    NodeIndex child = node.children + node.Quadrant(pptr->pos);
+    if (!nodes_[child].LooseContains(pptr->pos)) break;
+    index = child;
+  }
+
+  auto &players = nodes_[index].players;
+  pptr->node = index;
+  pptr->node_index = players.size();
+  players.push_back(pptr);
+}
+
+
+void QuadTreeAoi::_RemoveFromNode(PlayerAoi *pptr) {
+  if (pptr->node == kInvalidNode) return;
+
+  auto &players = nodes_[pptr->node].players;
+  auto index = pptr->node_index;
+  players.back()->node_index = index;
+  players[index] = players.back();
+  players.pop_back();
+  for (NodeIndex node = pptr->node; node != kInvalidNode; node = nodes_[node].parent) {
+    --nodes_[node].count;
+  }
+  pptr->node = kInvalidNode;
+}
+
+
+void QuadTreeAoi::AddPlayer(Nuid nuid, float x, float y, float z) {
+  if (trace_writer_) trace_writer_->AddPlayer(nuid, x, y, z);
+
+  auto piter = player_map_.find(nuid);
+  PlayerAoi* pptr = nullptr;
+
+  if (piter != player_map_.end()) {
+    pptr = piter->second.get();
+    _RemoveFromNode(pptr);
+    pptr->pos.Set(x, y, z);
+    pptr->UnsetFlag_Removed();
+  } else {
+    auto ret = player_map_.emplace(nuid, std::allocate_shared<PlayerAoi>(
+        ResourceAllocator<PlayerAoi>(resource_), nuid, x, y, z, resource_));
+    pptr = ret.first->second.get();
+    pptr->SetFlag_New();
+  }
+
+  _InsertPlayer(pptr);
+}
+
+
+void QuadTreeAoi::RemovePlayer(Nuid nuid) {
+  if (trace_writer_) trace_writer_->RemovePlayer(nuid);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  auto &player = *piter->second;
+  _RemoveFromNode(&player);
+  player.SetFlag_Removed();
+  if (!player.GetFlag_PendingErase()) {
+    player.SetFlag_PendingErase();
+    remove_list_.push_back(&player);
+  }
+}
+
+
+void QuadTreeAoi::AddSensor(Nuid nuid, Nuid sensor_id, float radius) {
+  if (trace_writer_) trace_writer_->AddSensor(nuid, sensor_id, radius);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  auto &player = *piter->second;
+  for (const auto &sensor : player.sensors) {
+    if (sensor.sensor_id == sensor_id) return;
+  }
+  player.sensors.emplace_back(sensor_id, radius, resource_);
+  max_sensor_radius_ = std::max(max_sensor_radius_, radius);
+}
+
+
+void QuadTreeAoi::UpdatePos(Nuid nuid, float x, float y, float z) {
+  if (trace_writer_) trace_writer_->UpdatePos(nuid, x, y, z);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  auto &player = *piter->second;
+  NodeIndex old_node = player.node;
+  player.pos.Set(x, y, z);
+  // 已经移除的玩家不在树里；还在叶子的松边界里就不用动
+  if (old_node == kInvalidNode) return;
+  const auto &node = nodes_[old_node];
+  if (node.IsLeaf() && node.LooseContains(player.pos)) return;
+
+  _RemoveFromNode(&player);
+  _InsertPlayer(&player);
+  if (player.node != old_node) AOI_STATS_INC(stats_, node_migrations);
+}
+
+
+void QuadTreeAoi::AddStaticEntity(Nuid nuid, float x, float y, float z) {
+  if (trace_writer_) trace_writer_->AddStaticEntity(nuid, x, y, z);
+
+  static_index_.Add(nuid, x, z);
+}
+
+
+void QuadTreeAoi::SetSensorMaxVisible(Nuid nuid, Nuid sensor_id, Uint32 max_visible) {
+  if (trace_writer_) trace_writer_->SetSensorMaxVisible(nuid, sensor_id, max_visible);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.max_visible = max_visible;
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+void QuadTreeAoi::SetSensorLeaveRadius(Nuid nuid, Nuid sensor_id, float leave_radius) {
+  if (trace_writer_) trace_writer_->SetSensorLeaveRadius(nuid, sensor_id, leave_radius);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.leave_radius = std::max(leave_radius, sensor.radius);
+      sensor.leave_radius_square = sensor.leave_radius * sensor.leave_radius;
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+void QuadTreeAoi::SetSensorInterval(Nuid nuid, Nuid sensor_id, Uint32 interval) {
+  if (trace_writer_) trace_writer_->SetSensorInterval(nuid, sensor_id, interval);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.interval = std::max<Uint32>(interval, 1);
+      sensor.phase = interval_schedule_.AllocPhase(sensor.interval);
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+void QuadTreeAoi::SetPlayerCategory(Nuid nuid, Uint32 category) {
+  if (trace_writer_) trace_writer_->SetPlayerCategory(nuid, category);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  auto &player = *piter->second;
+  if (player.category == category) return;
+
+  player.category = category;
+}
+
+
+void QuadTreeAoi::SetSensorInterest(Nuid nuid, Nuid sensor_id, Uint32 interest) {
+  if (trace_writer_) trace_writer_->SetSensorInterest(nuid, sensor_id, interest);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.interest = interest;
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+AoiUpdateInfos QuadTreeAoi::Tick() {
+  if (trace_writer_) trace_writer_->Tick();
+  if (static_index_.IsDirty()) {
+    static_index_.Build(std::max(max_sensor_radius_, kMinStaticCellSize));
+  }
+  _Rebalance(kRootNode);
+
+  // 按深度优先的顺序处理，空间上相邻的玩家连着算，查找时访问的节点大多还在缓存里。
+  // 移除的玩家已经不在树里
+  AoiUpdateInfos update_infos;
+  std::vector<NodeIndex> stack{kRootNode};
+  while (!stack.empty()) {
+    const auto &node = nodes_[stack.back()];
+    stack.pop_back();
+    for (auto pptr : node.players) {
+      if (pptr->sensors.empty()) continue;
+      auto update_info = _UpdatePlayerAoi(pptr);
+      if (!update_info.sensor_update_list.empty()) {
+        update_infos.emplace(update_info.nuid, std::move(update_info));
+      }
+    }
+    if (node.IsLeaf()) continue;
+    for (Uint32 i = 0; i < 4; ++i) {
+      if (nodes_[node.children + i].count > 0) stack.push_back(node.children + i);
+    }
+  }
+
+  // 移除之后又加回来的玩家不删
+  for (auto pptr : remove_list_) {
+    pptr->UnsetFlag_PendingErase();
+    if (pptr->GetFlag_Removed()) _ErasePlayer(pptr);
+  }
+  remove_list_.clear();
+  for (auto &node : nodes_) {
+    for (auto pptr : node.players) {
+      pptr->last_pos = pptr->pos;
+      pptr->last_category = pptr->category;
+      pptr->UnsetFlag_New();
+    }
+  }
+
+  cur_aoi_map_idx_ = 1 - cur_aoi_map_idx_;
+  graveyard_.Release(tick_count_++);
+  tick_stats_ = stats_;
+  stats_ = AoiStats();
+  return update_infos;
+}
+
+
+void QuadTreeAoi::_Rebalance(NodeIndex index) {
+  if (nodes_[index].IsLeaf()) {
+    if (nodes_[index].players.size() <= split_threshold_ ||
+        nodes_[index].depth >= max_depth_) return;
+    _Split(index);
+  } else if (nodes_[index].count <= split_threshold_ / 2) {
+    // 合并的阈值比分裂的低一半，玩家数在阈值附近波动时不会反复分裂、合并
+    _Merge(index);
+    return;
+  }
+
+  // _Split 可能让 nodes_ 重新分配，不能拿着引用递归
+  NodeIndex children = nodes_[index].children;
+  for (Uint32 i = 0; i < 4; ++i) {
+    _Rebalance(children + i);
+  }
+}
+
+
+NodeIndex QuadTreeAoi::_AllocChildren() {
+  if (!free_blocks_.empty()) {
+    NodeIndex first = free_blocks_.back();
+    free_blocks_.pop_back();
+    return first;
+  }
+  NodeIndex first = nodes_.size();
+  for (Uint32 i = 0; i < 4; ++i) {
+    nodes_.emplace_back(resource_);
+  }
+  return first;
+}
+
+
+void QuadTreeAoi::_Split(NodeIndex index) {
+  AOI_STATS_INC(stats_, node_splits);
+  NodeIndex first = _AllocChildren();
+  auto &node = nodes_[index];
+  float half = node.half / 2;
+  for (Uint32 i = 0; i < 4; ++i) {
+    auto &child = nodes_[first + i];
+    child.x = node.x + (i & 1 ? half : -half);
+    child.z = node.z + (i & 2 ? half : -half);
+    child.half = half;
+    child.depth = node.depth + 1;
+    child.count = 0;
+    child.parent = index;
+    child.children = kInvalidNode;
+    child.players.clear();
+  }
+  node.children = first;
+
+  // 松边界放得下的玩家下沉一层，剩下的（靠近边界外侧或者在世界外面）留在原节点
+  PlayerPtrList players(std::move(node.players));
+  node.players.clear();
+  for (auto pptr : players) {
+    NodeIndex child_index = first + node.Quadrant(pptr->pos);
+    auto &child = nodes_[child_index];
+    NodeIndex target = child.LooseContains(pptr->pos) ? child_index : index;
+    if (target == child_index) ++child.count;
+    auto &target_players = nodes_[target].players;
+    pptr->node = target;
+    pptr->node_index = target_players.size();
+    target_players.push_back(pptr);
+  }
+}
+
+
+void QuadTreeAoi::_Merge(NodeIndex index) {
+  AOI_STATS_INC(stats_, node_merges);
+  std::vector<NodeIndex> blocks{nodes_[index].children};
+  nodes_[index].children = kInvalidNode;
+  auto &players = nodes_[index].players;
+
+  while (!blocks.empty()) {
+    NodeIndex first = blocks.back();
+    blocks.pop_back();
+    for (Uint32 i = 0; i < 4; ++i) {
+      auto &child = nodes_[first + i];
+      for (auto pptr : child.players) {
+        pptr->node = index;
+        pptr->node_index = players.size();
+        players.push_back(pptr);
+      }
+      child.players.clear();
+      child.count = 0;
+      if (!child.IsLeaf()) blocks.push_back(child.children);
+      child.children = kInvalidNode;
+    }
+    free_blocks_.push_back(first);
+  }
+}
+
+
+void QuadTreeAoi::_ErasePlayer(PlayerAoi *pptr) {
+  auto piter = player_map_.find(pptr->nuid);
+  // 低频 sensor 最多再过 max_interval 次 Tick 就会重新计算，不再引用这个玩家
+  Uint32 max_interval = interval_schedule_.GetMaxInterval();
+  if (max_interval > 1) {
+    graveyard_.Bury(std::move(piter->second), tick_count_ + max_interval);
+  }
+  player_map_.erase(piter);
+}
+
+
+AoiUpdateInfo QuadTreeAoi::_UpdatePlayerAoi(PlayerAoi *pptr) {
+  AoiUpdateInfo aoi_update_info;
+  aoi_update_info.nuid = pptr->nuid;
+  Uint32 new_aoi_map_idx = 1 - cur_aoi_map_idx_;
+
+  for (auto &sensor : pptr->sensors) {
+    auto &old_aoi = sensor.aoi_players[cur_aoi_map_idx_];
+    auto &new_aoi = sensor.aoi_players[new_aoi_map_idx];
+    if (!sensor.IsDue(tick_count_)) {
+      // 没到计算的时候，上一次的列表原样留给下一次
+      std::swap(old_aoi, new_aoi);
+      AOI_STATS_INC(stats_, sensors_skipped);
+      continue;
+    }
+    if (sensor.max_visible > 0) {
+      nearest_.Reset(pptr->pos.x, pptr->pos.z, sensor.max_visible, &old_aoi);
+    }
+    _CalcAoiPlayers(*pptr, sensor, &new_aoi);
+    bool need_diff = sensor.NeedDiff();
+    // 用 last_pos 算进出时，离开半径内的旧玩家由 _CheckLeave 加回新的列表，不用排序
+    if (need_diff && sensor.leave_radius > sensor.radius) {
+      KeepIncumbents(pptr->pos, sensor.leave_radius_square, sensor.interest, &old_aoi, &new_aoi);
+    }
+    KeepNearest(pptr->pos, sensor.max_visible, &old_aoi, &new_aoi);
+
+    SensorUpdateInfo update_info;
+    auto &enters = update_info.enters;
+    auto &leaves = update_info.leaves;
+    if (need_diff) {
+      DiffAoiPlayers(&old_aoi, &new_aoi, &enters, &leaves);
+    } else {
+      // 先算 enter，这时新的列表里只有半径内的玩家
+      _CheckEnter(*pptr, sensor, new_aoi, &old_aoi, &enters);
+      _CheckLeave(*pptr, sensor, old_aoi, &new_aoi, &leaves);
+    }
+    if (sensor.interest & kDefaultCategory) {
+      sensor.static_aoi.Update(static_index_, pptr->pos.x, pptr->pos.z, sensor.radius,
+                               &enters, &leaves);
+    } else {
+      sensor.static_aoi.Clear(&leaves);
+    }
+    sensor.UnsetFlag_New();
+    sensor.UnsetFlag_Diff();
+    AOI_STATS_ADD(stats_, enters, enters.size());
+    AOI_STATS_ADD(stats_, leaves, leaves.size());
+
+    if (enters.empty() && leaves.empty()) continue;
+
+    update_info.sensor_id = sensor.sensor_id;
+    aoi_update_info.sensor_update_list.push_back(std::move(update_info));
+  }
+
+  return aoi_update_info;
+}
+
+
+void QuadTreeAoi::_CalcAoiPlayers(const PlayerAoi &player, const Sensor &sensor,
+                                  PlayerPtrList *aoi_map) {
+  float pos_x = player.pos.x;
+  float pos_z = player.pos.z;
+  float radius = sensor.radius;
+  float radius_square = sensor.radius_square;
+  Uint32 interest = sensor.interest;
+
+  aoi_map->clear();
+  bool capped = sensor.max_visible > 0;
+  query_stack_.clear();
+  query_stack_.push_back(kRootNode);
+  while (!query_stack_.empty()) {
+    const auto &node = nodes_[query_stack_.back()];
+    query_stack_.pop_back();
+    AOI_STATS_INC(stats_, nodes_visited);
+    AOI_STATS_ADD(stats_, candidates_scanned, node.players.size());
+
+    for (auto other_ptr : node.players) {
+      if (other_ptr == &player || !(other_ptr->category & interest)) continue;
+      float dx = other_ptr->pos.x - pos_x;
+      float dz = other_ptr->pos.z - pos_z;
+      if (dx * dx + dz * dz < radius_square) {
+        if (capped) {
+          nearest_.Offer(other_ptr);
+        } else {
+          aoi_map->push_back(other_ptr);
+        }
+      }
+    }
+
+    if (node.IsLeaf()) continue;
+    // 子树为空或者松边界和半径的外接正方形不相交就跳过
+    for (Uint32 i = 0; i < 4; ++i) {
+      const auto &child = nodes_[node.children + i];
+      if (child.count == 0) continue;
+      float reach = child.half * kLooseness + radius;
+      if (std::abs(child.x - pos_x) > reach || std::abs(child.z - pos_z) > reach) continue;
+      query_stack_.push_back(node.children + i);
+    }
+  }
+  if (capped) nearest_.Finish(aoi_map);
+  AOI_STATS_ADD(stats_, candidates_accepted, aoi_map->size());
+}
+
+
+void QuadTreeAoi::_CheckLeave(const PlayerAoi &player, const Sensor &sensor,
+                              const PlayerPtrList &aoi_players, PlayerPtrList *new_players,
+                              PlayerNuids *leaves) {
+  float pos_x = player.pos.x;
+  float pos_z = player.pos.z;
+  float radius_square = sensor.radius_square;
+  float leave_radius_square = sensor.leave_radius_square;
+  Uint32 interest = sensor.interest;
+  for (auto old_player_ptr : aoi_players) {
+    float dx = old_player_ptr->pos.x - pos_x;
+    float dz = old_player_ptr->pos.z - pos_z;
+    float dist_square = dx * dx + dz * dz;
+    // 改成了不感兴趣的 category，不管距离都离开
+    if (old_player_ptr->GetFlag_Removed() || !(old_player_ptr->category & interest)) {
+      leaves->push_back(old_player_ptr->nuid);
+    } else if (dist_square >= radius_square) {
+      // 出了进入半径、还在离开半径内的继续看到
+      if (dist_square < leave_radius_square) {
+        new_players->push_back(old_player_ptr);
+      } else {
+        leaves->push_back(old_player_ptr->nuid);
+      }
+    }
+  }
+}
+
+
+void QuadTreeAoi::_CheckEnter(const PlayerAoi &player, const Sensor &sensor,
+                              const PlayerPtrList &aoi_players, PlayerPtrList *old_players,
+                              PlayerNuids *enters) {
+  if (player.GetFlag_New() || sensor.GetFlag_New()) {
+    enters->reserve(aoi_players.size());
+    for (auto new_player_ptr : aoi_players) {
+      enters->push_back(new_player_ptr->nuid);
+    }
+    return;
+  }
+
+  // 上一次 Tick 时不在半径内或者 category 不感兴趣的就是新进来的，除非是离开半径内留下来的旧玩家
+  float pos_x = player.last_pos.x;
+  float pos_z = player.last_pos.z;
+  float radius_square = sensor.radius_square;
+  float leave_radius_square = sensor.leave_radius_square;
+  Uint32 interest = sensor.interest;
+  IncumbentLookup<PlayerPtrList> incumbents(old_players);
+  for (auto new_player_ptr : aoi_players) {
+    if (!(new_player_ptr->last_category & interest)) {
+      enters->push_back(new_player_ptr->nuid);
+      continue;
+    }
+    float dx = new_player_ptr->last_pos.x - pos_x;
+    float dz = new_player_ptr->last_pos.z - pos_z;
+    float dist_square = dx * dx + dz * dz;
+    if (dist_square < radius_square) continue;
+    if (dist_square < leave_radius_square && incumbents.Contains(new_player_ptr)) continue;
+    enters->push_back(new_player_ptr->nuid);
+  }
+}
+
+
+MemoryUsage QuadTreeAoi::GetMemoryUsage() const {
+  MemoryUsage usage;
+  usage.player_map = HashMapBytes(player_map_) + VectorBytes(remove_list_);
+  usage.static_entities = static_index_.MemoryBytes();
+
+  for (const auto &elem : player_map_) {
+    const auto &player = *elem.second;
+    usage.players += sizeof(PlayerAoi);
+    usage.sensors += VectorBytes(player.sensors);
+    for (const auto &sensor : player.sensors) {
+      usage.aoi_lists += VectorBytes(sensor.aoi_players[0]) + VectorBytes(sensor.aoi_players[1]);
+      usage.static_entities += VectorBytes(sensor.static_aoi.nuids);
+    }
+  }
+
+  usage.cells = VectorBytes(nodes_) + VectorBytes(free_blocks_) + VectorBytes(query_stack_);
+  for (const auto &node : nodes_) {
+    usage.cells += VectorBytes(node.players);
+  }
+  return usage;
+}
+
+}  // namespace quadtree
+
+}  // namespace aoi
@@ -0,0 +1,275 @@
+// Copyright <disenone>
+#pragma once
+
+#include <limits>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+
+#include "common/base_types.hpp"
+#include "common/memory_resource.hpp"
+#include "common/memory_usage.hpp"
+#include "common/sensor_interval.hpp"
+#include "common/static_index.hpp"
+#include "common/stats.hpp"
+#include "common/visible_cap.hpp"
+
+namespace aoi {
+
+class TraceWriter;
+
+namespace quadtree {
+
+// 松散四叉树的 aoi：玩家放在松边界包含它的最深的节点里，节点按局部密度分裂、合并，
+// 人多的地方自动切得更细，空旷的地方只有几个大节点。玩家在节点的松边界里小幅移动时不用换节点。
+// 进出事件的算法和 squares 一样：平时用 last_pos 判断，参数变化时用前后两次 aoi 集合的差。
+// Loose quadtree engine: nodes split and merge with local density; same event semantics as squares.
+
+class PlayerAoi;
+typedef std::unordered_map<Nuid, std::shared_ptr<PlayerAoi>, std::hash<Nuid>, std::equal_to<Nuid>,
+                           ResourceAllocator<std::pair<const Nuid, std::shared_ptr<PlayerAoi>>>>
+    PlayerMap;
+typedef std::vector<Nuid> PlayerNuids;
+typedef std::vector<PlayerAoi*, ResourceAllocator<PlayerAoi*>> PlayerPtrList;
+typedef Uint32 NodeIndex;
+constexpr NodeIndex kInvalidNode = static_cast<NodeIndex>(-1);
+constexpr NodeIndex kRootNode = 0;
+
+// 松边界的半边长是紧边界的 kLooseness 倍
+constexpr float kLooseness = 1.5f;
+
+#define AOI_FLOAT_MAX std::numeric_limits<float>::max()
+#undef AOI_INF_POS
+#define AOI_INF_POS AOI_FLOAT_MAX, AOI_FLOAT_MAX, AOI_FLOAT_MAX
+
+
+struct Pos {
+  Pos(float _x, float _y, float _z)
+      : x(_x), y(_y), z(_z) {}
+
+  void Set(float _x, float _y, float _z) {
+    x = _x;
+    y = _y;
+    z = _z;
+  }
+
+  float x, y, z;
+};
+
+
+struct Sensor {
+  Sensor(Nuid _sensor_id, float _radius, MemoryResource *resource = nullptr)
+      : sensor_id(_sensor_id), radius(_radius), radius_square(_radius * _radius),
+        leave_radius(_radius), leave_radius_square(_radius * _radius), flags(0),
+        aoi_players{PlayerPtrList(ResourceAllocator<PlayerAoi*>(resource)),
+                    PlayerPtrList(ResourceAllocator<PlayerAoi*>(resource))} {
+    SetFlag_New();
+  }
+
+  // 新加的 sensor 不管间隔，下次 Tick 马上计算
+  AOI_CLASS_ADD_FLAG(New, 0, flags);
+  // 参数变了，下次 Tick 马上计算，用集合差算进出
+  AOI_CLASS_ADD_FLAG(Diff, 1, flags);
+
+  // 只看到最近的几个玩家，或者上一次计算时的 last_pos 已经对不上
+  bool NeedDiff() const {
+    return max_visible > 0 || interval > 1 || GetFlag_Diff();
+  }
+
+  bool IsDue(Uint64 tick) const {
+    return GetFlag_New() || GetFlag_Diff() || IntervalSchedule::IsDue(tick, interval, phase);
+  }
+
+  Nuid sensor_id;
+  float radius;               // 进入半径
+  float radius_square;
+  float leave_radius;         // 离开半径，不小于 radius
+  float leave_radius_square;
+  Uint32 flags;
+  Uint32 max_visible = 0;     // 最多看到几个玩家，0 不限制
+  Uint32 interval = 1;        // 每隔几次 Tick 计算一次
+  Uint32 phase = 0;
+  Uint32 interest = kAllCategories;   // 只看 category 和它有交集的玩家
+  PlayerPtrList aoi_players[2];
+  StaticAoi static_aoi;       // 看到的静态实体
+};
+
+
+struct PlayerAoi {
+  PlayerAoi(Uint64 _nuid, float _x, float _y, float _z, MemoryResource *resource = nullptr)
+      : nuid(_nuid), pos(_x, _y, _z), flags(0), last_pos(AOI_INF_POS),
+        sensors(ResourceAllocator<Sensor>(resource)) {}
+
+  AOI_CLASS_ADD_FLAG(Removed, 0, flags);
+  AOI_CLASS_ADD_FLAG(New, 1, flags);
+  // 已经放进 remove_list_，Tick 结束时检查要不要真正删除
+  AOI_CLASS_ADD_FLAG(PendingErase, 2, flags);
+
+  // 查找候选玩家时访问的字段放在最前面
+  Nuid nuid;
+  Pos pos;
+  Uint32 flags;
+  Uint32 category = kDefaultCategory;
+  Pos last_pos;                     // 上一次 Tick 结束时的位置
+  Uint32 last_category = kDefaultCategory;
+  // 只有自己移动或者 Tick 时访问
+  NodeIndex node = kInvalidNode;    // 所在的节点，移除之后为 kInvalidNode
+  Uint32 node_index = 0;            // 在节点 players 里的下标
+  std::vector<Sensor, ResourceAllocator<Sensor>> sensors;
+};
+
+
+// 紧边界是以 (x, z) 为中心、半边长 half 的正方形，四个子节点连续存放。
+// count 是整棵子树里的玩家数，查找时跳过空的子树，Tick 开始时据此分裂、合并
+struct QuadNode {
+  QuadNode(MemoryResource *resource)    // NOLINT
+      : players(ResourceAllocator<PlayerAoi*>(resource)) {}
+
+  bool IsLeaf() const {
+    return children == kInvalidNode;
+  }
+  bool LooseContains(const Pos &pos) const {
+    float loose_half = half * kLooseness;
+    return pos.x >= x - loose_half && pos.x <= x + loose_half &&
+           pos.z >= z - loose_half && pos.z <= z + loose_half;
+  }
+  // pos 落在哪个子节点的紧边界里
+  Uint32 Quadrant(const Pos &pos) const {
+    return (pos.x >= x ? 1 : 0) | (pos.z >= z ? 2 : 0);
+  }
+
+  float x = 0;
+  float z = 0;
+  float half = 0;
+  Uint32 depth = 0;
+  Uint32 count = 0;
+  NodeIndex parent = kInvalidNode;
+  NodeIndex children = kInvalidNode;
+  PlayerPtrList players;
+};
+
+
+struct SensorUpdateInfo {
+  Nuid sensor_id;
+  PlayerNuids enters;
+  PlayerNuids leaves;
+};
+
+
+struct AoiUpdateInfo {
+  Nuid nuid;
+  std::vector<SensorUpdateInfo> sensor_update_list;
+};
+
+typedef std::unordered_map<Nuid, AoiUpdateInfo> AoiUpdateInfos;
+
+
+// 只有定义了 AOI_ENABLE_STATS 才会计数
+struct AoiStats {
+  Uint64 nodes_visited = 0;         // _CalcAoiPlayers 访问的节点数
+  Uint64 candidates_scanned = 0;    // 节点里检查过的玩家数
+  Uint64 candidates_accepted = 0;   // 在半径内的玩家数
+  Uint64 node_migrations = 0;       // UpdatePos 中换节点的次数
+  Uint64 node_splits = 0;
+  Uint64 node_merges = 0;
+  Uint64 enters = 0;
+  Uint64 leaves = 0;
+  Uint64 sensors_skipped = 0;       // 没到计算间隔跳过的 sensor 数
+};
+
+
+class QuadTreeAoi {
+ public:
+  // 根节点的紧边界是以原点为中心、边长 world_size 的正方形，外面的玩家直接放在根节点里。
+  // 叶子节点超过 split_threshold 个玩家、深度小于 max_depth 时分裂成四个，
+  // 子树的玩家数不超过 split_threshold / 2 时合并回来，分裂、合并都在 Tick 开始时做。
+  // resource 不为空时玩家、节点和 aoi 列表都从 resource 分配，resource 要比 QuadTreeAoi 活得久
+  explicit QuadTreeAoi(float world_size = 20000, Uint32 split_threshold = 16,
+                       Uint32 max_depth = 12, MemoryResource *resource = nullptr);
+
+  void AddPlayer(Nuid nuid, float x, float y, float z);
+  void RemovePlayer(Nuid nuid);
+  void AddSensor(Nuid nuid, Nuid sensor_id, float radius);
+  void UpdatePos(Nuid nuid, float x, float y, float z);
+  // 不会移动、也不会被移除的实体，不进四叉树，下次 Tick 时建成只读索引
+  void AddStaticEntity(Nuid nuid, float x, float y, float z);
+  // sensor 最多只看到最近的 max_visible 个玩家，0 不限制
+  void SetSensorMaxVisible(Nuid nuid, Nuid sensor_id, Uint32 max_visible);
+  // 已经看到的玩家走出 leave_radius 才离开，小于进入半径时按进入半径算
+  void SetSensorLeaveRadius(Nuid nuid, Nuid sensor_id, float leave_radius);
+  // sensor 每隔 interval 次 Tick 才计算一次（0 和 1 都是每次）
+  void SetSensorInterval(Nuid nuid, Nuid sensor_id, Uint32 interval);
+  // 玩家的 category 位掩码，默认 kDefaultCategory
+  void SetPlayerCategory(Nuid nuid, Uint32 category);
+  // sensor 只看 category 和 interest 有交集的玩家，默认 kAllCategories
+  void SetSensorInterest(Nuid nuid, Nuid sensor_id, Uint32 interest);
+  AoiUpdateInfos Tick();
+  const PlayerMap& GetPlayerMap() const {
+    return player_map_;
+  }
+  MemoryResource* GetMemoryResource() const {
+    return resource_;
+  }
+  // 当前在用的节点数和最深的节点深度（根节点深度为 0）
+  size_t GetNodeNum() const {
+    return nodes_.size() - free_blocks_.size() * 4;
+  }
+  Uint32 GetMaxDepth() const;
+  const QuadNode& GetNode(NodeIndex index) const {
+    return nodes_[index];
+  }
+  // 当前各类数据结构占用的内存，遍历所有玩家和节点，不要每次 Tick 都调用
+  MemoryUsage GetMemoryUsage() const;
+  // 上一次 Tick 结束时统计的计数，包括这次 Tick 以及之前的 UpdatePos
+  const AoiStats& GetTickStats() const {
+    return tick_stats_;
+  }
+  // 记录之后的操作，writer 由调用者持有，传 nullptr 关闭记录
+  void SetTraceWriter(TraceWriter *writer) {
+    trace_writer_ = writer;
+  }
+
+ protected:
+  void _InsertPlayer(PlayerAoi *pptr);
+  void _RemoveFromNode(PlayerAoi *pptr);
+  // 按玩家数分裂过满的叶子、合并过空的子树
+  void _Rebalance(NodeIndex index);
+  void _Split(NodeIndex index);
+  void _Merge(NodeIndex index);
+  // 四个连续的子节点，优先复用合并时释放的
+  NodeIndex _AllocChildren();
+  void _ErasePlayer(PlayerAoi *pptr);
+  AoiUpdateInfo _UpdatePlayerAoi(PlayerAoi *pptr);
+  void _CalcAoiPlayers(const PlayerAoi &player, const Sensor &sensor, PlayerPtrList *aoi_map);
+  // 出了进入半径、还在离开半径内的旧玩家不算离开，追加到 new_players
+  void _CheckLeave(const PlayerAoi &player, const Sensor &sensor,
+                   const PlayerPtrList &aoi_players, PlayerPtrList *new_players,
+                   PlayerNuids *leaves);
+  void _CheckEnter(const PlayerAoi &player, const Sensor &sensor,
+                   const PlayerPtrList &aoi_players, PlayerPtrList *old_players,
+                   PlayerNuids *enters);
+
+ protected:
+  Uint32 split_threshold_;
+  Uint32 max_depth_;
+  MemoryResource *resource_;
+  PlayerMap player_map_;
+  std::vector<QuadNode, ResourceAllocator<QuadNode>> nodes_;
+  std::vector<NodeIndex> free_blocks_;    // 合并后空出来的子节点组，存第一个的下标
+  std::vector<NodeIndex> query_stack_;
+  NearestSelector<PlayerAoi*> nearest_;   // 有 max_visible 的 sensor 查找时用
+  PlayerPtrList remove_list_;             // 调用过 RemovePlayer 的玩家
+  Uint32 cur_aoi_map_idx_ = 0;
+  float max_sensor_radius_ = 0;
+  TraceWriter *trace_writer_ = nullptr;
+  AoiStats stats_;
+  AoiStats tick_stats_;
+
+  Uint64 tick_count_ = 0;
+  IntervalSchedule interval_schedule_;
+  PlayerGraveyard<std::shared_ptr<PlayerAoi>> graveyard_;
+  StaticIndex static_index_;
+};
+
+}   // namespace quadtree
+}   // namespace aoi
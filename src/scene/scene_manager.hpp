@@ -0,0 +1,189 @@
+// Copyright <disenone>
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "common/arena.hpp"
+#include "common/base_types.hpp"
+#include "common/thread_pool.hpp"
+
+namespace aoi { namespace scene {
+
+// 管理多个互相独立的 aoi 实例（比如副本），Tick 时每个场景作为一个任务丢到线程池里并行执行。
+// 按每个场景平滑后的 Tick 耗时从大到小分配到负载最小的 worker（LPT），空闲的 worker 再去偷
+// 别人剩下的小任务，几个人多的场景不会拖慢整帧。
+// 场景之间不共享状态：一个场景 Tick 抛出的异常只记在这个场景上，不影响其它场景。
+// Owns many independent engine instances and ticks them concurrently. Scenes are handed out
+// longest-measured-cost first to the least loaded worker; leftovers are stolen by idle workers.
+// AddScene / RemoveScene / GetScene 以及对场景的操作只能在两次 Tick 之间、在调用 Tick 的线程上做。
+
+typedef Uint64 SceneId;
+
+template <typename Aoi>
+class SceneManager {
+ public:
+  typedef decltype(std::declval<Aoi&>().Tick()) AoiUpdateInfos;
+
+  // thread_num 为 0 时使用 std::thread::hardware_concurrency()
+  explicit SceneManager(size_t thread_num = 0)
+      : pool_(thread_num) {}
+
+  // 用 args 构造一个 Aoi，scene_id 已存在时返回 nullptr
+  template <typename... Args>
+  Aoi* AddScene(SceneId scene_id, Args&&... args) {
+    auto &scene = scenes_[scene_id];
+    if (scene) return nullptr;
+    scene.reset(new Scene(scene_id, new Aoi(std::forward<Args>(args)...)));
+    return scene->aoi.get();
+  }
+
+  // 场景独占一个 MemoryResource，用 args 加上 resource 指针构造 Aoi（args 要写全 resource
+  // 前面的参数）。删除场景时先析构 Aoi，再析构 resource。不同场景在不同线程里 Tick，
+  // 独占的 resource 不需要加锁
+  template <typename... Args>
+  Aoi* AddSceneWithResource(SceneId scene_id, std::unique_ptr<MemoryResource> resource,
+                            Args&&... args) {
+    auto &scene = scenes_[scene_id];
+    if (scene) return nullptr;
+    auto aoi = new Aoi(std::forward<Args>(args)..., resource.get());
+    scene.reset(new Scene(scene_id, aoi, std::move(resource)));
+    return scene->aoi.get();
+  }
+
+  // 场景独占一个 Arena，删除场景时整块归还。适合人数有上限、很快就会关闭的副本
+  template <typename... Args>
+  Aoi* AddSceneWithArena(SceneId scene_id, size_t chunk_size, bool huge_pages, Args&&... args) {
+    return AddSceneWithResource(scene_id,
+                                std::unique_ptr<MemoryResource>(new Arena(chunk_size, huge_pages)),
+                                std::forward<Args>(args)...);
+  }
+
+  void RemoveScene(SceneId scene_id) {
+    scenes_.erase(scene_id);
+  }
+
+  Aoi* GetScene(SceneId scene_id) const {
+    auto iter = scenes_.find(scene_id);
+    return iter == scenes_.end() ? nullptr : iter->second->aoi.get();
+  }
+
+  // 场景独占的 resource，用 AddScene 添加的场景返回 nullptr
+  MemoryResource* GetMemoryResource(SceneId scene_id) const {
+    auto iter = scenes_.find(scene_id);
+    return iter == scenes_.end() ? nullptr : iter->second->resource.get();
+  }
+
+  size_t GetSceneNum() const {
+    return scenes_.size();
+  }
+
+  // 并行 Tick 所有场景，阻塞到全部完成，结果用 GetUpdateInfos 取
+  void Tick();
+
+  // 场景上一次 Tick 的结果，场景不存在时返回 nullptr
+  const AoiUpdateInfos* GetUpdateInfos(SceneId scene_id) const {
+    auto iter = scenes_.find(scene_id);
+    return iter == scenes_.end() ? nullptr : &iter->second->update_infos;
+  }
+
+  // 场景上一次 Tick 抛出的异常，没有异常时为空
+  std::exception_ptr GetError(SceneId scene_id) const {
+    auto iter = scenes_.find(scene_id);
+    return iter == scenes_.end() ? nullptr : iter->second->error;
+  }
+
+  // 场景平滑后的 Tick 耗时（秒）
+  double GetTickCost(SceneId scene_id) const {
+    auto iter = scenes_.find(scene_id);
+    return iter == scenes_.end() ? 0 : iter->second->tick_cost;
+  }
+
+  size_t GetThreadNum() const {
+    return pool_.Size();
+  }
+
+ protected:
+  struct Scene {
+    Scene(SceneId _scene_id, Aoi *_aoi, std::unique_ptr<MemoryResource> _resource = nullptr)
+        : scene_id(_scene_id), resource(std::move(_resource)), aoi(_aoi) {}
+
+    SceneId scene_id;
+    std::unique_ptr<MemoryResource> resource;   // 在 aoi 之前声明，比 aoi 后析构
+    std::unique_ptr<Aoi> aoi;
+    double tick_cost = 0;   // 指数平滑
+    bool ticked = false;
+    AoiUpdateInfos update_infos;
+    std::exception_ptr error;
+  };
+
+  static void _TickScene(Scene *scene);
+
+  // 新的耗时样本占的权重
+  static constexpr double kCostSmoothing = 0.25;
+  // 没有测过耗时的场景按这个耗时分配，保证新场景也能分散到不同 worker
+  static constexpr double kMinCost = 1e-6;
+
+  ThreadPool pool_;
+  std::unordered_map<SceneId, std::unique_ptr<Scene>> scenes_;
+  std::vector<Scene*> order_;
+  std::vector<double> worker_loads_;
+};
+
+
+template <typename Aoi>
+void SceneManager<Aoi>::Tick() {
+  order_.clear();
+  for (auto &elem : scenes_) {
+    order_.push_back(elem.second.get());
+  }
+  std::sort(order_.begin(), order_.end(), [](const Scene *left, const Scene *right) {
+    if (left->tick_cost != right->tick_cost) return left->tick_cost > right->tick_cost;
+    return left->scene_id < right->scene_id;
+  });
+
+  // 每个 worker 按提交顺序（耗时从大到小）执行，别的 worker 从队尾偷耗时小的
+  worker_loads_.assign(pool_.Size(), 0);
+  for (auto scene : order_) {
+    auto worker = std::min_element(worker_loads_.begin(), worker_loads_.end());
+    *worker += std::max(scene->tick_cost, kMinCost);
+    pool_.Submit(worker - worker_loads_.begin(), [scene] { _TickScene(scene); });
+  }
+  pool_.Wait();
+}
+
+
+template <typename Aoi>
+void SceneManager<Aoi>::_TickScene(Scene *scene) {
+  auto begin = std::chrono::steady_clock::now();
+  try {
+    scene->update_infos = scene->aoi->Tick();
+    scene->error = nullptr;
+  } catch (...) {
+    scene->update_infos.clear();
+    scene->error = std::current_exception();
+  }
+  double cost = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+  if (scene->ticked) {
+    scene->tick_cost += (cost - scene->tick_cost) * kCostSmoothing;
+  } else {
+    scene->tick_cost = cost;
+    scene->ticked = true;
+  }
+}
+
+
+template <typename Aoi>
+constexpr double SceneManager<Aoi>::kCostSmoothing;
+
+template <typename Aoi>
+constexpr double SceneManager<Aoi>::kMinCost;
+
+}  // namespace scene
+}  // namespace aoi
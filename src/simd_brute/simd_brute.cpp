@@ -0,0 +1,521 @@
+// Copyright <disenone>
+
+#include "simd_brute.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <algorithm>
+#include <utility>
+
+#include "common/aoi_diff.hpp"
+#include "common/trace.hpp"
+
+namespace aoi { namespace simd_brute {
+
+constexpr float kMinStaticCellSize = 32;
+
+
+SimdBruteAoi::SimdBruteAoi(MemoryResource *resource /*= nullptr*/)
+    : resource_(resource),
+      player_map_(PlayerMap::allocator_type(resource)),
+      players_(PlayerPtrList::allocator_type(resource)),
+      xs_(FloatList::allocator_type(resource)),
+      zs_(FloatList::allocator_type(resource)),
+      categories_(Uint32List::allocator_type(resource)),
+      remove_list_(PlayerPtrList::allocator_type(resource)) {
+  player_map_.reserve(100);
+}
+
+
+SimdBruteAoi::~SimdBruteAoi() {
+}
+
+
+void SimdBruteAoi::_AddToArray(PlayerAoi *pptr) {
+  pptr->index = players_.size();
+  players_.push_back(pptr);
+  xs_.push_back(pptr->pos.x);
+  zs_.push_back(pptr->pos.z);
+  categories_.push_back(pptr->category);
+}
+
+
+void SimdBruteAoi::_RemoveFromArray(PlayerAoi *pptr) {
+  Uint32 index = pptr->index;
+  if (index == kInvalidIndex) return;
+
+  auto last = players_.back();
+  last->index = index;
+  players_[index] = last;
+  xs_[index] = xs_.back();
+  zs_[index] = zs_.back();
+  categories_[index] = categories_.back();
+  players_.pop_back();
+  xs_.pop_back();
+  zs_.pop_back();
+  categories_.pop_back();
+  pptr->index = kInvalidIndex;
+}
+
+
+void SimdBruteAoi::AddPlayer(Nuid nuid, float x, float y, float z) {
+  if (trace_writer_) trace_writer_->AddPlayer(nuid, x, y, z);
+
+  auto piter = player_map_.find(nuid);
+  if (piter != player_map_.end()) {
+    auto pptr = piter->second.get();
+    pptr->pos.Set(x, y, z);
+    pptr->UnsetFlag_Removed();
+    if (pptr->index == kInvalidIndex) {
+      _AddToArray(pptr);
+    } else {
+      xs_[pptr->index] = x;
+      zs_[pptr->index] = z;
+    }
+    return;
+  }
+
+  auto ret = player_map_.emplace(nuid, std::allocate_shared<PlayerAoi>(
+      ResourceAllocator<PlayerAoi>(resource_), nuid, x, y, z, resource_));
+  auto pptr = ret.first->second.get();
+  pptr->SetFlag_New();
+  _AddToArray(pptr);
+}
+
+
+void SimdBruteAoi::RemovePlayer(Nuid nuid) {
+  if (trace_writer_) trace_writer_->RemovePlayer(nuid);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  auto &player = *piter->second;
+  _RemoveFromArray(&player);
+  player.SetFlag_Removed();
+  if (!player.GetFlag_PendingErase()) {
+    player.SetFlag_PendingErase();
+    remove_list_.push_back(&player);
+  }
+}
+
+
+void SimdBruteAoi::AddSensor(Nuid nuid, Nuid sensor_id, float radius) {
+  if (trace_writer_) trace_writer_->AddSensor(nuid, sensor_id, radius);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  auto &player = *piter->second;
+  for (const auto &sensor : player.sensors) {
+    if (sensor.sensor_id == sensor_id) return;
+  }
+  player.sensors.emplace_back(sensor_id, radius, resource_);
+  max_sensor_radius_ = std::max(max_sensor_radius_, radius);
+}
+
+
+void SimdBruteAoi::UpdatePos(Nuid nuid, float x, float y, float z) {
+  if (trace_writer_) trace_writer_->UpdatePos(nuid, x, y, z);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  auto &player = *piter->second;
+  player.pos.Set(x, y, z);
+  if (player.index != kInvalidIndex) {
+    xs_[player.index] = x;
+    zs_[player.index] = z;
+  }
+}
+
+
+void SimdBruteAoi::AddStaticEntity(Nuid nuid, float x, float y, float z) {
+  if (trace_writer_) trace_writer_->AddStaticEntity(nuid, x, y, z);
+
+  static_index_.Add(nuid, x, z);
+}
+
+
+void SimdBruteAoi::SetSensorMaxVisible(Nuid nuid, Nuid sensor_id, Uint32 max_visible) {
+  if (trace_writer_) trace_writer_->SetSensorMaxVisible(nuid, sensor_id, max_visible);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.max_visible = max_visible;
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+void SimdBruteAoi::SetSensorLeaveRadius(Nuid nuid, Nuid sensor_id, float leave_radius) {
+  if (trace_writer_) trace_writer_->SetSensorLeaveRadius(nuid, sensor_id, leave_radius);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.leave_radius = std::max(leave_radius, sensor.radius);
+      sensor.leave_radius_square = sensor.leave_radius * sensor.leave_radius;
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+void SimdBruteAoi::SetSensorInterval(Nuid nuid, Nuid sensor_id, Uint32 interval) {
+  if (trace_writer_) trace_writer_->SetSensorInterval(nuid, sensor_id, interval);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.interval = std::max<Uint32>(interval, 1);
+      sensor.phase = interval_schedule_.AllocPhase(sensor.interval);
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+void SimdBruteAoi::SetPlayerCategory(Nuid nuid, Uint32 category) {
+  if (trace_writer_) trace_writer_->SetPlayerCategory(nuid, category);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  auto &player = *piter->second;
+  if (player.category == category) return;
+
+  player.category = category;
+  if (player.index != kInvalidIndex) categories_[player.index] = category;
+}
+
+
+void SimdBruteAoi::SetSensorInterest(Nuid nuid, Nuid sensor_id, Uint32 interest) {
+  if (trace_writer_) trace_writer_->SetSensorInterest(nuid, sensor_id, interest);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.interest = interest;
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+void SimdBruteAoi::ExportSnapshot(AoiSnapshot *snapshot) const {
+  snapshot->players.clear();
+  snapshot->static_entities.clear();
+  snapshot->tick_count = tick_count_;
+  snapshot->interval_schedule = interval_schedule_;
+  static_index_.ForEach([snapshot](Nuid nuid, float x, float z) {
+    snapshot->static_entities.push_back({nuid, x, z});
+  });
+
+  snapshot->players.reserve(players_.size());
+  for (auto pptr : players_) {
+    const auto &player = *pptr;
+    snapshot->players.push_back({player.nuid, player.pos.x, player.pos.y, player.pos.z,
+                                 player.category, {}});
+    auto &sensors = snapshot->players.back().sensors;
+    for (const auto &sensor : player.sensors) {
+      sensors.push_back({sensor.sensor_id, sensor.radius, sensor.leave_radius, sensor.max_visible,
+                         sensor.interval, sensor.phase, sensor.interest, {},
+                         sensor.static_aoi.nuids});
+      auto &aoi_players = sensors.back().aoi_players;
+      for (auto other_ptr : sensor.aoi_players[cur_aoi_map_idx_]) {
+        aoi_players.push_back(other_ptr->nuid);
+      }
+    }
+  }
+}
+
+
+void SimdBruteAoi::RestoreSensor(Nuid nuid, const SensorSnapshot &snapshot) {
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id != snapshot.sensor_id) continue;
+
+    auto &aoi_players = sensor.aoi_players[cur_aoi_map_idx_];
+    aoi_players.clear();
+    for (auto other_nuid : snapshot.aoi_players) {
+      auto other_iter = player_map_.find(other_nuid);
+      if (other_iter == player_map_.end() || other_iter->second->GetFlag_Removed()) continue;
+      aoi_players.push_back(other_iter->second.get());
+    }
+    // 版本号清零，下次 Tick 一定重新查询静态实体
+    sensor.static_aoi.nuids = snapshot.static_entities;
+    sensor.static_aoi.version = 0;
+    // 不是新加的 sensor，按原来的相位计算，没到时间的照样跳过；这次 Tick 整体用集合差算进出事件
+    sensor.phase = snapshot.phase;
+    sensor.UnsetFlag_New();
+    sensor.UnsetFlag_Diff();
+    diff_aoi_ = true;
+    return;
+  }
+}
+
+
+AoiUpdateInfos SimdBruteAoi::Tick() {
+  if (trace_writer_) trace_writer_->Tick();
+  if (static_index_.IsDirty()) {
+    static_index_.Build(std::max(max_sensor_radius_, kMinStaticCellSize));
+  }
+
+  AoiUpdateInfos update_infos;
+  for (auto pptr : players_) {
+    if (pptr->sensors.empty()) continue;
+
+    auto update_info = _UpdatePlayerAoi(pptr);
+    if (!update_info.sensor_update_list.empty()) {
+      update_infos.emplace(update_info.nuid, std::move(update_info));
+    }
+  }
+
+  // 移除之后又加回来的玩家不删
+  for (auto pptr : remove_list_) {
+    pptr->UnsetFlag_PendingErase();
+    if (pptr->GetFlag_Removed()) _ErasePlayer(pptr);
+  }
+  remove_list_.clear();
+  for (auto pptr : players_) {
+    pptr->last_pos = pptr->pos;
+    pptr->last_category = pptr->category;
+    pptr->UnsetFlag_New();
+  }
+
+  cur_aoi_map_idx_ = 1 - cur_aoi_map_idx_;
+  diff_aoi_ = false;
+  graveyard_.Release(tick_count_++);
+  tick_stats_ = stats_;
+  stats_ = AoiStats();
+  return update_infos;
+}
+
+
+void SimdBruteAoi::_ErasePlayer(PlayerAoi *pptr) {
+  auto piter = player_map_.find(pptr->nuid);
+  // 低频 sensor 最多再过 max_interval 次 Tick 就会重新计算，不再引用这个玩家
+  Uint32 max_interval = interval_schedule_.GetMaxInterval();
+  if (max_interval > 1) {
+    graveyard_.Bury(std::move(piter->second), tick_count_ + max_interval);
+  }
+  player_map_.erase(piter);
+}
+
+
+AoiUpdateInfo SimdBruteAoi::_UpdatePlayerAoi(PlayerAoi *pptr) {
+  AoiUpdateInfo aoi_update_info;
+  aoi_update_info.nuid = pptr->nuid;
+  Uint32 new_aoi_map_idx = 1 - cur_aoi_map_idx_;
+
+  for (auto &sensor : pptr->sensors) {
+    auto &old_aoi = sensor.aoi_players[cur_aoi_map_idx_];
+    auto &new_aoi = sensor.aoi_players[new_aoi_map_idx];
+    if (!sensor.IsDue(tick_count_)) {
+      // 没到计算的时候，上一次的列表原样留给下一次
+      std::swap(old_aoi, new_aoi);
+      AOI_STATS_INC(stats_, sensors_skipped);
+      continue;
+    }
+    if (sensor.max_visible > 0) {
+      nearest_.Reset(pptr->pos.x, pptr->pos.z, sensor.max_visible, &old_aoi);
+    }
+    _CalcAoiPlayers(*pptr, sensor, &new_aoi);
+    bool need_diff = diff_aoi_ || sensor.NeedDiff();
+    // 用 last_pos 算进出时，离开半径内的旧玩家由 _CheckLeave 加回新的列表，不用排序
+    if (need_diff && sensor.leave_radius > sensor.radius) {
+      KeepIncumbents(pptr->pos, sensor.leave_radius_square, sensor.interest, &old_aoi, &new_aoi);
+    }
+    KeepNearest(pptr->pos, sensor.max_visible, &old_aoi, &new_aoi);
+
+    SensorUpdateInfo update_info;
+    auto &enters = update_info.enters;
+    auto &leaves = update_info.leaves;
+    if (need_diff) {
+      DiffAoiPlayers(&old_aoi, &new_aoi, &enters, &leaves);
+    } else {
+      // 先算 enter，这时新的列表里只有半径内的玩家
+      _CheckEnter(*pptr, sensor, new_aoi, &old_aoi, &enters);
+      _CheckLeave(*pptr, sensor, old_aoi, &new_aoi, &leaves);
+    }
+    if (sensor.interest & kDefaultCategory) {
+      sensor.static_aoi.Update(static_index_, pptr->pos.x, pptr->pos.z, sensor.radius,
+                               &enters, &leaves);
+    } else {
+      sensor.static_aoi.Clear(&leaves);
+    }
+    sensor.UnsetFlag_New();
+    sensor.UnsetFlag_Diff();
+    AOI_STATS_ADD(stats_, enters, enters.size());
+    AOI_STATS_ADD(stats_, leaves, leaves.size());
+
+    if (enters.empty() && leaves.empty()) continue;
+
+    update_info.sensor_id = sensor.sensor_id;
+    aoi_update_info.sensor_update_list.push_back(std::move(update_info));
+  }
+
+  return aoi_update_info;
+}
+
+
+void SimdBruteAoi::_CalcAoiPlayers(const PlayerAoi &player, const Sensor &sensor,
+                                   PlayerPtrList *aoi_players) {
+  aoi_players->clear();
+  float pos_x = player.pos.x;
+  float pos_z = player.pos.z;
+  float radius_square = sensor.radius_square;
+  Uint32 interest = sensor.interest;
+  bool capped = sensor.max_visible > 0;
+
+  const float *xs = xs_.data();
+  const float *zs = zs_.data();
+  const Uint32 *categories = categories_.data();
+  PlayerAoi * const *players = players_.data();
+  size_t player_num = players_.size();
+  size_t i = 0;
+  AOI_STATS_ADD(stats_, candidates_scanned, player_num);
+
+#if defined(__SSE2__)
+  // 4 个玩家一组：距离和 category 都比较完，只对命中的位逐个处理
+  __m128 pos_x4 = _mm_set1_ps(pos_x);
+  __m128 pos_z4 = _mm_set1_ps(pos_z);
+  __m128 radius_square4 = _mm_set1_ps(radius_square);
+  __m128i interest4 = _mm_set1_epi32(static_cast<int>(interest));
+  __m128i zero4 = _mm_setzero_si128();
+  for (; i + 4 <= player_num; i += 4) {
+    __m128 dx = _mm_sub_ps(_mm_loadu_ps(xs + i), pos_x4);
+    __m128 dz = _mm_sub_ps(_mm_loadu_ps(zs + i), pos_z4);
+    __m128 in_radius = _mm_cmplt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dz, dz)),
+                                    radius_square4);
+    __m128i category4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(categories + i));
+    __m128i no_interest = _mm_cmpeq_epi32(_mm_and_si128(category4, interest4), zero4);
+    int hits = _mm_movemask_ps(_mm_andnot_ps(_mm_castsi128_ps(no_interest), in_radius));
+    while (hits) {
+      auto other_ptr = players[i + __builtin_ctz(hits)];
+      hits &= hits - 1;
+      if (other_ptr == &player) continue;
+      if (capped) {
+        nearest_.Offer(other_ptr);
+      } else {
+        aoi_players->push_back(other_ptr);
+      }
+    }
+  }
+#endif
+
+  for (; i < player_num; ++i) {
+    float dx = xs[i] - pos_x;
+    float dz = zs[i] - pos_z;
+    if (dx * dx + dz * dz < radius_square && (categories[i] & interest) &&
+        players[i] != &player) {
+      if (capped) {
+        nearest_.Offer(players[i]);
+      } else {
+        aoi_players->push_back(players[i]);
+      }
+    }
+  }
+  if (capped) nearest_.Finish(aoi_players);
+  AOI_STATS_ADD(stats_, candidates_accepted, aoi_players->size());
+}
+
+
+void SimdBruteAoi::_CheckLeave(const PlayerAoi &player, const Sensor &sensor,
+                               const PlayerPtrList &aoi_players, PlayerPtrList *new_players,
+                               PlayerNuids *leaves) {
+  float pos_x = player.pos.x;
+  float pos_z = player.pos.z;
+  float radius_square = sensor.radius_square;
+  float leave_radius_square = sensor.leave_radius_square;
+  Uint32 interest = sensor.interest;
+  for (auto old_player_ptr : aoi_players) {
+    float dx = old_player_ptr->pos.x - pos_x;
+    float dz = old_player_ptr->pos.z - pos_z;
+    float dist_square = dx * dx + dz * dz;
+    // 改成了不感兴趣的 category，不管距离都离开
+    if (old_player_ptr->GetFlag_Removed() || !(old_player_ptr->category & interest)) {
+      leaves->push_back(old_player_ptr->nuid);
+    } else if (dist_square >= radius_square) {
+      // 出了进入半径、还在离开半径内的继续看到
+      if (dist_square < leave_radius_square) {
+        new_players->push_back(old_player_ptr);
+      } else {
+        leaves->push_back(old_player_ptr->nuid);
+      }
+    }
+  }
+}
+
+
+void SimdBruteAoi::_CheckEnter(const PlayerAoi &player, const Sensor &sensor,
+                               const PlayerPtrList &aoi_players, PlayerPtrList *old_players,
+                               PlayerNuids *enters) {
+  if (player.GetFlag_New() || sensor.GetFlag_New()) {
+    enters->reserve(aoi_players.size());
+    for (auto new_player_ptr : aoi_players) {
+      enters->push_back(new_player_ptr->nuid);
+    }
+    return;
+  }
+
+  // 上一次 Tick 时不在半径内或者 category 不感兴趣的就是新进来的，除非是离开半径内留下来的旧玩家
+  float pos_x = player.last_pos.x;
+  float pos_z = player.last_pos.z;
+  float radius_square = sensor.radius_square;
+  float leave_radius_square = sensor.leave_radius_square;
+  Uint32 interest = sensor.interest;
+  IncumbentLookup<PlayerPtrList> incumbents(old_players);
+  for (auto new_player_ptr : aoi_players) {
+    if (!(new_player_ptr->last_category & interest)) {
+      enters->push_back(new_player_ptr->nuid);
+      continue;
+    }
+    float dx = new_player_ptr->last_pos.x - pos_x;
+    float dz = new_player_ptr->last_pos.z - pos_z;
+    float dist_square = dx * dx + dz * dz;
+    if (dist_square < radius_square) continue;
+    if (dist_square < leave_radius_square && incumbents.Contains(new_player_ptr)) continue;
+    enters->push_back(new_player_ptr->nuid);
+  }
+}
+
+
+MemoryUsage SimdBruteAoi::GetMemoryUsage() const {
+  MemoryUsage usage;
+  usage.player_map = HashMapBytes(player_map_) + VectorBytes(players_) + VectorBytes(remove_list_)
+                     + VectorBytes(xs_) + VectorBytes(zs_) + VectorBytes(categories_);
+  usage.static_entities = static_index_.MemoryBytes();
+
+  for (const auto &elem : player_map_) {
+    const auto &player = *elem.second;
+    usage.players += sizeof(PlayerAoi);
+    usage.sensors += VectorBytes(player.sensors);
+    for (const auto &sensor : player.sensors) {
+      usage.aoi_lists += VectorBytes(sensor.aoi_players[0]) + VectorBytes(sensor.aoi_players[1]);
+      usage.static_entities += VectorBytes(sensor.static_aoi.nuids);
+    }
+  }
+  return usage;
+}
+
+}  // namespace simd_brute
+
+}  // namespace aoi
@@ -0,0 +1,236 @@
+// Copyright <disenone>
+#pragma once
+
+#include <limits>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+
+#include "common/aoi_snapshot.hpp"
+#include "common/base_types.hpp"
+#include "common/memory_resource.hpp"
+#include "common/memory_usage.hpp"
+#include "common/sensor_interval.hpp"
+#include "common/static_index.hpp"
+#include "common/stats.hpp"
+#include "common/visible_cap.hpp"
+
+namespace aoi {
+
+class TraceWriter;
+
+namespace simd_brute {
+
+// 给小场景用的暴力 aoi：没有格子、没有 candidates，所有玩家的 x、z、category 放在三个连续的数组里，
+// 每个 sensor 用 SSE2 一次比较 4 个玩家，扫一遍整个数组。几百个玩家以内，省掉的哈希表和
+// 格子查找比多算的距离更值。
+// 进出事件的算法和 squares 一样：平时用 last_pos 判断，参数变化时用前后两次 aoi 集合的差。
+// All-pairs scan over packed SoA positions, 4 players per SSE2 compare, for small scenes.
+
+class PlayerAoi;
+typedef std::unordered_map<Nuid, std::shared_ptr<PlayerAoi>, std::hash<Nuid>, std::equal_to<Nuid>,
+                           ResourceAllocator<std::pair<const Nuid, std::shared_ptr<PlayerAoi>>>>
+    PlayerMap;
+typedef std::vector<Nuid> PlayerNuids;
+typedef std::vector<PlayerAoi*, ResourceAllocator<PlayerAoi*>> PlayerPtrList;
+typedef std::vector<float, ResourceAllocator<float>> FloatList;
+typedef std::vector<Uint32, ResourceAllocator<Uint32>> Uint32List;
+constexpr Uint32 kInvalidIndex = static_cast<Uint32>(-1);
+
+#define AOI_FLOAT_MAX std::numeric_limits<float>::max()
+#undef AOI_INF_POS
+#define AOI_INF_POS AOI_FLOAT_MAX, AOI_FLOAT_MAX, AOI_FLOAT_MAX
+
+
+struct Pos {
+  Pos(float _x, float _y, float _z)
+      : x(_x), y(_y), z(_z) {}
+
+  void Set(float _x, float _y, float _z) {
+    x = _x;
+    y = _y;
+    z = _z;
+  }
+
+  float x, y, z;
+};
+
+
+struct Sensor {
+  Sensor(Nuid _sensor_id, float _radius, MemoryResource *resource = nullptr)
+      : sensor_id(_sensor_id), radius(_radius), radius_square(_radius * _radius),
+        leave_radius(_radius), leave_radius_square(_radius * _radius), flags(0),
+        aoi_players{PlayerPtrList(ResourceAllocator<PlayerAoi*>(resource)),
+                    PlayerPtrList(ResourceAllocator<PlayerAoi*>(resource))} {
+    SetFlag_New();
+  }
+
+  // 新加的 sensor 不管间隔，下次 Tick 马上计算
+  AOI_CLASS_ADD_FLAG(New, 0, flags);
+  // 参数变了，下次 Tick 马上计算，用集合差算进出
+  AOI_CLASS_ADD_FLAG(Diff, 1, flags);
+
+  // 只看到最近的几个玩家，或者上一次计算时的 last_pos 已经对不上
+  bool NeedDiff() const {
+    return max_visible > 0 || interval > 1 || GetFlag_Diff();
+  }
+  bool IsDue(Uint64 tick) const {
+    return GetFlag_New() || GetFlag_Diff() || IntervalSchedule::IsDue(tick, interval, phase);
+  }
+
+  Nuid sensor_id;
+  float radius;               // 进入半径
+  float radius_square;
+  float leave_radius;         // 离开半径，不小于 radius
+  float leave_radius_square;
+  Uint32 flags;
+  Uint32 max_visible = 0;     // 最多看到几个玩家，0 不限制
+  Uint32 interval = 1;        // 每隔几次 Tick 计算一次
+  Uint32 phase = 0;
+  Uint32 interest = kAllCategories;   // 只看 category 和它有交集的玩家
+  PlayerPtrList aoi_players[2];
+  StaticAoi static_aoi;       // 看到的静态实体
+};
+
+
+struct PlayerAoi {
+  PlayerAoi(Uint64 _nuid, float _x, float _y, float _z, MemoryResource *resource = nullptr)
+      : nuid(_nuid), pos(_x, _y, _z), flags(0), last_pos(AOI_INF_POS),
+        sensors(ResourceAllocator<Sensor>(resource)) {}
+
+  AOI_CLASS_ADD_FLAG(Removed, 0, flags);
+  AOI_CLASS_ADD_FLAG(New, 1, flags);
+  // 已经放进 remove_list_，Tick 结束时检查要不要真正删除
+  AOI_CLASS_ADD_FLAG(PendingErase, 2, flags);
+
+  Nuid nuid;
+  Pos pos;
+  Uint32 flags;
+  Uint32 category = kDefaultCategory;
+  Pos last_pos;                     // 上一次 Tick 结束时的位置
+  Uint32 last_category = kDefaultCategory;
+  Uint32 index = kInvalidIndex;     // 在扁平数组里的下标，移除之后为 kInvalidIndex
+  std::vector<Sensor, ResourceAllocator<Sensor>> sensors;
+};
+
+
+struct SensorUpdateInfo {
+  Nuid sensor_id;
+  PlayerNuids enters;
+  PlayerNuids leaves;
+};
+
+
+struct AoiUpdateInfo {
+  Nuid nuid;
+  std::vector<SensorUpdateInfo> sensor_update_list;
+};
+
+typedef std::unordered_map<Nuid, AoiUpdateInfo> AoiUpdateInfos;
+
+
+// 只有定义了 AOI_ENABLE_STATS 才会计数
+struct AoiStats {
+  Uint64 candidates_scanned = 0;    // 比较过距离的玩家数，每个 sensor 都是所有玩家
+  Uint64 candidates_accepted = 0;   // 在半径内的玩家数
+  Uint64 enters = 0;
+  Uint64 leaves = 0;
+  Uint64 sensors_skipped = 0;       // 没到计算间隔跳过的 sensor 数
+};
+
+
+class SimdBruteAoi {
+ public:
+  // resource 不为空时玩家、扁平数组和 aoi 列表都从 resource 分配，要比 SimdBruteAoi 活得久
+  explicit SimdBruteAoi(MemoryResource *resource = nullptr);
+  ~SimdBruteAoi();
+
+  void AddPlayer(Nuid nuid, float x, float y, float z);
+  void RemovePlayer(Nuid nuid);
+  void AddSensor(Nuid nuid, Nuid sensor_id, float radius);
+  // 只写位置
+  void UpdatePos(Nuid nuid, float x, float y, float z);
+  // 不会移动、也不会被移除的实体，下次 Tick 时建成只读索引
+  void AddStaticEntity(Nuid nuid, float x, float y, float z);
+  // sensor 最多只看到最近的 max_visible 个玩家，0 不限制
+  void SetSensorMaxVisible(Nuid nuid, Nuid sensor_id, Uint32 max_visible);
+  // 已经看到的玩家走出 leave_radius 才离开，小于进入半径时按进入半径算
+  void SetSensorLeaveRadius(Nuid nuid, Nuid sensor_id, float leave_radius);
+  // sensor 每隔 interval 次 Tick 才计算一次（0 和 1 都是每次）
+  void SetSensorInterval(Nuid nuid, Nuid sensor_id, Uint32 interval);
+  // 玩家的 category 位掩码，默认 kDefaultCategory
+  void SetPlayerCategory(Nuid nuid, Uint32 category);
+  // sensor 只看 category 和 interest 有交集的玩家，默认 kAllCategories
+  void SetSensorInterest(Nuid nuid, Nuid sensor_id, Uint32 interest);
+  // 导出所有玩家、sensor 参数和上一次 Tick 之后的 aoi 列表，在 Tick 之后、下一次操作之前调用
+  void ExportSnapshot(AoiSnapshot *snapshot) const;
+  // 按 snapshot 接上 sensor：换成搬过来的 aoi 列表和静态实体，沿用原来的计算相位，
+  // 下次 Tick 和列表求差算进出事件。不在场景里的玩家会被忽略。ImportSnapshot 用它从别的算法接手，
+  // 不记录到 trace
+  void RestoreSensor(Nuid nuid, const SensorSnapshot &snapshot);
+  // 接上原来的 Tick 计数和低频 sensor 的相位分配，之后新设置的间隔和原来分到一样的相位
+  void RestoreSchedule(Uint64 tick_count, const IntervalSchedule &schedule) {
+    tick_count_ = tick_count;
+    interval_schedule_ = schedule;
+  }
+  AoiUpdateInfos Tick();
+  const PlayerMap& GetPlayerMap() const {
+    return player_map_;
+  }
+  MemoryResource* GetMemoryResource() const {
+    return resource_;
+  }
+  // 当前各类数据结构占用的内存，遍历所有玩家，不要每次 Tick 都调用
+  MemoryUsage GetMemoryUsage() const;
+  // 上一次 Tick 结束时统计的计数，包括这次 Tick 以及之前的 UpdatePos
+  const AoiStats& GetTickStats() const {
+    return tick_stats_;
+  }
+  // 记录之后的操作，writer 由调用者持有，传 nullptr 关闭记录
+  void SetTraceWriter(TraceWriter *writer) {
+    trace_writer_ = writer;
+  }
+
+ protected:
+  // 放进 / 拿出扁平数组，拿出时用最后一个玩家填空位
+  void _AddToArray(PlayerAoi *pptr);
+  void _RemoveFromArray(PlayerAoi *pptr);
+  void _ErasePlayer(PlayerAoi *pptr);
+  AoiUpdateInfo _UpdatePlayerAoi(PlayerAoi *pptr);
+  void _CalcAoiPlayers(const PlayerAoi &player, const Sensor &sensor, PlayerPtrList *aoi_players);
+  // 出了进入半径、还在离开半径内的旧玩家不算离开，追加到 new_players
+  void _CheckLeave(const PlayerAoi &player, const Sensor &sensor,
+                   const PlayerPtrList &aoi_players, PlayerPtrList *new_players,
+                   PlayerNuids *leaves);
+  void _CheckEnter(const PlayerAoi &player, const Sensor &sensor,
+                   const PlayerPtrList &aoi_players, PlayerPtrList *old_players,
+                   PlayerNuids *enters);
+
+ protected:
+  MemoryResource *resource_;
+  PlayerMap player_map_;
+
+  // 没有移除的玩家，下标和 PlayerAoi::index 对应，sensor 按这个顺序扫描
+  PlayerPtrList players_;
+  FloatList xs_;
+  FloatList zs_;
+  Uint32List categories_;
+  PlayerPtrList remove_list_;             // 调用过 RemovePlayer 的玩家
+  NearestSelector<PlayerAoi*> nearest_;   // 有 max_visible 的 sensor 查找时用
+
+  float max_sensor_radius_ = 0;          // 静态实体索引的格子边长
+  Uint32 cur_aoi_map_idx_ = 0;
+  // 从别的算法导入了状态，aoi 列表和 last_pos 对不上，这次用集合差算进出事件
+  bool diff_aoi_ = false;
+  TraceWriter *trace_writer_ = nullptr;
+  AoiStats stats_;
+  AoiStats tick_stats_;
+
+  Uint64 tick_count_ = 0;
+  IntervalSchedule interval_schedule_;
+  PlayerGraveyard<std::shared_ptr<PlayerAoi>> graveyard_;
+  StaticIndex static_index_;
+};
+
+}   // namespace simd_brute
+}   // namespace aoi
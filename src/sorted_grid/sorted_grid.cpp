@@ -0,0 +1,579 @@
+// Copyright <disenone>
+
+#include "sorted_grid.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#include "common/aoi_diff.hpp"
+#include "common/thread_pool.hpp"
+#include "common/trace.hpp"
+
+namespace aoi { namespace sorted_grid {
+
+constexpr size_t SortedGridAoi::kMaxCellsPerPlayer;
+constexpr size_t SortedGridAoi::kMinPlayersPerChunk;
+
+namespace {
+
+// 到网格左（下）边的距离所在的列（行），超出网格的夹到边上
+inline size_t ToCell(float offset, float inverse_cell_size, size_t cell_num) {
+  float cell = offset * inverse_cell_size;
+  if (!(cell > 0)) return 0;
+  if (cell >= cell_num - 1) return cell_num - 1;
+  return static_cast<size_t>(cell);
+}
+
+}  // namespace
+
+
+SortedGridAoi::SortedGridAoi(float cell_size /*= 200*/, size_t thread_num /*= 0*/,
+                             MemoryResource *resource /*= nullptr*/)
+    : cell_size_(cell_size),
+      resource_(resource),
+      pool_(thread_num == 1 ? nullptr : new ThreadPool(thread_num)),
+      player_map_(PlayerMap::allocator_type(resource)),
+      players_(PlayerPtrList::allocator_type(resource)),
+      xs_(FloatList::allocator_type(resource)),
+      zs_(FloatList::allocator_type(resource)),
+      categories_(Uint32List::allocator_type(resource)),
+      remove_list_(PlayerPtrList::allocator_type(resource)),
+      cell_start_(Uint32List::allocator_type(resource)),
+      cell_ids_(Uint32List::allocator_type(resource)),
+      sorted_players_(PlayerPtrList::allocator_type(resource)),
+      sorted_xs_(FloatList::allocator_type(resource)),
+      sorted_zs_(FloatList::allocator_type(resource)),
+      sorted_categories_(Uint32List::allocator_type(resource)) {
+  player_map_.reserve(100);
+}
+
+
+SortedGridAoi::~SortedGridAoi() {
+}
+
+
+void SortedGridAoi::_AddToArray(PlayerAoi *pptr) {
+  pptr->index = players_.size();
+  players_.push_back(pptr);
+  xs_.push_back(pptr->pos.x);
+  zs_.push_back(pptr->pos.z);
+  categories_.push_back(pptr->category);
+}
+
+
+void SortedGridAoi::_RemoveFromArray(PlayerAoi *pptr) {
+  Uint32 index = pptr->index;
+  if (index == kInvalidIndex) return;
+
+  auto last = players_.back();
+  last->index = index;
+  players_[index] = last;
+  xs_[index] = xs_.back();
+  zs_[index] = zs_.back();
+  categories_[index] = categories_.back();
+  players_.pop_back();
+  xs_.pop_back();
+  zs_.pop_back();
+  categories_.pop_back();
+  pptr->index = kInvalidIndex;
+}
+
+
+void SortedGridAoi::AddPlayer(Nuid nuid, float x, float y, float z) {
+  if (trace_writer_) trace_writer_->AddPlayer(nuid, x, y, z);
+
+  auto piter = player_map_.find(nuid);
+  if (piter != player_map_.end()) {
+    auto pptr = piter->second.get();
+    pptr->pos.Set(x, y, z);
+    pptr->UnsetFlag_Removed();
+    if (pptr->index == kInvalidIndex) {
+      _AddToArray(pptr);
+    } else {
+      xs_[pptr->index] = x;
+      zs_[pptr->index] = z;
+    }
+    return;
+  }
+
+  auto ret = player_map_.emplace(nuid, std::allocate_shared<PlayerAoi>(
+      ResourceAllocator<PlayerAoi>(resource_), nuid, x, y, z, resource_));
+  auto pptr = ret.first->second.get();
+  pptr->SetFlag_New();
+  _AddToArray(pptr);
+}
+
+
+void SortedGridAoi::RemovePlayer(Nuid nuid) {
+  if (trace_writer_) trace_writer_->RemovePlayer(nuid);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  auto &player = *piter->second;
+  _RemoveFromArray(&player);
+  player.SetFlag_Removed();
+  if (!player.GetFlag_PendingErase()) {
+    player.SetFlag_PendingErase();
+    remove_list_.push_back(&player);
+  }
+}
+
+
+void SortedGridAoi::AddSensor(Nuid nuid, Nuid sensor_id, float radius) {
+  if (trace_writer_) trace_writer_->AddSensor(nuid, sensor_id, radius);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  auto &player = *piter->second;
+  for (const auto &sensor : player.sensors) {
+    if (sensor.sensor_id == sensor_id) return;
+  }
+  player.sensors.emplace_back(sensor_id, radius, resource_);
+}
+
+
+void SortedGridAoi::UpdatePos(Nuid nuid, float x, float y, float z) {
+  if (trace_writer_) trace_writer_->UpdatePos(nuid, x, y, z);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  auto &player = *piter->second;
+  player.pos.Set(x, y, z);
+  if (player.index != kInvalidIndex) {
+    xs_[player.index] = x;
+    zs_[player.index] = z;
+  }
+}
+
+
+void SortedGridAoi::AddStaticEntity(Nuid nuid, float x, float y, float z) {
+  if (trace_writer_) trace_writer_->AddStaticEntity(nuid, x, y, z);
+
+  static_index_.Add(nuid, x, z);
+}
+
+
+void SortedGridAoi::SetSensorMaxVisible(Nuid nuid, Nuid sensor_id, Uint32 max_visible) {
+  if (trace_writer_) trace_writer_->SetSensorMaxVisible(nuid, sensor_id, max_visible);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.max_visible = max_visible;
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+void SortedGridAoi::SetSensorLeaveRadius(Nuid nuid, Nuid sensor_id, float leave_radius) {
+  if (trace_writer_) trace_writer_->SetSensorLeaveRadius(nuid, sensor_id, leave_radius);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.leave_radius = std::max(leave_radius, sensor.radius);
+      sensor.leave_radius_square = sensor.leave_radius * sensor.leave_radius;
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+void SortedGridAoi::SetSensorInterval(Nuid nuid, Nuid sensor_id, Uint32 interval) {
+  if (trace_writer_) trace_writer_->SetSensorInterval(nuid, sensor_id, interval);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.interval = std::max<Uint32>(interval, 1);
+      sensor.phase = interval_schedule_.AllocPhase(sensor.interval);
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+void SortedGridAoi::SetPlayerCategory(Nuid nuid, Uint32 category) {
+  if (trace_writer_) trace_writer_->SetPlayerCategory(nuid, category);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  auto &player = *piter->second;
+  if (player.category == category) return;
+
+  player.category = category;
+  if (player.index != kInvalidIndex) categories_[player.index] = category;
+}
+
+
+void SortedGridAoi::SetSensorInterest(Nuid nuid, Nuid sensor_id, Uint32 interest) {
+  if (trace_writer_) trace_writer_->SetSensorInterest(nuid, sensor_id, interest);
+
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto &sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.interest = interest;
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+size_t SortedGridAoi::GetCell(float x, float z) const {
+  return ToCell(z - grid_min_z_, grid_inverse_cell_size_, grid_rows_) * grid_cols_
+         + ToCell(x - grid_min_x_, grid_inverse_cell_size_, grid_cols_);
+}
+
+
+template <typename Func>
+void SortedGridAoi::_ForEachChunk(size_t chunk_num, Func func) {
+  size_t player_num = players_.size();
+  if (chunk_num <= 1) {
+    func(0, 0, player_num);
+    return;
+  }
+
+  size_t chunk_size = (player_num + chunk_num - 1) / chunk_num;
+  for (size_t chunk = 0; chunk < chunk_num; ++chunk) {
+    size_t begin = std::min(player_num, chunk * chunk_size);
+    size_t end = std::min(player_num, begin + chunk_size);
+    pool_->Submit(chunk, [&func, chunk, begin, end] { func(chunk, begin, end); });
+  }
+  pool_->Wait();
+}
+
+
+void SortedGridAoi::_BuildGrid() {
+  size_t player_num = players_.size();
+  size_t chunk_num = 1;
+  if (pool_) {
+    chunk_num = std::max<size_t>(1, std::min(pool_->Size(), player_num / kMinPlayersPerChunk));
+  }
+  AOI_STATS_ADD(stats_, sort_chunks, chunk_num);
+
+  // 包围所有玩家的网格
+  float min_x = 0, min_z = 0, max_x = 0, max_z = 0;
+  if (player_num > 0) {
+    min_x = max_x = xs_[0];
+    min_z = max_z = zs_[0];
+    for (size_t i = 1; i < player_num; ++i) {
+      min_x = std::min(min_x, xs_[i]);
+      max_x = std::max(max_x, xs_[i]);
+      min_z = std::min(min_z, zs_[i]);
+      max_z = std::max(max_z, zs_[i]);
+    }
+  }
+  float width = max_x - min_x;
+  float height = max_z - min_z;
+  double max_cells = std::max<size_t>(player_num * kMaxCellsPerPlayer, 1);
+  float cell_size = std::max(cell_size_, static_cast<float>(std::sqrt(width * height / max_cells)));
+  while ((std::floor(width / cell_size) + 1) * (std::floor(height / cell_size) + 1) > max_cells) {
+    cell_size *= 2;
+  }
+  grid_min_x_ = min_x;
+  grid_min_z_ = min_z;
+  grid_cell_size_ = cell_size;
+  grid_inverse_cell_size_ = 1 / cell_size;
+  grid_cols_ = static_cast<size_t>(width / cell_size) + 1;
+  grid_rows_ = static_cast<size_t>(height / cell_size) + 1;
+  size_t cell_num = grid_cols_ * grid_rows_;
+  AOI_STATS_ADD(stats_, grid_cells, cell_num);
+
+  while (chunk_counts_.size() < chunk_num) {
+    chunk_counts_.emplace_back(Uint32List::allocator_type(resource_));
+  }
+  cell_ids_.resize(player_num);
+
+  // 第一遍：每段各自数每个格子里有几个玩家
+  _ForEachChunk(chunk_num, [this, cell_num](size_t chunk, size_t begin, size_t end) {
+    auto &counts = chunk_counts_[chunk];
+    counts.assign(cell_num, 0);
+    for (size_t i = begin; i < end; ++i) {
+      size_t cell = GetCell(xs_[i], zs_[i]);
+      cell_ids_[i] = cell;
+      ++counts[cell];
+    }
+  });
+
+  // 前缀和按格子、再按段排，段内保持原来的顺序，和不分段时排出来的结果一样
+  cell_start_.resize(cell_num + 1);
+  Uint32 offset = 0;
+  for (size_t cell = 0; cell < cell_num; ++cell) {
+    cell_start_[cell] = offset;
+    for (size_t chunk = 0; chunk < chunk_num; ++chunk) {
+      Uint32 count = chunk_counts_[chunk][cell];
+      chunk_counts_[chunk][cell] = offset;
+      offset += count;
+    }
+  }
+  cell_start_[cell_num] = offset;
+
+  // 第二遍：每段把自己的玩家写到各个格子里属于这一段的位置
+  sorted_players_.resize(player_num);
+  sorted_xs_.resize(player_num);
+  sorted_zs_.resize(player_num);
+  sorted_categories_.resize(player_num);
+  _ForEachChunk(chunk_num, [this](size_t chunk, size_t begin, size_t end) {
+    auto &positions = chunk_counts_[chunk];
+    for (size_t i = begin; i < end; ++i) {
+      Uint32 pos = positions[cell_ids_[i]]++;
+      sorted_players_[pos] = players_[i];
+      sorted_xs_[pos] = xs_[i];
+      sorted_zs_[pos] = zs_[i];
+      sorted_categories_[pos] = categories_[i];
+    }
+  });
+}
+
+
+AoiUpdateInfos SortedGridAoi::Tick() {
+  if (trace_writer_) trace_writer_->Tick();
+  if (static_index_.IsDirty()) static_index_.Build(cell_size_);
+  _BuildGrid();
+
+  // 按快照的顺序处理，相邻的 sensor 查找的格子也相邻
+  AoiUpdateInfos update_infos;
+  for (auto pptr : sorted_players_) {
+    if (pptr->sensors.empty()) continue;
+
+    auto update_info = _UpdatePlayerAoi(pptr);
+    if (!update_info.sensor_update_list.empty()) {
+      update_infos.emplace(update_info.nuid, std::move(update_info));
+    }
+  }
+
+  // 移除之后又加回来的玩家不删
+  for (auto pptr : remove_list_) {
+    pptr->UnsetFlag_PendingErase();
+    if (pptr->GetFlag_Removed()) _ErasePlayer(pptr);
+  }
+  remove_list_.clear();
+  for (auto pptr : players_) {
+    pptr->last_pos = pptr->pos;
+    pptr->last_category = pptr->category;
+    pptr->UnsetFlag_New();
+  }
+
+  cur_aoi_map_idx_ = 1 - cur_aoi_map_idx_;
+  graveyard_.Release(tick_count_++);
+  tick_stats_ = stats_;
+  stats_ = AoiStats();
+  return update_infos;
+}
+
+
+void SortedGridAoi::_ErasePlayer(PlayerAoi *pptr) {
+  auto piter = player_map_.find(pptr->nuid);
+  // 低频 sensor 最多再过 max_interval 次 Tick 就会重新计算，不再引用这个玩家
+  Uint32 max_interval = interval_schedule_.GetMaxInterval();
+  if (max_interval > 1) {
+    graveyard_.Bury(std::move(piter->second), tick_count_ + max_interval);
+  }
+  player_map_.erase(piter);
+}
+
+
+AoiUpdateInfo SortedGridAoi::_UpdatePlayerAoi(PlayerAoi *pptr) {
+  AoiUpdateInfo aoi_update_info;
+  aoi_update_info.nuid = pptr->nuid;
+  Uint32 new_aoi_map_idx = 1 - cur_aoi_map_idx_;
+
+  for (auto &sensor : pptr->sensors) {
+    auto &old_aoi = sensor.aoi_players[cur_aoi_map_idx_];
+    auto &new_aoi = sensor.aoi_players[new_aoi_map_idx];
+    if (!sensor.IsDue(tick_count_)) {
+      // 没到计算的时候，上一次的列表原样留给下一次
+      std::swap(old_aoi, new_aoi);
+      AOI_STATS_INC(stats_, sensors_skipped);
+      continue;
+    }
+    if (sensor.max_visible > 0) {
+      nearest_.Reset(pptr->pos.x, pptr->pos.z, sensor.max_visible, &old_aoi);
+    }
+    _CalcAoiPlayers(*pptr, sensor, &new_aoi);
+    bool need_diff = sensor.NeedDiff();
+    // 用 last_pos 算进出时，离开半径内的旧玩家由 _CheckLeave 加回新的列表，不用排序
+    if (need_diff && sensor.leave_radius > sensor.radius) {
+      KeepIncumbents(pptr->pos, sensor.leave_radius_square, sensor.interest, &old_aoi, &new_aoi);
+    }
+    KeepNearest(pptr->pos, sensor.max_visible, &old_aoi, &new_aoi);
+
+    SensorUpdateInfo update_info;
+    auto &enters = update_info.enters;
+    auto &leaves = update_info.leaves;
+    if (need_diff) {
+      DiffAoiPlayers(&old_aoi, &new_aoi, &enters, &leaves);
+    } else {
+      // 先算 enter，这时新的列表里只有半径内的玩家
+      _CheckEnter(*pptr, sensor, new_aoi, &old_aoi, &enters);
+      _CheckLeave(*pptr, sensor, old_aoi, &new_aoi, &leaves);
+    }
+    if (sensor.interest & kDefaultCategory) {
+      sensor.static_aoi.Update(static_index_, pptr->pos.x, pptr->pos.z, sensor.radius,
+                               &enters, &leaves);
+    } else {
+      sensor.static_aoi.Clear(&leaves);
+    }
+    sensor.UnsetFlag_New();
+    sensor.UnsetFlag_Diff();
+    AOI_STATS_ADD(stats_, enters, enters.size());
+    AOI_STATS_ADD(stats_, leaves, leaves.size());
+
+    if (enters.empty() && leaves.empty()) continue;
+
+    update_info.sensor_id = sensor.sensor_id;
+    aoi_update_info.sensor_update_list.push_back(std::move(update_info));
+  }
+
+  return aoi_update_info;
+}
+
+
+void SortedGridAoi::_CalcAoiPlayers(const PlayerAoi &player, const Sensor &sensor,
+                                    PlayerPtrList *aoi_players) {
+  aoi_players->clear();
+  float pos_x = player.pos.x;
+  float pos_z = player.pos.z;
+  float radius = sensor.radius;
+  float radius_square = sensor.radius_square;
+  Uint32 interest = sensor.interest;
+  bool capped = sensor.max_visible > 0;
+
+  size_t min_col = ToCell(pos_x - radius - grid_min_x_, grid_inverse_cell_size_, grid_cols_);
+  size_t max_col = ToCell(pos_x + radius - grid_min_x_, grid_inverse_cell_size_, grid_cols_);
+  size_t min_row = ToCell(pos_z - radius - grid_min_z_, grid_inverse_cell_size_, grid_rows_);
+  size_t max_row = ToCell(pos_z + radius - grid_min_z_, grid_inverse_cell_size_, grid_rows_);
+
+  // 同一行里相邻的格子在快照里也是连续的，一行只扫一段
+  const float *xs = sorted_xs_.data();
+  const float *zs = sorted_zs_.data();
+  const Uint32 *categories = sorted_categories_.data();
+  PlayerAoi * const *players = sorted_players_.data();
+  for (size_t row = min_row; row <= max_row; ++row) {
+    Uint32 begin = cell_start_[row * grid_cols_ + min_col];
+    Uint32 end = cell_start_[row * grid_cols_ + max_col + 1];
+    AOI_STATS_ADD(stats_, cells_visited, max_col - min_col + 1);
+    AOI_STATS_ADD(stats_, candidates_scanned, end - begin);
+    for (Uint32 i = begin; i < end; ++i) {
+      float dx = xs[i] - pos_x;
+      float dz = zs[i] - pos_z;
+      if (dx * dx + dz * dz < radius_square && (categories[i] & interest) &&
+          players[i] != &player) {
+        if (capped) {
+          nearest_.Offer(players[i]);
+        } else {
+          aoi_players->push_back(players[i]);
+        }
+      }
+    }
+  }
+  if (capped) nearest_.Finish(aoi_players);
+  AOI_STATS_ADD(stats_, candidates_accepted, aoi_players->size());
+}
+
+
+void SortedGridAoi::_CheckLeave(const PlayerAoi &player, const Sensor &sensor,
+                                const PlayerPtrList &aoi_players, PlayerPtrList *new_players,
+                                PlayerNuids *leaves) {
+  float pos_x = player.pos.x;
+  float pos_z = player.pos.z;
+  float radius_square = sensor.radius_square;
+  float leave_radius_square = sensor.leave_radius_square;
+  Uint32 interest = sensor.interest;
+  for (auto old_player_ptr : aoi_players) {
+    float dx = old_player_ptr->pos.x - pos_x;
+    float dz = old_player_ptr->pos.z - pos_z;
+    float dist_square = dx * dx + dz * dz;
+    // 改成了不感兴趣的 category，不管距离都离开
+    if (old_player_ptr->GetFlag_Removed() || !(old_player_ptr->category & interest)) {
+      leaves->push_back(old_player_ptr->nuid);
+    } else if (dist_square >= radius_square) {
+      // 出了进入半径、还在离开半径内的继续看到
+      if (dist_square < leave_radius_square) {
+        new_players->push_back(old_player_ptr);
+      } else {
+        leaves->push_back(old_player_ptr->nuid);
+      }
+    }
+  }
+}
+
+
+void SortedGridAoi::_CheckEnter(const PlayerAoi &player, const Sensor &sensor,
+                                const PlayerPtrList &aoi_players, PlayerPtrList *old_players,
+                                PlayerNuids *enters) {
+  if (player.GetFlag_New() || sensor.GetFlag_New()) {
+    enters->reserve(aoi_players.size());
+    for (auto new_player_ptr : aoi_players) {
+      enters->push_back(new_player_ptr->nuid);
+    }
+    return;
+  }
+
+  // 上一次 Tick 时不在半径内或者 category 不感兴趣的就是新进来的，除非是离开半径内留下来的旧玩家
+  float pos_x = player.last_pos.x;
+  float pos_z = player.last_pos.z;
+  float radius_square = sensor.radius_square;
+  float leave_radius_square = sensor.leave_radius_square;
+  Uint32 interest = sensor.interest;
+  IncumbentLookup<PlayerPtrList> incumbents(old_players);
+  for (auto new_player_ptr : aoi_players) {
+    if (!(new_player_ptr->last_category & interest)) {
+      enters->push_back(new_player_ptr->nuid);
+      continue;
+    }
+    float dx = new_player_ptr->last_pos.x - pos_x;
+    float dz = new_player_ptr->last_pos.z - pos_z;
+    float dist_square = dx * dx + dz * dz;
+    if (dist_square < radius_square) continue;
+    if (dist_square < leave_radius_square && incumbents.Contains(new_player_ptr)) continue;
+    enters->push_back(new_player_ptr->nuid);
+  }
+}
+
+
+MemoryUsage SortedGridAoi::GetMemoryUsage() const {
+  MemoryUsage usage;
+  usage.player_map = HashMapBytes(player_map_) + VectorBytes(players_) + VectorBytes(remove_list_);
+  usage.static_entities = static_index_.MemoryBytes();
+  usage.cells = VectorBytes(xs_) + VectorBytes(zs_) + VectorBytes(categories_)
+                + VectorBytes(cell_start_) + VectorBytes(cell_ids_)
+                + VectorBytes(sorted_players_) + VectorBytes(sorted_xs_)
+                + VectorBytes(sorted_zs_) + VectorBytes(sorted_categories_);
+  for (const auto &counts : chunk_counts_) {
+    usage.cells += VectorBytes(counts);
+  }
+
+  for (const auto &elem : player_map_) {
+    const auto &player = *elem.second;
+    usage.players += sizeof(PlayerAoi);
+    usage.sensors += VectorBytes(player.sensors);
+    for (const auto &sensor : player.sensors) {
+      usage.aoi_lists += VectorBytes(sensor.aoi_players[0]) + VectorBytes(sensor.aoi_players[1]);
+      usage.static_entities += VectorBytes(sensor.static_aoi.nuids);
+    }
+  }
+  return usage;
+}
+
+}  // namespace sorted_grid
+
+}  // namespace aoi
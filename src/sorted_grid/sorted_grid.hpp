@@ -0,0 +1,269 @@
+// Copyright <disenone>
+#pragma once
+
+#include <limits>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+
+#include "common/base_types.hpp"
+#include "common/memory_resource.hpp"
+#include "common/memory_usage.hpp"
+#include "common/sensor_interval.hpp"
+#include "common/static_index.hpp"
+#include "common/stats.hpp"
+#include "common/visible_cap.hpp"
+
+namespace aoi {
+
+class ThreadPool;
+class TraceWriter;
+
+namespace sorted_grid {
+
+// 每次 Tick 重建格子的 aoi：UpdatePos 只写位置，不维护格子；Tick 开始时对扁平的坐标数组做一次
+// 计数排序（玩家多时分段并行），得到按格子连续存放的坐标快照，sensor 查找时一行格子就是一段
+// 连续的数组。移动的玩家越多，省掉的增量维护越多。
+// 进出事件的算法和 squares 一样：平时用 last_pos 判断，参数变化时用前后两次 aoi 集合的差。
+// Grid rebuilt every Tick with a (parallel) counting sort over a flat position array.
+
+class PlayerAoi;
+typedef std::unordered_map<Nuid, std::shared_ptr<PlayerAoi>, std::hash<Nuid>, std::equal_to<Nuid>,
+                           ResourceAllocator<std::pair<const Nuid, std::shared_ptr<PlayerAoi>>>>
+    PlayerMap;
+typedef std::vector<Nuid> PlayerNuids;
+typedef std::vector<PlayerAoi*, ResourceAllocator<PlayerAoi*>> PlayerPtrList;
+typedef std::vector<float, ResourceAllocator<float>> FloatList;
+typedef std::vector<Uint32, ResourceAllocator<Uint32>> Uint32List;
+constexpr Uint32 kInvalidIndex = static_cast<Uint32>(-1);
+
+#define AOI_FLOAT_MAX std::numeric_limits<float>::max()
+#undef AOI_INF_POS
+#define AOI_INF_POS AOI_FLOAT_MAX, AOI_FLOAT_MAX, AOI_FLOAT_MAX
+
+
+struct Pos {
+  Pos(float _x, float _y, float _z)
+      : x(_x), y(_y), z(_z) {}
+
+  void Set(float _x, float _y, float _z) {
+    x = _x;
+    y = _y;
+    z = _z;
+  }
+
+  float x, y, z;
+};
+
+
+struct Sensor {
+  Sensor(Nuid _sensor_id, float _radius, MemoryResource *resource = nullptr)
+      : sensor_id(_sensor_id), radius(_radius), radius_square(_radius * _radius),
+        leave_radius(_radius), leave_radius_square(_radius * _radius), flags(0),
+        aoi_players{PlayerPtrList(ResourceAllocator<PlayerAoi*>(resource)),
+                    PlayerPtrList(ResourceAllocator<PlayerAoi*>(resource))} {
+    SetFlag_New();
+  }
+
+  // 新加的 sensor 不管间隔，下次 Tick 马上计算
+  AOI_CLASS_ADD_FLAG(New, 0, flags);
+  // 参数变了，下次 Tick 马上计算，用集合差算进出
+  AOI_CLASS_ADD_FLAG(Diff, 1, flags);
+
+  // 只看到最近的几个玩家，或者上一次计算时的 last_pos 已经对不上
+  bool NeedDiff() const {
+    return max_visible > 0 || interval > 1 || GetFlag_Diff();
+  }
+  bool IsDue(Uint64 tick) const {
+    return GetFlag_New() || GetFlag_Diff() || IntervalSchedule::IsDue(tick, interval, phase);
+  }
+
+  Nuid sensor_id;
+  float radius;               // 进入半径
+  float radius_square;
+  float leave_radius;         // 离开半径，不小于 radius
+  float leave_radius_square;
+  Uint32 flags;
+  Uint32 max_visible = 0;     // 最多看到几个玩家，0 不限制
+  Uint32 interval = 1;        // 每隔几次 Tick 计算一次
+  Uint32 phase = 0;
+  Uint32 interest = kAllCategories;   // 只看 category 和它有交集的玩家
+  PlayerPtrList aoi_players[2];
+  StaticAoi static_aoi;       // 看到的静态实体
+};
+
+
+struct PlayerAoi {
+  PlayerAoi(Uint64 _nuid, float _x, float _y, float _z, MemoryResource *resource = nullptr)
+      : nuid(_nuid), pos(_x, _y, _z), flags(0), last_pos(AOI_INF_POS),
+        sensors(ResourceAllocator<Sensor>(resource)) {}
+
+  AOI_CLASS_ADD_FLAG(Removed, 0, flags);
+  AOI_CLASS_ADD_FLAG(New, 1, flags);
+  // 已经放进 remove_list_，Tick 结束时检查要不要真正删除
+  AOI_CLASS_ADD_FLAG(PendingErase, 2, flags);
+
+  Nuid nuid;
+  Pos pos;
+  Uint32 flags;
+  Uint32 category = kDefaultCategory;
+  Pos last_pos;                     // 上一次 Tick 结束时的位置
+  Uint32 last_category = kDefaultCategory;
+  Uint32 index = kInvalidIndex;     // 在扁平数组里的下标，移除之后为 kInvalidIndex
+  std::vector<Sensor, ResourceAllocator<Sensor>> sensors;
+};
+
+
+struct SensorUpdateInfo {
+  Nuid sensor_id;
+  PlayerNuids enters;
+  PlayerNuids leaves;
+};
+
+
+struct AoiUpdateInfo {
+  Nuid nuid;
+  std::vector<SensorUpdateInfo> sensor_update_list;
+};
+
+typedef std::unordered_map<Nuid, AoiUpdateInfo> AoiUpdateInfos;
+
+
+// 只有定义了 AOI_ENABLE_STATS 才会计数
+struct AoiStats {
+  Uint64 grid_cells = 0;            // 这次 Tick 重建的格子数
+  Uint64 sort_chunks = 0;           // 计数排序分成几段，大于 1 时是并行的
+  Uint64 cells_visited = 0;         // sensor 查找到的格子数
+  Uint64 candidates_scanned = 0;    // 格子里检查过的玩家数
+  Uint64 candidates_accepted = 0;   // 在半径内的玩家数
+  Uint64 enters = 0;
+  Uint64 leaves = 0;
+  Uint64 sensors_skipped = 0;       // 没到计算间隔跳过的 sensor 数
+};
+
+
+class SortedGridAoi {
+ public:
+  // cell_size 是希望的格子边长，玩家很分散时会放大，让格子数不超过玩家数的 kMaxCellsPerPlayer 倍。
+  // thread_num 为 0 时使用 hardware_concurrency，为 1 时不开线程。
+  // 并行的部分只写 Tick 之前分配好的数组，resource 不用是线程安全的，要比 SortedGridAoi 活得久
+  explicit SortedGridAoi(float cell_size = 200, size_t thread_num = 0,
+                         MemoryResource *resource = nullptr);
+  ~SortedGridAoi();
+
+  void AddPlayer(Nuid nuid, float x, float y, float z);
+  void RemovePlayer(Nuid nuid);
+  void AddSensor(Nuid nuid, Nuid sensor_id, float radius);
+  // 只写位置，下次 Tick 重建格子
+  void UpdatePos(Nuid nuid, float x, float y, float z);
+  // 不会移动、也不会被移除的实体，不进格子，下次 Tick 时建成只读索引
+  void AddStaticEntity(Nuid nuid, float x, float y, float z);
+  // sensor 最多只看到最近的 max_visible 个玩家，0 不限制
+  void SetSensorMaxVisible(Nuid nuid, Nuid sensor_id, Uint32 max_visible);
+  // 已经看到的玩家走出 leave_radius 才离开，小于进入半径时按进入半径算
+  void SetSensorLeaveRadius(Nuid nuid, Nuid sensor_id, float leave_radius);
+  // sensor 每隔 interval 次 Tick 才计算一次（0 和 1 都是每次）
+  void SetSensorInterval(Nuid nuid, Nuid sensor_id, Uint32 interval);
+  // 玩家的 category 位掩码，默认 kDefaultCategory
+  void SetPlayerCategory(Nuid nuid, Uint32 category);
+  // sensor 只看 category 和 interest 有交集的玩家，默认 kAllCategories
+  void SetSensorInterest(Nuid nuid, Nuid sensor_id, Uint32 interest);
+  AoiUpdateInfos Tick();
+  const PlayerMap& GetPlayerMap() const {
+    return player_map_;
+  }
+  MemoryResource* GetMemoryResource() const {
+    return resource_;
+  }
+  // 上一次 Tick 用的格子边长和格子数
+  float GetCellSize() const {
+    return grid_cell_size_;
+  }
+  size_t GetCellNum() const {
+    return grid_cols_ * grid_rows_;
+  }
+  // 坐标在上一次 Tick 的网格里所在的格子，按行优先编号，超出网格的夹到边上
+  size_t GetCell(float x, float z) const;
+  // 上一次 Tick 的快照里第 cell 个格子的玩家
+  const PlayerAoi* const* GetCellPlayers(size_t cell, size_t *num) const {
+    *num = cell_start_[cell + 1] - cell_start_[cell];
+    return sorted_players_.data() + cell_start_[cell];
+  }
+  // 当前各类数据结构占用的内存，遍历所有玩家，不要每次 Tick 都调用
+  MemoryUsage GetMemoryUsage() const;
+  // 上一次 Tick 结束时统计的计数，包括这次 Tick 以及之前的 UpdatePos
+  const AoiStats& GetTickStats() const {
+    return tick_stats_;
+  }
+  // 记录之后的操作，writer 由调用者持有，传 nullptr 关闭记录
+  void SetTraceWriter(TraceWriter *writer) {
+    trace_writer_ = writer;
+  }
+
+  // 格子数最多是玩家数的几倍，太稀疏时放大格子，免得前缀和扫大量空格子
+  static constexpr size_t kMaxCellsPerPlayer = 2;
+  // 每段至少这么多玩家才并行，太少时线程同步比排序还慢
+  static constexpr size_t kMinPlayersPerChunk = 4096;
+
+ protected:
+  // 放进 / 拿出扁平数组，拿出时用最后一个玩家填空位
+  void _AddToArray(PlayerAoi *pptr);
+  void _RemoveFromArray(PlayerAoi *pptr);
+  // 算出包围所有玩家的网格，对扁平数组做计数排序，得到 cell_start_ 和 sorted_* 快照
+  void _BuildGrid();
+  // chunk_num 段并行执行 func(chunk, begin, end)，只有一段时在当前线程里执行
+  template <typename Func>
+  void _ForEachChunk(size_t chunk_num, Func func);
+  void _ErasePlayer(PlayerAoi *pptr);
+  AoiUpdateInfo _UpdatePlayerAoi(PlayerAoi *pptr);
+  void _CalcAoiPlayers(const PlayerAoi &player, const Sensor &sensor, PlayerPtrList *aoi_players);
+  // 出了进入半径、还在离开半径内的旧玩家不算离开，追加到 new_players
+  void _CheckLeave(const PlayerAoi &player, const Sensor &sensor,
+                   const PlayerPtrList &aoi_players, PlayerPtrList *new_players,
+                   PlayerNuids *leaves);
+  void _CheckEnter(const PlayerAoi &player, const Sensor &sensor,
+                   const PlayerPtrList &aoi_players, PlayerPtrList *old_players,
+                   PlayerNuids *enters);
+
+ protected:
+  float cell_size_;
+  MemoryResource *resource_;
+  std::unique_ptr<ThreadPool> pool_;      // thread_num 为 1 时为空
+  PlayerMap player_map_;
+
+  // 没有移除的玩家，下标和 PlayerAoi::index 对应。UpdatePos 只写这里和 PlayerAoi::pos
+  PlayerPtrList players_;
+  FloatList xs_;
+  FloatList zs_;
+  Uint32List categories_;
+  PlayerPtrList remove_list_;             // 调用过 RemovePlayer 的玩家
+  NearestSelector<PlayerAoi*> nearest_;   // 有 max_visible 的 sensor 查找时用
+
+  // 上一次 Tick 的快照：第 i 个格子的玩家是 sorted_*[cell_start_[i], cell_start_[i + 1])
+  float grid_min_x_ = 0;
+  float grid_min_z_ = 0;
+  float grid_cell_size_ = 0;
+  float grid_inverse_cell_size_ = 0;
+  size_t grid_cols_ = 0;
+  size_t grid_rows_ = 0;
+  Uint32List cell_start_;
+  Uint32List cell_ids_;                   // 每个玩家所在的格子，和 players_ 对应
+  std::vector<Uint32List> chunk_counts_;  // 每段在每个格子里的玩家数，前缀和之后是写入位置
+  PlayerPtrList sorted_players_;
+  FloatList sorted_xs_;
+  FloatList sorted_zs_;
+  Uint32List sorted_categories_;
+
+  Uint32 cur_aoi_map_idx_ = 0;
+  TraceWriter *trace_writer_ = nullptr;
+  AoiStats stats_;
+  AoiStats tick_stats_;
+
+  Uint64 tick_count_ = 0;
+  IntervalSchedule interval_schedule_;
+  PlayerGraveyard<std::shared_ptr<PlayerAoi>> graveyard_;
+  StaticIndex static_index_;
+};
+
+}   // namespace sorted_grid
+}   // namespace aoi
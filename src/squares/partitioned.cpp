@@ -0,0 +1,243 @@
+// Copyright <disenone>
+
+#include "partitioned.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include "common/trace.hpp"
+
+namespace aoi { namespace squares {
+
+namespace {
+
+inline int FloorDiv(int a, int b) {
+  return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+inline int SquareX(SquareId square_id) {
+  return static_cast<int>(static_cast<Uint32>(square_id >> kSquareIdShift));
+}
+
+inline int SquareZ(SquareId square_id) {
+  return static_cast<int>(static_cast<Uint32>(square_id));
+}
+
+void AddStats(const AoiStats &from, AoiStats *to) {
+  to->cells_visited += from.cells_visited;
+  to->candidates_scanned += from.candidates_scanned;
+  to->candidates_accepted += from.candidates_accepted;
+  to->cell_migrations += from.cell_migrations;
+  to->enters += from.enters;
+  to->leaves += from.leaves;
+  to->sensors_skipped += from.sensors_skipped;
+}
+
+}  // namespace
+
+
+// 一个区域：layers_ 只有 category，没有格子；square_refs_ 引用 owner 里本区域的格子和 halo 格子，
+// player_map_ 为空。计算时只写 owned 玩家自己的 sensor，只读格子和其它玩家的位置，所以区域之间
+// 可以并行。
+class RegionAoi : public SquareAoi {
+ public:
+  explicit RegionAoi(float square_size)
+      : SquareAoi(square_size) {}
+
+  void Clear(const PartitionedAoi &owner) {
+    diff_aoi_ = owner.diff_aoi_;
+    tick_count_ = owner.tick_count_;
+    static_index_ = owner.static_index_;
+    quantized_ = owner.quantized_;
+    resolution_ = owner.resolution_;
+    inverse_resolution_ = owner.inverse_resolution_;
+    // 层只增不减，和 owner 的层一一对应
+    for (size_t i = 0; i < owner.layers_.size(); ++i) {
+      if (i == layers_.size()) layers_.emplace_back(owner.layers_[i].category);
+    }
+    square_refs_.resize(layers_.size());
+    for (auto &refs : square_refs_) {
+      refs.clear();
+    }
+    owned.clear();
+    update_infos.clear();
+    stats_ = AoiStats();
+    histograms_enabled_ = owner.histograms_enabled_;
+    histograms_.Clear();
+    histogram_enters_ = 0;
+    histogram_leaves_ = 0;
+    phase_cycles_ = PhaseCycles();
+  }
+
+  void AddSquare(Uint32 layer, SquareId square_id, const Square &square) {
+    square_refs_[layer].emplace(square_id, &square);
+  }
+
+  size_t SquareRefsBytes() const {
+    size_t bytes = VectorBytes(square_refs_);
+    for (const auto &refs : square_refs_) {
+      bytes += HashMapBytes(refs);
+    }
+    return bytes;
+  }
+
+  void TickOwned(Uint32 cur_aoi_map_idx) {
+    for (auto pptr : owned) {
+      auto update_info = _UpdatePlayerAoi(cur_aoi_map_idx, pptr);
+      if (!update_info.sensor_update_list.empty()) {
+        update_infos.emplace(update_info.nuid, std::move(update_info));
+      }
+    }
+  }
+
+  const AoiStats& GetStats() const {
+    return stats_;
+  }
+  const PhaseCycles& GetPhaseCycles() const {
+    return phase_cycles_;
+  }
+
+  // 这个区域统计的直方图和进出事件数加到 owner 上，格子人数由 owner 统计
+  void MergeHistograms(PartitionedAoi *owner) const {
+    owner->histograms_.Merge(histograms_);
+    owner->histogram_enters_ += histogram_enters_;
+    owner->histogram_leaves_ += histogram_leaves_;
+  }
+
+  PlayerPtrList owned;
+  AoiUpdateInfos update_infos;
+};
+
+
+PartitionedAoi::PartitionedAoi(float square_size /*= 200*/, float region_size /*= 2000*/,
+                               size_t thread_num /*= 0*/, MemoryResource *resource /*= nullptr*/)
+    : SquareAoi(square_size, resource),
+      region_squares_(std::max(1, static_cast<int>(std::ceil(region_size / square_size)))),
+      pool_(thread_num) {
+}
+
+
+PartitionedAoi::~PartitionedAoi() {
+}
+
+
+void PartitionedAoi::_BuildRegions(PlayerPtrList *remove_list) {
+  for (auto &elem : regions_) {
+    elem.second->Clear(*this);
+  }
+
+  // 有 sensor 的玩家分到所在格子的区域
+  float max_radius = 0;
+  for (auto &elem : player_map_) {
+    auto &player = *elem.second;
+    if (player.GetFlag_Removed()) {
+      remove_list->push_back(&player);
+      continue;
+    }
+    if (player.sensors.empty()) continue;
+
+    for (const auto &sensor : player.sensors) {
+      max_radius = std::max(max_radius, sensor.radius);
+    }
+    auto region_id = GenSquareId(FloorDiv(SquareX(player.square_id), region_squares_),
+                                 FloorDiv(SquareZ(player.square_id), region_squares_));
+    auto &region = regions_[region_id];
+    if (!region) {
+      region.reset(new RegionAoi(square_size_));
+      region->Clear(*this);
+    }
+    region->owned.push_back(&player);
+  }
+
+  for (auto iter = regions_.begin(); iter != regions_.end();) {
+    if (iter->second->owned.empty()) {
+      iter = regions_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+
+  // 格子加到距离 halo 个格子以内的所有区域。多算一个格子，避免浮点误差让边界上的查找越过 halo
+  int halo = static_cast<int>(max_radius * inverse_square_size_) + 1;
+  for (Uint32 layer = 0; layer < layers_.size(); ++layer) {
+    for (const auto &elem : layers_[layer].squares) {
+      if (elem.second.empty()) continue;
+
+      int xi = SquareX(elem.first);
+      int zi = SquareZ(elem.first);
+      int max_rx = FloorDiv(xi + halo, region_squares_);
+      int max_rz = FloorDiv(zi + halo, region_squares_);
+      for (int rx = FloorDiv(xi - halo, region_squares_); rx <= max_rx; ++rx) {
+        for (int rz = FloorDiv(zi - halo, region_squares_); rz <= max_rz; ++rz) {
+          auto region_iter = regions_.find(GenSquareId(rx, rz));
+          if (region_iter != regions_.end()) {
+            region_iter->second->AddSquare(layer, elem.first, elem.second);
+          }
+        }
+      }
+    }
+  }
+}
+
+
+AoiUpdateInfos PartitionedAoi::Tick() {
+  // 先把没跑完的分片 Tick 跑完
+  if (slicing_) return SquareAoi::Tick();
+
+  if (trace_writer_) trace_writer_->Tick();
+  _BuildStaticIndex();
+
+  PlayerPtrList remove_list;
+  _BuildRegions(&remove_list);
+
+  // 玩家多的区域先提交，空闲的 worker 再偷剩下的
+  std::vector<RegionAoi*> order;
+  order.reserve(regions_.size());
+  for (auto &elem : regions_) {
+    order.push_back(elem.second.get());
+  }
+  std::sort(order.begin(), order.end(), [](const RegionAoi *left, const RegionAoi *right) {
+    return left->owned.size() > right->owned.size();
+  });
+
+  Uint32 cur_aoi_map_idx = cur_aoi_map_idx_;
+  for (size_t i = 0; i < order.size(); ++i) {
+    auto region = order[i];
+    pool_.Submit(i, [region, cur_aoi_map_idx] { region->TickOwned(cur_aoi_map_idx); });
+  }
+  pool_.Wait();
+
+  AoiUpdateInfos update_infos;
+  for (auto region : order) {
+    for (auto &elem : region->update_infos) {
+      update_infos.emplace(elem.first, std::move(elem.second));
+    }
+    if (kAoiStatsEnabled) AddStats(region->GetStats(), &stats_);
+    if (histograms_enabled_) region->MergeHistograms(this);
+    if (kAoiPhaseTimerEnabled) phase_cycles_.Merge(region->GetPhaseCycles());
+  }
+
+  // 计算过程中不能改其它区域可能读到的 flags，等全部算完再清掉 New
+  for (auto &elem : player_map_) {
+    elem.second->UnsetFlag_New();
+  }
+
+  _EndTick(remove_list);
+  return update_infos;
+}
+
+
+MemoryUsage PartitionedAoi::GetMemoryUsage() const {
+  auto usage = SquareAoi::GetMemoryUsage();
+  usage.cells += HashMapBytes(regions_);
+  for (const auto &elem : regions_) {
+    // 区域的 player_map_ 为空，静态索引和 owner 共用，只算格子的引用
+    usage.cells += sizeof(RegionAoi) + elem.second->SquareRefsBytes();
+  }
+  return usage;
+}
+
+}  // namespace squares
+}  // namespace aoi
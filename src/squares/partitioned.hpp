@@ -0,0 +1,48 @@
+// Copyright <disenone>
+#pragma once
+
+#include <memory>
+#include <unordered_map>
+
+#include "common/thread_pool.hpp"
+#include "squares/squares.hpp"
+
+namespace aoi { namespace squares {
+
+class RegionAoi;
+
+// 单个大地图的并行九宫格：格子按 region_size 划分成区域，每个区域负责计算区域内玩家的 aoi，
+// Tick 时所有区域在线程池里并行计算。离区域边界不超过最大 sensor 半径的格子会作为只读的 halo
+// 加到相邻区域（只是引用，不复制格子），区域内只读自己的格子和 halo，合并后的结果和
+// SquareAoi::Tick 完全一致。
+// Grid split into spatial regions ticked in parallel. Cells within the largest sensor radius of
+// a region border are referenced read-only by the neighbour as halo cells.
+class PartitionedAoi : public SquareAoi {
+ public:
+  // region_size 会向上取整到 square_size 的整数倍，thread_num 为 0 时使用 hardware_concurrency。
+  // 区域引用格子的表每次 Tick 都重建，总是用普通堆，不占 resource
+  explicit PartitionedAoi(float square_size = 200, float region_size = 2000,
+                          size_t thread_num = 0, MemoryResource *resource = nullptr);
+  ~PartitionedAoi();
+
+  AoiUpdateInfos Tick();
+  // 在 SquareAoi 的基础上加上各个区域引用格子的表
+  MemoryUsage GetMemoryUsage() const;
+  // 上一次 Tick 参与计算的区域数
+  size_t GetRegionNum() const {
+    return regions_.size();
+  }
+
+ protected:
+  friend class RegionAoi;
+
+  void _BuildRegions(PlayerPtrList *remove_list);
+
+ protected:
+  int region_squares_;    // 区域边长是多少个格子
+  ThreadPool pool_;
+  std::unordered_map<SquareId, std::unique_ptr<RegionAoi>> regions_;
+};
+
+}   // namespace squares
+}   // namespace aoi
@@ -4,6 +4,7 @@
 
 #include <immintrin.h>
 #include <algorithm>
+#include <chrono>
 #include <utility>
 #include <limits>
 #include <cassert>
@@ -11,6 +12,9 @@
 
 #include <boost/timer/timer.hpp>
 
+#include "common/aoi_diff.hpp"
+#include "common/trace.hpp"
+
 namespace aoi { namespace squares {
 
 
@@ -25,10 +29,11 @@ namespace aoi { namespace squares {
   if (dx * dx + dz * dz <= radius_square) \
 
 
+// 和 _CalcAoiPlayers 的 "< radius_square" 互补，正好在半径上的玩家不在列表里，也要算离开
 #define IfNotInXZRadiusSquare(dx, dz, x0, z0, x1, z1, radius_square) \
   dx = x0 - x1; \
   dz = z0 - z1; \
-  if (dx * dx + dz * dz > radius_square) \
+  if (dx * dx + dz * dz >= radius_square) \
 
 
 BOOST_FORCEINLINE float CalcAoiDistSquare(const Pos &a, const Pos &b) {
@@ -38,12 +43,59 @@ BOOST_FORCEINLINE float CalcAoiDistSquare(const Pos &a, const Pos &b) {
 }
 
 
-SquareAoi::SquareAoi(float square_size /*= 200*/)
+SquareAoi::SquareAoi(float square_size /*= 200*/, MemoryResource *resource /*= nullptr*/)
     : square_size_(square_size),
       inverse_square_size_(1 / square_size),
-      cur_aoi_map_idx_(0) {
+      cur_aoi_map_idx_(0),
+      resource_(resource),
+      player_map_(PlayerMap::allocator_type(resource)),
+      tick_order_(PlayerPtrList::allocator_type(resource)),
+      static_index_(std::make_shared<StaticIndex>()) {
   player_map_.reserve(100);
-  squares_.reserve(100);
+  layers_.emplace_back(kDefaultCategory, resource_);
+  layers_[0].squares.reserve(100);
+}
+
+
+void SquareAoi::EnableQuantization(float resolution /*= 0.25f*/) {
+  int exponent;
+  if (!player_map_.empty() || resolution <= 0 || std::frexp(resolution, &exponent) != 0.5f) return;
+  quantized_ = true;
+  resolution_ = resolution;
+  inverse_resolution_ = 1 / resolution;
+}
+
+
+SquareList SquareAoi::GetSquares() const {
+  SquareList squares{SquareList::allocator_type(resource_)};
+  for (const auto &layer : layers_) {
+    for (const auto &pair : layer.squares) {
+      auto it = squares.emplace(pair.first, Square(resource_)).first;
+      Square &square = it->second;
+      square.players.insert(square.players.end(), pair.second.players.begin(), pair.second.players.end());
+      square.xs.insert(square.xs.end(), pair.second.xs.begin(), pair.second.xs.end());
+      square.zs.insert(square.zs.end(), pair.second.zs.begin(), pair.second.zs.end());
+    }
+  }
+  return squares;
+}
+
+
+const SquareList& SquareAoi::GetLayerSquares(Uint32 category) const {
+  static const SquareList empty;
+  for (const auto &layer : layers_) {
+    if (layer.category == category) return layer.squares;
+  }
+  return empty;
+}
+
+
+Uint32 SquareAoi::_GetLayer(Uint32 category) {
+  for (Uint32 i = 0; i < layers_.size(); ++i) {
+    if (layers_[i].category == category) return i;
+  }
+  layers_.emplace_back(category, resource_);
+  return layers_.size() - 1;
 }
 
 
@@ -52,13 +104,21 @@ void SquareAoi::_RemoveFromSquare(Nuid nuid, PlayerAoi* pptr) {
     return;
   }
   auto square_id = pptr->square_id;
-  auto square_ptr = squares_.find(square_id);
-  if (square_ptr != squares_.end()) {
+  auto &squares = layers_[pptr->layer].squares;
+  auto square_ptr = squares.find(square_id);
+  if (square_ptr != squares.end()) {
     auto &square = square_ptr->second;
-    auto &last = square[square.size() - 1];
-    auto &remove = square[pptr->square_index];
-    std::swap(remove, last);
-    square.pop_back();
+    auto index = pptr->square_index;
+    auto &players = square.players;
+    players.back()->square_index = index;
+    players[index] = players.back();
+    players.pop_back();
+    if (quantized_) {
+      square.xs[index] = square.xs.back();
+      square.xs.pop_back();
+      square.zs[index] = square.zs.back();
+      square.zs.pop_back();
+    }
   }
   pptr->square_index = -1;
 }
@@ -66,26 +126,44 @@ void SquareAoi::_RemoveFromSquare(Nuid nuid, PlayerAoi* pptr) {
 
 void SquareAoi::_AddToSquare(Nuid nuid, PlayerAoi* pptr) {
   auto square_id = PosToId(pptr->pos.x, pptr->pos.z, inverse_square_size_);
-  auto &square = squares_[square_id];
-  square.push_back(pptr);
+  auto &squares = layers_[pptr->layer].squares;
+  auto square_iter = squares.find(square_id);
+  if (square_iter == squares.end()) {
+    square_iter = squares.emplace(square_id, Square(resource_)).first;
+  }
+  auto &square = square_iter->second;
+  square.players.push_back(pptr);
+  if (quantized_) {
+    square.xs.push_back(_ToQuantized(pptr->pos.x));
+    square.zs.push_back(_ToQuantized(pptr->pos.z));
+  }
   pptr->square_id = square_id;
   pptr->square_index = square.size() - 1;
 }
 
 
 void SquareAoi::AddPlayer(Nuid nuid, float x, float y, float z) {
+  if (trace_writer_) trace_writer_->AddPlayer(nuid, x, y, z);
+  _Quantize(&x, &z);
+
   auto piter = player_map_.find(nuid);
   PlayerAoi* pptr = nullptr;
 
   if (piter != player_map_.end()) {
     _RemoveFromSquare(nuid, piter->second.get());
     pptr = piter->second.get();
+    // 重新加入时放到新的位置上
+    pptr->pos.Set(x, y, z);
+    if (pptr->GetFlag_Removed()) pptr->SetFlag_Revived();
     pptr->UnsetFlag_Removed();
   } else {
-    auto ret = player_map_.emplace(nuid, new PlayerAoi(nuid, x, y, z));
+    auto ret = player_map_.emplace(nuid, std::allocate_shared<PlayerAoi>(
+        ResourceAllocator<PlayerAoi>(resource_), nuid, x, y, z, resource_));
     if (ret.second) {
       pptr = ret.first->second.get();
       pptr->SetFlag_New();
+      pptr->order_index = tick_order_.size();
+      tick_order_.push_back(pptr);
     } else {
       return;
     }
@@ -96,6 +174,8 @@ void SquareAoi::AddPlayer(Nuid nuid, float x, float y, float z) {
 
 
 void SquareAoi::RemovePlayer(Nuid nuid) {
+  if (trace_writer_) trace_writer_->RemovePlayer(nuid);
+
   auto piter = player_map_.find(nuid);
 
   if (piter != player_map_.end()) {
@@ -107,6 +187,8 @@ void SquareAoi::RemovePlayer(Nuid nuid) {
 
 
 void SquareAoi::AddSensor(Nuid nuid, Nuid sensor_id, float radius) {
+  if (trace_writer_) trace_writer_->AddSensor(nuid, sensor_id, radius);
+
   auto piter = player_map_.find(nuid);
 
   if (piter == player_map_.end())
@@ -117,11 +199,14 @@ void SquareAoi::AddSensor(Nuid nuid, Nuid sensor_id, float radius) {
     if (sensor.sensor_id == sensor_id)
       return;
   }
-  player.sensors.emplace_back(sensor_id, radius);
+  player.sensors.emplace_back(sensor_id, radius, resource_);
 }
 
 
 void SquareAoi::UpdatePos(Nuid nuid, float x, float y, float z) {
+  if (trace_writer_) trace_writer_->UpdatePos(nuid, x, y, z);
+  _Quantize(&x, &z);
+
   auto piter = player_map_.find(nuid);
 
   if (piter == player_map_.end())
@@ -133,22 +218,202 @@ void SquareAoi::UpdatePos(Nuid nuid, float x, float y, float z) {
     player.pos.x, player.pos.z, inverse_square_size_);
 
   if (old_square_id != new_square_id) {
+    AOI_STATS_INC(stats_, cell_migrations);
     _RemoveFromSquare(nuid, &player);
     player.pos.Set(x, y, z);
     _AddToSquare(nuid, &player);
   } else {
     player.pos.Set(x, y, z);
+    if (quantized_ && player.square_index >= 0) {
+      // 格子里的 int16 坐标也要跟着变
+      auto &square = layers_[player.layer].squares[player.square_id];
+      square.xs[player.square_index] = _ToQuantized(x);
+      square.zs[player.square_index] = _ToQuantized(z);
+    }
+  }
+}
+
+
+void SquareAoi::AddStaticEntity(Nuid nuid, float x, float y, float z) {
+  if (trace_writer_) trace_writer_->AddStaticEntity(nuid, x, y, z);
+  _Quantize(&x, &z);
+
+  static_index_->Add(nuid, x, z);
+}
+
+
+void SquareAoi::SetSensorMaxVisible(Nuid nuid, Nuid sensor_id, Uint32 max_visible) {
+  if (trace_writer_) trace_writer_->SetSensorMaxVisible(nuid, sensor_id, max_visible);
+
+  auto piter = player_map_.find(nuid);
+
+  if (piter == player_map_.end())
+    return;
+
+  for (auto& sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.max_visible = max_visible;
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+void SquareAoi::SetSensorLeaveRadius(Nuid nuid, Nuid sensor_id, float leave_radius) {
+  if (trace_writer_) trace_writer_->SetSensorLeaveRadius(nuid, sensor_id, leave_radius);
+
+  auto piter = player_map_.find(nuid);
+
+  if (piter == player_map_.end())
+    return;
+
+  for (auto& sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.leave_radius = std::max(leave_radius, sensor.radius);
+      sensor.leave_radius_square = sensor.leave_radius * sensor.leave_radius;
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+void SquareAoi::SetSensorInterval(Nuid nuid, Nuid sensor_id, Uint32 interval) {
+  if (trace_writer_) trace_writer_->SetSensorInterval(nuid, sensor_id, interval);
+
+  auto piter = player_map_.find(nuid);
+
+  if (piter == player_map_.end())
+    return;
+
+  for (auto& sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.interval = std::max<Uint32>(interval, 1);
+      sensor.phase = interval_schedule_.AllocPhase(sensor.interval);
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+void SquareAoi::SetPlayerCategory(Nuid nuid, Uint32 category) {
+  if (trace_writer_) trace_writer_->SetPlayerCategory(nuid, category);
+
+  auto piter = player_map_.find(nuid);
+
+  if (piter == player_map_.end())
+    return;
+
+  auto& player = *piter->second;
+  if (player.category == category)
+    return;
+
+  // 换到新的层；已经移除的玩家不在格子里，重新加入时再放进去
+  bool in_square = player.square_index >= 0;
+  _RemoveFromSquare(nuid, &player);
+  player.category = category;
+  player.layer = _GetLayer(category);
+  if (in_square) _AddToSquare(nuid, &player);
+  // 进出事件由 _CheckEnter、_CheckLeave 对比 last_category 算出，别的 sensor 不用集合差
+}
+
+
+void SquareAoi::SetSensorInterest(Nuid nuid, Nuid sensor_id, Uint32 interest) {
+  if (trace_writer_) trace_writer_->SetSensorInterest(nuid, sensor_id, interest);
+
+  auto piter = player_map_.find(nuid);
+
+  if (piter == player_map_.end())
+    return;
+
+  for (auto& sensor : piter->second->sensors) {
+    if (sensor.sensor_id == sensor_id) {
+      sensor.interest = interest;
+      sensor.SetFlag_Diff();
+      return;
+    }
+  }
+}
+
+
+void SquareAoi::ExportSnapshot(AoiSnapshot *snapshot) const {
+  snapshot->players.clear();
+  snapshot->static_entities.clear();
+  snapshot->tick_count = tick_count_;
+  snapshot->interval_schedule = interval_schedule_;
+  static_index_->ForEach([snapshot](Nuid nuid, float x, float z) {
+    snapshot->static_entities.push_back({nuid, x, z});
+  });
+
+  snapshot->players.reserve(player_map_.size());
+  for (const auto &elem : player_map_) {
+    const auto &player = *elem.second;
+    if (player.GetFlag_Removed()) continue;
+
+    snapshot->players.push_back({player.nuid, player.pos.x, player.pos.y, player.pos.z,
+                                 player.category, {}});
+    auto &sensors = snapshot->players.back().sensors;
+    for (const auto &sensor : player.sensors) {
+      sensors.push_back({sensor.sensor_id, sensor.radius, sensor.leave_radius, sensor.max_visible,
+                         sensor.interval, sensor.phase, sensor.interest, {},
+                         sensor.static_aoi.nuids});
+      auto &aoi_players = sensors.back().aoi_players;
+      for (auto other_ptr : sensor.aoi_players[cur_aoi_map_idx_]) {
+        aoi_players.push_back(other_ptr->nuid);
+      }
+    }
+  }
+}
+
+
+void SquareAoi::RestoreSensor(Nuid nuid, const SensorSnapshot &snapshot) {
+  auto piter = player_map_.find(nuid);
+  if (piter == player_map_.end()) return;
+
+  for (auto& sensor : piter->second->sensors) {
+    if (sensor.sensor_id != snapshot.sensor_id) continue;
+
+    auto &aoi_players = sensor.aoi_players[cur_aoi_map_idx_];
+    aoi_players.clear();
+    for (auto other_nuid : snapshot.aoi_players) {
+      auto other_iter = player_map_.find(other_nuid);
+      if (other_iter == player_map_.end() || other_iter->second->GetFlag_Removed()) continue;
+      aoi_players.push_back(other_iter->second.get());
+    }
+    // 版本号清零，下次 Tick 一定重新查询静态实体
+    sensor.static_aoi.nuids = snapshot.static_entities;
+    sensor.static_aoi.version = 0;
+    // 不是新加的 sensor，按原来的相位计算，没到时间的照样跳过；这次 Tick 整体用集合差算进出事件
+    sensor.phase = snapshot.phase;
+    sensor.UnsetFlag_New();
+    sensor.UnsetFlag_Diff();
+    diff_aoi_ = true;
+    return;
   }
 }
 
 
 AoiUpdateInfos SquareAoi::Tick() {
+  if (slicing_) {
+    AoiUpdateInfos update_infos;
+    TickSliced(TickBudget(), slice_mode_, &update_infos);
+    return update_infos;
+  }
+
+  if (trace_writer_) trace_writer_->Tick();
+  _BuildStaticIndex();
+  if (reorder_interval_ > 0 && tick_count_ % reorder_interval_ == 0) {
+    _ReorderPlayers();
+  }
+
   // 全量做一遍 aoi
   AoiUpdateInfos update_infos;
   PlayerPtrList remove_list;
 
-  for (auto& elem : player_map_) {
-    auto& player = *elem.second;
+  for (auto pptr : tick_order_) {
+    auto& player = *pptr;
     if (player.GetFlag_Removed()) {
       remove_list.push_back(&player);
       continue;
@@ -164,15 +429,224 @@ AoiUpdateInfos SquareAoi::Tick() {
     player.UnsetFlag_New();
   }
 
-  for (auto pptr : remove_list) {
-    player_map_.erase(pptr->nuid);
+  _EndTick(remove_list);
+  return update_infos;
+}
+
+
+void SquareAoi::_EndTick(const PlayerPtrList &remove_list) {
+  {
+    AOI_PHASE_SCOPE(phase_cycles_, kPhaseRemove);
+    for (auto pptr : remove_list) {
+      _ErasePlayer(pptr);
+    }
+  }
+  {
+    AOI_PHASE_SCOPE(phase_cycles_, kPhaseLastPos);
+    for (auto pptr : tick_order_) {
+      pptr->last_pos = pptr->pos;
+      pptr->last_category = pptr->category;
+    }
+  }
+  cur_aoi_map_idx_ = 1 - cur_aoi_map_idx_;
+  graveyard_.Release(tick_count_++);
+  diff_aoi_ = false;
+  tick_stats_ = stats_;
+  stats_ = AoiStats();
+  tick_phase_cycles_ = phase_cycles_;
+  phase_cycles_ = PhaseCycles();
+  if (histograms_enabled_) _EndTickHistograms();
+}
+
+
+void SquareAoi::_EndTickHistograms() {
+  for (const auto &layer : layers_) {
+    for (const auto &elem : layer.squares) {
+      if (!elem.second.empty()) histograms_.occupancy.Add(elem.second.size());
+    }
+  }
+  histograms_.enters.Add(histogram_enters_);
+  histograms_.leaves.Add(histogram_leaves_);
+  histogram_enters_ = 0;
+  histogram_leaves_ = 0;
+
+  tick_histograms_ = histograms_;
+  window_histograms_.Merge(histograms_);
+  histograms_.Clear();
+}
+
+
+void SquareAoi::_BuildStaticIndex() {
+  if (static_index_->IsDirty()) static_index_->Build(square_size_);
+}
+
+
+void SquareAoi::_ErasePlayer(PlayerAoi* pptr) {
+  auto last = tick_order_.back();
+  last->order_index = pptr->order_index;
+  tick_order_[pptr->order_index] = last;
+  tick_order_.pop_back();
+
+  auto piter = player_map_.find(pptr->nuid);
+  // 低频 sensor 最多再过 max_interval 次 Tick 就会重新计算，不再引用这个玩家
+  Uint32 max_interval = interval_schedule_.GetMaxInterval();
+  if (max_interval > 1) {
+    graveyard_.Bury(std::move(piter->second), tick_count_ + max_interval);
+  }
+  player_map_.erase(piter);
+}
+
+
+MemoryUsage SquareAoi::GetMemoryUsage() const {
+  MemoryUsage usage;
+  usage.player_map = HashMapBytes(player_map_) + VectorBytes(tick_order_);
+  usage.static_entities = static_index_->MemoryBytes();
+
+  for (const auto &elem : player_map_) {
+    const auto &player = *elem.second;
+    usage.players += sizeof(PlayerAoi);
+    usage.sensors += VectorBytes(player.sensors);
+    for (const auto &sensor : player.sensors) {
+      usage.aoi_lists += VectorBytes(sensor.aoi_players[0]) + VectorBytes(sensor.aoi_players[1]);
+      usage.static_entities += VectorBytes(sensor.static_aoi.nuids);
+    }
+  }
+
+  for (const auto &layer : layers_) {
+    usage.cells += sizeof(SquareLayer) + HashMapBytes(layer.squares);
+    for (const auto &elem : layer.squares) {
+      const auto &square = elem.second;
+      usage.cells += VectorBytes(square.players) + VectorBytes(square.xs) + VectorBytes(square.zs);
+    }
+  }
+  return usage;
+}
+
+
+void SquareAoi::_ReorderPlayers() {
+  std::vector<std::pair<Uint64, PlayerAoi*>> keys;
+  keys.reserve(tick_order_.size());
+  for (auto pptr : tick_order_) {
+    keys.emplace_back(MortonCode(CoordToId(pptr->pos.x, inverse_square_size_),
+                                 CoordToId(pptr->pos.z, inverse_square_size_)), pptr);
+  }
+  // 同一个格子里按 nuid 排，保证顺序确定
+  std::sort(keys.begin(), keys.end(),
+            [](const std::pair<Uint64, PlayerAoi*> &left,
+               const std::pair<Uint64, PlayerAoi*> &right) {
+              if (left.first != right.first) return left.first < right.first;
+              return left.second->nuid < right.second->nuid;
+            });
+  for (Uint32 i = 0; i < keys.size(); ++i) {
+    tick_order_[i] = keys[i].second;
+    tick_order_[i]->order_index = i;
+  }
+}
+
+
+bool SquareAoi::TickSliced(const TickBudget &budget, TickSliceMode mode,
+                           AoiUpdateInfos *update_infos) {
+  if (!slicing_) _BeginSlice(mode);
+
+  auto begin = std::chrono::steady_clock::now();
+  auto &infos = slice_mode_ == kSliceAtomic ? slice_infos_ : *update_infos;
+  size_t player_num = 0;
+  while (slice_pos_ < slice_players_.size()) {
+    _SlicePlayer(slice_players_[slice_pos_++], &infos);
+    ++player_num;
+
+    if (budget.players > 0 && player_num >= budget.players) break;
+    if (budget.seconds > 0 && std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - begin).count() >= budget.seconds) break;
+  }
+
+  if (slice_pos_ < slice_players_.size()) return false;
+
+  if (slice_mode_ == kSliceAtomic) {
+    for (auto &elem : slice_infos_) {
+      update_infos->emplace(elem.first, std::move(elem.second));
+    }
+    slice_infos_.clear();
   }
+  _EndSlice();
+  return true;
+}
+
+
+void SquareAoi::_BeginSlice(TickSliceMode mode) {
+  slicing_ = true;
+  slice_mode_ = mode;
+  slice_pos_ = 0;
+  diff_aoi_ = true;
+  _BuildStaticIndex();
+
   for (auto& elem : player_map_) {
     auto& player = *elem.second;
-    player.last_pos = player.pos;
+    if (player.GetFlag_Removed()) {
+      player.UnsetFlag_Revived();
+      slice_removed_.push_back(&player);
+    }
+    // 移除的玩家也要处理：清空它的列表，之后才能删除它列表里的玩家
+    if (!player.sensors.empty()) {
+      slice_players_.push_back(&player);
+    }
+  }
+  std::sort(slice_players_.begin(), slice_players_.end(),
+            [](const PlayerAoi *left, const PlayerAoi *right) {
+              return left->nuid < right->nuid;
+            });
+}
+
+
+void SquareAoi::_SlicePlayer(PlayerAoi* pptr, AoiUpdateInfos *update_infos) {
+  if (pptr->GetFlag_Removed()) {
+    for (auto& sensor : pptr->sensors) {
+      sensor.aoi_players[0].clear();
+      sensor.aoi_players[1].clear();
+    }
+    return;
+  }
+
+  auto update_info = _UpdatePlayerAoi(cur_aoi_map_idx_, pptr);
+  // 一轮中间 cur_aoi_map_idx_ 不变，新列表换回当前的位置
+  for (auto& sensor : pptr->sensors) {
+    std::swap(sensor.aoi_players[0], sensor.aoi_players[1]);
+  }
+  if (!update_info.sensor_update_list.empty()) {
+    update_infos->emplace(update_info.nuid, std::move(update_info));
   }
-  cur_aoi_map_idx_ = 1 - cur_aoi_map_idx_;
-  return update_infos;
+}
+
+
+void SquareAoi::_EndSlice() {
+  // 一轮开始时已经移除、中间没被重新加入的玩家，不会再出现在任何列表里
+  {
+    AOI_PHASE_SCOPE(phase_cycles_, kPhaseRemove);
+    for (auto pptr : slice_removed_) {
+      if (pptr->GetFlag_Removed() && !pptr->GetFlag_Revived()) {
+        _ErasePlayer(pptr);
+      }
+    }
+  }
+  {
+    AOI_PHASE_SCOPE(phase_cycles_, kPhaseLastPos);
+    for (auto& elem : player_map_) {
+      auto& player = *elem.second;
+      player.UnsetFlag_New();
+      player.last_pos = player.pos;
+      player.last_category = player.category;
+    }
+  }
+
+  graveyard_.Release(tick_count_++);
+  slicing_ = false;
+  slice_players_.clear();
+  slice_removed_.clear();
+  tick_stats_ = stats_;
+  stats_ = AoiStats();
+  tick_phase_cycles_ = phase_cycles_;
+  phase_cycles_ = PhaseCycles();
+  if (histograms_enabled_) _EndTickHistograms();
 }
 
 
@@ -185,16 +659,61 @@ AoiUpdateInfo SquareAoi::_UpdatePlayerAoi(Uint32 cur_aoi_map_idx,
   for (auto& sensor : pptr->sensors) {
     auto& old_aoi = sensor.aoi_players[cur_aoi_map_idx];
     auto& new_aoi = sensor.aoi_players[new_aoi_map_idx];
+    if (!sensor.IsDue(tick_count_)) {
+      // 没到计算的时候，上一次的列表原样留给下一次
+      std::swap(old_aoi, new_aoi);
+      AOI_STATS_INC(stats_, sensors_skipped);
+      continue;
+    }
+    if (sensor.max_visible > 0) {
+      nearest_.Reset(pptr->pos.x, pptr->pos.z, sensor.max_visible, &old_aoi);
+    }
     _CalcAoiPlayers(*pptr, sensor, &new_aoi);
+    bool need_diff = diff_aoi_ || sensor.NeedDiff();
+    // 用 last_pos 算进出时，离开半径内的旧玩家由 _CheckLeave 加回新的列表，不用排序
+    if (need_diff && sensor.leave_radius > sensor.radius) {
+      if (quantized_) {
+        KeepIncumbents(pptr->pos, static_cast<double>(sensor.leave_radius) * sensor.leave_radius,
+                       sensor.interest, &old_aoi, &new_aoi);
+      } else {
+        KeepIncumbents(pptr->pos, sensor.leave_radius_square, sensor.interest, &old_aoi, &new_aoi);
+      }
+    }
+    KeepNearest(pptr->pos, sensor.max_visible, &old_aoi, &new_aoi);
 
     SensorUpdateInfo update_info;
 
     auto& enters = update_info.enters;
     auto& leaves = update_info.leaves;
-    float radius_square = sensor.radius_square;
 
-    _CheckLeave(pptr, radius_square, old_aoi, &leaves);
-    _CheckEnter(pptr, radius_square, new_aoi, &enters);
+    if (need_diff) {
+      AOI_PHASE_SCOPE(phase_cycles_, kPhaseDiff);
+      DiffAoiPlayers(&old_aoi, &new_aoi, &enters, &leaves);
+    } else {
+      // 先算 enter，这时新的列表里只有半径内的玩家
+      if (quantized_) {
+        _CheckEnter<double>(pptr, sensor, new_aoi, &old_aoi, &enters);
+        _CheckLeave<double>(pptr, sensor, old_aoi, &new_aoi, &leaves);
+      } else {
+        _CheckEnter<float>(pptr, sensor, new_aoi, &old_aoi, &enters);
+        _CheckLeave<float>(pptr, sensor, old_aoi, &new_aoi, &leaves);
+      }
+    }
+    if (sensor.interest & kDefaultCategory) {
+      sensor.static_aoi.Update(*static_index_, pptr->pos.x, pptr->pos.z, sensor.radius,
+                               &enters, &leaves);
+    } else {
+      sensor.static_aoi.Clear(&leaves);
+    }
+    sensor.UnsetFlag_New();
+    sensor.UnsetFlag_Diff();
+    AOI_STATS_ADD(stats_, enters, enters.size());
+    AOI_STATS_ADD(stats_, leaves, leaves.size());
+    if (histograms_enabled_) {
+      histograms_.visible.Add(new_aoi.size());
+      histogram_enters_ += enters.size();
+      histogram_leaves_ += leaves.size();
+    }
 
     if (enters.empty() && leaves.empty()) {
       continue;
@@ -210,27 +729,74 @@ AoiUpdateInfo SquareAoi::_UpdatePlayerAoi(Uint32 cur_aoi_map_idx,
 
 void SquareAoi::_CalcAoiPlayers(const PlayerAoi& player, const Sensor& sensor,
                                 PlayerPtrList* aoi_map) {
+  AOI_PHASE_SCOPE(phase_cycles_, kPhaseCalcAoi);
   Nuid player_nuid = player.nuid;
   float pos_x = player.pos.x;
   float pos_z = player.pos.z;
   float radius = sensor.radius;
   float radius_square = radius * radius;
 
-  std::vector<SquarePlayers*> check_squares;
+  std::vector<const Square*> check_squares;
   size_t max_num = 0;
-  _GetSquaresAndPlayerNum(player.pos, radius, &check_squares, &max_num);
+  _GetSquaresAndPlayerNum(player.pos, radius, sensor.interest, &check_squares, &max_num);
+  if (histograms_enabled_) histograms_.candidates.Add(max_num);
 
+  // 不按格子里的玩家总数预留：半径内的通常只是一小部分，两个列表轮流使用，容量会自己稳定下来
   aoi_map->clear();
-  aoi_map->reserve(max_num);
-  assert(max_num <= player_map_.size());
+  // 有上限时只把通过检查的玩家交给 nearest_，最后只有选中的进列表
+  bool capped = sensor.max_visible > 0;
+  if (quantized_) {
+    _CalcAoiPlayersQuantized(player, sensor, check_squares, aoi_map);
+  } else {
+    float dx, dz;
+
+    for (auto square : check_squares) {
+      AOI_STATS_ADD(stats_, candidates_scanned, square->size());
+      for (auto other_ptr : square->players) {
+        if (other_ptr->nuid == player_nuid || other_ptr->GetFlag_Removed()) continue;
+        IfNotInXZSquare(dx, dz, pos_x, pos_z, other_ptr->pos.x, other_ptr->pos.z, radius) continue;
+        if (dx * dx + dz * dz < radius_square) {
+          if (capped) {
+            nearest_.Offer(other_ptr);
+          } else {
+            aoi_map->push_back(other_ptr);
+          }
+        }
+      }
+    }
+  }
+  if (capped) nearest_.Finish(aoi_map);
+  AOI_STATS_ADD(stats_, candidates_accepted, aoi_map->size());
+}
+
 
-  float dx, dz;
+void SquareAoi::_CalcAoiPlayersQuantized(const PlayerAoi& player, const Sensor& sensor,
+                                         const std::vector<const Square*> &check_squares,
+                                         PlayerPtrList* aoi_map) {
+  bool capped = sensor.max_visible > 0;
+  int pos_x = _ToQuantized(player.pos.x);
+  int pos_z = _ToQuantized(player.pos.z);
+  // 先用整数的方框排除，再和 ceil(radius² / resolution²) 比较，平方和用 Int64 不会溢出
+  int box = static_cast<int>(std::min(sensor.radius * inverse_resolution_, 65535.f));
+  Int64 radius_square = _QuantizedRadiusSquare(sensor.radius);
 
   for (auto square : check_squares) {
-    for (auto other_ptr : *square) {
-      if (other_ptr->nuid == player_nuid || other_ptr->GetFlag_Removed()) continue;
-      IfNotInXZSquare(dx, dz, pos_x, pos_z, other_ptr->pos.x, other_ptr->pos.z, radius) continue;
-      if (dx * dx + dz * dz < radius_square) {
+    AOI_STATS_ADD(stats_, candidates_scanned, square->size());
+    const Int16 *xs = square->xs.data();
+    const Int16 *zs = square->zs.data();
+    size_t size = square->size();
+    for (size_t i = 0; i < size; ++i) {
+      int dx = xs[i] - pos_x;
+      int dz = zs[i] - pos_z;
+      if (dx > box || dx < -box || dz > box || dz < -box) continue;
+      if (static_cast<Int64>(dx) * dx + static_cast<Int64>(dz) * dz >= radius_square) continue;
+
+      // 只有通过距离检查的玩家才访问 PlayerAoi
+      auto other_ptr = square->players[i];
+      if (other_ptr == &player || other_ptr->GetFlag_Removed()) continue;
+      if (capped) {
+        nearest_.Offer(other_ptr);
+      } else {
         aoi_map->push_back(other_ptr);
       }
     }
@@ -238,32 +804,48 @@ void SquareAoi::_CalcAoiPlayers(const PlayerAoi& player, const Sensor& sensor,
 }
 
 
-void SquareAoi::_CheckLeave(PlayerAoi* pptr, float radius_square,
-                             const PlayerPtrList &aoi_players, PlayerNuids *leaves) {
+template <typename Real>
+void SquareAoi::_CheckLeave(PlayerAoi* pptr, const Sensor &sensor,
+                             const PlayerPtrList &aoi_players, PlayerPtrList *new_players,
+                             PlayerNuids *leaves) {
+  AOI_PHASE_SCOPE(phase_cycles_, kPhaseCheckLeave);
   const auto &player_pos = pptr->pos;
-  float dx, dz;
-  float pos_x = player_pos.x;
-  float pos_z = player_pos.z;
+  Real dx, dz;
+  Real pos_x = player_pos.x;
+  Real pos_z = player_pos.z;
+  Real radius_square = static_cast<Real>(sensor.radius) * sensor.radius;
+  Real leave_radius_square = static_cast<Real>(sensor.leave_radius) * sensor.leave_radius;
+  Uint32 interest = sensor.interest;
   for (auto old_player_ptr : aoi_players) {
-    if (old_player_ptr->GetFlag_Removed()) {
+    // 改成了不感兴趣的 category，不管距离都离开
+    if (old_player_ptr->GetFlag_Removed() || !(old_player_ptr->category & interest)) {
       leaves->push_back(old_player_ptr->nuid);
     } else {
       IfNotInXZRadiusSquare(dx, dz, old_player_ptr->pos.x, old_player_ptr->pos.z,
                             pos_x, pos_z, radius_square) {
-        leaves->push_back(old_player_ptr->nuid);
+        // 出了进入半径、还在离开半径内的继续看到
+        if (dx * dx + dz * dz < leave_radius_square) {
+          new_players->push_back(old_player_ptr);
+        } else {
+          leaves->push_back(old_player_ptr->nuid);
+        }
       }
     }
   }
 }
 
 
-void SquareAoi::_CheckEnter(PlayerAoi* pptr, float radius_square,
-                             const PlayerPtrList &aoi_players, PlayerNuids *enters) {
+template <typename Real>
+void SquareAoi::_CheckEnter(PlayerAoi* pptr, const Sensor &sensor,
+                             const PlayerPtrList &aoi_players, PlayerPtrList *old_players,
+                             PlayerNuids *enters) {
+  AOI_PHASE_SCOPE(phase_cycles_, kPhaseCheckEnter);
   const auto &player_last_pos = pptr->last_pos;
-  float pos_x = player_last_pos.x;
-  float pos_z = player_last_pos.z;
+  Real pos_x = player_last_pos.x;
+  Real pos_z = player_last_pos.z;
+  Real radius_square = static_cast<Real>(sensor.radius) * sensor.radius;
 
-  if (pptr->GetFlag_New()) {
+  if (pptr->GetFlag_New() || sensor.GetFlag_New()) {
     enters->reserve(aoi_players.size());
     for (auto new_player_ptr : aoi_players) {
       enters->push_back(new_player_ptr->nuid);
@@ -271,10 +853,22 @@ void SquareAoi::_CheckEnter(PlayerAoi* pptr, float radius_square,
     return;
   }
 
-  float dx, dz;
+  // 上一次在离开半径内的可能是留下来的旧玩家，到上一次的列表里查
+  Real leave_radius_square = static_cast<Real>(sensor.leave_radius) * sensor.leave_radius;
+  Uint32 interest = sensor.interest;
+  IncumbentLookup<PlayerPtrList> incumbents(old_players);
+  Real dx, dz;
   for (auto new_player_ptr : aoi_players) {
+    // 上一次 Tick 时的 category 不感兴趣，一定是新进来的
+    if (!(new_player_ptr->last_category & interest)) {
+      enters->push_back(new_player_ptr->nuid);
+      continue;
+    }
     IfNotInXZRadiusSquare(dx, dz, new_player_ptr->last_pos.x, new_player_ptr->last_pos.z,
                           pos_x, pos_z, radius_square) {
+      if (dx * dx + dz * dz < leave_radius_square && incumbents.Contains(new_player_ptr)) {
+        continue;
+      }
       enters->push_back(new_player_ptr->nuid);
     }
   }
@@ -1,6 +1,7 @@
 // Copyright <disenone>
 #pragma once
 
+#include <algorithm>
 #include <unordered_map>
 #include <map>
 #include <vector>
@@ -8,21 +9,70 @@
 #include <limits>
 #include <memory>
 
+#include "common/memory_resource.hpp"
+#include "common/aoi_snapshot.hpp"
 #include "common/base_types.hpp"
+#include "common/histogram.hpp"
+#include "common/memory_usage.hpp"
+#include "common/phase_timer.hpp"
+#include "common/sensor_interval.hpp"
+#include "common/static_index.hpp"
+#include "common/stats.hpp"
+#include "common/visible_cap.hpp"
 
-namespace aoi { namespace squares {
+namespace aoi {
+
+class TraceWriter;
+
+namespace squares {
 
 class PlayerAoi;
-typedef std::unordered_map<Nuid, std::shared_ptr<PlayerAoi>> PlayerMap;
+// 玩家、格子和 aoi 列表都从 SquareAoi 的 MemoryResource 分配，没有时就是普通的堆分配
+typedef std::unordered_map<Nuid, std::shared_ptr<PlayerAoi>, std::hash<Nuid>, std::equal_to<Nuid>,
+                           ResourceAllocator<std::pair<const Nuid, std::shared_ptr<PlayerAoi>>>>
+    PlayerMap;
 typedef std::unordered_map<Nuid, PlayerAoi*> PlayerPtrMap;
 typedef std::vector<Nuid> PlayerNuids;
-typedef std::vector<PlayerAoi*> PlayerPtrList;
+typedef std::vector<PlayerAoi*, ResourceAllocator<PlayerAoi*>> PlayerPtrList;
 typedef Uint64 SquareId;
-typedef std::vector<PlayerAoi*> SquarePlayers;
-typedef std::unordered_map<SquareId, SquarePlayers> SquareList;
+typedef std::vector<PlayerAoi*, ResourceAllocator<PlayerAoi*>> SquarePlayers;
+
+// 一个格子里的玩家。量化模式下 xs、zs 和 players 一一对应，存量化后的 int16 坐标，
+// 查找时只顺序读这两个数组，不用访问 PlayerAoi
+struct Square {
+  explicit Square(MemoryResource *resource = nullptr)
+      : players(ResourceAllocator<PlayerAoi*>(resource)),
+        xs(ResourceAllocator<Int16>(resource)),
+        zs(ResourceAllocator<Int16>(resource)) {}
+
+  size_t size() const {
+    return players.size();
+  }
+  bool empty() const {
+    return players.empty();
+  }
+
+  SquarePlayers players;
+  std::vector<Int16, ResourceAllocator<Int16>> xs;
+  std::vector<Int16, ResourceAllocator<Int16>> zs;
+};
+typedef std::unordered_map<SquareId, Square, std::hash<SquareId>, std::equal_to<SquareId>,
+                           ResourceAllocator<std::pair<const SquareId, Square>>> SquareList;
 constexpr int kSquareIdShift = sizeof(SquareId) * 4;
+// 分区计算时区域只读引用 owner 的格子，不复制
+typedef std::unordered_map<SquareId, const Square*> SquareRefs;
+
+// 同一种 category 的玩家放在同一层格子里，sensor 只查找 interest 包含的层
+struct SquareLayer {
+  explicit SquareLayer(Uint32 _category, MemoryResource *resource = nullptr)
+      : category(_category), squares(SquareList::allocator_type(resource)) {}
+
+  Uint32 category;
+  SquareList squares;
+};
 
 #define AOI_FLOAT_MAX std::numeric_limits<float>::max()
+#undef AOI_INF_POS
 #define AOI_INF_POS AOI_FLOAT_MAX, AOI_FLOAT_MAX, AOI_FLOAT_MAX
 
 struct Pos {
@@ -40,30 +90,70 @@ struct Pos {
 
 
 struct Sensor {
-  Sensor(Nuid _sensor_id, float _radius)
-      : sensor_id(_sensor_id), radius(_radius), radius_square(_radius * _radius) {}
+  Sensor(Nuid _sensor_id, float _radius, MemoryResource *resource = nullptr)
+      : sensor_id(_sensor_id), radius(_radius), radius_square(_radius * _radius),
+        leave_radius(_radius), leave_radius_square(_radius * _radius), flags(0),
+        max_visible(0), interval(1), phase(0), interest(kAllCategories),
+        aoi_players{PlayerPtrList(ResourceAllocator<PlayerAoi*>(resource)),
+                    PlayerPtrList(ResourceAllocator<PlayerAoi*>(resource))} {
+    SetFlag_New();
+  }
+
+  // 新加的 sensor 还没有上一次的 aoi 列表，Tick 时全部算 enter
+  AOI_CLASS_ADD_FLAG(New, 0, flags);
+  // 参数变了，aoi 列表和 last_pos 对不上，下次 Tick 用集合差算进出
+  AOI_CLASS_ADD_FLAG(Diff, 1, flags);
+
+  // 只看到最近的几个玩家时，不能用 last_pos 判断进出；离开半径在 _CheckEnter、_CheckLeave 里处理
+  // 隔几次 Tick 才计算的 sensor，上一次计算时的 last_pos 也已经对不上了
+  bool NeedDiff() const {
+    return max_visible > 0 || interval > 1 || GetFlag_Diff();
+  }
+
+  // 新加的、参数刚变过的 sensor 马上计算，其它的按间隔和相位
+  bool IsDue(Uint64 tick) const {
+    return GetFlag_New() || GetFlag_Diff() || IntervalSchedule::IsDue(tick, interval, phase);
+  }
 
   Nuid sensor_id;
-  float radius;
+  float radius;               // 进入半径
   float radius_square;
+  float leave_radius;         // 离开半径，不小于 radius
+  float leave_radius_square;
+  Uint32 flags;
+  Uint32 max_visible;   // 最多看到几个玩家，0 不限制
+  Uint32 interval;      // 每隔几次 Tick 计算一次
+  Uint32 phase;
+  Uint32 interest;      // 只看 category 和它有交集的玩家
   PlayerPtrList aoi_players[2];
+  StaticAoi static_aoi;       // 看到的静态实体
 };
 
 
 struct PlayerAoi {
-  PlayerAoi(Uint64 _nuid, float _x, float _y, float _z)
-      : nuid(_nuid), pos(_x, _y, _z), last_pos(AOI_INF_POS), flags(0) {}
+  PlayerAoi(Uint64 _nuid, float _x, float _y, float _z, MemoryResource *resource = nullptr)
+      : nuid(_nuid), pos(_x, _y, _z), flags(0), last_pos(AOI_INF_POS),
+        category(kDefaultCategory), last_category(kDefaultCategory), layer(0), order_index(0),
+        sensors(ResourceAllocator<Sensor>(resource)) {}
 
   AOI_CLASS_ADD_FLAG(Removed, 0, flags);
   AOI_CLASS_ADD_FLAG(New, 1, flags);
+  // 移除之后又被重新加入，分片 Tick 据此判断能不能删除
+  AOI_CLASS_ADD_FLAG(Revived, 2, flags);
 
+  // 别的玩家查找候选玩家时访问的字段放在最前面
   Nuid nuid;
-  SquareId square_id;
-  int square_index;
   Pos pos;
-  Pos last_pos;
   Uint32 flags;
-  std::vector<Sensor> sensors;
+  Pos last_pos;
+  Uint32 category;
+  Uint32 last_category;   // 上一次 Tick 结束时的 category
+  // 只有自己移动或者 Tick 时访问
+  SquareId square_id;
+  int square_index;
+  Uint32 layer;         // 所在的层，下标
+  Uint32 order_index;   // 在 tick_order_ 里的下标
+  std::vector<Sensor, ResourceAllocator<Sensor>> sensors;
 };
 
 
@@ -82,6 +172,31 @@ struct AoiUpdateInfo {
 typedef std::unordered_map<Nuid, AoiUpdateInfo> AoiUpdateInfos;
 
 
+// 分片 Tick 的预算，0 表示不限制。每次调用至少处理一个玩家，保证能往前推进
+struct TickBudget {
+  double seconds = 0;
+  size_t players = 0;
+};
+
+
+enum TickSliceMode {
+  kSliceProgressive,    // 每次调用返回这次处理过的玩家的事件
+  kSliceAtomic,         // 事件先攒起来，一轮跑完时一次性返回
+};
+
+
+// 只有定义了 AOI_ENABLE_STATS 才会计数
+struct AoiStats {
+  Uint64 cells_visited = 0;         // _CalcAoiPlayers 查找到的格子数
+  Uint64 candidates_scanned = 0;    // 格子里检查过的玩家数
+  Uint64 candidates_accepted = 0;   // 在半径内的玩家数
+  Uint64 cell_migrations = 0;       // UpdatePos 中跨格子的次数
+  Uint64 enters = 0;
+  Uint64 leaves = 0;
+  Uint64 sensors_skipped = 0;       // 没到计算间隔跳过的 sensor 数
+};
+
+
 inline int CoordToId(float coord, float inverse_square_size) {
   return static_cast<int>(std::floor(coord * inverse_square_size));
 }
@@ -99,45 +214,221 @@ inline SquareId PosToId(float x, float z, float inverse_square_size) {
 }
 
 
+// 把 32 位数的每一位隔开，放到 64 位的偶数位上
+inline Uint64 SpreadBits(Uint32 value) {
+  Uint64 bits = value;
+  bits = (bits | (bits << 16)) & 0x0000FFFF0000FFFFull;
+  bits = (bits | (bits << 8)) & 0x00FF00FF00FF00FFull;
+  bits = (bits | (bits << 4)) & 0x0F0F0F0F0F0F0F0Full;
+  bits = (bits | (bits << 2)) & 0x3333333333333333ull;
+  bits = (bits | (bits << 1)) & 0x5555555555555555ull;
+  return bits;
+}
+
+
+// 格子坐标的 Z 序（Morton）编码，相邻的格子编码也大多相邻。
+// 有符号坐标翻转符号位，保证负坐标排在正坐标前面
+inline Uint64 MortonCode(int xi, int zi) {
+  return (SpreadBits(static_cast<Uint32>(xi) ^ 0x80000000u) << 1) |
+         SpreadBits(static_cast<Uint32>(zi) ^ 0x80000000u);
+}
+
+
 class SquareAoi {
  public:
-  explicit SquareAoi(float square_size = 200);
+  // resource 不为空时玩家、格子和 aoi 列表都从 resource 分配（比如场景的 Arena），
+  // resource 要比 SquareAoi 活得久。Tick 返回的事件和临时列表仍然用普通堆。
+  // PartitionedAoi 会在多个线程里分配 aoi 列表，resource 要是线程安全的
+  explicit SquareAoi(float square_size = 200, MemoryResource *resource = nullptr);
 
   void AddPlayer(Nuid nuid, float x, float y, float z);
   void RemovePlayer(Nuid nuid);
   void AddSensor(Nuid nuid, Nuid sensor_id, float radius);
   void UpdatePos(Nuid nuid, float x, float y, float z);
+  // 不会移动、也不会被移除的实体，不进格子，下次 Tick 时建成只读索引。
+  // sensor 移动之后才重新查询静态实体，只按进入半径算，不受 max_visible 和离开半径影响
+  void AddStaticEntity(Nuid nuid, float x, float y, float z);
+  // sensor 最多只看到最近的 max_visible 个玩家，0 不限制
+  void SetSensorMaxVisible(Nuid nuid, Nuid sensor_id, Uint32 max_visible);
+  // 已经看到的玩家走出 leave_radius 才离开，小于进入半径时按进入半径算
+  void SetSensorLeaveRadius(Nuid nuid, Nuid sensor_id, float leave_radius);
+  // sensor 每隔 interval 次 Tick 才计算一次（0 和 1 都是每次），同一个间隔的 sensor 错开到
+  // 不同的 Tick 上。没计算的 Tick 不产生事件，下次计算时和上一次的列表比较
+  void SetSensorInterval(Nuid nuid, Nuid sensor_id, Uint32 interval);
+  // 玩家的 category 位掩码，默认 kDefaultCategory。改变之后下次 Tick 用集合差算进出
+  void SetPlayerCategory(Nuid nuid, Uint32 category);
+  // sensor 只看 category 和 interest 有交集的玩家，默认 kAllCategories。
+  // 静态实体的 category 是 kDefaultCategory
+  void SetSensorInterest(Nuid nuid, Nuid sensor_id, Uint32 interest);
+  // 导出所有玩家、sensor 参数和上一次 Tick 之后的 aoi 列表，在 Tick 之后、下一次操作之前调用
+  void ExportSnapshot(AoiSnapshot *snapshot) const;
+  // 按 snapshot 接上 sensor：换成搬过来的 aoi 列表和静态实体，沿用原来的计算相位，
+  // 下次 Tick 和列表求差算进出事件。不在场景里的玩家会被忽略。ImportSnapshot 用它从别的算法接手，
+  // 不记录到 trace
+  void RestoreSensor(Nuid nuid, const SensorSnapshot &snapshot);
+  // 接上原来的 Tick 计数和低频 sensor 的相位分配，之后新设置的间隔和原来分到一样的相位
+  void RestoreSchedule(Uint64 tick_count, const IntervalSchedule &schedule) {
+    tick_count_ = tick_count;
+    interval_schedule_ = schedule;
+  }
+  // Tick 按格子的 Z 序处理玩家，相邻的玩家查找的格子也相邻，格子在缓存里更热。
+  // 只重排 tick_order_ 里的指针，PlayerAoi 本身不移动。
+  // 玩家移动之后顺序会慢慢变乱，每隔 interval 次 Tick 重新排一次，0 不重排
+  void SetReorderInterval(Uint32 interval) {
+    reorder_interval_ = interval;
+  }
+  // 量化模式：玩家和静态实体的 x、z 按 resolution 取整到 int16（resolution 0.25 时范围是 ±8192），
+  // 格子里另存一份 int16 坐标，查找时用整数算距离。边界规则：量化之后的整数差满足
+  // dx² + dz² < ceil(radius² / resolution²) 才在半径内，也就是用取整之后的位置精确比较
+  // distance < radius；last_pos 的进出检查和离开半径用 double 算，取整之后的坐标在 double 里
+  // 没有舍入，和这个规则一致。静态实体和 max_visible 的远近排序仍然用 float。
+  // resolution 不是 2 的幂或者已经有玩家时什么都不做
+  void EnableQuantization(float resolution = 0.25f);
+  bool IsQuantized() const {
+    return quantized_;
+  }
   AoiUpdateInfos Tick();
-  const SquareList& GetSquares() const {
-    return squares_;
+  // 分片 Tick：按 nuid 顺序处理有 sensor 的玩家，预算用完就返回，下次调用从停下的地方继续，
+  // 返回 true 表示这一轮处理完了。mode 在每一轮开始时确定。
+  // 分片期间用前后两次 aoi 集合的差算进出事件，每个 sensor 的事件总是和它自己上一次的集合
+  // 对得上；移除的玩家要等到所有列表都不再引用它之后才真正删除。分片 Tick 不记录到 trace。
+  // 一轮没跑完时调用 Tick，会先把这一轮跑完，返回剩下的事件。
+  bool TickSliced(const TickBudget &budget, TickSliceMode mode, AoiUpdateInfos *update_infos);
+  bool IsSlicing() const {
+    return slicing_;
   }
+  // 所有 category 的格子合在一起，和不分层时一样
+  SquareList GetSquares() const;
+  const SquareList& GetLayerSquares(Uint32 category) const;
   const PlayerMap& GetPlayerMap() const {
     return player_map_;
   }
+  MemoryResource* GetMemoryResource() const {
+    return resource_;
+  }
+  // 当前各类数据结构占用的内存，遍历所有玩家和格子，不要每次 Tick 都调用
+  MemoryUsage GetMemoryUsage() const;
+  // Tick 处理玩家的顺序，新加的玩家排在最后，直到下一次重排
+  const PlayerPtrList& GetTickOrder() const {
+    return tick_order_;
+  }
+  // 上一次 Tick 结束时统计的计数，包括这次 Tick 以及之前的 UpdatePos
+  const AoiStats& GetTickStats() const {
+    return tick_stats_;
+  }
+  // 打开后每次 Tick 统计可见数、候选数、格子人数和进出事件数的分布，关闭时保留已有的结果
+  void EnableHistograms(bool enable) {
+    histograms_enabled_ = enable;
+  }
+  // 上一次 Tick 的直方图
+  const SceneHistograms& GetTickHistograms() const {
+    return tick_histograms_;
+  }
+  // 上一次取出之后所有 Tick 累计的直方图，取出后重新累计
+  SceneHistograms TakeWindowHistograms() {
+    SceneHistograms histograms = window_histograms_;
+    window_histograms_.Clear();
+    return histograms;
+  }
+  // 上一次 Tick 各阶段的周期数，只在定义了 AOI_ENABLE_PHASE_TIMER 时计时
+  const PhaseCycles& GetTickPhaseCycles() const {
+    return tick_phase_cycles_;
+  }
+  // 记录之后的操作，writer 由调用者持有，传 nullptr 关闭记录
+  void SetTraceWriter(TraceWriter *writer) {
+    trace_writer_ = writer;
+  }
 
  protected:
+  // Tick 收尾：删除已移除的玩家，记录 last_pos，切换 aoi 列表
+  void _EndTick(const PlayerPtrList &remove_list);
+  // 统计格子人数，这次 Tick 的直方图存到 tick_histograms_ 并累计到 window_histograms_
+  void _EndTickHistograms();
+  void _BuildStaticIndex();
+  // 从 player_map_ 删除，有低频 sensor 时先放到 graveyard_ 里
+  void _ErasePlayer(PlayerAoi* pptr);
+  // tick_order_ 按玩家所在格子的 Morton 编码重新排序
+  void _ReorderPlayers();
+  void _BeginSlice(TickSliceMode mode);
+  void _SlicePlayer(PlayerAoi* pptr, AoiUpdateInfos *update_infos);
+  void _EndSlice();
+  // category 对应的层，没有就新建一层
+  Uint32 _GetLayer(Uint32 category);
   void _AddToSquare(Nuid nuid, PlayerAoi*);
   void _RemoveFromSquare(Nuid nuid, PlayerAoi*);
   AoiUpdateInfo _UpdatePlayerAoi(Uint32 cur_aoi_map_idx, PlayerAoi* player);
   void _CalcAoiPlayers(const PlayerAoi& player, const Sensor& sensor, PlayerPtrList* aoi_map);
-  inline void _GetSquaresAndPlayerNum(const Pos& pos, float radius,
-                                      std::vector<SquarePlayers*> *squares, size_t* player_num);
-  void _CheckLeave(PlayerAoi* pptr, float radius_square,
-                    const PlayerPtrList &aoi_players, PlayerNuids *leaves);
-  void _CheckEnter(PlayerAoi* pptr, float radius_square,
-                    const PlayerPtrList &aoi_players, PlayerNuids *leaves);
+  inline void _GetSquaresAndPlayerNum(const Pos& pos, float radius, Uint32 interest,
+                                      std::vector<const Square*> *squares, size_t* player_num);
+  // square_refs_ 不为空时在引用里找，否则在自己的格子里找
+  inline const Square* _FindSquare(Uint32 layer, SquareId square_id) const;
+  // 量化模式下把坐标取整到格点上
+  inline void _Quantize(float *x, float *z) const;
+  inline Int16 _ToQuantized(float coord) const;
+  // 量化坐标下的 ceil(radius² / resolution²)，整数距离平方小于它才在半径内
+  inline Int64 _QuantizedRadiusSquare(float radius) const;
+  void _CalcAoiPlayersQuantized(const PlayerAoi& player, const Sensor& sensor,
+                                const std::vector<const Square*> &check_squares,
+                                PlayerPtrList* aoi_map);
+  // 出了进入半径、还在离开半径内的旧玩家不算离开，追加到 new_players。
+  // 两个都按 category 和 last_category 处理改过 category 的玩家。
+  // Real 是算距离的类型，量化模式用 double
+  template <typename Real>
+  void _CheckLeave(PlayerAoi* pptr, const Sensor &sensor,
+                    const PlayerPtrList &aoi_players, PlayerPtrList *new_players,
+                    PlayerNuids *leaves);
+  template <typename Real>
+  void _CheckEnter(PlayerAoi* pptr, const Sensor &sensor,
+                    const PlayerPtrList &aoi_players, PlayerPtrList *old_players,
+                    PlayerNuids *enters);
 
  protected:
   float square_size_;
   float inverse_square_size_;
   Uint32 cur_aoi_map_idx_;
+  MemoryResource *resource_;
 
-  SquareList squares_;
+  std::vector<SquareLayer> layers_;   // 第 0 层是 kDefaultCategory
+  std::vector<SquareRefs> square_refs_;   // 只有分区计算的区域用，和 layers_ 一一对应
   PlayerMap player_map_;
+  // 所有玩家的指针，Tick 按这个顺序处理；PlayerAoi 本身不移动，nuid 和指针一直有效
+  PlayerPtrList tick_order_;
+  Uint32 reorder_interval_ = 16;
+  bool quantized_ = false;
+  float resolution_ = 1;
+  float inverse_resolution_ = 1;
+  TraceWriter *trace_writer_ = nullptr;
+  AoiStats stats_;
+  AoiStats tick_stats_;
+  bool histograms_enabled_ = false;
+  SceneHistograms histograms_;        // 这次 Tick 正在统计的
+  SceneHistograms tick_histograms_;
+  SceneHistograms window_histograms_;
+  Uint64 histogram_enters_ = 0;       // 这次 Tick 到目前为止的进出事件数
+  Uint64 histogram_leaves_ = 0;
+  PhaseCycles phase_cycles_;
+  PhaseCycles tick_phase_cycles_;
+  // 有 max_visible 的 sensor 在 _CalcAoiPlayers 里边查找边选
+  NearestSelector<PlayerAoi*> nearest_;
+
+  Uint64 tick_count_ = 0;
+  IntervalSchedule interval_schedule_;
+  PlayerGraveyard<std::shared_ptr<PlayerAoi>> graveyard_;
+  // 分区计算时所有区域共用同一个索引
+  std::shared_ptr<StaticIndex> static_index_;
+
+  // aoi 列表和 last_pos 对不上（分片 Tick 之后），这次用集合差算进出事件
+  bool diff_aoi_ = false;
+  bool slicing_ = false;
+  TickSliceMode slice_mode_ = kSliceProgressive;
+  size_t slice_pos_ = 0;
+  PlayerPtrList slice_players_;     // 这一轮要处理的玩家，按 nuid 排序
+  PlayerPtrList slice_removed_;     // 这一轮开始时已经移除的玩家
+  AoiUpdateInfos slice_infos_;      // kSliceAtomic 攒下的事件
 };
 
-inline void SquareAoi::_GetSquaresAndPlayerNum(const Pos& pos, float radius,
-                                        std::vector<SquarePlayers*> *squares,
+inline void SquareAoi::_GetSquaresAndPlayerNum(const Pos& pos, float radius, Uint32 interest,
+                                        std::vector<const Square*> *squares,
                                         size_t* player_num) {
   float pos_x = pos.x;
   float pos_z = pos.z;
@@ -147,18 +438,57 @@ inline void SquareAoi::_GetSquaresAndPlayerNum(const Pos& pos, float radius,
   int maxzi = CoordToId(pos_z + radius, inverse_square_size_);
 
   *player_num = 0;
-  for (int xi = minxi; xi <= maxxi; ++xi) {
-    for (int zi = minzi; zi <= maxzi; ++zi) {
-      auto square_id = GenSquareId(xi, zi);
-      auto square_iter = squares_.find(square_id);
-      if (square_iter == squares_.end())
-        continue;
-      squares->push_back(&(square_iter->second));
-      *player_num += square_iter->second.size();
+  for (Uint32 layer = 0; layer < layers_.size(); ++layer) {
+    if (!(layers_[layer].category & interest)) continue;
+    for (int xi = minxi; xi <= maxxi; ++xi) {
+      for (int zi = minzi; zi <= maxzi; ++zi) {
+        auto square = _FindSquare(layer, GenSquareId(xi, zi));
+        if (!square)
+          continue;
+        squares->push_back(square);
+        *player_num += square->size();
+        AOI_STATS_INC(stats_, cells_visited);
+      }
     }
   }
 }
 
 
+inline const Square* SquareAoi::_FindSquare(Uint32 layer, SquareId square_id) const {
+  if (!square_refs_.empty()) {
+    const auto &refs = square_refs_[layer];
+    auto ref_iter = refs.find(square_id);
+    return ref_iter == refs.end() ? nullptr : ref_iter->second;
+  }
+  const auto &layer_squares = layers_[layer].squares;
+  auto square_iter = layer_squares.find(square_id);
+  return square_iter == layer_squares.end() ? nullptr : &square_iter->second;
+}
+
+
+inline Int16 SquareAoi::_ToQuantized(float coord) const {
+  float value = std::round(coord * inverse_resolution_);
+  value = std::min(std::max(value, static_cast<float>(std::numeric_limits<Int16>::min())),
+                   static_cast<float>(std::numeric_limits<Int16>::max()));
+  return static_cast<Int16>(value);
+}
+
+
+inline Int64 SquareAoi::_QuantizedRadiusSquare(float radius) const {
+  // float 的平方在 double 里是精确的，resolution 是 2 的幂，乘它的倒数也是精确的。
+  // 超过量化坐标能表示的最远距离时，所有玩家都在半径内
+  const double max_square = 2.0 * 65535 * 65535 + 1;
+  double radius_square = static_cast<double>(radius) * radius * inverse_resolution_ * inverse_resolution_;
+  return static_cast<Int64>(std::min(std::ceil(radius_square), max_square));
+}
+
+
+inline void SquareAoi::_Quantize(float *x, float *z) const {
+  if (!quantized_) return;
+  *x = _ToQuantized(*x) * resolution_;
+  *z = _ToQuantized(*z) * resolution_;
+}
+
+
 }   // namespace squares
 }   // namespace aoi
@@ -0,0 +1,231 @@
+// Copyright <disenone>
+
+#include <algorithm>
+#include <vector>
+
+#define BOOST_TEST_MODULE test_adaptive
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/included/unit_test.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <boost/range/irange.hpp>
+
+#include <adaptive/adaptive.hpp>
+#include <common/arena.hpp>
+#include <squares/squares.hpp>
+
+using namespace aoi;
+using namespace aoi::adaptive;
+
+BOOST_AUTO_TEST_SUITE(test_adaptive)
+
+// 两边的事件集合一样，列表里的顺序不管
+void CheckSameInfos(AoiUpdateInfos *update_infos, AoiUpdateInfos *expect_infos) {
+  BOOST_TEST_REQUIRE((update_infos->size() == expect_infos->size()));
+  for (auto &elem : *update_infos) {
+    auto &sensor_list = elem.second.sensor_update_list;
+    auto &expect_list = (*expect_infos)[elem.first].sensor_update_list;
+    BOOST_TEST_REQUIRE((sensor_list.size() == expect_list.size()));
+    for (auto &sensor_info : sensor_list) {
+      auto iter = std::find_if(expect_list.begin(), expect_list.end(),
+                               [&sensor_info](const SensorUpdateInfo &expect_info) {
+                                 return expect_info.sensor_id == sensor_info.sensor_id;
+                               });
+      BOOST_TEST_REQUIRE((iter != expect_list.end()));
+      std::sort(sensor_info.enters.begin(), sensor_info.enters.end());
+      std::sort(sensor_info.leaves.begin(), sensor_info.leaves.end());
+      std::sort(iter->enters.begin(), iter->enters.end());
+      std::sort(iter->leaves.begin(), iter->leaves.end());
+      BOOST_TEST_REQUIRE((sensor_info.enters == iter->enters));
+      BOOST_TEST_REQUIRE((sensor_info.leaves == iter->leaves));
+    }
+  }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_choose_engine) {
+  AdaptiveConfig config;
+  config.brute_max_players = 100;
+  config.brute_min_visible_ratio = 0.2f;
+  config.squares_min_players = 1000;
+  config.hysteresis = 0.5f;
+
+  SceneShape shape;
+  shape.player_num = 100;
+  shape.neighbours = 10;
+  BOOST_TEST_REQUIRE((AdaptiveAoi::ChooseEngine(config, kEngineCross, shape) == kEngineBrute));
+  // 离开当前的算法要多越过 hysteresis 的比例
+  shape.player_num = 120;
+  BOOST_TEST_REQUIRE((AdaptiveAoi::ChooseEngine(config, kEngineBrute, shape) == kEngineBrute));
+  BOOST_TEST_REQUIRE((AdaptiveAoi::ChooseEngine(config, kEngineSquares, shape) == kEngineCross));
+  shape.player_num = 800;
+  BOOST_TEST_REQUIRE((AdaptiveAoi::ChooseEngine(config, kEngineBrute, shape) == kEngineCross));
+  BOOST_TEST_REQUIRE((AdaptiveAoi::ChooseEngine(config, kEngineSquares, shape) == kEngineSquares));
+  shape.player_num = 1200;
+  BOOST_TEST_REQUIRE((AdaptiveAoi::ChooseEngine(config, kEngineBrute, shape) == kEngineSquares));
+  BOOST_TEST_REQUIRE((AdaptiveAoi::ChooseEngine(config, kEngineCross, shape) == kEngineCross));
+  shape.player_num = 2000;
+  BOOST_TEST_REQUIRE((AdaptiveAoi::ChooseEngine(config, kEngineCross, shape) == kEngineSquares));
+
+  // 每个 sensor 看到的玩家占比高时用 simd_brute，不管人数
+  shape.player_num = 500;
+  shape.neighbours = 80;
+  BOOST_TEST_REQUIRE((AdaptiveAoi::ChooseEngine(config, kEngineBrute, shape) == kEngineBrute));
+  BOOST_TEST_REQUIRE((AdaptiveAoi::ChooseEngine(config, kEngineCross, shape) == kEngineCross));
+  shape.neighbours = 120;
+  BOOST_TEST_REQUIRE((AdaptiveAoi::ChooseEngine(config, kEngineCross, shape) == kEngineBrute));
+  shape.player_num = 5000;
+  shape.neighbours = 1500;
+  BOOST_TEST_REQUIRE((AdaptiveAoi::ChooseEngine(config, kEngineSquares, shape) == kEngineBrute));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_migrate) {
+  // 每次 Tick 之后都换一种算法，事件和一直用 squares 一样：
+  // 离开半径、max_visible、低频 sensor 的相位和已经移除的玩家都要搬过去
+  AdaptiveConfig config;
+  config.square_size = 20;
+  config.check_interval = 0;
+  AdaptiveAoi aoi(config);
+  squares::SquareAoi square(20);
+
+  boost::random::mt19937 random_generator(20211205);
+  boost::random::uniform_real_distribution<float> pos_gen(-60, 60);
+  boost::random::uniform_real_distribution<float> move_gen(-6, 6);
+  size_t player_num = 40;
+  std::vector<squares::Pos> positions;
+  for (size_t i : boost::irange(player_num)) {
+    positions.emplace_back(pos_gen(random_generator), 0, pos_gen(random_generator));
+    const auto &pos = positions.back();
+    aoi.AddPlayer(i + 1, pos.x, 0, pos.z);
+    square.AddPlayer(i + 1, pos.x, 0, pos.z);
+    if (i % 4 != 0) continue;
+    aoi.AddSensor(i + 1, i + 1, 25);
+    square.AddSensor(i + 1, i + 1, 25);
+    switch (i % 16) {
+      case 4:
+        aoi.SetSensorLeaveRadius(i + 1, i + 1, 35);
+        square.SetSensorLeaveRadius(i + 1, i + 1, 35);
+        break;
+      case 8:
+        aoi.SetSensorMaxVisible(i + 1, i + 1, 3);
+        square.SetSensorMaxVisible(i + 1, i + 1, 3);
+        break;
+      case 12:
+        aoi.SetSensorInterval(i + 1, i + 1, 3);
+        square.SetSensorInterval(i + 1, i + 1, 3);
+        break;
+    }
+  }
+
+  EngineKind kinds[] = {kEngineSquares, kEngineCross, kEngineBrute};
+  for (int t : boost::irange(30)) {
+    aoi.RequestSwitch(kinds[t % 3]);
+    auto update_infos = aoi.Tick();
+    auto square_infos = square.Tick();
+    BOOST_TEST_REQUIRE((aoi.GetEngineKind() == kinds[t % 3]));
+    CheckSameInfos(&update_infos, &square_infos);
+
+    for (size_t i : boost::irange(player_num)) {
+      auto &pos = positions[i];
+      pos.Set(pos.x + move_gen(random_generator), 0, pos.z + move_gen(random_generator));
+      aoi.UpdatePos(i + 1, pos.x, 0, pos.z);
+      square.UpdatePos(i + 1, pos.x, 0, pos.z);
+    }
+    // 移除一个没有 sensor 的玩家，低频 sensor 要到下一次计算时才看到它离开
+    if (t % 5 == 0) {
+      Nuid nuid = t + 2;
+      aoi.RemovePlayer(nuid);
+      square.RemovePlayer(nuid);
+    }
+    // 新设置的间隔在切换之后也要分到和原来一样的相位
+    if (t == 10) {
+      aoi.SetSensorInterval(1, 1, 4);
+      square.SetSensorInterval(1, 1, 4);
+    }
+  }
+  BOOST_TEST_REQUIRE((aoi.GetSwitchCount() == 30));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_auto_switch) {
+  AdaptiveConfig config;
+  config.square_size = 20;
+  config.brute_max_players = 10;
+  config.brute_min_visible_ratio = 0.5f;
+  config.squares_min_players = 30;
+  config.check_interval = 1;
+  AdaptiveAoi aoi(config);
+
+  for (int i : boost::irange(8)) {
+    aoi.AddPlayer(i + 1, i * 100.f, 0, 0);
+    aoi.AddSensor(i + 1, i + 1, 10);
+  }
+  aoi.Tick();
+  BOOST_TEST_REQUIRE((aoi.GetEngineKind() == kEngineBrute));
+  BOOST_TEST_REQUIRE((aoi.GetSceneShape().player_num == 8));
+  BOOST_TEST_REQUIRE((aoi.GetSwitchCount() == 0));
+
+  // 人多了但很稀疏，换成 cross
+  for (int i : boost::irange(8, 20)) {
+    aoi.AddPlayer(i + 1, i * 100.f, 0, (i % 2) * 100.f);
+  }
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.empty()));
+  BOOST_TEST_REQUIRE((aoi.GetEngineKind() == kEngineCross));
+
+  // 人再多一些，换成 squares
+  for (int i : boost::irange(20, 40)) {
+    aoi.AddPlayer(i + 1, i * 100.f, 0, (i % 2) * 100.f);
+  }
+  BOOST_TEST_REQUIRE((aoi.Tick().empty()));
+  BOOST_TEST_REQUIRE((aoi.GetEngineKind() == kEngineSquares));
+  BOOST_TEST_REQUIRE((aoi.GetSceneShape().neighbours < 0.5f * 40));
+
+  // 全挤到一起，每个 sensor 都看到所有人，换成 simd_brute。切换本身不产生事件，挤过来的玩家照常进入
+  for (int i : boost::irange(40)) {
+    aoi.UpdatePos(i + 1, (i % 7) * 1.f, 0, (i / 7) * 1.f);
+  }
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 8));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters.size() == 39));
+  BOOST_TEST_REQUIRE((aoi.GetEngineKind() == kEngineBrute));
+  BOOST_TEST_REQUIRE((aoi.Tick().empty()));
+  BOOST_TEST_REQUIRE((aoi.GetSwitchCount() == 3));
+
+  // 散开之后回到 squares，离开的玩家照常离开
+  for (int i : boost::irange(40)) {
+    aoi.UpdatePos(i + 1, i * 100.f, 0, (i % 2) * 100.f);
+  }
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves.size() == 39));
+  BOOST_TEST_REQUIRE((aoi.GetEngineKind() == kEngineSquares));
+  BOOST_TEST_REQUIRE((aoi.Tick().empty()));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_memory_usage) {
+  Arena arena;
+  AdaptiveConfig config;
+  config.check_interval = 0;
+  AdaptiveAoi aoi(config, kEngineSquares, &arena);
+  for (int i : boost::irange(100)) {
+    aoi.AddPlayer(i + 1, i, 0, 0);
+    if (i % 2 == 0) aoi.AddSensor(i + 1, 1000 + i, 10);
+  }
+  aoi.Tick();
+  auto usage = aoi.GetMemoryUsage();
+  BOOST_TEST_REQUIRE((usage.players > 0 && usage.sensors > 0 && usage.aoi_lists > 0));
+
+  // 切换之后只剩新算法的内存，都从同一个 arena 分配
+  size_t used = arena.GetUsedBytes();
+  aoi.RequestSwitch(kEngineBrute);
+  aoi.Tick();
+  BOOST_TEST_REQUIRE((arena.GetUsedBytes() > used));
+  BOOST_TEST_REQUIRE((aoi.GetEngineKind() == kEngineBrute));
+  usage = aoi.GetMemoryUsage();
+  BOOST_TEST_REQUIRE((usage.players == 100 * sizeof(simd_brute::PlayerAoi)));
+  BOOST_TEST_REQUIRE((usage.candidates == 0));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
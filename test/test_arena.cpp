@@ -0,0 +1,92 @@
+// Copyright <disenone>
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#define BOOST_TEST_MODULE test_arena
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/included/unit_test.hpp>
+#include <boost/range/irange.hpp>
+#include <boost/container/pmr/unsynchronized_pool_resource.hpp>
+
+#include <common/arena.hpp>
+
+using namespace aoi;
+
+BOOST_AUTO_TEST_SUITE(test_arena)
+
+BOOST_AUTO_TEST_CASE(test_allocate) {
+  Arena arena(4096);
+  BOOST_TEST_REQUIRE((arena.GetChunkNum() == 0 && arena.GetReservedBytes() == 0));
+
+  auto first = static_cast<char*>(arena.Allocate(10, 1));
+  auto second = static_cast<char*>(arena.Allocate(8, 8));
+  BOOST_TEST_REQUIRE((reinterpret_cast<uintptr_t>(second) % 8 == 0));
+  BOOST_TEST_REQUIRE((second >= first + 10));
+  BOOST_TEST_REQUIRE((arena.GetChunkNum() == 1 && arena.GetReservedBytes() == 4096));
+  BOOST_TEST_REQUIRE((arena.GetUsedBytes() == static_cast<size_t>(second + 8 - first)));
+
+  // 当前块放不下就换一块新的
+  for (int i : boost::irange(100)) {
+    auto ptr = arena.Allocate(100, 64);
+    BOOST_TEST_REQUIRE((reinterpret_cast<uintptr_t>(ptr) % 64 == 0));
+    std::memset(ptr, i, 100);
+  }
+  BOOST_TEST_REQUIRE((arena.GetChunkNum() > 1));
+
+  // 比块还大的分配单独一块，大小是块大小的整数倍
+  size_t reserved = arena.GetReservedBytes();
+  arena.Allocate(10000);
+  BOOST_TEST_REQUIRE((arena.GetReservedBytes() - reserved == 3 * 4096));
+}
+
+BOOST_AUTO_TEST_CASE(test_huge_pages) {
+  Arena arena(4096, true);
+  BOOST_TEST_REQUIRE(arena.IsHugePages());
+  auto ptr = arena.Allocate(16);
+  BOOST_TEST_REQUIRE((arena.GetReservedBytes() == Arena::kHugePageSize));
+  BOOST_TEST_REQUIRE((reinterpret_cast<uintptr_t>(ptr) % Arena::kHugePageSize == 0));
+}
+
+BOOST_AUTO_TEST_CASE(test_allocator) {
+  Arena arena(4096);
+  std::vector<int, ResourceAllocator<int>> values{ResourceAllocator<int>(&arena)};
+  for (int i : boost::irange(1000)) values.push_back(i);
+  BOOST_TEST_REQUIRE((values[999] == 999));
+  BOOST_TEST_REQUIRE((arena.GetUsedBytes() >= 1000 * sizeof(int)));
+
+  // 拷贝出来的容器用普通堆，移动时跟着原来的 arena
+  auto copied = values;
+  BOOST_TEST_REQUIRE((copied.get_allocator().GetResource() == nullptr));
+  BOOST_TEST_REQUIRE((copied == values));
+  auto moved = std::move(values);
+  BOOST_TEST_REQUIRE((moved.get_allocator().GetResource() == &arena));
+
+  // 没有 arena 时就是普通的 new / delete
+  std::vector<int, ResourceAllocator<int>> heap_values;
+  heap_values.assign(100, 1);
+  BOOST_TEST_REQUIRE((heap_values.get_allocator().GetResource() == nullptr));
+}
+
+BOOST_AUTO_TEST_CASE(test_resource) {
+  // Arena 可以当成普通的 memory_resource 用，释放什么都不做
+  Arena arena(4096);
+  MemoryResource *resource = &arena;
+  auto ptr = resource->allocate(100, 16);
+  BOOST_TEST_REQUIRE((reinterpret_cast<uintptr_t>(ptr) % 16 == 0));
+  resource->deallocate(ptr, 100, 16);
+  BOOST_TEST_REQUIRE((arena.GetUsedBytes() >= 100));
+  BOOST_TEST_REQUIRE(resource->is_equal(arena));
+
+  // 池化的 resource 真正释放，释放时的大小要和分配时一致
+  boost::container::pmr::unsynchronized_pool_resource pool;
+  std::vector<int, ResourceAllocator<int>> values{ResourceAllocator<int>(&pool)};
+  for (int i : boost::irange(1000)) values.push_back(i);
+  values.erase(values.begin(), values.begin() + 500);
+  values.shrink_to_fit();
+  BOOST_TEST_REQUIRE((values.front() == 500 && values.size() == 500));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
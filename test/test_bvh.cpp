@@ -0,0 +1,340 @@
+// Copyright <disenone>
+
+#include <iostream>
+#include <set>
+#include <utility>
+#include <vector>
+#include <cmath>
+#include <ctime>
+
+#define BOOST_TEST_MODULE test_bvh
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/included/unit_test.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <boost/timer/timer.hpp>
+#include <boost/range/irange.hpp>
+
+#include <common/arena.hpp>
+#include <common/nuid.hpp>
+#include <common/silence_unused.hpp>
+#include <bvh/bvh.hpp>
+
+using namespace aoi;
+using namespace aoi::bvh;
+
+BOOST_AUTO_TEST_SUITE(test_bvh)
+
+typedef std::set<std::pair<size_t, size_t>> ProxyPairs;
+
+
+BOOST_AUTO_TEST_CASE(test_dynamic_tree) {
+  // 随机增删移动，树一直保持合法、平衡，两棵树的相交对和两两比较的结果一致
+  boost::random::mt19937 random_generator(20211118);
+  boost::random::uniform_real_distribution<float> pos_gen(-500, 500);
+  boost::random::uniform_real_distribution<float> move_gen(-20, 20);
+  boost::random::uniform_real_distribution<float> half_gen(0, 50);
+  std::vector<Aabb> left_boxes, right_boxes;
+  std::vector<int> left_proxies, right_proxies;
+  DynamicTree left(5), right(0);
+  for (size_t i : boost::irange(300)) {
+    left_boxes.push_back(Aabb::Around(pos_gen(random_generator), pos_gen(random_generator),
+                                      i % 50 == 0 ? 300 : half_gen(random_generator)));
+    left_proxies.push_back(left.CreateProxy(left_boxes.back(), nullptr, i));
+    right_boxes.push_back(Aabb::Around(pos_gen(random_generator), pos_gen(random_generator), 0));
+    right_proxies.push_back(right.CreateProxy(right_boxes.back(), nullptr, i));
+  }
+  BOOST_TEST_REQUIRE((left.IsValid() && right.IsValid()));
+  BOOST_TEST_REQUIRE((left.GetProxyNum() == 300 && right.GetProxyNum() == 300));
+  // 平衡的二叉树，300 个叶子不会比 20 层更高
+  BOOST_TEST_REQUIRE((left.GetHeight() < 20 && right.GetHeight() < 20));
+
+  for (int round : boost::irange(10)) {
+    for (size_t i : boost::irange(left_boxes.size())) {
+      float dx = move_gen(random_generator), dz = move_gen(random_generator);
+      auto &box = left_boxes[i];
+      box = Aabb(box.min_x + dx, box.min_z + dz, box.max_x + dx, box.max_z + dz);
+      left.MoveProxy(left_proxies[i], box);
+      BOOST_TEST_REQUIRE((left.GetFatAabb(left_proxies[i]).Contains(box)));
+    }
+    // 删掉一半再加回来，空闲的节点被复用
+    for (size_t i = round % 2; i < right_boxes.size(); i += 2) {
+      right.DestroyProxy(right_proxies[i]);
+    }
+    for (size_t i = round % 2; i < right_boxes.size(); i += 2) {
+      right_boxes[i] = Aabb::Around(pos_gen(random_generator), pos_gen(random_generator), 0);
+      right_proxies[i] = right.CreateProxy(right_boxes[i], nullptr, i);
+    }
+    BOOST_TEST_REQUIRE((left.IsValid() && right.IsValid()));
+
+    ProxyPairs expected, found;
+    for (size_t i : boost::irange(left_boxes.size())) {
+      for (size_t j : boost::irange(right_boxes.size())) {
+        if (left.GetFatAabb(left_proxies[i]).Overlaps(right.GetFatAabb(right_proxies[j]))) {
+          expected.emplace(i, j);
+        }
+      }
+    }
+    left.QueryPairs(right, [&](int left_proxy, int right_proxy) {
+      found.emplace(left.GetUserTag(left_proxy), right.GetUserTag(right_proxy));
+    });
+    BOOST_TEST_REQUIRE((found == expected));
+
+    std::set<size_t> query_found;
+    Aabb query = Aabb::Around(0, 0, 100);
+    right.Query(query, [&](int proxy) { query_found.insert(right.GetUserTag(proxy)); });
+    for (size_t j : boost::irange(right_boxes.size())) {
+      bool overlaps = right.GetFatAabb(right_proxies[j]).Overlaps(query);
+      BOOST_TEST_REQUIRE((overlaps == (query_found.count(j) > 0)));
+    }
+  }
+
+  for (int proxy : right_proxies) right.DestroyProxy(proxy);
+  BOOST_TEST_REQUIRE((right.IsValid() && right.GetProxyNum() == 0 && right.GetHeight() == -1));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_simple) {
+  BvhAoi aoi;
+  aoi.AddPlayer(1, 0, 0, 0);
+  aoi.AddSensor(1, 100, 10);
+  aoi.AddPlayer(2, 0, 0, 0);
+  aoi.AddSensor(2, 200, 5);
+
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 2));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{2}));
+  BOOST_TEST_REQUIRE((update_infos[2].sensor_update_list[0].enters == PlayerNuids{1}));
+
+  aoi.UpdatePos(2, 6, 0, 0);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 1));
+  BOOST_TEST_REQUIRE((update_infos[2].sensor_update_list[0].leaves == PlayerNuids{1}));
+
+  aoi.UpdatePos(2, 600, 0, 100);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 1));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{2}));
+
+  aoi.UpdatePos(1, 601, 0, 101);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 2));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{2}));
+  BOOST_TEST_REQUIRE((update_infos[2].sensor_update_list[0].enters == PlayerNuids{1}));
+
+  aoi.RemovePlayer(2);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 1));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{2}));
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == 1));
+  BOOST_TEST_REQUIRE((aoi.GetPlayerTree().GetProxyNum() == 1));
+  BOOST_TEST_REQUIRE((aoi.GetSensorTree().GetProxyNum() == 1));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_mixed_radius) {
+  // 一个看整个战场的 sensor 和一群只看几米的 sensor 混在一起
+  BvhAoi aoi;
+  aoi.AddPlayer(1, 0, 0, 500);
+  aoi.AddSensor(1, 100, 5000);
+  for (Nuid nuid : boost::irange<Nuid>(2, 102)) {
+    aoi.AddPlayer(nuid, nuid * 40.f - 2000, 0, (nuid % 10) * 3.f);
+    aoi.AddSensor(nuid, nuid * 1000, 2);
+  }
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 1));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters.size() == 100));
+  if (kAoiStatsEnabled) {
+    // 小 sensor 的盒子互不相交，只和自己、以及大 sensor 的主人相交
+    BOOST_TEST_REQUIRE((aoi.GetTickStats().candidates_accepted == 100));
+    BOOST_TEST_REQUIRE((aoi.GetTickStats().pairs_found < 400));
+  }
+
+  // 走到一个小 sensor 旁边，只有它看到
+  aoi.UpdatePos(1, 41 * 40.f - 2000 + 1, 0, 3);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 1));
+  BOOST_TEST_REQUIRE((update_infos[41].sensor_update_list[0].enters == PlayerNuids{1}));
+  BOOST_TEST_REQUIRE((aoi.GetPlayerTree().IsValid() && aoi.GetSensorTree().IsValid()));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_margin) {
+  BvhAoi aoi(10);
+  aoi.AddPlayer(1, 0, 0, 0);
+  aoi.AddSensor(1, 100, 50);
+  for (Nuid nuid : boost::irange<Nuid>(2, 50)) {
+    aoi.AddPlayer(nuid, nuid * 10.f, 0, 0);
+  }
+  aoi.Tick();
+  auto proxy = aoi.GetPlayerMap().at(2)->proxy;
+  auto fat_aabb = aoi.GetPlayerTree().GetFatAabb(proxy);
+
+  // 在放大的盒子里移动，树不变
+  aoi.UpdatePos(2, 25, 0, 5);
+  BOOST_TEST_REQUIRE((aoi.GetPlayerTree().GetFatAabb(proxy).Contains(fat_aabb)));
+  aoi.Tick();
+  if (kAoiStatsEnabled) {
+    BOOST_TEST_REQUIRE((aoi.GetTickStats().proxies_refit == 0));
+    BOOST_TEST_REQUIRE((aoi.GetTickStats().proxies_reinserted == 0));
+  }
+
+  // 走远了重新插入，移动过的代理还是同一个
+  aoi.UpdatePos(2, 2000, 0, 0);
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().at(2)->proxy == proxy));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{2}));
+  if (kAoiStatsEnabled) {
+    BOOST_TEST_REQUIRE((aoi.GetTickStats().proxies_reinserted == 1));
+  }
+
+  // sensor 的盒子跟着玩家走
+  aoi.UpdatePos(1, 1995, 0, 0);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{2}));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves.size() == 2));
+  BOOST_TEST_REQUIRE((aoi.GetPlayerTree().IsValid() && aoi.GetSensorTree().IsValid()));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_remove_and_add) {
+  BvhAoi aoi;
+  aoi.AddPlayer(1, 0, 0, 0);
+  aoi.AddSensor(1, 100, 10);
+  aoi.AddPlayer(2, 3, 0, 0);
+  aoi.AddSensor(2, 200, 10);
+  aoi.Tick();
+
+  // 同一次 Tick 里移除又加回来，没有进出，也不会被删掉
+  aoi.RemovePlayer(2);
+  aoi.RemovePlayer(2);
+  aoi.AddPlayer(2, 4, 0, 0);
+  BOOST_TEST_REQUIRE(aoi.Tick().empty());
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == 2));
+  BOOST_TEST_REQUIRE((aoi.GetSensorTree().GetProxyNum() == 2));
+
+  // 移除的玩家移动、加 sensor 不影响树
+  aoi.RemovePlayer(2);
+  aoi.UpdatePos(2, 5, 0, 0);
+  aoi.AddSensor(2, 201, 10);
+  BOOST_TEST_REQUIRE((aoi.GetPlayerTree().GetProxyNum() == 1));
+  BOOST_TEST_REQUIRE((aoi.GetSensorTree().GetProxyNum() == 1));
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{2}));
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == 1));
+  BOOST_TEST_REQUIRE((aoi.GetPlayerTree().IsValid() && aoi.GetSensorTree().IsValid()));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_memory_usage) {
+  Arena arena;
+  BvhAoi aoi(10, &arena);
+  BOOST_TEST_REQUIRE((aoi.GetMemoryResource() == &arena));
+  auto empty_usage = aoi.GetMemoryUsage();
+  BOOST_TEST_REQUIRE((empty_usage.players == 0 && empty_usage.sensors == 0));
+
+  for (int i : boost::irange(100)) {
+    aoi.AddPlayer(i + 1, i, 0, 0);
+    if (i % 2 == 0) aoi.AddSensor(i + 1, 1000 + i, 10);
+  }
+  size_t used = arena.GetUsedBytes();
+  aoi.Tick();
+  BOOST_TEST_REQUIRE((arena.GetUsedBytes() > used));
+  auto usage = aoi.GetMemoryUsage();
+  BOOST_TEST_REQUIRE((usage.players == 100 * sizeof(PlayerAoi)));
+  BOOST_TEST_REQUIRE((usage.sensors >= 50 * sizeof(Sensor)));
+  BOOST_TEST_REQUIRE((usage.cells > 0));
+  BOOST_TEST_REQUIRE((usage.aoi_lists > 0 && usage.candidates == 0));
+  BOOST_TEST_REQUIRE((usage.Total() > empty_usage.Total()));
+}
+
+
+std::vector<Pos> GenPositions(const size_t player_num, const float map_size) {
+  std::vector<Pos> positions;
+  positions.reserve(player_num);
+
+  boost::random::mt19937 random_generator(std::time(0));
+  boost::random::uniform_real_distribution<float> pos_generator(-map_size, map_size);
+  for (int UNUSED(i) : boost::irange(player_num)) {
+    positions.emplace_back(pos_generator(random_generator), 0, pos_generator(random_generator));
+  }
+  return positions;
+}
+
+
+std::vector<Pos> GenMovements(const size_t player_num, const float length) {
+  std::vector<Pos> movements;
+  movements.reserve(player_num);
+
+  boost::random::mt19937 random_generator(std::time(0));
+  boost::random::uniform_real_distribution<float> angle_gen(0, 360);
+  for (int UNUSED(i) : boost::irange(player_num)) {
+    float angle = angle_gen(random_generator);
+    float radian = 2 * M_PI * angle / 360;
+    movements.emplace_back(std::cos(radian) * length, 0, std::sin(radian) * length);
+  }
+
+  return movements;
+}
+
+
+void TestOneMilestone(std::vector<Pos> *positions, const size_t player_num,
+                      const float map_size) {
+  printf("\n===Begin Milestore: player_num = %lu, map_size = (%f, %f)\n",
+         player_num, -map_size, map_size);
+
+  boost::timer::cpu_timer run_timer;
+  BvhAoi aoi;
+  std::vector<Nuid> nuids;
+  nuids.reserve(player_num);
+  for (const auto &pos : *positions) {
+    nuids.push_back(GenNuid());
+    aoi.AddPlayer(nuids.back(), pos.x, pos.y, pos.z);
+    aoi.AddSensor(nuids.back(), GenNuid(), 100);
+  }
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == player_num));
+  run_timer.stop();
+  printf("Add Player (1 times)");
+  std::cout << run_timer.format();
+
+  aoi.Tick();
+  printf("Player tree height: %d, sensor tree height: %d\n", aoi.GetPlayerTree().GetHeight(),
+         aoi.GetSensorTree().GetHeight());
+
+  run_timer.start();
+  aoi.Tick();
+  run_timer.stop();
+  printf("Tick (1 times)");
+  std::cout << run_timer.format();
+
+  float speed = 6;
+  float delta_time = 0.1;
+  auto movements = GenMovements(player_num, delta_time * speed);
+  int times = 1 / delta_time;
+  run_timer.start();
+  for (int UNUSED(t) : boost::irange(times)) {
+    for (int i : boost::irange(player_num)) {
+      auto &pos = positions->at(i);
+      auto &move = movements[i];
+      pos.Set(pos.x + move.x, pos.y + move.y, pos.z + move.z);
+      aoi.UpdatePos(nuids[i], pos.x, pos.y, pos.z);
+    }
+  }
+  run_timer.stop();
+  printf("Update Pos (%i times)", times);
+  std::cout << run_timer.format();
+
+  printf("===End Milestore\n");
+}
+
+
+BOOST_AUTO_TEST_CASE(test_milestone) {
+  for (size_t player_num : {100, 1000, 10000}) {
+    for (float map_size : {50, 100, 1000, 10000}) {
+      auto positions = GenPositions(player_num, map_size);
+      TestOneMilestone(&positions, player_num, map_size);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -220,6 +220,220 @@ BOOST_AUTO_TEST_CASE(test_simple) {
 }
 
 
+BOOST_AUTO_TEST_CASE(test_tick_stats) {
+  CrossAoiTest cross_aoi;
+
+  Player player1{GenNuid(), {0, 0, 0}};
+  player1.AddToAoi(&cross_aoi);
+  player1.AddSensor(10);
+
+  Player player2{GenNuid(), {1, 0, 1}};
+  player2.AddToAoi(&cross_aoi);
+  player2.AddSensor(5);
+
+  cross_aoi.Tick();
+  auto stats = cross_aoi.GetTickStats();
+  if (!kAoiStatsEnabled) {
+    BOOST_TEST_REQUIRE((stats.nodes_crossed == 0));
+    BOOST_TEST_REQUIRE((stats.enters == 0));
+    return;
+  }
+
+  BOOST_TEST_REQUIRE((stats.nodes_crossed > 0));
+  BOOST_TEST_REQUIRE((stats.move_ins > 0));
+  BOOST_TEST_REQUIRE((stats.candidates_scanned == 2));
+  BOOST_TEST_REQUIRE((stats.candidates_accepted == 2));
+  BOOST_TEST_REQUIRE((stats.enters == 2));
+  BOOST_TEST_REQUIRE((stats.leaves == 0));
+
+  player2.MoveTo(600, 0, 100);
+  cross_aoi.Tick();
+  stats = cross_aoi.GetTickStats();
+  BOOST_TEST_REQUIRE((stats.move_outs >= 2));
+  BOOST_TEST_REQUIRE((stats.candidates_scanned == 0));
+  BOOST_TEST_REQUIRE((stats.enters == 0));
+  BOOST_TEST_REQUIRE((stats.leaves == 2));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_leave_radius) {
+  CrossAoiTest aoi;
+  aoi.AddPlayer(1, 0, 0, 0);
+  aoi.AddSensor(1, 100, 10);
+  aoi.SetSensorLeaveRadius(1, 100, 15);
+  aoi.AddPlayer(2, 12, 0, 0);
+
+  // 在进入半径外，看不到
+  BOOST_TEST_REQUIRE(aoi.Tick().empty());
+
+  aoi.UpdatePos(2, 9, 0, 0);
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{2}));
+
+  // 在进入和离开半径之间来回走，不产生事件
+  for (float x : {12.f, 9.5f, 14.5f, 11.f}) {
+    aoi.UpdatePos(2, x, 0, 0);
+    BOOST_TEST_REQUIRE(aoi.Tick().empty());
+  }
+
+  aoi.UpdatePos(2, 16, 0, 0);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{2}));
+
+  aoi.UpdatePos(2, 14, 0, 0);
+  BOOST_TEST_REQUIRE(aoi.Tick().empty());
+
+  // 离开半径设回进入半径，14 超出了 10
+  aoi.UpdatePos(2, 9, 0, 0);
+  aoi.Tick();
+  aoi.SetSensorLeaveRadius(1, 100, 0);
+  aoi.UpdatePos(2, 14, 0, 0);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{2}));
+}
+
+BOOST_AUTO_TEST_CASE(test_sensor_interval) {
+  CrossAoiTest aoi;
+  for (int i = 1; i <= 4; ++i) {
+    aoi.AddPlayer(i, i * 100, 0, 0);
+    aoi.AddSensor(i, 100 + i, 10);
+    aoi.SetSensorInterval(i, 100 + i, 2);
+    aoi.AddPlayer(10 + i, i * 100 + 5, 0, 0);
+  }
+
+  // 刚设置间隔的 sensor 马上计算
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 4));
+
+  // 相位错开，每次 Tick 只有一半的 sensor 计算
+  for (int i = 1; i <= 4; ++i) {
+    aoi.UpdatePos(10 + i, i * 100 + 20, 0, 0);
+  }
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 2));
+  BOOST_TEST_REQUIRE((update_infos[2].sensor_update_list[0].leaves == PlayerNuids{12}));
+  BOOST_TEST_REQUIRE((update_infos[4].sensor_update_list[0].leaves == PlayerNuids{14}));
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 2));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{11}));
+  BOOST_TEST_REQUIRE((update_infos[3].sensor_update_list[0].leaves == PlayerNuids{13}));
+
+  // 1 下一次 Tick 不计算，再下一次才看到 11
+  aoi.UpdatePos(11, 105, 0, 0);
+  BOOST_TEST_REQUIRE(aoi.Tick().empty());
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{11}));
+
+  // 11 被移除，1 计算的时候才离开
+  aoi.RemovePlayer(11);
+  BOOST_TEST_REQUIRE(aoi.Tick().empty());
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == 7));
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 1));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{11}));
+}
+
+BOOST_AUTO_TEST_CASE(test_static_entity) {
+  CrossAoiTest aoi;
+  aoi.AddPlayer(1, 0, 0, 0);
+  aoi.AddSensor(1, 100, 10);
+  aoi.AddPlayer(2, 3, 0, 0);
+  aoi.AddStaticEntity(50, 5, 0, 0);
+  aoi.AddStaticEntity(51, 30, 0, 0);
+
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{2, 50}));
+  // 静态实体不是玩家
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == 2));
+
+  // 只有玩家移动，sensor 没动，静态实体不产生事件
+  aoi.UpdatePos(2, 40, 0, 0);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{2}));
+
+  aoi.UpdatePos(1, 25, 0, 0);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{51}));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{50}));
+}
+
+BOOST_AUTO_TEST_CASE(test_observed_only) {
+  CrossAoiTest aoi;
+  aoi.AddPlayer(1, 0, 0, 0);
+  aoi.AddPlayer(2, 5, 0, 0);
+  const auto &player_map = aoi.GetPlayerMap();
+  // 没有 sensor 的实体不分配 sensor 相关的部分
+  BOOST_TEST_REQUIRE(!player_map.at(1)->observer);
+  BOOST_TEST_REQUIRE(!player_map.at(2)->observer);
+
+  aoi.AddSensor(1, 100, 10);
+  BOOST_TEST_REQUIRE(player_map.at(1)->HasSensor());
+  BOOST_TEST_REQUIRE(!player_map.at(2)->observer);
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{2}));
+
+  aoi.UpdatePos(2, 20, 0, 0);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{2}));
+
+  // 最后一个 sensor 删掉之后退回只被观察的形式
+  aoi.RemoveSensor(1, 100);
+  BOOST_TEST_REQUIRE(!player_map.at(1)->observer);
+  aoi.UpdatePos(2, 5, 0, 0);
+  BOOST_TEST_REQUIRE(aoi.Tick().empty());
+
+  aoi.AddSensor(1, 101, 10);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].sensor_id == 101));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{2}));
+}
+
+BOOST_AUTO_TEST_CASE(test_category) {
+  CrossAoiTest aoi;
+  aoi.AddPlayer(1, 0, 0, 0);
+  aoi.AddSensor(1, 100, 10);
+  aoi.SetSensorInterest(1, 100, 2);
+  aoi.AddPlayer(2, 3, 0, 0);
+  aoi.AddPlayer(3, -3, 0, 0);
+  aoi.SetPlayerCategory(3, 2);
+  aoi.AddStaticEntity(50, 5, 0, 0);
+
+  // 默认 category 的玩家和静态实体都不在 interest 里
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{3}));
+
+  // 不移动只改 category 也要产生进出
+  aoi.SetPlayerCategory(2, 3);
+  aoi.SetPlayerCategory(3, kDefaultCategory);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{2}));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{3}));
+
+  aoi.SetSensorInterest(1, 100, kAllCategories);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{3, 50}));
+  BOOST_TEST_REQUIRE(update_infos[1].sensor_update_list[0].leaves.empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_memory_usage) {
+  CrossAoiTest aoi;
+  auto empty_usage = aoi.GetMemoryUsage();
+  BOOST_TEST_REQUIRE((empty_usage.players == 0 && empty_usage.sensors == 0));
+
+  for (int i : boost::irange(100)) {
+    aoi.AddPlayer(i + 1, i, 0, 0);
+    if (i % 2 == 0) aoi.AddSensor(i + 1, 1000 + i, 10);
+  }
+  aoi.Tick();
+  auto usage = aoi.GetMemoryUsage();
+  // 只有一半的玩家有 sensor，分配了 ObserverPart
+  BOOST_TEST_REQUIRE((usage.players == 100 * sizeof(PlayerAoi) + 50 * sizeof(ObserverPart)));
+  BOOST_TEST_REQUIRE((usage.sensors >= 50 * sizeof(Sensor)));
+  BOOST_TEST_REQUIRE((usage.candidates > 0 && usage.cells == 0));
+  BOOST_TEST_REQUIRE((usage.aoi_lists > 0));
+  BOOST_TEST_REQUIRE((usage.Total() > empty_usage.Total()));
+}
+
 std::vector<Player> GenPlayers(const size_t player_num, const float map_size) {
   std::vector<Player> players(player_num);
 
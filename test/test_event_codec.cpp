@@ -0,0 +1,158 @@
+// Copyright <disenone>
+
+#include <algorithm>
+#include <vector>
+
+#define BOOST_TEST_MODULE test_event_codec
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/included/unit_test.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <boost/range/irange.hpp>
+
+#include <common/event_codec.hpp>
+#include <common/nuid.hpp>
+#include <common/silence_unused.hpp>
+#include <squares/squares.hpp>
+
+using namespace aoi;
+using namespace aoi::squares;
+
+BOOST_AUTO_TEST_SUITE(test_event_codec)
+
+BOOST_AUTO_TEST_CASE(test_varint) {
+  Uint8 buffer[kMaxVarintBytes];
+  for (Uint64 value : {Uint64(0), Uint64(1), Uint64(127), Uint64(128), Uint64(300),
+                       Uint64(1) << 35, ~Uint64(0)}) {
+    auto end = EncodeVarint(value, buffer, buffer + sizeof(buffer));
+    BOOST_TEST_REQUIRE((end != nullptr));
+    Uint64 decoded = 0;
+    BOOST_TEST_REQUIRE((DecodeVarint(buffer, end, &decoded) == end));
+    BOOST_TEST_REQUIRE((decoded == value));
+    // 少一个字节写不下，也读不出来
+    BOOST_TEST_REQUIRE((EncodeVarint(value, buffer, end - 1) == nullptr));
+    BOOST_TEST_REQUIRE((DecodeVarint(buffer, end - 1, &decoded) == nullptr));
+  }
+  BOOST_TEST_REQUIRE((EncodeVarint(127, buffer, buffer + 1) == buffer + 1));
+  BOOST_TEST_REQUIRE((EncodeVarint(128, buffer, buffer + 3) == buffer + 2));
+  BOOST_TEST_REQUIRE((EncodeVarint(~Uint64(0), buffer, buffer + 10) == buffer + 10));
+
+  // zigzag：绝对值小的正负差值都很短
+  BOOST_TEST_REQUIRE((ZigZagEncode(0) == 0));
+  BOOST_TEST_REQUIRE((ZigZagEncode(static_cast<Uint64>(-1)) == 1));
+  BOOST_TEST_REQUIRE((ZigZagEncode(1) == 2));
+  BOOST_TEST_REQUIRE((ZigZagEncode(static_cast<Uint64>(-64)) == 127));
+  for (Uint64 delta : {Uint64(0), Uint64(5), static_cast<Uint64>(-5), ~Uint64(0) >> 1,
+                       ~(~Uint64(0) >> 1)}) {
+    BOOST_TEST_REQUIRE((ZigZagDecode(ZigZagEncode(delta)) == delta));
+  }
+
+  // 超过 64 位的 varint 是坏数据
+  Uint8 overlong[11] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01};
+  Uint64 decoded = 0;
+  BOOST_TEST_REQUIRE((DecodeVarint(overlong, overlong + 11, &decoded) == nullptr));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_simple) {
+  AoiUpdateInfos update_infos;
+  update_infos[300] = {300, {{2, {1000, 1001, 999}, {5}}, {1, {}, {7, 3}}}};
+  update_infos[200] = {200, {{9, {1}, {}}}};
+
+  EventEncoder encoder;
+  std::vector<Uint8> buffer(EventEncoder::MaxEncodedSize(update_infos));
+  size_t size = encoder.Encode(&update_infos, buffer.data(), buffer.size());
+  // 原地排好序
+  BOOST_TEST_REQUIRE((update_infos[300].sensor_update_list[0].sensor_id == 1));
+  BOOST_TEST_REQUIRE((update_infos[300].sensor_update_list[0].leaves == PlayerNuids{3, 7}));
+  BOOST_TEST_REQUIRE((update_infos[300].sensor_update_list[1].enters ==
+                      PlayerNuids{999, 1000, 1001}));
+
+  std::vector<Uint8> expect = {
+    2,                            // watcher_num
+    200 - 128 + 0x80, 1, 1,       // watcher 200，1 个 sensor
+    18, 1, 0, 1,                  // sensor 9（差 9）：enters {1}
+    100, 2,                       // watcher 300，2 个 sensor
+    15, 0, 2, 3, 4,               // sensor 1（差 -8）：leaves {3, 7}
+    // sensor 2（差 1）：enters {999, 1000, 1001}，leaves {5}
+    2, 3, 1, 999 - 896 + 0x80, 7, 1, 1, 5,
+  };
+  BOOST_TEST_REQUIRE((size == expect.size()));
+  BOOST_TEST_REQUIRE((std::equal(expect.begin(), expect.end(), buffer.begin())));
+
+  AoiUpdateInfos decoded;
+  BOOST_TEST_REQUIRE(DecodeEvents(buffer.data(), size, &decoded));
+  BOOST_TEST_REQUIRE((decoded.size() == 2));
+  BOOST_TEST_REQUIRE((decoded[200].nuid == 200));
+  BOOST_TEST_REQUIRE((decoded[200].sensor_update_list[0].enters == PlayerNuids{1}));
+  BOOST_TEST_REQUIRE((decoded[300].sensor_update_list[1].sensor_id == 2));
+  BOOST_TEST_REQUIRE((decoded[300].sensor_update_list[1].leaves == PlayerNuids{5}));
+
+  // buffer 不够时返回 0，截断的数据解不出来
+  for (size_t capacity : boost::irange(size)) {
+    BOOST_TEST_REQUIRE((encoder.Encode(&update_infos, buffer.data(), capacity) == 0));
+  }
+  BOOST_TEST_REQUIRE((!DecodeEvents(buffer.data(), size - 1, &decoded)));
+
+  // 没有事件时只有一个 0
+  AoiUpdateInfos empty;
+  BOOST_TEST_REQUIRE((encoder.Encode(&empty, buffer.data(), buffer.size()) == 1));
+  BOOST_TEST_REQUIRE((buffer[0] == 0));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_round_trip) {
+  // squares 的真实事件编码后解回来一样，比每个 nuid 8 个字节小得多
+  boost::random::mt19937 random_generator(20211210);
+  boost::random::uniform_real_distribution<float> pos_gen(-300, 300);
+  boost::random::uniform_real_distribution<float> move_gen(-10, 10);
+  SquareAoi aoi(100);
+  std::vector<Nuid> nuids;
+  std::vector<Pos> positions;
+  for (int i : boost::irange(500)) {
+    nuids.push_back(GenNuid());
+    positions.emplace_back(pos_gen(random_generator), 0, pos_gen(random_generator));
+    aoi.AddPlayer(nuids.back(), positions.back().x, 0, positions.back().z);
+    aoi.AddSensor(nuids.back(), GenNuid(), 50);
+    if (i % 5 == 0) aoi.AddSensor(nuids.back(), GenNuid(), 100);
+  }
+
+  EventEncoder encoder;
+  std::vector<Uint8> buffer;
+  for (int t : boost::irange(5)) {
+    auto update_infos = aoi.Tick();
+    buffer.resize(EventEncoder::MaxEncodedSize(update_infos));
+    size_t size = encoder.Encode(&update_infos, buffer.data(), buffer.size());
+    BOOST_TEST_REQUIRE((size > 0));
+
+    size_t raw_size = 0;
+    for (const auto &elem : update_infos) {
+      for (const auto &sensor_info : elem.second.sensor_update_list) {
+        raw_size += (sensor_info.enters.size() + sensor_info.leaves.size()) * sizeof(Nuid);
+      }
+    }
+    if (t == 0) BOOST_TEST_REQUIRE((size * 2 < raw_size));
+
+    AoiUpdateInfos decoded;
+    BOOST_TEST_REQUIRE(DecodeEvents(buffer.data(), size, &decoded));
+    BOOST_TEST_REQUIRE((decoded.size() == update_infos.size()));
+    for (auto &elem : update_infos) {
+      const auto &sensor_list = elem.second.sensor_update_list;
+      const auto &decoded_list = decoded[elem.first].sensor_update_list;
+      BOOST_TEST_REQUIRE((decoded_list.size() == sensor_list.size()));
+      for (size_t s : boost::irange(sensor_list.size())) {
+        BOOST_TEST_REQUIRE((decoded_list[s].sensor_id == sensor_list[s].sensor_id));
+        BOOST_TEST_REQUIRE((decoded_list[s].enters == sensor_list[s].enters));
+        BOOST_TEST_REQUIRE((decoded_list[s].leaves == sensor_list[s].leaves));
+      }
+    }
+
+    for (size_t i : boost::irange(nuids.size())) {
+      auto &pos = positions[i];
+      pos.Set(pos.x + move_gen(random_generator), 0, pos.z + move_gen(random_generator));
+      aoi.UpdatePos(nuids[i], pos.x, 0, pos.z);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,493 @@
+// Copyright <disenone>
+//
+// 差分模糊测试：随机生成 AddPlayer / UpdatePos / RemovePlayer / AddSensor 操作（包括在同一个
+// Tick 里和之后的 Tick 里重新加入移除的玩家），同时作用到 brute、squares、cross、quadtree、bvh、
+// sorted_grid、simd_brute 和 adaptive 上，每次 Tick 都要求进出集合完全一致。出错时把操作序列
+// 收缩到最小，打印出来并保存成 trace 文件，可以用 aoi_replay 复现。
+// Differential fuzzer: every engine must report the same enter/leave sets every tick.
+// Failures are shrunk to a minimal op list and saved as a trace file.
+//
+// AOI_FUZZ_SEEDS 环境变量可以指定随机的轮数。test_max_visible 是所有 aoi 共用的固定场景。
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#define BOOST_TEST_MODULE test_fuzz
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/included/unit_test.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <boost/container/pmr/unsynchronized_pool_resource.hpp>
+
+#include <adaptive/adaptive.hpp>
+#include <common/arena.hpp>
+#include <common/trace.hpp>
+#include <brute/brute.hpp>
+#include <cross/cross.hpp>
+#include <quadtree/quadtree.hpp>
+#include <bvh/bvh.hpp>
+#include <simd_brute/simd_brute.hpp>
+#include <sorted_grid/sorted_grid.hpp>
+#include <squares/partitioned.hpp>
+#include <squares/squares.hpp>
+
+using namespace aoi;
+
+BOOST_AUTO_TEST_SUITE(test_fuzz)
+
+const char *kFailurePath = "fuzz_failure.aoitrace";
+constexpr Nuid kNuidBase = 1ULL << 40;
+constexpr Nuid kSensorIdBase = 1ULL << 41;
+
+// player nuid -> sensor id -> (enters, leaves)，与顺序无关
+typedef std::map<Nuid, std::map<Nuid, std::pair<std::set<Nuid>, std::set<Nuid>>>> SortedInfos;
+
+template <typename AoiUpdateInfos>
+SortedInfos SortInfos(const AoiUpdateInfos &update_infos) {
+  SortedInfos ret;
+  for (const auto &elem : update_infos) {
+    for (const auto &sensor_info : elem.second.sensor_update_list) {
+      auto &sensor = ret[elem.first][sensor_info.sensor_id];
+      sensor.first.insert(sensor_info.enters.begin(), sensor_info.enters.end());
+      sensor.second.insert(sensor_info.leaves.begin(), sensor_info.leaves.end());
+    }
+  }
+  return ret;
+}
+
+
+// 把操作序列作用到一种 aoi 上，返回每次 Tick 的结果
+typedef std::function<std::vector<SortedInfos>(const TraceOps&)> EngineRunner;
+
+template <typename Aoi>
+EngineRunner MakeRunner(std::function<Aoi*()> factory) {
+  return [factory](const TraceOps &ops) {
+    std::unique_ptr<Aoi> aoi(factory());
+    std::vector<SortedInfos> results;
+    for (const auto &op : ops) {
+      if (op.type == kTraceTick) {
+        results.push_back(SortInfos(aoi->Tick()));
+      } else {
+        ApplyTraceOp(aoi.get(), op);
+      }
+    }
+    return results;
+  };
+}
+
+
+// 每次 Tick 分成很多片跑完一轮
+class SlicedSquareAoi : public squares::SquareAoi {
+ public:
+  explicit SlicedSquareAoi(float square_size) : SquareAoi(square_size) {}
+
+  squares::AoiUpdateInfos Tick() {
+    squares::TickBudget budget;
+    budget.players = 3;
+    squares::AoiUpdateInfos update_infos;
+    while (!TickSliced(budget, squares::kSliceProgressive, &update_infos)) {}
+    return update_infos;
+  }
+};
+
+
+// 每次 Tick 结束时都换一种算法，搬过去的状态要让下一次 Tick 的事件和不换一样
+class RotatingAdaptiveAoi : public adaptive::AdaptiveAoi {
+ public:
+  RotatingAdaptiveAoi() : AdaptiveAoi(Config()) {}
+
+  adaptive::AoiUpdateInfos Tick() {
+    RequestSwitch(static_cast<adaptive::EngineKind>(++tick_ % 3));
+    return AdaptiveAoi::Tick();
+  }
+
+ private:
+  static adaptive::AdaptiveConfig Config() {
+    adaptive::AdaptiveConfig config;
+    config.square_size = 7;
+    config.check_interval = 0;
+    return config;
+  }
+
+  int tick_ = 0;
+};
+
+
+// 从自己的 resource 分配，resource 比 aoi 先构造、后析构。arena 从不释放，
+// 池化的 resource 会真正复用释放掉的内存
+struct ArenaHolder {
+  Arena resource{16 * 1024};
+};
+
+struct PoolHolder {
+  boost::container::pmr::unsynchronized_pool_resource resource;
+};
+
+template <typename Holder>
+class ResourceSquareAoi : private Holder, public squares::SquareAoi {
+ public:
+  explicit ResourceSquareAoi(float square_size) : SquareAoi(square_size, &this->resource) {}
+};
+
+template <typename Holder>
+class ResourceCrossAoi : private Holder, public cross::CrossAoi {
+ public:
+  ResourceCrossAoi() : CrossAoi(-100, 100, -100, 100, 3, 3, 40, &this->resource) {}
+};
+
+
+std::vector<std::pair<std::string, EngineRunner>> Engines() {
+  return {
+    {"squares(200)", MakeRunner<squares::SquareAoi>([] { return new squares::SquareAoi(200); })},
+    {"squares(7)", MakeRunner<squares::SquareAoi>([] {
+      // 每次 Tick 都重排，处理顺序不能影响结果
+      auto aoi = new squares::SquareAoi(7);
+      aoi->SetReorderInterval(1);
+      return aoi;
+    })},
+    {"squares(sliced)", MakeRunner<SlicedSquareAoi>([] { return new SlicedSquareAoi(7); })},
+    {"squares(arena)", MakeRunner<ResourceSquareAoi<ArenaHolder>>([] {
+      return new ResourceSquareAoi<ArenaHolder>(7);
+    })},
+    {"squares(pool)", MakeRunner<ResourceSquareAoi<PoolHolder>>([] {
+      return new ResourceSquareAoi<PoolHolder>(7);
+    })},
+    {"partitioned", MakeRunner<squares::PartitionedAoi>([] {
+      return new squares::PartitionedAoi(7, 21, 4);
+    })},
+    {"cross", MakeRunner<cross::CrossAoi>([] {
+      return new cross::CrossAoi(0, 0, 0, 0, 0, 0, 0);
+    })},
+    {"cross(beacon)", MakeRunner<cross::CrossAoi>([] {
+      return new cross::CrossAoi(-100, 100, -100, 100, 3, 3, 40);
+    })},
+    {"cross(arena)", MakeRunner<ResourceCrossAoi<ArenaHolder>>([] {
+      return new ResourceCrossAoi<ArenaHolder>();
+    })},
+    {"cross(pool)", MakeRunner<ResourceCrossAoi<PoolHolder>>([] {
+      return new ResourceCrossAoi<PoolHolder>();
+    })},
+    {"quadtree", MakeRunner<quadtree::QuadTreeAoi>([] {
+      // 阈值很小，几个玩家就会分裂，玩家离开后又合并回去
+      return new quadtree::QuadTreeAoi(200, 2, 8);
+    })},
+    {"quadtree(small world)", MakeRunner<quadtree::QuadTreeAoi>([] {
+      // 大部分玩家在世界外面，留在根节点里
+      return new quadtree::QuadTreeAoi(50, 2, 8);
+    })},
+    {"bvh", MakeRunner<bvh::BvhAoi>([] {
+      return new bvh::BvhAoi(10);
+    })},
+    {"bvh(no margin)", MakeRunner<bvh::BvhAoi>([] {
+      // 包围盒不放大，每次移动都要换盒子或者重新插入
+      return new bvh::BvhAoi(0);
+    })},
+    {"sorted_grid", MakeRunner<sorted_grid::SortedGridAoi>([] {
+      return new sorted_grid::SortedGridAoi(20, 1);
+    })},
+    {"simd_brute", MakeRunner<simd_brute::SimdBruteAoi>([] {
+      return new simd_brute::SimdBruteAoi();
+    })},
+    {"adaptive(rotating)", MakeRunner<RotatingAdaptiveAoi>([] {
+      return new RotatingAdaptiveAoi();
+    })},
+    {"adaptive", MakeRunner<adaptive::AdaptiveAoi>([] {
+      // 门槛很低，随机场景里会按人数和密度来回切换
+      adaptive::AdaptiveConfig config;
+      config.square_size = 20;
+      config.brute_max_players = 6;
+      config.brute_min_visible_ratio = 0.5f;
+      config.squares_min_players = 12;
+      config.check_interval = 2;
+      return new adaptive::AdaptiveAoi(config);
+    })},
+  };
+}
+
+
+// 返回第一个和 brute 不一致的 Tick 描述，一致则返回空
+std::string FindDivergence(const TraceOps &ops) {
+  auto expected = MakeRunner<brute::BruteAoi>([] { return new brute::BruteAoi(); })(ops);
+  for (const auto &engine : Engines()) {
+    auto results = engine.second(ops);
+    for (size_t tick = 0; tick < expected.size(); ++tick) {
+      if (results[tick] != expected[tick]) {
+        return engine.first + " diverges from brute at tick " + std::to_string(tick);
+      }
+    }
+  }
+  return "";
+}
+
+
+TraceOps GenOps(Uint32 seed, int tick_num) {
+  boost::random::mt19937 random_generator(seed);
+  boost::random::uniform_real_distribution<float> pos_gen(-100, 100);
+  boost::random::uniform_real_distribution<float> step_gen(-8, 8);
+  boost::random::uniform_real_distribution<float> radius_gen(1, 50);
+  boost::random::uniform_int_distribution<int> op_gen(0, 129);
+  boost::random::uniform_int_distribution<int> max_visible_gen(0, 5);
+  boost::random::uniform_int_distribution<int> interval_gen(0, 4);
+  boost::random::uniform_int_distribution<int> mask_gen(0, 3);
+  const Uint32 kMasks[] = {1, 2, 3, kAllCategories};
+
+  TraceOps ops;
+  std::vector<Nuid> alive;
+  std::vector<Nuid> removed_this_tick;
+  std::vector<Nuid> removed_before;
+  std::vector<std::pair<Nuid, Nuid>> sensors;
+  std::map<Nuid, std::pair<float, float>> positions;
+  Nuid next_nuid = kNuidBase;
+  Nuid next_sensor_id = kSensorIdBase;
+
+  auto pick = [&]() -> Nuid {
+    boost::random::uniform_int_distribution<size_t> index_gen(0, alive.size() - 1);
+    return alive[index_gen(random_generator)];
+  };
+
+  for (int tick = 0; tick < tick_num; ++tick) {
+    boost::random::uniform_int_distribution<int> op_num_gen(0, 20);
+    for (int i = op_num_gen(random_generator); i > 0; --i) {
+      int op = op_gen(random_generator);
+      if (alive.empty() || op < 15) {
+        auto nuid = next_nuid++;
+        float x = pos_gen(random_generator), z = pos_gen(random_generator);
+        ops.emplace_back(kTraceAddPlayer, nuid, 0, x, 0, z);
+        alive.push_back(nuid);
+        positions[nuid] = {x, z};
+      } else if (op < 25) {
+        auto nuid = pick();
+        ops.emplace_back(kTraceAddSensor, nuid, next_sensor_id, radius_gen(random_generator), 0, 0);
+        sensors.emplace_back(nuid, next_sensor_id++);
+      } else if (op >= 120) {
+        if (op < 125) {
+          ops.emplace_back(kTraceSetPlayerCategory, pick(), 0, 0, 0, 0,
+                           kMasks[mask_gen(random_generator) % 3]);
+        } else {
+          if (sensors.empty()) continue;
+          boost::random::uniform_int_distribution<size_t> index_gen(0, sensors.size() - 1);
+          auto &sensor = sensors[index_gen(random_generator)];
+          ops.emplace_back(kTraceSetSensorInterest, sensor.first, sensor.second, 0, 0, 0,
+                           kMasks[mask_gen(random_generator)]);
+        }
+      } else if (op >= 115) {
+        // 静态实体用单独的 nuid，不参与移动和移除
+        ops.emplace_back(kTraceAddStaticEntity, next_nuid++, 0,
+                         pos_gen(random_generator), 0, pos_gen(random_generator));
+      } else if (op >= 100) {
+        if (sensors.empty()) continue;
+        boost::random::uniform_int_distribution<size_t> index_gen(0, sensors.size() - 1);
+        auto &sensor = sensors[index_gen(random_generator)];
+        if (op < 105) {
+          ops.emplace_back(kTraceSetMaxVisible, sensor.first, sensor.second, 0, 0, 0,
+                           max_visible_gen(random_generator));
+        } else if (op < 110) {
+          ops.emplace_back(kTraceSetLeaveRadius, sensor.first, sensor.second,
+                           radius_gen(random_generator), 0, 0);
+        } else {
+          ops.emplace_back(kTraceSetInterval, sensor.first, sensor.second, 0, 0, 0,
+                           interval_gen(random_generator));
+        }
+      } else if (op < 30) {
+        auto nuid = pick();
+        ops.emplace_back(kTraceRemovePlayer, nuid, 0, 0, 0, 0);
+        alive.erase(std::find(alive.begin(), alive.end(), nuid));
+        removed_this_tick.push_back(nuid);
+      } else if (op < 34) {
+        // 重新加入移除的玩家：同一个 Tick 里的还没真正删除（Revived），之前 Tick 的已经删掉了
+        auto &removed = op < 32 ? removed_this_tick : removed_before;
+        if (removed.empty()) continue;
+        boost::random::uniform_int_distribution<size_t> index_gen(0, removed.size() - 1);
+        auto iter = removed.begin() + index_gen(random_generator);
+        auto nuid = *iter;
+        removed.erase(iter);
+        float x = pos_gen(random_generator), z = pos_gen(random_generator);
+        ops.emplace_back(kTraceAddPlayer, nuid, 0, x, 0, z);
+        alive.push_back(nuid);
+        positions[nuid] = {x, z};
+      } else {
+        auto nuid = pick();
+        auto &pos = positions[nuid];
+        if (op < 38) {
+          // 瞬移
+          pos = {pos_gen(random_generator), pos_gen(random_generator)};
+        } else {
+          pos.first += step_gen(random_generator);
+          pos.second += step_gen(random_generator);
+        }
+        ops.emplace_back(kTraceUpdatePos, nuid, 0, pos.first, 0, pos.second);
+      }
+    }
+    ops.emplace_back(kTraceTick, 0, 0, 0, 0, 0);
+    removed_before.insert(removed_before.end(), removed_this_tick.begin(), removed_this_tick.end());
+    removed_this_tick.clear();
+  }
+  return ops;
+}
+
+
+// 逐步删掉一段操作，只要还失败就保留删除，直到每个操作都不能再删
+typedef std::function<bool(const TraceOps&)> FailPredicate;
+
+TraceOps Shrink(TraceOps ops, const FailPredicate &fails) {
+  for (size_t chunk = ops.size() / 2; chunk >= 1; chunk /= 2) {
+    size_t begin = 0;
+    while (begin < ops.size()) {
+      TraceOps candidate(ops.begin(), ops.begin() + begin);
+      candidate.insert(candidate.end(),
+                       ops.begin() + std::min(begin + chunk, ops.size()), ops.end());
+      if (fails(candidate)) {
+        ops.swap(candidate);
+      } else {
+        begin += chunk;
+      }
+    }
+  }
+  return ops;
+}
+
+
+void PrintOps(const TraceOps &ops) {
+  for (const auto &op : ops) {
+    switch (op.type) {
+      case kTraceAddPlayer:
+        printf("  AddPlayer(%lu, %f, %f, %f)\n", op.nuid - kNuidBase, op.x, op.y, op.z);
+        break;
+      case kTraceRemovePlayer:
+        printf("  RemovePlayer(%lu)\n", op.nuid - kNuidBase);
+        break;
+      case kTraceAddSensor:
+        printf("  AddSensor(%lu, %lu, %f)\n",
+               op.nuid - kNuidBase, op.sensor_id - kSensorIdBase, op.radius());
+        break;
+      case kTraceUpdatePos:
+        printf("  UpdatePos(%lu, %f, %f, %f)\n", op.nuid - kNuidBase, op.x, op.y, op.z);
+        break;
+      case kTraceTick:
+        printf("  Tick()\n");
+        break;
+      case kTraceSetMaxVisible:
+        printf("  SetSensorMaxVisible(%lu, %lu, %u)\n",
+               op.nuid - kNuidBase, op.sensor_id - kSensorIdBase, op.max_visible());
+        break;
+      case kTraceSetLeaveRadius:
+        printf("  SetSensorLeaveRadius(%lu, %lu, %f)\n",
+               op.nuid - kNuidBase, op.sensor_id - kSensorIdBase, op.radius());
+        break;
+      case kTraceAddStaticEntity:
+        printf("  AddStaticEntity(%lu, %f, %f, %f)\n", op.nuid - kNuidBase, op.x, op.y, op.z);
+        break;
+      case kTraceSetInterval:
+        printf("  SetSensorInterval(%lu, %lu, %u)\n",
+               op.nuid - kNuidBase, op.sensor_id - kSensorIdBase, op.interval());
+        break;
+      case kTraceSetPlayerCategory:
+        printf("  SetPlayerCategory(%lu, %u)\n", op.nuid - kNuidBase, op.mask);
+        break;
+      case kTraceSetSensorInterest:
+        printf("  SetSensorInterest(%lu, %lu, %u)\n",
+               op.nuid - kNuidBase, op.sensor_id - kSensorIdBase, op.mask);
+        break;
+    }
+  }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_differential) {
+  int seed_num = 30;
+  if (auto env = std::getenv("AOI_FUZZ_SEEDS")) seed_num = std::atoi(env);
+
+  for (int seed = 0; seed < seed_num; ++seed) {
+    auto ops = GenOps(seed, 60);
+    auto divergence = FindDivergence(ops);
+    if (divergence.empty()) continue;
+
+    auto shrunk = Shrink(ops, [](const TraceOps &candidate) {
+      return !FindDivergence(candidate).empty();
+    });
+    printf("seed %d: %s\nminimal reproducer (%zu ops, nuids relative to %lu), saved to %s:\n",
+           seed, FindDivergence(shrunk).c_str(), shrunk.size(), kNuidBase, kFailurePath);
+    PrintOps(shrunk);
+    SaveTrace(kFailurePath, shrunk);
+    BOOST_TEST_REQUIRE(divergence.empty());
+  }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_max_visible) {
+  // 所有 aoi 共用的固定场景：2 ~ 7 号玩家离 1 的距离是 1 ~ 6，只看最近的 3 个
+  TraceOps ops = {
+    {kTraceAddPlayer, 1, 0, 0, 0, 0},
+    {kTraceAddSensor, 1, 100, 20, 0, 0},
+    {kTraceSetMaxVisible, 1, 100, 0, 0, 0, 3},
+  };
+  for (Nuid nuid = 2; nuid < 8; ++nuid) {
+    ops.emplace_back(kTraceAddPlayer, nuid, 0, nuid - 1, 0, 0);
+  }
+  ops.emplace_back(kTraceTick, 0, 0, 0, 0, 0);
+  // 5 比 4 近，但差不到 10%，4 继续留着
+  ops.emplace_back(kTraceUpdatePos, 5, 0, 2.8, 0, 0);
+  ops.emplace_back(kTraceTick, 0, 0, 0, 0, 0);
+  ops.emplace_back(kTraceUpdatePos, 5, 0, 2.5, 0, 0);
+  ops.emplace_back(kTraceTick, 0, 0, 0, 0, 0);
+  // 取消限制，剩下的都进来
+  ops.emplace_back(kTraceSetMaxVisible, 1, 100, 0, 0, 0, 0);
+  ops.emplace_back(kTraceTick, 0, 0, 0, 0, 0);
+  // 之后回到普通的计算，人走出半径照常离开
+  ops.emplace_back(kTraceUpdatePos, 7, 0, 30, 0, 0);
+  ops.emplace_back(kTraceTick, 0, 0, 0, 0, 0);
+
+  auto sensor_result = [](std::set<Nuid> enters, std::set<Nuid> leaves) {
+    SortedInfos infos;
+    infos[1][100] = std::make_pair(enters, leaves);
+    return infos;
+  };
+  std::vector<SortedInfos> expected = {
+    sensor_result({2, 3, 4}, {}),
+    SortedInfos(),
+    sensor_result({5}, {4}),
+    sensor_result({4, 6, 7}, {}),
+    sensor_result({}, {7}),
+  };
+
+  auto engines = Engines();
+  engines.emplace_back("brute", MakeRunner<brute::BruteAoi>([] { return new brute::BruteAoi(); }));
+  for (const auto &engine : engines) {
+    BOOST_TEST_CONTEXT(engine.first) {
+      BOOST_TEST_REQUIRE((engine.second(ops) == expected));
+    }
+  }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_shrink) {
+  // 假设 "移除某个玩家之后再 Tick" 会出错，收缩之后应该只剩这两个操作
+  TraceOps ops = GenOps(1, 20);
+  auto remove_iter = std::find_if(ops.begin(), ops.end(), [](const TraceOp &op) {
+    return op.type == kTraceRemovePlayer;
+  });
+  BOOST_TEST_REQUIRE((remove_iter != ops.end()));
+  Nuid removed = remove_iter->nuid;
+
+  auto shrunk = Shrink(ops, [removed](const TraceOps &candidate) {
+    bool removed_seen = false;
+    for (const auto &op : candidate) {
+      if (op.type == kTraceRemovePlayer && op.nuid == removed) removed_seen = true;
+      if (op.type == kTraceTick && removed_seen) return true;
+    }
+    return false;
+  });
+  BOOST_TEST_REQUIRE((shrunk.size() == 2));
+  BOOST_TEST_REQUIRE((shrunk[0].type == kTraceRemovePlayer));
+  BOOST_TEST_REQUIRE((shrunk[1].type == kTraceTick));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,159 @@
+// Copyright <disenone>
+
+#include <vector>
+
+#define BOOST_TEST_MODULE test_histogram
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/included/unit_test.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <boost/range/irange.hpp>
+
+#include <common/histogram.hpp>
+#include <common/nuid.hpp>
+#include <common/silence_unused.hpp>
+#include <cross/cross.hpp>
+#include <squares/partitioned.hpp>
+#include <squares/squares.hpp>
+
+using namespace aoi;
+
+BOOST_AUTO_TEST_SUITE(test_histogram)
+
+BOOST_AUTO_TEST_CASE(test_buckets) {
+  BOOST_TEST_REQUIRE((Log2Histogram::Bucket(0) == 0));
+  BOOST_TEST_REQUIRE((Log2Histogram::Bucket(1) == 1));
+  BOOST_TEST_REQUIRE((Log2Histogram::Bucket(2) == 2));
+  BOOST_TEST_REQUIRE((Log2Histogram::Bucket(3) == 2));
+  BOOST_TEST_REQUIRE((Log2Histogram::Bucket(4) == 3));
+  BOOST_TEST_REQUIRE((Log2Histogram::Bucket(1023) == 10));
+  BOOST_TEST_REQUIRE((Log2Histogram::Bucket(1024) == 11));
+  BOOST_TEST_REQUIRE((Log2Histogram::Bucket(~Uint64(0)) == Log2Histogram::kBucketNum - 1));
+  // 每个桶的上界落在自己的桶里，上界加一落在下一个桶
+  for (size_t bucket : boost::irange<size_t>(Log2Histogram::kBucketNum - 1)) {
+    Uint64 upper = Log2Histogram::BucketUpper(bucket);
+    BOOST_TEST_REQUIRE((Log2Histogram::Bucket(upper) == bucket));
+    BOOST_TEST_REQUIRE((Log2Histogram::Bucket(upper + 1) == bucket + 1));
+  }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_percentile) {
+  Log2Histogram histogram;
+  BOOST_TEST_REQUIRE((histogram.Percentile(50) == 0));
+  BOOST_TEST_REQUIRE((histogram.Mean() == 0));
+
+  // 90 个 5，9 个 100，1 个 3000
+  for (int UNUSED(i) : boost::irange(90)) {
+    histogram.Add(5);
+  }
+  for (int UNUSED(i) : boost::irange(9)) {
+    histogram.Add(100);
+  }
+  histogram.Add(3000);
+  BOOST_TEST_REQUIRE((histogram.Count() == 100));
+  BOOST_TEST_REQUIRE((histogram.Sum() == 90 * 5 + 9 * 100 + 3000));
+  BOOST_TEST_REQUIRE((histogram.Max() == 3000));
+  BOOST_TEST_REQUIRE((histogram.BucketCount(3) == 90));
+  BOOST_TEST_REQUIRE((histogram.Percentile(50) == 7));
+  BOOST_TEST_REQUIRE((histogram.Percentile(90) == 7));
+  BOOST_TEST_REQUIRE((histogram.Percentile(99) == 127));
+  BOOST_TEST_REQUIRE((histogram.Percentile(100) == 3000));
+  BOOST_TEST_REQUIRE((histogram.Format() == "n=100 mean=43.50 p50<=7 p90<=7 p99<=127 max=3000"));
+
+  Log2Histogram other;
+  other.Add(0);
+  other.Add(10000);
+  histogram.Merge(other);
+  BOOST_TEST_REQUIRE((histogram.Count() == 102));
+  BOOST_TEST_REQUIRE((histogram.BucketCount(0) == 1));
+  BOOST_TEST_REQUIRE((histogram.Max() == 10000));
+
+  histogram.Clear();
+  BOOST_TEST_REQUIRE((histogram.Count() == 0));
+  BOOST_TEST_REQUIRE((histogram.BucketCount(3) == 0));
+}
+
+
+// 跑几次 Tick，检查直方图和返回的事件对得上
+template <typename Aoi>
+void CheckSceneHistograms(Aoi *aoi, bool has_occupancy) {
+  boost::random::mt19937 random_generator(20211212);
+  boost::random::uniform_real_distribution<float> pos_gen(-500, 500);
+  boost::random::uniform_real_distribution<float> move_gen(-20, 20);
+  const int player_num = 300;
+  std::vector<Nuid> nuids;
+  for (int UNUSED(i) : boost::irange(player_num)) {
+    nuids.push_back(GenNuid());
+    aoi->AddPlayer(nuids.back(), pos_gen(random_generator), 0, pos_gen(random_generator));
+    aoi->AddSensor(nuids.back(), GenNuid(), 80);
+  }
+
+  // 没打开时不统计
+  aoi->Tick();
+  BOOST_TEST_REQUIRE((aoi->GetTickHistograms().visible.Count() == 0));
+
+  aoi->EnableHistograms(true);
+  Uint64 total_enters = 0;
+  for (int UNUSED(t) : boost::irange(4)) {
+    for (auto nuid : nuids) {
+      const auto &pos = aoi->GetPlayerMap().find(nuid)->second->pos;
+      aoi->UpdatePos(nuid, pos.x + move_gen(random_generator), 0,
+                     pos.z + move_gen(random_generator));
+    }
+    auto update_infos = aoi->Tick();
+    Uint64 enters = 0, leaves = 0;
+    for (const auto &elem : update_infos) {
+      for (const auto &sensor_info : elem.second.sensor_update_list) {
+        enters += sensor_info.enters.size();
+        leaves += sensor_info.leaves.size();
+      }
+    }
+    total_enters += enters;
+
+    const auto &histograms = aoi->GetTickHistograms();
+    BOOST_TEST_REQUIRE((histograms.visible.Count() == player_num));
+    BOOST_TEST_REQUIRE((histograms.candidates.Count() == player_num));
+    BOOST_TEST_REQUIRE((histograms.candidates.Sum() >= histograms.visible.Sum()));
+    BOOST_TEST_REQUIRE((histograms.enters.Count() == 1));
+    BOOST_TEST_REQUIRE((histograms.enters.Sum() == enters));
+    BOOST_TEST_REQUIRE((histograms.leaves.Sum() == leaves));
+    if (has_occupancy) {
+      BOOST_TEST_REQUIRE((histograms.occupancy.Sum() == player_num));
+    } else {
+      BOOST_TEST_REQUIRE((histograms.occupancy.Count() == 0));
+    }
+  }
+
+  auto window = aoi->TakeWindowHistograms();
+  BOOST_TEST_REQUIRE((window.visible.Count() == 4 * player_num));
+  BOOST_TEST_REQUIRE((window.enters.Count() == 4));
+  BOOST_TEST_REQUIRE((window.enters.Sum() == total_enters));
+  BOOST_TEST_REQUIRE((aoi->TakeWindowHistograms().visible.Count() == 0));
+
+  // 关掉之后保留上一次的结果，不再累计
+  aoi->EnableHistograms(false);
+  aoi->Tick();
+  BOOST_TEST_REQUIRE((aoi->GetTickHistograms().visible.Count() == player_num));
+  BOOST_TEST_REQUIRE((aoi->TakeWindowHistograms().visible.Count() == 0));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_squares) {
+  squares::SquareAoi aoi(100);
+  CheckSceneHistograms(&aoi, true);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_partitioned) {
+  squares::PartitionedAoi aoi(100, 300, 4);
+  CheckSceneHistograms(&aoi, true);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_cross) {
+  cross::CrossAoi aoi(-600, 600, -600, 600, 4, 4, 100);
+  CheckSceneHistograms(&aoi, false);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,127 @@
+// Copyright <disenone>
+
+#include <map>
+#include <utility>
+#include <vector>
+
+#define BOOST_TEST_MODULE test_partitioned
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/included/unit_test.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <boost/range/irange.hpp>
+
+#include <common/silence_unused.hpp>
+#include <squares/partitioned.hpp>
+#include <squares/squares.hpp>
+
+using namespace aoi;
+using namespace aoi::squares;
+
+BOOST_AUTO_TEST_SUITE(test_partitioned)
+
+// player nuid -> [(sensor id, enters, leaves)]，保留 sensor 和玩家的顺序
+typedef std::map<Nuid, std::vector<std::pair<Nuid, std::pair<PlayerNuids, PlayerNuids>>>>
+  OrderedInfos;
+
+OrderedInfos OrderInfos(const AoiUpdateInfos &update_infos) {
+  OrderedInfos ret;
+  for (const auto &elem : update_infos) {
+    auto &sensors = ret[elem.first];
+    for (const auto &sensor_info : elem.second.sensor_update_list) {
+      sensors.push_back({sensor_info.sensor_id, {sensor_info.enters, sensor_info.leaves}});
+    }
+  }
+  return ret;
+}
+
+
+// 同样的操作作用到 SquareAoi 和 PartitionedAoi 上，每次 Tick 的结果要完全相同
+void TestSameAsSquares(float square_size, float region_size, size_t thread_num) {
+  boost::random::mt19937 random_generator(20211118);
+  boost::random::uniform_real_distribution<float> pos_gen(-500, 500);
+  boost::random::uniform_real_distribution<float> move_gen(-20, 20);
+  boost::random::uniform_int_distribution<int> radius_gen(1, 6);
+  boost::random::uniform_int_distribution<int> op_gen(0, 99);
+
+  SquareAoi expected(square_size);
+  PartitionedAoi partitioned(square_size, region_size, thread_num);
+
+  const int player_num = 2000;
+  std::vector<std::pair<float, float>> positions;
+  for (int i : boost::irange(player_num)) {
+    float x = pos_gen(random_generator), z = pos_gen(random_generator);
+    // 半径有一部分刚好是格子大小的整数倍
+    float radius = radius_gen(random_generator) * square_size / 2;
+    for (SquareAoi *aoi : {&expected, static_cast<SquareAoi*>(&partitioned)}) {
+      aoi->AddPlayer(i + 1, x, 0, z);
+      if (i % 3 == 0) aoi->AddSensor(i + 1, i + 100001, radius);
+    }
+    positions.emplace_back(x, z);
+  }
+
+  for (int UNUSED(tick) : boost::irange(20)) {
+    BOOST_TEST_REQUIRE((OrderInfos(partitioned.Tick()) == OrderInfos(expected.Tick())));
+
+    for (int i : boost::irange(player_num)) {
+      int op = op_gen(random_generator);
+      auto &pos = positions[i];
+      if (op < 2) {
+        expected.RemovePlayer(i + 1);
+        partitioned.RemovePlayer(i + 1);
+        continue;
+      }
+      if (op < 5) {
+        pos = {pos_gen(random_generator), pos_gen(random_generator)};
+        expected.AddPlayer(i + 1, pos.first, 0, pos.second);
+        partitioned.AddPlayer(i + 1, pos.first, 0, pos.second);
+        continue;
+      }
+      pos.first += move_gen(random_generator);
+      pos.second += move_gen(random_generator);
+      expected.UpdatePos(i + 1, pos.first, 0, pos.second);
+      partitioned.UpdatePos(i + 1, pos.first, 0, pos.second);
+    }
+  }
+  BOOST_TEST_REQUIRE((partitioned.GetPlayerMap().size() == expected.GetPlayerMap().size()));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_same_as_squares) {
+  TestSameAsSquares(50, 200, 4);
+  // 区域比 sensor 半径小，halo 跨过好几个区域
+  TestSameAsSquares(20, 40, 3);
+  TestSameAsSquares(200, 2000, 1);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_regions) {
+  PartitionedAoi aoi(10, 100, 2);
+  aoi.AddPlayer(1, 5, 0, 5);
+  aoi.AddPlayer(2, 95, 0, 5);
+  aoi.AddPlayer(3, 105, 0, 5);
+  aoi.AddPlayer(4, -5, 0, 5);
+  aoi.AddSensor(1, 11, 15);
+  aoi.AddSensor(2, 12, 15);
+  aoi.AddSensor(3, 13, 15);
+
+  // 1 和 2 在同一个区域，3 在右边的区域，4 没有 sensor 不占区域
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((aoi.GetRegionNum() == 2));
+  BOOST_TEST_REQUIRE((update_infos.size() == 3));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{4}));
+  BOOST_TEST_REQUIRE((update_infos[2].sensor_update_list[0].enters == PlayerNuids{3}));
+  BOOST_TEST_REQUIRE((update_infos[3].sensor_update_list[0].enters == PlayerNuids{2}));
+
+  // 3 走开，2 和 3 互相离开；1 被移除，不再有它的结果
+  aoi.UpdatePos(3, 150, 0, 5);
+  aoi.RemovePlayer(1);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 2));
+  BOOST_TEST_REQUIRE((update_infos[2].sensor_update_list[0].leaves == PlayerNuids{3}));
+  BOOST_TEST_REQUIRE((update_infos[3].sensor_update_list[0].leaves == PlayerNuids{2}));
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == 3));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
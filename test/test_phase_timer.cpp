@@ -0,0 +1,100 @@
+// Copyright <disenone>
+
+#include <vector>
+
+#define BOOST_TEST_MODULE test_phase_timer
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/included/unit_test.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <boost/range/irange.hpp>
+
+#include <common/nuid.hpp>
+#include <common/phase_timer.hpp>
+#include <common/silence_unused.hpp>
+#include <cross/cross.hpp>
+#include <squares/partitioned.hpp>
+#include <squares/squares.hpp>
+
+using namespace aoi;
+
+BOOST_AUTO_TEST_SUITE(test_phase_timer)
+
+BOOST_AUTO_TEST_CASE(test_scope) {
+  PhaseCycles cycles;
+  for (int UNUSED(i) : boost::irange(3)) {
+    PhaseScope scope(&cycles, kPhaseCheckEnter);
+  }
+  BOOST_TEST_REQUIRE((cycles.calls[kPhaseCheckEnter] == 3));
+  BOOST_TEST_REQUIRE((cycles.calls[kPhaseCheckLeave] == 0));
+  BOOST_TEST_REQUIRE((cycles.Total() == cycles.cycles[kPhaseCheckEnter]));
+
+  PhaseCycles other;
+  other.Add(kPhaseRemove, 100);
+  cycles.Merge(other);
+  BOOST_TEST_REQUIRE((cycles.calls[kPhaseRemove] == 1));
+  BOOST_TEST_REQUIRE((cycles.cycles[kPhaseRemove] == 100));
+
+  BOOST_TEST_REQUIRE((CycleCounterRate() > 0));
+  BOOST_TEST_REQUIRE((std::string(TickPhaseName(kPhaseCalcAoi)) == "calc_aoi"));
+  BOOST_TEST_REQUIRE((std::string(TickPhaseName(kPhaseLastPos)) == "last_pos"));
+  BOOST_TEST_REQUIRE((cycles.Format().find("remove=") != std::string::npos));
+}
+
+
+// 没定义 AOI_ENABLE_PHASE_TIMER 时全是 0；定义了时每个阶段的调用次数和场景对得上
+template <typename Aoi>
+void CheckTickPhases(Aoi *aoi) {
+  boost::random::mt19937 random_generator(20211213);
+  boost::random::uniform_real_distribution<float> pos_gen(-500, 500);
+  const int player_num = 200;
+  std::vector<Nuid> nuids;
+  for (int UNUSED(i) : boost::irange(player_num)) {
+    nuids.push_back(GenNuid());
+    aoi->AddPlayer(nuids.back(), pos_gen(random_generator), 0, pos_gen(random_generator));
+    aoi->AddSensor(nuids.back(), GenNuid(), 80);
+  }
+  aoi->Tick();
+
+  for (int i : boost::irange(10)) {
+    aoi->RemovePlayer(nuids[i]);
+  }
+  for (int i : boost::irange(10, player_num)) {
+    aoi->UpdatePos(nuids[i], pos_gen(random_generator), 0, pos_gen(random_generator));
+  }
+  aoi->Tick();
+
+  const auto &cycles = aoi->GetTickPhaseCycles();
+  if (!kAoiPhaseTimerEnabled) {
+    BOOST_TEST_REQUIRE((cycles.Total() == 0));
+    return;
+  }
+  const Uint64 sensor_num = player_num - 10;
+  BOOST_TEST_REQUIRE((cycles.calls[kPhaseCalcAoi] == sensor_num));
+  BOOST_TEST_REQUIRE((cycles.calls[kPhaseCheckLeave] == sensor_num));
+  BOOST_TEST_REQUIRE((cycles.calls[kPhaseCheckEnter] == sensor_num));
+  BOOST_TEST_REQUIRE((cycles.calls[kPhaseDiff] == 0));
+  BOOST_TEST_REQUIRE((cycles.calls[kPhaseRemove] == 1));
+  BOOST_TEST_REQUIRE((cycles.calls[kPhaseLastPos] == 1));
+  BOOST_TEST_REQUIRE((cycles.cycles[kPhaseCalcAoi] > 0));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_squares) {
+  squares::SquareAoi aoi(100);
+  CheckTickPhases(&aoi);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_partitioned) {
+  squares::PartitionedAoi aoi(100, 300, 4);
+  CheckTickPhases(&aoi);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_cross) {
+  cross::CrossAoi aoi(-600, 600, -600, 600, 4, 4, 100);
+  CheckTickPhases(&aoi);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,287 @@
+// Copyright <disenone>
+
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <ctime>
+
+#define BOOST_TEST_MODULE test_quadtree
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/included/unit_test.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <boost/timer/timer.hpp>
+#include <boost/range/irange.hpp>
+
+#include <common/arena.hpp>
+#include <common/nuid.hpp>
+#include <common/silence_unused.hpp>
+#include <quadtree/quadtree.hpp>
+
+using namespace aoi;
+using namespace aoi::quadtree;
+
+BOOST_AUTO_TEST_SUITE(test_quadtree)
+
+// 检查每个节点的 count 等于子树里的玩家数，玩家记录的位置和节点里的一致
+size_t CheckNode(const QuadTreeAoi &aoi, NodeIndex index) {
+  const auto &node = aoi.GetNode(index);
+  size_t count = node.players.size();
+  for (Uint32 i = 0; i < node.players.size(); ++i) {
+    BOOST_TEST_REQUIRE((node.players[i]->node == index && node.players[i]->node_index == i));
+  }
+  if (!node.IsLeaf()) {
+    for (Uint32 i = 0; i < 4; ++i) {
+      BOOST_TEST_REQUIRE((aoi.GetNode(node.children + i).parent == index));
+      count += CheckNode(aoi, node.children + i);
+    }
+  }
+  BOOST_TEST_REQUIRE((node.count == count));
+  return count;
+}
+
+
+BOOST_AUTO_TEST_CASE(test_simple) {
+  QuadTreeAoi aoi(2000);
+  aoi.AddPlayer(1, 0, 0, 0);
+  aoi.AddSensor(1, 100, 10);
+  aoi.AddPlayer(2, 0, 0, 0);
+  aoi.AddSensor(2, 200, 5);
+
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 2));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{2}));
+  BOOST_TEST_REQUIRE((update_infos[2].sensor_update_list[0].enters == PlayerNuids{1}));
+
+  aoi.UpdatePos(2, 6, 0, 0);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 1));
+  BOOST_TEST_REQUIRE((update_infos[2].sensor_update_list[0].leaves == PlayerNuids{1}));
+
+  aoi.UpdatePos(2, 600, 0, 100);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 1));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{2}));
+
+  aoi.UpdatePos(1, 601, 0, 101);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 2));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{2}));
+  BOOST_TEST_REQUIRE((update_infos[2].sensor_update_list[0].enters == PlayerNuids{1}));
+
+  aoi.RemovePlayer(2);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 1));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{2}));
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == 1));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_split_merge) {
+  QuadTreeAoi aoi(1000, 4, 6);
+  // 挤在一个角落里的玩家让那一块一直分裂下去，其它地方保持一个大节点
+  for (Nuid nuid : boost::irange<Nuid>(1, 21)) {
+    aoi.AddPlayer(nuid, 300 + nuid, 0, 300 + nuid % 5);
+  }
+  aoi.AddPlayer(100, -300, 0, -300);
+  aoi.AddSensor(100, 1000, 50);
+  BOOST_TEST_REQUIRE((aoi.GetNodeNum() == 1));
+
+  aoi.Tick();
+  BOOST_TEST_REQUIRE((aoi.GetNodeNum() > 1));
+  BOOST_TEST_REQUIRE((aoi.GetMaxDepth() > 1 && aoi.GetMaxDepth() <= 6));
+  BOOST_TEST_REQUIRE((CheckNode(aoi, kRootNode) == 21));
+  if (kAoiStatsEnabled) {
+    BOOST_TEST_REQUIRE((aoi.GetTickStats().node_splits == aoi.GetNodeNum() / 4));
+  }
+  // 叶子要么不超过阈值，要么已经到了最大深度
+  for (const auto &elem : aoi.GetPlayerMap()) {
+    const auto &node = aoi.GetNode(elem.second->node);
+    BOOST_TEST_REQUIRE((!node.IsLeaf() || node.players.size() <= 4 || node.depth == 6));
+  }
+
+  // 人走掉之后合并回一个节点，空出来的节点之后再分裂时复用
+  for (Nuid nuid : boost::irange<Nuid>(1, 21)) {
+    aoi.RemovePlayer(nuid);
+  }
+  aoi.Tick();
+  BOOST_TEST_REQUIRE((aoi.GetNodeNum() == 1 && aoi.GetMaxDepth() == 0));
+  BOOST_TEST_REQUIRE((CheckNode(aoi, kRootNode) == 1));
+  if (kAoiStatsEnabled) {
+    BOOST_TEST_REQUIRE((aoi.GetTickStats().node_merges == 1));
+  }
+
+  for (Nuid nuid : boost::irange<Nuid>(1, 21)) {
+    aoi.AddPlayer(nuid, -300.f + nuid, 0, -300);
+  }
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((aoi.GetNodeNum() > 1));
+  BOOST_TEST_REQUIRE((CheckNode(aoi, kRootNode) == 21));
+  BOOST_TEST_REQUIRE((update_infos[100].sensor_update_list[0].enters.size() == 20));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_loose_bounds) {
+  QuadTreeAoi aoi(1000, 1, 2);
+  aoi.AddPlayer(1, 100, 0, 100);
+  aoi.AddPlayer(2, -100, 0, -100);
+  aoi.AddSensor(2, 100, 300);
+  aoi.Tick();
+  auto node = aoi.GetPlayerMap().at(1)->node;
+  BOOST_TEST_REQUIRE((node != kRootNode));
+
+  // 越过紧边界但还在松边界里，不换节点
+  aoi.UpdatePos(1, -50, 0, 100);
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().at(1)->node == node));
+  aoi.UpdatePos(1, -200, 0, 100);
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().at(1)->node != node));
+  BOOST_TEST_REQUIRE((CheckNode(aoi, kRootNode) == 2));
+
+  // 世界外面的玩家放在根节点，照样能被看到
+  aoi.UpdatePos(1, -100, 0, -1000);
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().at(1)->node == kRootNode));
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[2].sensor_update_list[0].leaves == PlayerNuids{1}));
+  aoi.UpdatePos(2, -100, 0, -900);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[2].sensor_update_list[0].enters == PlayerNuids{1}));
+  BOOST_TEST_REQUIRE((CheckNode(aoi, kRootNode) == 2));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_remove_and_add) {
+  QuadTreeAoi aoi(1000, 2, 4);
+  aoi.AddPlayer(1, 0, 0, 0);
+  aoi.AddSensor(1, 100, 10);
+  aoi.AddPlayer(2, 3, 0, 0);
+  aoi.Tick();
+
+  // 同一次 Tick 里移除又加回来，没有进出，也不会被删掉
+  aoi.RemovePlayer(2);
+  aoi.RemovePlayer(2);
+  aoi.AddPlayer(2, 4, 0, 0);
+  BOOST_TEST_REQUIRE(aoi.Tick().empty());
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == 2));
+  BOOST_TEST_REQUIRE((CheckNode(aoi, kRootNode) == 2));
+
+  // 移除的玩家移动不影响树
+  aoi.RemovePlayer(2);
+  aoi.UpdatePos(2, 5, 0, 0);
+  BOOST_TEST_REQUIRE((CheckNode(aoi, kRootNode) == 1));
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{2}));
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == 1));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_memory_usage) {
+  Arena arena;
+  QuadTreeAoi aoi(1000, 4, 8, &arena);
+  BOOST_TEST_REQUIRE((aoi.GetMemoryResource() == &arena));
+  auto empty_usage = aoi.GetMemoryUsage();
+  BOOST_TEST_REQUIRE((empty_usage.players == 0 && empty_usage.sensors == 0));
+
+  for (int i : boost::irange(100)) {
+    aoi.AddPlayer(i + 1, i, 0, 0);
+    if (i % 2 == 0) aoi.AddSensor(i + 1, 1000 + i, 10);
+  }
+  size_t used = arena.GetUsedBytes();
+  aoi.Tick();
+  BOOST_TEST_REQUIRE((arena.GetUsedBytes() > used));
+  auto usage = aoi.GetMemoryUsage();
+  BOOST_TEST_REQUIRE((usage.players == 100 * sizeof(PlayerAoi)));
+  BOOST_TEST_REQUIRE((usage.sensors >= 50 * sizeof(Sensor)));
+  BOOST_TEST_REQUIRE((usage.cells >= aoi.GetNodeNum() * sizeof(QuadNode)));
+  BOOST_TEST_REQUIRE((usage.aoi_lists > 0 && usage.candidates == 0));
+  BOOST_TEST_REQUIRE((usage.Total() > empty_usage.Total()));
+}
+
+
+std::vector<Pos> GenPositions(const size_t player_num, const float map_size) {
+  std::vector<Pos> positions;
+  positions.reserve(player_num);
+
+  boost::random::mt19937 random_generator(std::time(0));
+  boost::random::uniform_real_distribution<float> pos_generator(-map_size, map_size);
+  for (int UNUSED(i) : boost::irange(player_num)) {
+    positions.emplace_back(pos_generator(random_generator), 0, pos_generator(random_generator));
+  }
+  return positions;
+}
+
+
+std::vector<Pos> GenMovements(const size_t player_num, const float length) {
+  std::vector<Pos> movements;
+  movements.reserve(player_num);
+
+  boost::random::mt19937 random_generator(std::time(0));
+  boost::random::uniform_real_distribution<float> angle_gen(0, 360);
+  for (int UNUSED(i) : boost::irange(player_num)) {
+    float angle = angle_gen(random_generator);
+    float radian = 2 * M_PI * angle / 360;
+    movements.emplace_back(std::cos(radian) * length, 0, std::sin(radian) * length);
+  }
+
+  return movements;
+}
+
+
+void TestOneMilestone(std::vector<Pos> *positions, const size_t player_num,
+                      const float map_size) {
+  printf("\n===Begin Milestore: player_num = %lu, map_size = (%f, %f)\n",
+         player_num, -map_size, map_size);
+
+  boost::timer::cpu_timer run_timer;
+  QuadTreeAoi aoi(map_size * 2);
+  std::vector<Nuid> nuids;
+  nuids.reserve(player_num);
+  for (const auto &pos : *positions) {
+    nuids.push_back(GenNuid());
+    aoi.AddPlayer(nuids.back(), pos.x, pos.y, pos.z);
+    aoi.AddSensor(nuids.back(), GenNuid(), 100);
+  }
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == player_num));
+  run_timer.stop();
+  printf("Add Player (1 times)");
+  std::cout << run_timer.format();
+
+  aoi.Tick();
+  printf("Nodes: %lu, max depth: %u\n", aoi.GetNodeNum(), aoi.GetMaxDepth());
+
+  run_timer.start();
+  aoi.Tick();
+  run_timer.stop();
+  printf("Tick (1 times)");
+  std::cout << run_timer.format();
+
+  float speed = 6;
+  float delta_time = 0.1;
+  auto movements = GenMovements(player_num, delta_time * speed);
+  int times = 1 / delta_time;
+  run_timer.start();
+  for (int UNUSED(t) : boost::irange(times)) {
+    for (int i : boost::irange(player_num)) {
+      auto &pos = positions->at(i);
+      auto &move = movements[i];
+      pos.Set(pos.x + move.x, pos.y + move.y, pos.z + move.z);
+      aoi.UpdatePos(nuids[i], pos.x, pos.y, pos.z);
+    }
+  }
+  run_timer.stop();
+  printf("Update Pos (%i times)", times);
+  std::cout << run_timer.format();
+
+  printf("===End Milestore\n");
+}
+
+
+BOOST_AUTO_TEST_CASE(test_milestone) {
+  for (size_t player_num : {100, 1000, 10000}) {
+    for (float map_size : {50, 100, 1000, 10000}) {
+      auto positions = GenPositions(player_num, map_size);
+      TestOneMilestone(&positions, player_num, map_size);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
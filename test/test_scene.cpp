@@ -0,0 +1,203 @@
+// Copyright <disenone>
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#define BOOST_TEST_MODULE test_scene
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/included/unit_test.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <boost/range/irange.hpp>
+#include <boost/container/pmr/unsynchronized_pool_resource.hpp>
+
+#include <common/silence_unused.hpp>
+#include <common/thread_pool.hpp>
+#include <scene/scene_manager.hpp>
+#include <squares/squares.hpp>
+
+using namespace aoi;
+
+BOOST_AUTO_TEST_SUITE(test_scene)
+
+// player nuid -> sensor id -> (enters, leaves)，与顺序无关
+typedef std::map<Nuid, std::map<Nuid, std::pair<std::set<Nuid>, std::set<Nuid>>>> SortedInfos;
+
+template <typename AoiUpdateInfos>
+SortedInfos SortInfos(const AoiUpdateInfos &update_infos) {
+  SortedInfos ret;
+  for (const auto &elem : update_infos) {
+    for (const auto &sensor_info : elem.second.sensor_update_list) {
+      auto &sensor = ret[elem.first][sensor_info.sensor_id];
+      sensor.first.insert(sensor_info.enters.begin(), sensor_info.enters.end());
+      sensor.second.insert(sensor_info.leaves.begin(), sensor_info.leaves.end());
+    }
+  }
+  return ret;
+}
+
+
+// Tick 时可以抛异常的 aoi，用来测场景隔离
+class ThrowingAoi : public squares::SquareAoi {
+ public:
+  squares::AoiUpdateInfos Tick() {
+    if (fail) throw std::runtime_error("scene broken");
+    return squares::SquareAoi::Tick();
+  }
+
+  bool fail = false;
+};
+
+
+BOOST_AUTO_TEST_CASE(test_thread_pool) {
+  ThreadPool pool(4);
+  BOOST_TEST_REQUIRE((pool.Size() == 4));
+
+  // 全部提交到 0 号 worker，其它 worker 要偷过去执行
+  std::atomic<int> count(0);
+  std::mutex mutex;
+  std::set<std::thread::id> thread_ids;
+  for (int UNUSED(i) : boost::irange(64)) {
+    pool.Submit(0, [&] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      ++count;
+      std::lock_guard<std::mutex> lock(mutex);
+      thread_ids.insert(std::this_thread::get_id());
+    });
+  }
+  pool.Wait();
+  BOOST_TEST_REQUIRE((count == 64));
+  BOOST_TEST_REQUIRE((thread_ids.size() > 1));
+
+  // 可以重复使用
+  for (int i : boost::irange(100)) {
+    pool.Submit(i, [&] { ++count; });
+  }
+  pool.Wait();
+  BOOST_TEST_REQUIRE((count == 164));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_same_as_serial) {
+  boost::random::mt19937 random_generator(20211118);
+  boost::random::uniform_real_distribution<float> pos_gen(-100, 100);
+  boost::random::uniform_real_distribution<float> move_gen(-10, 10);
+
+  const int scene_num = 16;
+  scene::SceneManager<squares::SquareAoi> manager(4);
+  std::vector<std::unique_ptr<squares::SquareAoi>> serials;
+  for (int i : boost::irange(scene_num)) {
+    BOOST_TEST_REQUIRE((manager.AddScene(i, 50) != nullptr));
+    serials.emplace_back(new squares::SquareAoi(50));
+  }
+  BOOST_TEST_REQUIRE((manager.AddScene(0, 50) == nullptr));
+  BOOST_TEST_REQUIRE((manager.GetSceneNum() == scene_num));
+
+  // 场景人数不同
+  std::vector<std::vector<std::pair<float, float>>> positions(scene_num);
+  for (int i : boost::irange(scene_num)) {
+    for (int j : boost::irange((i + 1) * 10)) {
+      float x = pos_gen(random_generator), z = pos_gen(random_generator);
+      for (auto aoi : {manager.GetScene(i), serials[i].get()}) {
+        aoi->AddPlayer(j + 1, x, 0, z);
+        aoi->AddSensor(j + 1, j + 100001, 20);
+      }
+      positions[i].emplace_back(x, z);
+    }
+  }
+
+  for (int UNUSED(tick) : boost::irange(10)) {
+    manager.Tick();
+    for (int i : boost::irange(scene_num)) {
+      BOOST_TEST_REQUIRE((!manager.GetError(i)));
+      BOOST_TEST_REQUIRE((SortInfos(*manager.GetUpdateInfos(i)) == SortInfos(serials[i]->Tick())));
+    }
+
+    for (int i : boost::irange(scene_num)) {
+      for (size_t j = 0; j < positions[i].size(); ++j) {
+        auto &pos = positions[i][j];
+        pos.first += move_gen(random_generator);
+        pos.second += move_gen(random_generator);
+        manager.GetScene(i)->UpdatePos(j + 1, pos.first, 0, pos.second);
+        serials[i]->UpdatePos(j + 1, pos.first, 0, pos.second);
+      }
+    }
+  }
+
+  // 人多的场景耗时更多
+  BOOST_TEST_REQUIRE((manager.GetTickCost(scene_num - 1) > manager.GetTickCost(0)));
+
+  manager.RemoveScene(0);
+  BOOST_TEST_REQUIRE((manager.GetScene(0) == nullptr));
+  BOOST_TEST_REQUIRE((manager.GetUpdateInfos(0) == nullptr));
+  BOOST_TEST_REQUIRE((manager.GetSceneNum() == scene_num - 1));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_scene_resource) {
+  scene::SceneManager<squares::SquareAoi> manager(2);
+  squares::SquareAoi serial(50);
+  auto arena_aoi = manager.AddSceneWithArena(1, 64 * 1024, false, 50);
+  BOOST_TEST_REQUIRE((arena_aoi != nullptr));
+  BOOST_TEST_REQUIRE((manager.AddSceneWithArena(1, 64 * 1024, false, 50) == nullptr));
+  BOOST_TEST_REQUIRE((manager.GetMemoryResource(1) == arena_aoi->GetMemoryResource()));
+  auto pool_aoi = manager.AddSceneWithResource(
+      2, std::unique_ptr<MemoryResource>(new boost::container::pmr::unsynchronized_pool_resource()),
+      50);
+  BOOST_TEST_REQUIRE((pool_aoi != nullptr && pool_aoi->GetMemoryResource() != nullptr));
+  BOOST_TEST_REQUIRE((manager.AddScene(3, 50) != nullptr));
+  BOOST_TEST_REQUIRE((manager.GetMemoryResource(3) == nullptr));
+
+  for (int i : boost::irange(200)) {
+    for (auto pscene : {arena_aoi, pool_aoi, &serial}) {
+      pscene->AddPlayer(i + 1, i % 20 * 5, 0, i / 20 * 5);
+      pscene->AddSensor(i + 1, i + 100001, 12);
+    }
+  }
+  BOOST_TEST_REQUIRE((static_cast<Arena*>(manager.GetMemoryResource(1))->GetUsedBytes() > 0));
+
+  manager.Tick();
+  auto require_infos = SortInfos(serial.Tick());
+  BOOST_TEST_REQUIRE((SortInfos(*manager.GetUpdateInfos(1)) == require_infos));
+  BOOST_TEST_REQUIRE((SortInfos(*manager.GetUpdateInfos(2)) == require_infos));
+  manager.RemoveScene(1);
+  manager.RemoveScene(2);
+  BOOST_TEST_REQUIRE((manager.GetMemoryResource(1) == nullptr));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_isolation) {
+  scene::SceneManager<ThrowingAoi> manager(2);
+  for (int i : boost::irange(4)) {
+    auto aoi = manager.AddScene(i);
+    aoi->AddPlayer(1, 0, 0, 0);
+    aoi->AddPlayer(2, 1, 0, 1);
+    aoi->AddSensor(1, 3, 10);
+  }
+  manager.GetScene(2)->fail = true;
+
+  manager.Tick();
+  for (int i : boost::irange(4)) {
+    if (i == 2) {
+      BOOST_TEST_REQUIRE((manager.GetError(i) != nullptr));
+      BOOST_TEST_REQUIRE((manager.GetUpdateInfos(i)->empty()));
+    } else {
+      BOOST_TEST_REQUIRE((!manager.GetError(i)));
+      BOOST_TEST_REQUIRE((manager.GetUpdateInfos(i)->size() == 1));
+    }
+  }
+
+  // 修好之后可以继续 Tick
+  manager.GetScene(2)->fail = false;
+  manager.Tick();
+  BOOST_TEST_REQUIRE((!manager.GetError(2)));
+  BOOST_TEST_REQUIRE((manager.GetUpdateInfos(2)->size() == 1));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
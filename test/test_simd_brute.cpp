@@ -0,0 +1,353 @@
+// Copyright <disenone>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <ctime>
+
+#define BOOST_TEST_MODULE test_simd_brute
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/included/unit_test.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <boost/timer/timer.hpp>
+#include <boost/range/irange.hpp>
+
+#include <common/arena.hpp>
+#include <common/nuid.hpp>
+#include <common/silence_unused.hpp>
+#include <simd_brute/simd_brute.hpp>
+#include <squares/squares.hpp>
+
+using namespace aoi;
+using namespace aoi::simd_brute;
+
+BOOST_AUTO_TEST_SUITE(test_simd_brute)
+
+BOOST_AUTO_TEST_CASE(test_simple) {
+  SimdBruteAoi aoi;
+  aoi.AddPlayer(1, 0, 0, 0);
+  aoi.AddSensor(1, 100, 10);
+  aoi.AddPlayer(2, 0, 0, 0);
+  aoi.AddSensor(2, 200, 5);
+
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 2));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{2}));
+  BOOST_TEST_REQUIRE((update_infos[2].sensor_update_list[0].enters == PlayerNuids{1}));
+
+  aoi.UpdatePos(2, 6, 0, 0);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 1));
+  BOOST_TEST_REQUIRE((update_infos[2].sensor_update_list[0].leaves == PlayerNuids{1}));
+
+  aoi.UpdatePos(2, 600, 0, 100);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 1));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{2}));
+
+  aoi.UpdatePos(1, 601, 0, 101);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 2));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{2}));
+  BOOST_TEST_REQUIRE((update_infos[2].sensor_update_list[0].enters == PlayerNuids{1}));
+
+  aoi.RemovePlayer(2);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 1));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{2}));
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == 1));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_scan_tail) {
+  // 玩家数不是 4 的倍数时，最后几个玩家由标量代码处理，结果要和 squares 一样
+  for (size_t player_num : {1, 2, 3, 4, 5, 7, 8, 9, 13}) {
+    SimdBruteAoi aoi;
+    squares::SquareAoi square(20);
+    for (size_t i : boost::irange(player_num)) {
+      float x = static_cast<float>(i) * 3;
+      aoi.AddPlayer(i + 1, x, 0, 0);
+      square.AddPlayer(i + 1, x, 0, 0);
+      // 奇数号玩家换个 category，只有第一个 sensor 看得到
+      if (i % 2 == 1) {
+        aoi.SetPlayerCategory(i + 1, 2);
+        square.SetPlayerCategory(i + 1, 2);
+      }
+    }
+    aoi.AddSensor(1, 100, 100);
+    square.AddSensor(1, 100, 100);
+    aoi.AddSensor(1, 101, 100);
+    square.AddSensor(1, 101, 100);
+    aoi.SetSensorInterest(1, 101, kDefaultCategory);
+    square.SetSensorInterest(1, 101, kDefaultCategory);
+
+    auto update_infos = aoi.Tick();
+    auto square_infos = square.Tick();
+    BOOST_TEST_REQUIRE((update_infos.size() == square_infos.size()));
+    if (player_num == 1) continue;
+
+    // 没看到玩家的 sensor 不在结果里，两边的 sensor 数也要一样
+    auto &sensor_list = update_infos[1].sensor_update_list;
+    auto &square_list = square_infos[1].sensor_update_list;
+    BOOST_TEST_REQUIRE((sensor_list.size() == square_list.size()));
+    for (size_t s : boost::irange(sensor_list.size())) {
+      auto &enters = sensor_list[s].enters;
+      auto &square_enters = square_list[s].enters;
+      BOOST_TEST_REQUIRE((sensor_list[s].sensor_id == square_list[s].sensor_id));
+      std::sort(enters.begin(), enters.end());
+      std::sort(square_enters.begin(), square_enters.end());
+      BOOST_TEST_REQUIRE((enters == square_enters));
+    }
+    BOOST_TEST_REQUIRE((sensor_list[0].sensor_id == 100));
+    BOOST_TEST_REQUIRE((sensor_list[0].enters.size() == player_num - 1));
+  }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_random_vs_squares) {
+  // 随机走动、偶尔加减玩家，每次 Tick 的事件集合都和 squares 一样
+  boost::random::mt19937 random_generator(20211201);
+  boost::random::uniform_real_distribution<float> pos_gen(-100, 100);
+  boost::random::uniform_real_distribution<float> move_gen(-5, 5);
+  SimdBruteAoi aoi;
+  squares::SquareAoi square(30);
+  std::vector<Pos> positions;
+  size_t player_num = 61;
+  for (size_t i : boost::irange(player_num)) {
+    positions.emplace_back(pos_gen(random_generator), 0, pos_gen(random_generator));
+    const auto &pos = positions.back();
+    aoi.AddPlayer(i + 1, pos.x, 0, pos.z);
+    square.AddPlayer(i + 1, pos.x, 0, pos.z);
+    if (i % 3 == 0) {
+      aoi.AddSensor(i + 1, i + 1, 30);
+      square.AddSensor(i + 1, i + 1, 30);
+    }
+  }
+
+  for (int t : boost::irange(20)) {
+    auto update_infos = aoi.Tick();
+    auto square_infos = square.Tick();
+    BOOST_TEST_REQUIRE((update_infos.size() == square_infos.size()));
+    for (auto &elem : update_infos) {
+      auto &sensor_info = elem.second.sensor_update_list[0];
+      auto &square_info = square_infos[elem.first].sensor_update_list[0];
+      std::sort(sensor_info.enters.begin(), sensor_info.enters.end());
+      std::sort(sensor_info.leaves.begin(), sensor_info.leaves.end());
+      std::sort(square_info.enters.begin(), square_info.enters.end());
+      std::sort(square_info.leaves.begin(), square_info.leaves.end());
+      BOOST_TEST_REQUIRE((sensor_info.enters == square_info.enters));
+      BOOST_TEST_REQUIRE((sensor_info.leaves == square_info.leaves));
+    }
+
+    for (size_t i : boost::irange(player_num)) {
+      auto &pos = positions[i];
+      pos.Set(pos.x + move_gen(random_generator), 0, pos.z + move_gen(random_generator));
+      aoi.UpdatePos(i + 1, pos.x, 0, pos.z);
+      square.UpdatePos(i + 1, pos.x, 0, pos.z);
+    }
+    // 移除再加回一个没有 sensor 的玩家，扁平数组的顺序会变
+    Nuid nuid = (t * 7) % player_num + 1;
+    if (nuid % 3 != 1) {
+      aoi.RemovePlayer(nuid);
+      square.RemovePlayer(nuid);
+      if (t % 2 == 0) {
+        aoi.AddPlayer(nuid, positions[nuid - 1].x, 0, positions[nuid - 1].z);
+        square.AddPlayer(nuid, positions[nuid - 1].x, 0, positions[nuid - 1].z);
+      }
+    }
+  }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_remove_and_add) {
+  SimdBruteAoi aoi;
+  aoi.AddPlayer(1, 0, 0, 0);
+  aoi.AddSensor(1, 100, 10);
+  aoi.AddPlayer(2, 3, 0, 0);
+  aoi.AddPlayer(3, 30, 0, 0);
+  aoi.Tick();
+
+  // 同一次 Tick 里移除又加回来，没有进出，也不会被删掉
+  aoi.RemovePlayer(2);
+  aoi.RemovePlayer(2);
+  aoi.AddPlayer(2, 4, 0, 0);
+  BOOST_TEST_REQUIRE(aoi.Tick().empty());
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == 3));
+
+  // 移除的玩家移动、改 category 都不会再被看到
+  aoi.RemovePlayer(1);
+  aoi.UpdatePos(1, 5, 0, 0);
+  aoi.SetPlayerCategory(1, 2);
+  aoi.UpdatePos(3, 5, 0, 0);
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.empty()));
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == 2));
+
+  aoi.AddPlayer(1, 0, 0, 0);
+  aoi.AddSensor(1, 100, 10);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters.size() == 2));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_snapshot) {
+  SimdBruteAoi aoi;
+  aoi.AddStaticEntity(50, 1, 0, 1);
+  aoi.AddPlayer(1, 0, 0, 0);
+  aoi.AddSensor(1, 100, 10);
+  aoi.SetSensorInterval(1, 100, 2);
+  aoi.AddPlayer(2, 3, 0, 0);
+  aoi.SetPlayerCategory(2, 4);
+  aoi.Tick();
+
+  AoiSnapshot snapshot;
+  aoi.ExportSnapshot(&snapshot);
+  BOOST_TEST_REQUIRE((snapshot.tick_count == 1));
+  BOOST_TEST_REQUIRE((snapshot.players.size() == 2));
+  BOOST_TEST_REQUIRE((snapshot.static_entities.size() == 1));
+  for (const auto &player : snapshot.players) {
+    if (player.nuid == 2) {
+      BOOST_TEST_REQUIRE((player.category == 4 && player.sensors.empty()));
+      continue;
+    }
+    BOOST_TEST_REQUIRE((player.sensors.size() == 1));
+    const auto &sensor = player.sensors[0];
+    BOOST_TEST_REQUIRE((sensor.interval == 2));
+    BOOST_TEST_REQUIRE((sensor.aoi_players == PlayerNuids{2}));
+    BOOST_TEST_REQUIRE((sensor.static_entities == PlayerNuids{50}));
+  }
+
+  // 搬到另一个实例上之后没有多余的事件，之后的事件和原来的实例一样
+  SimdBruteAoi copy;
+  ImportSnapshot(snapshot, &copy);
+  for (int t : boost::irange(4)) {
+    if (t == 1) {
+      aoi.UpdatePos(2, 30, 0, 0);
+      copy.UpdatePos(2, 30, 0, 0);
+    }
+    auto update_infos = aoi.Tick();
+    auto copy_infos = copy.Tick();
+    BOOST_TEST_REQUIRE((update_infos.size() == copy_infos.size()));
+    for (auto &elem : update_infos) {
+      const auto &sensor_info = elem.second.sensor_update_list[0];
+      const auto &copy_info = copy_infos[elem.first].sensor_update_list[0];
+      BOOST_TEST_REQUIRE((sensor_info.enters == copy_info.enters));
+      BOOST_TEST_REQUIRE((sensor_info.leaves == copy_info.leaves));
+    }
+  }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_memory_usage) {
+  Arena arena;
+  SimdBruteAoi aoi(&arena);
+  BOOST_TEST_REQUIRE((aoi.GetMemoryResource() == &arena));
+  auto empty_usage = aoi.GetMemoryUsage();
+  BOOST_TEST_REQUIRE((empty_usage.players == 0 && empty_usage.sensors == 0));
+
+  for (int i : boost::irange(100)) {
+    aoi.AddPlayer(i + 1, i, 0, 0);
+    if (i % 2 == 0) aoi.AddSensor(i + 1, 1000 + i, 10);
+  }
+  size_t used = arena.GetUsedBytes();
+  aoi.Tick();
+  BOOST_TEST_REQUIRE((arena.GetUsedBytes() > used));
+  auto usage = aoi.GetMemoryUsage();
+  BOOST_TEST_REQUIRE((usage.players == 100 * sizeof(PlayerAoi)));
+  BOOST_TEST_REQUIRE((usage.sensors >= 50 * sizeof(Sensor)));
+  BOOST_TEST_REQUIRE((usage.player_map >= 100 * (sizeof(float) * 2 + sizeof(Uint32))));
+  BOOST_TEST_REQUIRE((usage.aoi_lists > 0 && usage.candidates == 0));
+  BOOST_TEST_REQUIRE((usage.Total() > empty_usage.Total()));
+}
+
+
+std::vector<Pos> GenPositions(const size_t player_num, const float map_size) {
+  std::vector<Pos> positions;
+  positions.reserve(player_num);
+
+  boost::random::mt19937 random_generator(std::time(0));
+  boost::random::uniform_real_distribution<float> pos_generator(-map_size, map_size);
+  for (int UNUSED(i) : boost::irange(player_num)) {
+    positions.emplace_back(pos_generator(random_generator), 0, pos_generator(random_generator));
+  }
+  return positions;
+}
+
+
+std::vector<Pos> GenMovements(const size_t player_num, const float length) {
+  std::vector<Pos> movements;
+  movements.reserve(player_num);
+
+  boost::random::mt19937 random_generator(std::time(0));
+  boost::random::uniform_real_distribution<float> angle_gen(0, 360);
+  for (int UNUSED(i) : boost::irange(player_num)) {
+    float angle = angle_gen(random_generator);
+    float radian = 2 * M_PI * angle / 360;
+    movements.emplace_back(std::cos(radian) * length, 0, std::sin(radian) * length);
+  }
+
+  return movements;
+}
+
+
+void TestOneMilestone(std::vector<Pos> *positions, const size_t player_num,
+                      const float map_size) {
+  printf("\n===Begin Milestore: player_num = %lu, map_size = (%f, %f)\n",
+         player_num, -map_size, map_size);
+
+  boost::timer::cpu_timer run_timer;
+  SimdBruteAoi aoi;
+  std::vector<Nuid> nuids;
+  nuids.reserve(player_num);
+  for (const auto &pos : *positions) {
+    nuids.push_back(GenNuid());
+    aoi.AddPlayer(nuids.back(), pos.x, pos.y, pos.z);
+    aoi.AddSensor(nuids.back(), GenNuid(), 100);
+  }
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == player_num));
+  run_timer.stop();
+  printf("Add Player (1 times)");
+  std::cout << run_timer.format();
+
+  aoi.Tick();
+
+  run_timer.start();
+  aoi.Tick();
+  run_timer.stop();
+  printf("Tick (1 times)");
+  std::cout << run_timer.format();
+
+  float speed = 6;
+  float delta_time = 0.1;
+  auto movements = GenMovements(player_num, delta_time * speed);
+  int times = 1 / delta_time;
+  run_timer.start();
+  for (int UNUSED(t) : boost::irange(times)) {
+    for (int i : boost::irange(player_num)) {
+      auto &pos = positions->at(i);
+      auto &move = movements[i];
+      pos.Set(pos.x + move.x, pos.y + move.y, pos.z + move.z);
+      aoi.UpdatePos(nuids[i], pos.x, pos.y, pos.z);
+    }
+  }
+  run_timer.stop();
+  printf("Update Pos (%i times)", times);
+  std::cout << run_timer.format();
+
+  printf("===End Milestore\n");
+}
+
+
+BOOST_AUTO_TEST_CASE(test_milestone) {
+  // 暴力算法是 O(n^2)，只测到它适用的规模
+  for (size_t player_num : {100, 1000}) {
+    for (float map_size : {50, 100, 1000, 10000}) {
+      auto positions = GenPositions(player_num, map_size);
+      TestOneMilestone(&positions, player_num, map_size);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
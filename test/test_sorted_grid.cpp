@@ -0,0 +1,315 @@
+// Copyright <disenone>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <ctime>
+
+#define BOOST_TEST_MODULE test_sorted_grid
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/included/unit_test.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <boost/timer/timer.hpp>
+#include <boost/range/irange.hpp>
+
+#include <common/arena.hpp>
+#include <common/nuid.hpp>
+#include <common/silence_unused.hpp>
+#include <sorted_grid/sorted_grid.hpp>
+#include <squares/squares.hpp>
+
+using namespace aoi;
+using namespace aoi::sorted_grid;
+
+BOOST_AUTO_TEST_SUITE(test_sorted_grid)
+
+// Tick 之后马上检查：快照里每个格子的玩家都在这个格子里，返回快照里的玩家数
+size_t CheckGrid(const SortedGridAoi &aoi) {
+  size_t count = 0;
+  for (size_t cell = 0; cell < aoi.GetCellNum(); ++cell) {
+    size_t num = 0;
+    auto players = aoi.GetCellPlayers(cell, &num);
+    for (size_t i = 0; i < num; ++i) {
+      BOOST_TEST_REQUIRE((!players[i]->GetFlag_Removed()));
+      BOOST_TEST_REQUIRE((aoi.GetCell(players[i]->pos.x, players[i]->pos.z) == cell));
+    }
+    count += num;
+  }
+  return count;
+}
+
+
+BOOST_AUTO_TEST_CASE(test_simple) {
+  SortedGridAoi aoi(20, 1);
+  aoi.AddPlayer(1, 0, 0, 0);
+  aoi.AddSensor(1, 100, 10);
+  aoi.AddPlayer(2, 0, 0, 0);
+  aoi.AddSensor(2, 200, 5);
+
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 2));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{2}));
+  BOOST_TEST_REQUIRE((update_infos[2].sensor_update_list[0].enters == PlayerNuids{1}));
+
+  aoi.UpdatePos(2, 6, 0, 0);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 1));
+  BOOST_TEST_REQUIRE((update_infos[2].sensor_update_list[0].leaves == PlayerNuids{1}));
+
+  aoi.UpdatePos(2, 600, 0, 100);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 1));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{2}));
+
+  aoi.UpdatePos(1, 601, 0, 101);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 2));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{2}));
+  BOOST_TEST_REQUIRE((update_infos[2].sensor_update_list[0].enters == PlayerNuids{1}));
+
+  aoi.RemovePlayer(2);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 1));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{2}));
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == 1));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_grid) {
+  SortedGridAoi aoi(10, 1);
+  for (Nuid nuid : boost::irange<Nuid>(1, 101)) {
+    aoi.AddPlayer(nuid, (nuid % 10) * 10.f + 5, 0, (nuid / 10) * 10.f + 5);
+  }
+  aoi.AddSensor(1, 100, 15);
+  aoi.Tick();
+  // 玩家的包围盒 90 x 100，格子边长 10，不用放大
+  BOOST_TEST_REQUIRE((aoi.GetCellSize() == 10));
+  BOOST_TEST_REQUIRE((aoi.GetCellNum() == 10 * 11));
+  BOOST_TEST_REQUIRE((CheckGrid(aoi) == 100));
+  // 每个格子最多一个玩家，左下角的格子是空的，右边一格是 nuid 1
+  size_t num = 0;
+  aoi.GetCellPlayers(0, &num);
+  BOOST_TEST_REQUIRE((num == 0));
+  auto players = aoi.GetCellPlayers(1, &num);
+  BOOST_TEST_REQUIRE((num == 1 && players[0]->nuid == 1));
+
+  // 玩家很分散时放大格子，格子数不超过玩家数的 kMaxCellsPerPlayer 倍
+  aoi.UpdatePos(100, 100000, 0, 100000);
+  aoi.RemovePlayer(50);
+  aoi.Tick();
+  BOOST_TEST_REQUIRE((aoi.GetCellSize() > 10));
+  BOOST_TEST_REQUIRE((aoi.GetCellNum() <= 99 * SortedGridAoi::kMaxCellsPerPlayer));
+  BOOST_TEST_REQUIRE((CheckGrid(aoi) == 99));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_parallel_sort) {
+  // 分段并行排出来的快照和事件要和单线程完全一样，事件集合和 squares 一样
+  size_t player_num = SortedGridAoi::kMinPlayersPerChunk * 4;
+  boost::random::mt19937 random_generator(20211118);
+  boost::random::uniform_real_distribution<float> pos_gen(-500, 500);
+  boost::random::uniform_real_distribution<float> move_gen(-5, 5);
+  SortedGridAoi serial(50, 1), parallel(50, 4);
+  squares::SquareAoi square(50);
+  std::vector<Pos> positions;
+  for (size_t i : boost::irange(player_num)) {
+    positions.emplace_back(pos_gen(random_generator), 0, pos_gen(random_generator));
+    const auto &pos = positions.back();
+    serial.AddPlayer(i + 1, pos.x, 0, pos.z);
+    parallel.AddPlayer(i + 1, pos.x, 0, pos.z);
+    square.AddPlayer(i + 1, pos.x, 0, pos.z);
+    if (i % 4 == 0) {
+      serial.AddSensor(i + 1, i + 1, 20);
+      parallel.AddSensor(i + 1, i + 1, 20);
+      square.AddSensor(i + 1, i + 1, 20);
+    }
+  }
+
+  for (int UNUSED(t) : boost::irange(3)) {
+    auto serial_infos = serial.Tick();
+    auto parallel_infos = parallel.Tick();
+    auto square_infos = square.Tick();
+    BOOST_TEST_REQUIRE((serial.GetCellNum() == parallel.GetCellNum()));
+    BOOST_TEST_REQUIRE((CheckGrid(parallel) == player_num));
+    for (size_t cell = 0; cell < serial.GetCellNum(); ++cell) {
+      size_t serial_num = 0, parallel_num = 0;
+      auto serial_players = serial.GetCellPlayers(cell, &serial_num);
+      auto parallel_players = parallel.GetCellPlayers(cell, &parallel_num);
+      BOOST_TEST_REQUIRE((serial_num == parallel_num));
+      for (size_t i = 0; i < serial_num; ++i) {
+        BOOST_TEST_REQUIRE((serial_players[i]->nuid == parallel_players[i]->nuid));
+      }
+    }
+
+    BOOST_TEST_REQUIRE((serial_infos.size() == parallel_infos.size()));
+    BOOST_TEST_REQUIRE((serial_infos.size() == square_infos.size()));
+    for (auto &elem : serial_infos) {
+      auto &sensor_info = elem.second.sensor_update_list[0];
+      BOOST_TEST_REQUIRE((sensor_info.enters ==
+                          parallel_infos[elem.first].sensor_update_list[0].enters));
+      auto &square_info = square_infos[elem.first].sensor_update_list[0];
+      std::sort(sensor_info.enters.begin(), sensor_info.enters.end());
+      std::sort(sensor_info.leaves.begin(), sensor_info.leaves.end());
+      std::sort(square_info.enters.begin(), square_info.enters.end());
+      std::sort(square_info.leaves.begin(), square_info.leaves.end());
+      BOOST_TEST_REQUIRE((sensor_info.enters == square_info.enters));
+      BOOST_TEST_REQUIRE((sensor_info.leaves == square_info.leaves));
+    }
+
+    for (size_t i : boost::irange(player_num)) {
+      auto &pos = positions[i];
+      pos.Set(pos.x + move_gen(random_generator), 0, pos.z + move_gen(random_generator));
+      serial.UpdatePos(i + 1, pos.x, 0, pos.z);
+      parallel.UpdatePos(i + 1, pos.x, 0, pos.z);
+      square.UpdatePos(i + 1, pos.x, 0, pos.z);
+    }
+  }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_remove_and_add) {
+  SortedGridAoi aoi(20, 1);
+  aoi.AddPlayer(1, 0, 0, 0);
+  aoi.AddSensor(1, 100, 10);
+  aoi.AddPlayer(2, 3, 0, 0);
+  aoi.AddPlayer(3, 30, 0, 0);
+  aoi.Tick();
+
+  // 同一次 Tick 里移除又加回来，没有进出，也不会被删掉
+  aoi.RemovePlayer(2);
+  aoi.RemovePlayer(2);
+  aoi.AddPlayer(2, 4, 0, 0);
+  BOOST_TEST_REQUIRE(aoi.Tick().empty());
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == 3));
+  BOOST_TEST_REQUIRE((CheckGrid(aoi) == 3));
+
+  // 移除的玩家移动、改 category 不进快照；扁平数组里的空位由最后一个玩家填上
+  aoi.RemovePlayer(1);
+  aoi.UpdatePos(1, 5, 0, 0);
+  aoi.SetPlayerCategory(1, 2);
+  aoi.UpdatePos(3, 5, 0, 0);
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.empty()));
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == 2));
+  BOOST_TEST_REQUIRE((CheckGrid(aoi) == 2));
+
+  aoi.AddPlayer(1, 0, 0, 0);
+  aoi.AddSensor(1, 100, 10);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters.size() == 2));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_memory_usage) {
+  Arena arena;
+  SortedGridAoi aoi(20, 2, &arena);
+  BOOST_TEST_REQUIRE((aoi.GetMemoryResource() == &arena));
+  auto empty_usage = aoi.GetMemoryUsage();
+  BOOST_TEST_REQUIRE((empty_usage.players == 0 && empty_usage.sensors == 0));
+
+  for (int i : boost::irange(100)) {
+    aoi.AddPlayer(i + 1, i, 0, 0);
+    if (i % 2 == 0) aoi.AddSensor(i + 1, 1000 + i, 10);
+  }
+  size_t used = arena.GetUsedBytes();
+  aoi.Tick();
+  BOOST_TEST_REQUIRE((arena.GetUsedBytes() > used));
+  auto usage = aoi.GetMemoryUsage();
+  BOOST_TEST_REQUIRE((usage.players == 100 * sizeof(PlayerAoi)));
+  BOOST_TEST_REQUIRE((usage.sensors >= 50 * sizeof(Sensor)));
+  BOOST_TEST_REQUIRE((usage.cells >= aoi.GetCellNum() * sizeof(Uint32) + 100 * sizeof(float) * 4));
+  BOOST_TEST_REQUIRE((usage.aoi_lists > 0 && usage.candidates == 0));
+  BOOST_TEST_REQUIRE((usage.Total() > empty_usage.Total()));
+}
+
+
+std::vector<Pos> GenPositions(const size_t player_num, const float map_size) {
+  std::vector<Pos> positions;
+  positions.reserve(player_num);
+
+  boost::random::mt19937 random_generator(std::time(0));
+  boost::random::uniform_real_distribution<float> pos_generator(-map_size, map_size);
+  for (int UNUSED(i) : boost::irange(player_num)) {
+    positions.emplace_back(pos_generator(random_generator), 0, pos_generator(random_generator));
+  }
+  return positions;
+}
+
+
+std::vector<Pos> GenMovements(const size_t player_num, const float length) {
+  std::vector<Pos> movements;
+  movements.reserve(player_num);
+
+  boost::random::mt19937 random_generator(std::time(0));
+  boost::random::uniform_real_distribution<float> angle_gen(0, 360);
+  for (int UNUSED(i) : boost::irange(player_num)) {
+    float angle = angle_gen(random_generator);
+    float radian = 2 * M_PI * angle / 360;
+    movements.emplace_back(std::cos(radian) * length, 0, std::sin(radian) * length);
+  }
+
+  return movements;
+}
+
+
+void TestOneMilestone(std::vector<Pos> *positions, const size_t player_num,
+                      const float map_size) {
+  printf("\n===Begin Milestore: player_num = %lu, map_size = (%f, %f)\n",
+         player_num, -map_size, map_size);
+
+  boost::timer::cpu_timer run_timer;
+  SortedGridAoi aoi;
+  std::vector<Nuid> nuids;
+  nuids.reserve(player_num);
+  for (const auto &pos : *positions) {
+    nuids.push_back(GenNuid());
+    aoi.AddPlayer(nuids.back(), pos.x, pos.y, pos.z);
+    aoi.AddSensor(nuids.back(), GenNuid(), 100);
+  }
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == player_num));
+  run_timer.stop();
+  printf("Add Player (1 times)");
+  std::cout << run_timer.format();
+
+  aoi.Tick();
+  printf("Cells: %lu, cell size: %f\n", aoi.GetCellNum(), aoi.GetCellSize());
+
+  run_timer.start();
+  aoi.Tick();
+  run_timer.stop();
+  printf("Tick (1 times)");
+  std::cout << run_timer.format();
+
+  float speed = 6;
+  float delta_time = 0.1;
+  auto movements = GenMovements(player_num, delta_time * speed);
+  int times = 1 / delta_time;
+  run_timer.start();
+  for (int UNUSED(t) : boost::irange(times)) {
+    for (int i : boost::irange(player_num)) {
+      auto &pos = positions->at(i);
+      auto &move = movements[i];
+      pos.Set(pos.x + move.x, pos.y + move.y, pos.z + move.z);
+      aoi.UpdatePos(nuids[i], pos.x, pos.y, pos.z);
+    }
+  }
+  run_timer.stop();
+  printf("Update Pos (%i times)", times);
+  std::cout << run_timer.format();
+
+  printf("===End Milestore\n");
+}
+
+
+BOOST_AUTO_TEST_CASE(test_milestone) {
+  for (size_t player_num : {100, 1000, 10000}) {
+    for (float map_size : {50, 100, 1000, 10000}) {
+      auto positions = GenPositions(player_num, map_size);
+      TestOneMilestone(&positions, player_num, map_size);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
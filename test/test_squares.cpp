@@ -2,6 +2,8 @@
 
 #include <unordered_map>
 #include <iostream>
+#include <map>
+#include <set>
 #include <vector>
 
 #define BOOST_TEST_MODULE test_squares
@@ -9,9 +11,11 @@
 #include <boost/test/included/unit_test.hpp>
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_real_distribution.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
 #include <boost/timer/timer.hpp>
 #include <boost/range/irange.hpp>
 
+#include <common/arena.hpp>
 #include <common/nuid.hpp>
 #include <common/silence_unused.hpp>
 #include <squares/squares.hpp>
@@ -234,6 +238,446 @@ BOOST_AUTO_TEST_CASE(test_simple) {
 }
 
 
+BOOST_AUTO_TEST_CASE(test_tick_stats) {
+  SquareAoiTest square_aoi;
+
+  Player player1{GenNuid(), {0, 0, 0}};
+  player1.AddToAoi(&square_aoi);
+  player1.AddSensor(10);
+
+  Player player2{GenNuid(), {0, 0, 0}};
+  player2.AddToAoi(&square_aoi);
+  player2.AddSensor(5);
+
+  square_aoi.Tick();
+  auto stats = square_aoi.GetTickStats();
+  if (!kAoiStatsEnabled) {
+    BOOST_TEST_REQUIRE((stats.cells_visited == 0));
+    BOOST_TEST_REQUIRE((stats.enters == 0));
+    return;
+  }
+
+  BOOST_TEST_REQUIRE((stats.cells_visited == 2));
+  BOOST_TEST_REQUIRE((stats.candidates_scanned == 4));
+  BOOST_TEST_REQUIRE((stats.candidates_accepted == 2));
+  BOOST_TEST_REQUIRE((stats.cell_migrations == 0));
+  BOOST_TEST_REQUIRE((stats.enters == 2));
+  BOOST_TEST_REQUIRE((stats.leaves == 0));
+
+  player2.MoveTo(600, 0, 100);
+  square_aoi.Tick();
+  stats = square_aoi.GetTickStats();
+  BOOST_TEST_REQUIRE((stats.cells_visited == 2));
+  BOOST_TEST_REQUIRE((stats.candidates_scanned == 2));
+  BOOST_TEST_REQUIRE((stats.candidates_accepted == 0));
+  BOOST_TEST_REQUIRE((stats.cell_migrations == 1));
+  BOOST_TEST_REQUIRE((stats.enters == 0));
+  BOOST_TEST_REQUIRE((stats.leaves == 2));
+}
+
+
+// 按事件维护每个 sensor 看到的玩家，不能重复进入，也不能离开没看到的玩家
+typedef std::map<Nuid, std::set<Nuid>> SensorViews;
+
+void ApplyEvents(const AoiUpdateInfos &update_infos, SensorViews *views) {
+  for (const auto &elem : update_infos) {
+    for (const auto &sensor_info : elem.second.sensor_update_list) {
+      auto &view = (*views)[sensor_info.sensor_id];
+      for (auto nuid : sensor_info.leaves) {
+        BOOST_TEST_REQUIRE((view.erase(nuid) == 1));
+      }
+      for (auto nuid : sensor_info.enters) {
+        BOOST_TEST_REQUIRE(view.insert(nuid).second);
+      }
+    }
+  }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_tick_sliced_static) {
+  // 位置不变时，分片跑完一轮和一次 Tick 的结果相同
+  boost::random::mt19937 random_generator(20211118);
+  boost::random::uniform_real_distribution<float> pos_gen(-300, 300);
+
+  SquareAoi expected(100), progressive(100), atomic(100);
+  for (Nuid nuid : boost::irange<Nuid>(1, 301)) {
+    float x = pos_gen(random_generator), z = pos_gen(random_generator);
+    for (auto aoi : {&expected, &progressive, &atomic}) {
+      aoi->AddPlayer(nuid, x, 0, z);
+      aoi->AddSensor(nuid, nuid + 1000, 80);
+    }
+  }
+
+  SensorViews expected_views, progressive_views, atomic_views;
+  ApplyEvents(expected.Tick(), &expected_views);
+
+  TickBudget budget;
+  budget.players = 7;
+  int calls = 0;
+  while (true) {
+    AoiUpdateInfos progressive_infos, atomic_infos;
+    bool progressive_done = progressive.TickSliced(budget, kSliceProgressive, &progressive_infos);
+    bool atomic_done = atomic.TickSliced(budget, kSliceAtomic, &atomic_infos);
+    BOOST_TEST_REQUIRE((progressive_done == atomic_done));
+    BOOST_TEST_REQUIRE((progressive_infos.size() <= budget.players));
+    BOOST_TEST_REQUIRE((atomic_done || atomic_infos.empty()));
+    ApplyEvents(progressive_infos, &progressive_views);
+    ApplyEvents(atomic_infos, &atomic_views);
+    ++calls;
+    if (progressive_done) break;
+    BOOST_TEST_REQUIRE(progressive.IsSlicing());
+  }
+  BOOST_TEST_REQUIRE((calls == (300 + 6) / 7));
+  BOOST_TEST_REQUIRE(!progressive.IsSlicing());
+  BOOST_TEST_REQUIRE((progressive_views == expected_views));
+  BOOST_TEST_REQUIRE((atomic_views == expected_views));
+
+  // 之后普通的 Tick 不会产生多余的事件
+  BOOST_TEST_REQUIRE(progressive.Tick().empty());
+  BOOST_TEST_REQUIRE(atomic.Tick().empty());
+}
+
+
+BOOST_AUTO_TEST_CASE(test_tick_sliced_dynamic) {
+  // 分片之间玩家移动、移除、重新加入，事件始终和每个 sensor 自己看到的集合一致
+  boost::random::mt19937 random_generator(20211118);
+  boost::random::uniform_real_distribution<float> pos_gen(-200, 200);
+  boost::random::uniform_real_distribution<float> move_gen(-15, 15);
+  boost::random::uniform_int_distribution<int> op_gen(0, 99);
+
+  const float radius = 50;
+  const Nuid player_num = 200;
+  SquareAoi aoi(60);
+  std::map<Nuid, std::pair<float, float>> positions;
+  std::set<Nuid> removed;
+  SensorViews views;
+  for (Nuid nuid : boost::irange<Nuid>(1, player_num + 1)) {
+    float x = pos_gen(random_generator), z = pos_gen(random_generator);
+    aoi.AddPlayer(nuid, x, 0, z);
+    positions[nuid] = {x, z};
+    // 偶数号玩家有 sensor
+    if (nuid % 2 == 0) aoi.AddSensor(nuid, nuid + 1000, radius);
+  }
+
+  TickBudget budget;
+  budget.players = 9;
+  for (int UNUSED(pass) : boost::irange(10)) {
+    for (int UNUSED(slice) : boost::irange(100)) {
+      AoiUpdateInfos update_infos;
+      bool done = aoi.TickSliced(budget, kSliceProgressive, &update_infos);
+      ApplyEvents(update_infos, &views);
+      if (done) break;
+
+      for (auto &elem : positions) {
+        auto nuid = elem.first;
+        auto &pos = elem.second;
+        int op = op_gen(random_generator);
+        if (removed.count(nuid)) {
+          // 只重新加入没有 sensor 的玩家，有 sensor 的玩家被移除之后它的列表会清空
+          if (nuid % 2 == 1 && op < 10) {
+            aoi.AddPlayer(nuid, pos.first, 0, pos.second);
+            removed.erase(nuid);
+          }
+        } else if (op < 1) {
+          aoi.RemovePlayer(nuid);
+          removed.insert(nuid);
+          views.erase(nuid + 1000);
+        } else if (op < 30) {
+          pos.first += move_gen(random_generator);
+          pos.second += move_gen(random_generator);
+          aoi.UpdatePos(nuid, pos.first, 0, pos.second);
+        }
+      }
+    }
+    BOOST_TEST_REQUIRE(!aoi.IsSlicing());
+  }
+
+  // 没跑完的一轮由 Tick 跑完，再 Tick 一次，看到的集合和实际位置一致
+  AoiUpdateInfos update_infos;
+  aoi.TickSliced(budget, kSliceAtomic, &update_infos);
+  BOOST_TEST_REQUIRE(update_infos.empty());
+  BOOST_TEST_REQUIRE(aoi.IsSlicing());
+  ApplyEvents(aoi.Tick(), &views);
+  BOOST_TEST_REQUIRE(!aoi.IsSlicing());
+  ApplyEvents(aoi.Tick(), &views);
+
+  for (const auto &elem : positions) {
+    auto nuid = elem.first;
+    if (nuid % 2 == 1 || removed.count(nuid)) continue;
+
+    std::set<Nuid> expected;
+    for (const auto &other : positions) {
+      if (other.first == nuid || removed.count(other.first)) continue;
+      float dx = elem.second.first - other.second.first;
+      float dz = elem.second.second - other.second.second;
+      if (dx * dx + dz * dz < radius * radius) expected.insert(other.first);
+    }
+    BOOST_TEST_REQUIRE((views[nuid + 1000] == expected));
+  }
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == player_num - removed.size()));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_leave_radius) {
+  SquareAoiTest aoi;
+  aoi.AddPlayer(1, 0, 0, 0);
+  aoi.AddSensor(1, 100, 10);
+  aoi.SetSensorLeaveRadius(1, 100, 15);
+  aoi.AddPlayer(2, 12, 0, 0);
+
+  // 在进入半径外，看不到
+  BOOST_TEST_REQUIRE(aoi.Tick().empty());
+
+  aoi.UpdatePos(2, 9, 0, 0);
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{2}));
+
+  // 在进入和离开半径之间来回走，不产生事件
+  for (float x : {12.f, 9.5f, 14.5f, 11.f}) {
+    aoi.UpdatePos(2, x, 0, 0);
+    BOOST_TEST_REQUIRE(aoi.Tick().empty());
+  }
+
+  aoi.UpdatePos(2, 16, 0, 0);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{2}));
+
+  aoi.UpdatePos(2, 14, 0, 0);
+  BOOST_TEST_REQUIRE(aoi.Tick().empty());
+
+  // 离开半径设回进入半径，14 超出了 10
+  aoi.UpdatePos(2, 9, 0, 0);
+  aoi.Tick();
+  aoi.SetSensorLeaveRadius(1, 100, 0);
+  aoi.UpdatePos(2, 14, 0, 0);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{2}));
+}
+
+BOOST_AUTO_TEST_CASE(test_sensor_interval) {
+  SquareAoiTest aoi;
+  for (int i = 1; i <= 4; ++i) {
+    aoi.AddPlayer(i, i * 100, 0, 0);
+    aoi.AddSensor(i, 100 + i, 10);
+    aoi.SetSensorInterval(i, 100 + i, 2);
+    aoi.AddPlayer(10 + i, i * 100 + 5, 0, 0);
+  }
+
+  // 刚设置间隔的 sensor 马上计算
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 4));
+
+  // 相位错开，每次 Tick 只有一半的 sensor 计算
+  for (int i = 1; i <= 4; ++i) {
+    aoi.UpdatePos(10 + i, i * 100 + 20, 0, 0);
+  }
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 2));
+  BOOST_TEST_REQUIRE((update_infos[2].sensor_update_list[0].leaves == PlayerNuids{12}));
+  BOOST_TEST_REQUIRE((update_infos[4].sensor_update_list[0].leaves == PlayerNuids{14}));
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 2));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{11}));
+  BOOST_TEST_REQUIRE((update_infos[3].sensor_update_list[0].leaves == PlayerNuids{13}));
+
+  // 1 下一次 Tick 不计算，再下一次才看到 11
+  aoi.UpdatePos(11, 105, 0, 0);
+  BOOST_TEST_REQUIRE(aoi.Tick().empty());
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{11}));
+
+  // 11 被移除，1 计算的时候才离开
+  aoi.RemovePlayer(11);
+  BOOST_TEST_REQUIRE(aoi.Tick().empty());
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == 7));
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos.size() == 1));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{11}));
+}
+
+BOOST_AUTO_TEST_CASE(test_static_entity) {
+  SquareAoiTest aoi;
+  aoi.AddPlayer(1, 0, 0, 0);
+  aoi.AddSensor(1, 100, 10);
+  aoi.AddPlayer(2, 3, 0, 0);
+  aoi.AddStaticEntity(50, 5, 0, 0);
+  aoi.AddStaticEntity(51, 30, 0, 0);
+
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{2, 50}));
+  // 静态实体不是玩家
+  BOOST_TEST_REQUIRE((aoi.GetPlayerMap().size() == 2));
+
+  // 只有玩家移动，sensor 没动，静态实体不产生事件
+  aoi.UpdatePos(2, 40, 0, 0);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{2}));
+
+  aoi.UpdatePos(1, 25, 0, 0);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{51}));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{50}));
+}
+
+BOOST_AUTO_TEST_CASE(test_category) {
+  SquareAoiTest aoi;
+  aoi.AddPlayer(1, 0, 0, 0);
+  aoi.AddSensor(1, 100, 10);
+  aoi.SetSensorInterest(1, 100, 2);
+  aoi.AddPlayer(2, 3, 0, 0);
+  aoi.AddPlayer(3, -3, 0, 0);
+  aoi.SetPlayerCategory(3, 2);
+  aoi.AddStaticEntity(50, 5, 0, 0);
+
+  // 默认 category 的玩家和静态实体都不在 interest 里
+  auto update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{3}));
+  // category 2 的玩家在单独的一层格子里
+  BOOST_TEST_REQUIRE((aoi.GetLayerSquares(2).size() == 1));
+  BOOST_TEST_REQUIRE((aoi.GetLayerSquares(2).begin()->second.size() == 1));
+
+  // 不移动只改 category 也要产生进出
+  aoi.SetPlayerCategory(2, 3);
+  aoi.SetPlayerCategory(3, kDefaultCategory);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{2}));
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].leaves == PlayerNuids{3}));
+
+  aoi.SetSensorInterest(1, 100, kAllCategories);
+  update_infos = aoi.Tick();
+  BOOST_TEST_REQUIRE((update_infos[1].sensor_update_list[0].enters == PlayerNuids{3, 50}));
+  BOOST_TEST_REQUIRE(update_infos[1].sensor_update_list[0].leaves.empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_tick_order) {
+  SquareAoiTest aoi;
+  aoi.AddPlayer(1, 250, 0, 250);
+  aoi.AddPlayer(2, 10, 0, 10);
+  aoi.AddPlayer(3, -10, 0, 10);
+  aoi.AddPlayer(4, 10, 0, 250);
+
+  auto order_nuids = [&aoi]() {
+    PlayerNuids nuids;
+    for (auto pptr : aoi.GetTickOrder()) nuids.push_back(pptr->nuid);
+    return nuids;
+  };
+  BOOST_TEST_REQUIRE((order_nuids() == PlayerNuids{1, 2, 3, 4}));
+  // 第一次 Tick 就按格子的 Z 序排好
+  aoi.Tick();
+  BOOST_TEST_REQUIRE((order_nuids() == PlayerNuids{3, 2, 4, 1}));
+
+  // 新玩家排在最后，删除的玩家由最后一个补上
+  aoi.AddPlayer(5, -300, 0, -300);
+  aoi.RemovePlayer(2);
+  aoi.Tick();
+  BOOST_TEST_REQUIRE((order_nuids() == PlayerNuids{3, 5, 4, 1}));
+
+  aoi.SetReorderInterval(1);
+  aoi.Tick();
+  BOOST_TEST_REQUIRE((order_nuids() == PlayerNuids{5, 3, 4, 1}));
+}
+
+BOOST_AUTO_TEST_CASE(test_quantized) {
+  boost::random::mt19937 random_generator(20211201);
+  boost::random::uniform_real_distribution<float> pos_gen(-300, 300);
+  boost::random::uniform_real_distribution<float> step_gen(-10, 10);
+  boost::random::uniform_real_distribution<float> radius_gen(1, 80);
+  auto snap = [](float coord) { return std::round(coord * 4) / 4; };
+
+  // 量化的 aoi 直接用原始坐标，普通的 aoi 用取整之后的坐标，结果要完全一样
+  SquareAoi quantized(50);
+  quantized.EnableQuantization(0.25);
+  SquareAoi plain(50);
+  BOOST_TEST_REQUIRE(quantized.IsQuantized());
+
+  std::vector<std::pair<float, float>> positions;
+  for (int i : boost::irange(300)) {
+    float x = pos_gen(random_generator), z = pos_gen(random_generator);
+    positions.emplace_back(x, z);
+    quantized.AddPlayer(i + 1, x, 0, z);
+    plain.AddPlayer(i + 1, snap(x), 0, snap(z));
+    if (i % 3 == 0) {
+      float radius = radius_gen(random_generator);
+      quantized.AddSensor(i + 1, 1000 + i, radius);
+      plain.AddSensor(i + 1, 1000 + i, radius);
+    }
+  }
+  BOOST_TEST_REQUIRE((quantized.GetPlayerMap().at(1)->pos.x == snap(positions[0].first)));
+
+  for (int UNUSED(tick) : boost::irange(20)) {
+    for (int i : boost::irange(300)) {
+      auto &pos = positions[i];
+      pos.first += step_gen(random_generator);
+      pos.second += step_gen(random_generator);
+      quantized.UpdatePos(i + 1, pos.first, 0, pos.second);
+      plain.UpdatePos(i + 1, snap(pos.first), 0, snap(pos.second));
+    }
+    CheckUpdateInfos(quantized.Tick(), plain.Tick());
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_memory_usage) {
+  SquareAoiTest aoi;
+  auto empty_usage = aoi.GetMemoryUsage();
+  BOOST_TEST_REQUIRE((empty_usage.players == 0 && empty_usage.sensors == 0));
+
+  for (int i : boost::irange(100)) {
+    aoi.AddPlayer(i + 1, i, 0, 0);
+    if (i % 2 == 0) aoi.AddSensor(i + 1, 1000 + i, 10);
+  }
+  aoi.Tick();
+  auto usage = aoi.GetMemoryUsage();
+  BOOST_TEST_REQUIRE((usage.players == 100 * sizeof(PlayerAoi)));
+  BOOST_TEST_REQUIRE((usage.sensors >= 50 * sizeof(Sensor)));
+  BOOST_TEST_REQUIRE((usage.cells > 0 && usage.candidates == 0));
+  BOOST_TEST_REQUIRE((usage.aoi_lists > 0));
+  BOOST_TEST_REQUIRE((usage.Total() > empty_usage.Total()));
+}
+BOOST_AUTO_TEST_CASE(test_arena) {
+  boost::random::mt19937 random_generator(20211205);
+  boost::random::uniform_real_distribution<float> pos_gen(-300, 300);
+  boost::random::uniform_real_distribution<float> step_gen(-10, 10);
+
+  // 从 arena 分配的 aoi 和普通的 aoi 结果完全一样
+  std::unique_ptr<Arena> arena(new Arena(64 * 1024, true));
+  std::unique_ptr<SquareAoi> arena_aoi(new SquareAoi(50, arena.get()));
+  SquareAoi plain(50);
+  BOOST_TEST_REQUIRE((arena_aoi->GetMemoryResource() == arena.get()));
+
+  std::vector<std::pair<float, float>> positions;
+  for (int i : boost::irange(300)) {
+    positions.emplace_back(pos_gen(random_generator), pos_gen(random_generator));
+    arena_aoi->AddPlayer(i + 1, positions.back().first, 0, positions.back().second);
+    plain.AddPlayer(i + 1, positions.back().first, 0, positions.back().second);
+    if (i % 3 == 0) {
+      arena_aoi->AddSensor(i + 1, 1000 + i, 40);
+      plain.AddSensor(i + 1, 1000 + i, 40);
+    }
+  }
+  size_t used_bytes = arena->GetUsedBytes();
+  BOOST_TEST_REQUIRE((used_bytes >= 300 * sizeof(PlayerAoi)));
+
+  for (int tick : boost::irange(10)) {
+    for (int i : boost::irange(300)) {
+      auto &pos = positions[i];
+      pos.first += step_gen(random_generator);
+      pos.second += step_gen(random_generator);
+      arena_aoi->UpdatePos(i + 1, pos.first, 0, pos.second);
+      plain.UpdatePos(i + 1, pos.first, 0, pos.second);
+    }
+    if (tick == 5) {
+      arena_aoi->RemovePlayer(1);
+      plain.RemovePlayer(1);
+    }
+    CheckUpdateInfos(arena_aoi->Tick(), plain.Tick());
+  }
+  BOOST_TEST_REQUIRE((arena->GetUsedBytes() > used_bytes));
+
+  // 先析构 aoi，arena 整块归还
+  arena_aoi.reset();
+  arena.reset();
+}
+
 std::vector<Player> GenPlayers(const size_t player_num, const float map_size) {
   std::vector<Player> players(player_num);
 
@@ -0,0 +1,106 @@
+// Copyright <disenone>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#define BOOST_TEST_MODULE test_static_index
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/included/unit_test.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <boost/range/irange.hpp>
+
+#include <common/silence_unused.hpp>
+#include <common/static_index.hpp>
+
+using namespace aoi;
+
+BOOST_AUTO_TEST_SUITE(test_static_index)
+
+struct Point {
+  Nuid nuid;
+  float x, z;
+};
+
+
+std::vector<Nuid> BruteQuery(const std::vector<Point> &points, float x, float z, float radius) {
+  std::vector<Nuid> ret;
+  for (const auto &point : points) {
+    float dx = point.x - x;
+    float dz = point.z - z;
+    if (dx * dx + dz * dz < radius * radius) ret.push_back(point.nuid);
+  }
+  std::sort(ret.begin(), ret.end());
+  return ret;
+}
+
+
+BOOST_AUTO_TEST_CASE(test_query) {
+  boost::random::mt19937 random_generator(20211118);
+  boost::random::uniform_real_distribution<float> pos_gen(-500, 500);
+  boost::random::uniform_real_distribution<float> radius_gen(0, 150);
+
+  for (float cell_size : {7.f, 50.f, 1000.f}) {
+    StaticIndex index;
+    std::vector<Point> points;
+    for (int i : boost::irange(2000)) {
+      points.push_back({static_cast<Nuid>(i + 1), pos_gen(random_generator),
+                        pos_gen(random_generator)});
+      index.Add(points.back().nuid, points.back().x, points.back().z);
+    }
+    BOOST_TEST_REQUIRE(index.IsDirty());
+    index.Build(cell_size);
+    BOOST_TEST_REQUIRE(!index.IsDirty());
+    BOOST_TEST_REQUIRE((index.Size() == points.size()));
+
+    std::vector<Nuid> nuids;
+    for (int UNUSED(i) : boost::irange(200)) {
+      float x = pos_gen(random_generator), z = pos_gen(random_generator);
+      float radius = radius_gen(random_generator);
+      index.Query(x, z, radius, &nuids);
+      BOOST_TEST_REQUIRE((nuids == BruteQuery(points, x, z, radius)));
+    }
+  }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_static_aoi) {
+  StaticIndex index;
+  StaticAoi aoi;
+  std::vector<Nuid> enters, leaves;
+
+  // 索引为空时什么都看不到
+  aoi.Update(index, 0, 0, 10, &enters, &leaves);
+  BOOST_TEST_REQUIRE((enters.empty() && leaves.empty()));
+
+  index.Add(1, 5, 0);
+  index.Add(2, -5, 0);
+  index.Add(3, 20, 0);
+  index.Build(8);
+  BOOST_TEST_REQUIRE((index.GetVersion() == 1));
+  aoi.Update(index, 0, 0, 10, &enters, &leaves);
+  BOOST_TEST_REQUIRE((enters == std::vector<Nuid>{1, 2}));
+  BOOST_TEST_REQUIRE(leaves.empty());
+
+  // 没有移动，不重新查询
+  enters.clear();
+  aoi.Update(index, 0, 0, 10, &enters, &leaves);
+  BOOST_TEST_REQUIRE((enters.empty() && leaves.empty()));
+
+  aoi.Update(index, 12, 0, 10, &enters, &leaves);
+  BOOST_TEST_REQUIRE((enters == std::vector<Nuid>{3}));
+  BOOST_TEST_REQUIRE((leaves == std::vector<Nuid>{2}));
+
+  // 重建之后即使没有移动也要重新查询
+  enters.clear();
+  leaves.clear();
+  index.Add(4, 15, 5);
+  index.Build(8);
+  aoi.Update(index, 12, 0, 10, &enters, &leaves);
+  BOOST_TEST_REQUIRE((enters == std::vector<Nuid>{4}));
+  BOOST_TEST_REQUIRE(leaves.empty());
+  BOOST_TEST_REQUIRE((aoi.nuids == std::vector<Nuid>{1, 3, 4}));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,210 @@
+// Copyright <disenone>
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <vector>
+
+#define BOOST_TEST_MODULE test_trace
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/included/unit_test.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <boost/range/irange.hpp>
+
+#include <common/nuid.hpp>
+#include <common/silence_unused.hpp>
+#include <common/trace.hpp>
+#include <cross/cross.hpp>
+#include <squares/squares.hpp>
+
+using namespace aoi;
+
+BOOST_AUTO_TEST_SUITE(test_trace)
+
+const char *kTracePath = "test_trace.aoitrace";
+
+// player nuid -> sensor id -> (enters, leaves)，与顺序无关
+typedef std::map<Nuid, std::map<Nuid, std::pair<std::set<Nuid>, std::set<Nuid>>>> SortedInfos;
+
+template <typename AoiUpdateInfos>
+SortedInfos SortInfos(const AoiUpdateInfos &update_infos) {
+  SortedInfos ret;
+  for (const auto &elem : update_infos) {
+    for (const auto &sensor_info : elem.second.sensor_update_list) {
+      auto &sensor = ret[elem.first][sensor_info.sensor_id];
+      sensor.first.insert(sensor_info.enters.begin(), sensor_info.enters.end());
+      sensor.second.insert(sensor_info.leaves.begin(), sensor_info.leaves.end());
+    }
+  }
+  return ret;
+}
+
+
+// 随机跑一段，返回每次 Tick 的结果
+template <typename Aoi>
+std::vector<SortedInfos> RunRandomSession(Aoi *aoi) {
+  boost::random::mt19937 random_generator(20211118);
+  boost::random::uniform_real_distribution<float> pos_gen(-100, 100);
+  boost::random::uniform_real_distribution<float> move_gen(-5, 5);
+
+  std::vector<Nuid> nuids;
+  for (int UNUSED(i) : boost::irange(50)) {
+    auto nuid = GenNuid();
+    aoi->AddPlayer(nuid, pos_gen(random_generator), 0, pos_gen(random_generator));
+    aoi->AddSensor(nuid, GenNuid(), 30);
+    nuids.push_back(nuid);
+  }
+
+  std::vector<SortedInfos> results;
+  results.push_back(SortInfos(aoi->Tick()));
+  for (int t : boost::irange(10)) {
+    // 前 t 个玩家已经被移除
+    for (auto i : boost::irange<size_t>(t, nuids.size())) {
+      auto nuid = nuids[i];
+      const auto &player = *aoi->GetPlayerMap().find(nuid)->second;
+      aoi->UpdatePos(nuid, player.pos.x + move_gen(random_generator), 0,
+                     player.pos.z + move_gen(random_generator));
+    }
+    aoi->RemovePlayer(nuids[t]);
+    results.push_back(SortInfos(aoi->Tick()));
+  }
+  return results;
+}
+
+
+template <typename Aoi>
+std::vector<SortedInfos> ReplayTrace(const TraceOps &ops, Aoi *aoi) {
+  std::vector<SortedInfos> results;
+  for (const auto &op : ops) {
+    if (op.type == kTraceTick) {
+      results.push_back(SortInfos(aoi->Tick()));
+    } else {
+      ApplyTraceOp(aoi, op);
+    }
+  }
+  return results;
+}
+
+
+BOOST_AUTO_TEST_CASE(test_write_read) {
+  TraceOps ops = {
+    {kTraceAddPlayer, 1, 0, 1.5, 2, -3},
+    {kTraceAddSensor, 1, 2, 10, 0, 0},
+    {kTraceSetMaxVisible, 1, 2, 0, 0, 0, (1u << 24) + 1},
+    {kTraceSetLeaveRadius, 1, 2, 12.5, 0, 0},
+    {kTraceSetInterval, 1, 2, 0, 0, 0, (1u << 24) + 1},
+    {kTraceAddStaticEntity, 3, 0, 7, 0, -8},
+    {kTraceSetPlayerCategory, 2, 0, 0, 0, 0, 6},
+    {kTraceSetSensorInterest, 1, 11, 0, 0, 0, kAllCategories},
+    {kTraceTick, 0, 0, 0, 0, 0},
+    {kTraceUpdatePos, 1, 0, 4, 5, 6},
+    {kTraceRemovePlayer, 1, 0, 0, 0, 0},
+    {kTraceRemoveSensor, 1, 2, 0, 0, 0},
+    {kTraceTick, 0, 0, 0, 0, 0},
+  };
+  BOOST_TEST_REQUIRE(SaveTrace(kTracePath, ops));
+
+  TraceOps load_ops;
+  BOOST_TEST_REQUIRE(LoadTrace(kTracePath, &load_ops));
+  std::remove(kTracePath);
+
+  BOOST_TEST_REQUIRE((load_ops.size() == ops.size()));
+  for (size_t i = 0; i < ops.size(); ++i) {
+    BOOST_TEST_REQUIRE((load_ops[i].type == ops[i].type));
+    BOOST_TEST_REQUIRE((load_ops[i].nuid == ops[i].nuid));
+    BOOST_TEST_REQUIRE((load_ops[i].sensor_id == ops[i].sensor_id));
+    BOOST_TEST_REQUIRE((load_ops[i].x == ops[i].x));
+    BOOST_TEST_REQUIRE((load_ops[i].y == ops[i].y));
+    BOOST_TEST_REQUIRE((load_ops[i].z == ops[i].z));
+    BOOST_TEST_REQUIRE((load_ops[i].mask == ops[i].mask));
+  }
+
+  BOOST_TEST_REQUIRE(!LoadTrace("not_exist.aoitrace", &load_ops));
+}
+
+
+template <typename Aoi>
+void TestRecordReplay(Aoi *record_aoi, Aoi *replay_aoi) {
+  std::vector<SortedInfos> results;
+  {
+    TraceWriter writer(kTracePath);
+    BOOST_TEST_REQUIRE(writer.IsOpen());
+    record_aoi->SetTraceWriter(&writer);
+    results = RunRandomSession(record_aoi);
+    record_aoi->SetTraceWriter(nullptr);
+  }
+
+  TraceOps ops;
+  BOOST_TEST_REQUIRE(LoadTrace(kTracePath, &ops));
+  std::remove(kTracePath);
+
+  // 50 * (AddPlayer + AddSensor) + 11 * Tick + (50 + ... + 41) * UpdatePos + 10 * RemovePlayer
+  BOOST_TEST_REQUIRE((ops.size() == 50 * 2 + 11 + 455 + 10));
+  BOOST_TEST_REQUIRE((ReplayTrace(ops, replay_aoi) == results));
+}
+
+
+BOOST_AUTO_TEST_CASE(test_record_replay_squares) {
+  squares::SquareAoi record_aoi(20), replay_aoi(20);
+  TestRecordReplay(&record_aoi, &replay_aoi);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_record_replay_cross) {
+  // 带 beacon 的情况下，内部的 AddPlayerNoBeacon / UpdatePos 调用不能被重复记录
+  cross::CrossAoi record_aoi(-100, 100, -100, 100, 3, 3, 30);
+  cross::CrossAoi replay_aoi(-100, 100, -100, 100, 3, 3, 30);
+  TestRecordReplay(&record_aoi, &replay_aoi);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_record_replay_remove_sensor) {
+  cross::CrossAoi record_aoi(-100, 100, -100, 100, 3, 3, 30);
+  cross::CrossAoi replay_aoi(-100, 100, -100, 100, 3, 3, 30);
+
+  boost::random::mt19937 random_generator(20211118);
+  boost::random::uniform_real_distribution<float> pos_gen(-100, 100);
+  boost::random::uniform_real_distribution<float> move_gen(-5, 5);
+
+  std::vector<SortedInfos> results;
+  TraceWriter writer(kTracePath);
+  BOOST_TEST_REQUIRE(writer.IsOpen());
+  record_aoi.SetTraceWriter(&writer);
+
+  // 每个玩家两个 sensor，之后每次 Tick 删掉一个玩家的一个 sensor
+  std::vector<std::pair<Nuid, std::vector<Nuid>>> players;
+  for (int UNUSED(i) : boost::irange(30)) {
+    auto nuid = GenNuid();
+    record_aoi.AddPlayer(nuid, pos_gen(random_generator), 0, pos_gen(random_generator));
+    std::vector<Nuid> sensor_ids = {GenNuid(), GenNuid()};
+    record_aoi.AddSensor(nuid, sensor_ids[0], 20);
+    record_aoi.AddSensor(nuid, sensor_ids[1], 40);
+    players.emplace_back(nuid, sensor_ids);
+  }
+  results.push_back(SortInfos(record_aoi.Tick()));
+  for (int t : boost::irange(10)) {
+    for (const auto &elem : players) {
+      const auto &player = *record_aoi.GetPlayerMap().find(elem.first)->second;
+      record_aoi.UpdatePos(elem.first, player.pos.x + move_gen(random_generator), 0,
+                           player.pos.z + move_gen(random_generator));
+    }
+    record_aoi.RemoveSensor(players[t].first, players[t].second[t % 2]);
+    results.push_back(SortInfos(record_aoi.Tick()));
+  }
+  record_aoi.SetTraceWriter(nullptr);
+  writer.Close();
+
+  TraceOps ops;
+  BOOST_TEST_REQUIRE(LoadTrace(kTracePath, &ops));
+  std::remove(kTracePath);
+
+  size_t remove_num = std::count_if(ops.begin(), ops.end(), [](const TraceOp &op) {
+    return op.type == kTraceRemoveSensor;
+  });
+  BOOST_TEST_REQUIRE((remove_num == 10));
+  BOOST_TEST_REQUIRE((ReplayTrace(ops, &replay_aoi) == results));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,397 @@
+// Copyright <disenone>
+//
+// 稳态基准测试：固定随机种子生成场景，先跑若干次预热 Tick，再统计多次 Tick 的耗时分布，
+// 每个阶段输出一行 json（或 csv），方便不同提交之间对比。
+// Steady-state benchmark: deterministic scenes, warm-up ticks, then per-phase latency
+// distributions printed as one machine-readable record per (engine, scene, phase).
+// tick 阶段同时输出平均每次 Tick 的进出事件数，用 --leave-radius 对比不同离开半径下的事件量：
+// events_drop 是比 --leave-radius 0 少掉的比例，列表里没有 0 时也会先跑一次 0 作为对照。
+// --big-radius 让每 --big-every 个玩家里有一个 sensor 用大半径，模拟大小差别很大的 sensor 混在一起。
+// --moving 是每次 Tick 移动的玩家比例，可以给多个，用来对比增量维护格子和每次 Tick 重建格子的引擎。
+// squares-unordered 是不按 Morton 序重排玩家的 squares，用来对比 Tick 顺序的影响。
+// adaptive 从 simd_brute 开始，每 16 次 Tick 按场景形状重新选一次算法，预热阶段就会切换到位。
+// --resource 选择每个场景独占的 memory_resource：heap（默认，不用 resource）、arena、
+// huge（大页 arena）、monotonic、pool、sync-pool。monotonic 和 pool 不加锁，partitioned 会在
+// 多个线程里分配，只能用 arena、huge 或 sync-pool。teardown 阶段是析构 aoi 和 resource 的耗时。
+//
+// usage:
+//   aoi_bench [--engine squares|squares-quantized|squares-unordered|partitioned|cross|quadtree|
+//                      bvh|sorted_grid|simd_brute|adaptive|all] [--players 100,1000]
+//             [--map-sizes 50,1000] [--radius 100] [--big-radius 0] [--big-every 100]
+//             [--moving 0.1,1] [--leave-radius 0,120] [--warmup 5] [--ticks 50] [--runs 3]
+//             [--seed 20211118] [--format json|csv]
+//             [--resource heap|arena|huge|monotonic|pool|sync-pool]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/container/pmr/monotonic_buffer_resource.hpp>
+#include <boost/container/pmr/synchronized_pool_resource.hpp>
+#include <boost/container/pmr/unsynchronized_pool_resource.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+
+#include <adaptive/adaptive.hpp>
+#include <bvh/bvh.hpp>
+#include <common/arena.hpp>
+#include <common/latency.hpp>
+#include <common/nuid.hpp>
+#include <cross/cross.hpp>
+#include <quadtree/quadtree.hpp>
+#include <simd_brute/simd_brute.hpp>
+#include <sorted_grid/sorted_grid.hpp>
+#include <squares/partitioned.hpp>
+#include <squares/squares.hpp>
+
+using namespace aoi;
+
+struct BenchConfig {
+  std::vector<std::string> engines = {"squares", "cross"};
+  std::vector<size_t> player_nums = {100, 1000, 10000};
+  std::vector<float> map_sizes = {50, 100, 1000, 10000};
+  float radius = 100;
+  float big_radius = 0;                   // 大于 0 时每 big_every 个玩家里有一个 sensor 用这个半径
+  size_t big_every = 100;
+  std::vector<float> movings = {1};       // 每次 Tick 移动的玩家比例，只对移动的玩家调用 UpdatePos
+  std::vector<float> leave_radii = {0};   // 0 表示和 radius 相同
+  float speed = 6;
+  float delta_time = 0.1;
+  int warmup = 5;
+  int ticks = 50;
+  int runs = 3;
+  Uint32 seed = 20211118;
+  bool csv = false;
+  std::string resource = "heap";
+};
+
+struct BenchPos {
+  float x, z;
+};
+
+struct BenchScene {
+  std::vector<Nuid> nuids;
+  std::vector<BenchPos> positions;
+  std::vector<BenchPos> velocities;
+};
+
+typedef std::chrono::steady_clock BenchClock;
+
+const std::vector<std::string> kResources = {
+  "heap", "arena", "huge", "monotonic", "pool", "sync-pool"};
+
+inline double Seconds(BenchClock::time_point begin, BenchClock::time_point end) {
+  return std::chrono::duration<double>(end - begin).count();
+}
+
+
+BenchScene GenScene(const BenchConfig &config, size_t player_num, float map_size) {
+  BenchScene scene;
+  boost::random::mt19937 random_generator(config.seed);
+  boost::random::uniform_real_distribution<float> pos_gen(-map_size, map_size);
+  boost::random::uniform_real_distribution<float> angle_gen(0, 2 * M_PI);
+
+  float length = config.speed * config.delta_time;
+  for (size_t i = 0; i < player_num; ++i) {
+    scene.nuids.push_back(GenNuid());
+    scene.positions.push_back({pos_gen(random_generator), pos_gen(random_generator)});
+    float radian = angle_gen(random_generator);
+    scene.velocities.push_back({std::cos(radian) * length, std::sin(radian) * length});
+  }
+  return scene;
+}
+
+
+// 每次运行新建一个 resource，heap 返回空，引擎直接用全局堆
+MemoryResource* NewResource(const std::string &name) {
+  namespace pmr = boost::container::pmr;
+  if (name == "arena") return new Arena();
+  if (name == "huge") return new Arena(Arena::kDefaultChunkSize, true);
+  if (name == "monotonic") return new pmr::monotonic_buffer_resource();
+  if (name == "pool") return new pmr::unsynchronized_pool_resource();
+  if (name == "sync-pool") return new pmr::synchronized_pool_resource();
+  return nullptr;
+}
+
+
+// 前 moving_num 个玩家在地图内来回移动，保证多次 Tick 之间密度不变
+void MoveScene(float map_size, size_t moving_num, BenchScene *scene) {
+  for (size_t i = 0; i < moving_num; ++i) {
+    auto &pos = scene->positions[i];
+    auto &velocity = scene->velocities[i];
+    pos.x += velocity.x;
+    pos.z += velocity.z;
+    if (pos.x < -map_size || pos.x > map_size) velocity.x = -velocity.x;
+    if (pos.z < -map_size || pos.z > map_size) velocity.z = -velocity.z;
+  }
+}
+
+
+void PrintHeader(const BenchConfig &config) {
+  if (config.csv) {
+    printf("engine,players,map_size,moving,leave_radius,phase,n,mean_ms,p50_ms,p99_ms,max_ms,"
+           "events_per_tick,events_drop\n");
+  }
+}
+
+
+void PrintPhase(const BenchConfig &config, const std::string &engine, size_t player_num,
+                float map_size, float moving, float leave_radius, const char *phase,
+                LatencyStats *stats, double events_per_tick = 0, double events_drop = 0) {
+  const char *format = config.csv
+    ? "%s,%zu,%g,%g,%g,%s,%zu,%.6f,%.6f,%.6f,%.6f,%.2f,%.4f\n"
+    : "{\"engine\": \"%s\", \"players\": %zu, \"map_size\": %g, \"moving\": %g, "
+      "\"leave_radius\": %g, \"phase\": \"%s\", \"n\": %zu, \"mean_ms\": %.6f, "
+      "\"p50_ms\": %.6f, \"p99_ms\": %.6f, \"max_ms\": %.6f, \"events_per_tick\": %.2f, "
+      "\"events_drop\": %.4f}\n";
+  printf(format, engine.c_str(), player_num, map_size, moving, leave_radius, phase,
+         stats->Count(), stats->Mean() * 1e3, stats->Percentile(50) * 1e3,
+         stats->Percentile(99) * 1e3, stats->Max() * 1e3, events_per_tick, events_drop);
+  fflush(stdout);
+}
+
+
+template <typename AoiUpdateInfos>
+size_t CountEvents(const AoiUpdateInfos &update_infos) {
+  size_t events = 0;
+  for (const auto &elem : update_infos) {
+    for (const auto &sensor_info : elem.second.sensor_update_list) {
+      events += sensor_info.enters.size() + sensor_info.leaves.size();
+    }
+  }
+  return events;
+}
+
+
+// 返回平均每次 Tick 的进出事件数；base_events_per_tick 是同一场景 --leave-radius 0 的结果
+template <typename Aoi, typename Factory>
+double BenchOneScene(const BenchConfig &config, const std::string &engine, Factory factory,
+                     size_t player_num, float map_size, float moving, float leave_radius,
+                     double base_events_per_tick) {
+  LatencyStats add_stats, update_stats, tick_stats, teardown_stats;
+  double events = 0;
+  auto moving_num = static_cast<size_t>(player_num * moving);
+
+  for (int run = 0; run < config.runs; ++run) {
+    auto scene = GenScene(config, player_num, map_size);
+    std::unique_ptr<MemoryResource> resource(NewResource(config.resource));
+    std::unique_ptr<Aoi> aoi(factory(map_size, resource.get()));
+
+    auto begin = BenchClock::now();
+    for (size_t i = 0; i < player_num; ++i) {
+      const auto &pos = scene.positions[i];
+      aoi->AddPlayer(scene.nuids[i], pos.x, 0, pos.z);
+      auto sensor_id = GenNuid();
+      bool big = config.big_radius > 0 && i % config.big_every == 0;
+      aoi->AddSensor(scene.nuids[i], sensor_id, big ? config.big_radius : config.radius);
+      if (leave_radius > 0) aoi->SetSensorLeaveRadius(scene.nuids[i], sensor_id, leave_radius);
+    }
+    add_stats.Add(Seconds(begin, BenchClock::now()));
+
+    for (int tick = 0; tick < config.warmup + config.ticks; ++tick) {
+      bool measure = tick >= config.warmup;
+
+      MoveScene(map_size, moving_num, &scene);
+      begin = BenchClock::now();
+      for (size_t i = 0; i < moving_num; ++i) {
+        const auto &pos = scene.positions[i];
+        aoi->UpdatePos(scene.nuids[i], pos.x, 0, pos.z);
+      }
+      auto end = BenchClock::now();
+      if (measure) update_stats.Add(Seconds(begin, end));
+
+      begin = BenchClock::now();
+      auto update_infos = aoi->Tick();
+      end = BenchClock::now();
+      if (measure) {
+        tick_stats.Add(Seconds(begin, end));
+        events += CountEvents(update_infos);
+      }
+    }
+
+    begin = BenchClock::now();
+    aoi.reset();
+    resource.reset();
+    teardown_stats.Add(Seconds(begin, BenchClock::now()));
+  }
+
+  double events_per_tick = tick_stats.Count() ? events / tick_stats.Count() : 0;
+  double events_drop = base_events_per_tick > 0 ? 1 - events_per_tick / base_events_per_tick : 0;
+  PrintPhase(config, engine, player_num, map_size, moving, leave_radius, "add_player",
+             &add_stats);
+  PrintPhase(config, engine, player_num, map_size, moving, leave_radius, "update_pos",
+             &update_stats);
+  PrintPhase(config, engine, player_num, map_size, moving, leave_radius, "tick", &tick_stats,
+             events_per_tick, events_drop);
+  PrintPhase(config, engine, player_num, map_size, moving, leave_radius, "teardown",
+             &teardown_stats);
+  return events_per_tick;
+}
+
+
+template <typename Aoi, typename Factory>
+void BenchEngine(const BenchConfig &config, const std::string &engine, Factory factory) {
+  for (auto player_num : config.player_nums) {
+    for (auto map_size : config.map_sizes) {
+      for (auto moving : config.movings) {
+        // leave_radii 的第一个总是 0，后面的都和它比
+        double base_events_per_tick = 0;
+        for (auto leave_radius : config.leave_radii) {
+          double events_per_tick = BenchOneScene<Aoi>(config, engine, factory, player_num,
+                                                      map_size, moving, leave_radius,
+                                                      base_events_per_tick);
+          if (leave_radius == 0) base_events_per_tick = events_per_tick;
+        }
+      }
+    }
+  }
+}
+
+
+template <typename T>
+std::vector<T> ParseList(const char *arg) {
+  std::vector<T> ret;
+  std::stringstream ss(arg);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    std::stringstream item_ss(item);
+    T value;
+    if (item_ss >> value) ret.push_back(value);
+  }
+  return ret;
+}
+
+
+bool ParseArgs(int argc, char *argv[], BenchConfig *config) {
+  for (int i = 1; i < argc; ++i) {
+    std::string key = argv[i];
+    if (i + 1 >= argc) return false;
+    const char *value = argv[++i];
+
+    if (key == "--engine") {
+      config->engines = std::string(value) == "all"
+        ? std::vector<std::string>{"squares", "partitioned", "cross", "quadtree", "bvh",
+                                   "sorted_grid", "simd_brute", "adaptive"}
+        : ParseList<std::string>(value);
+    } else if (key == "--players") {
+      config->player_nums = ParseList<size_t>(value);
+    } else if (key == "--map-sizes") {
+      config->map_sizes = ParseList<float>(value);
+    } else if (key == "--radius") {
+      config->radius = std::atof(value);
+    } else if (key == "--big-radius") {
+      config->big_radius = std::atof(value);
+    } else if (key == "--big-every") {
+      config->big_every = std::max(1, std::atoi(value));
+    } else if (key == "--moving") {
+      config->movings = ParseList<float>(value);
+      for (auto &moving : config->movings) moving = std::min(std::max(moving, 0.f), 1.f);
+    } else if (key == "--leave-radius") {
+      config->leave_radii = ParseList<float>(value);
+      // 0 作为对照放在最前面
+      config->leave_radii.erase(std::remove(config->leave_radii.begin(), config->leave_radii.end(),
+                                            0.0f), config->leave_radii.end());
+      config->leave_radii.insert(config->leave_radii.begin(), 0.0f);
+    } else if (key == "--warmup") {
+      config->warmup = std::atoi(value);
+    } else if (key == "--ticks") {
+      config->ticks = std::atoi(value);
+    } else if (key == "--runs") {
+      config->runs = std::max(1, std::atoi(value));
+    } else if (key == "--seed") {
+      config->seed = std::strtoul(value, nullptr, 10);
+    } else if (key == "--format") {
+      config->csv = std::string(value) == "csv";
+    } else if (key == "--resource") {
+      config->resource = value;
+      if (std::find(kResources.begin(), kResources.end(), config->resource) == kResources.end()) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+int main(int argc, char *argv[]) {
+  BenchConfig config;
+  if (!ParseArgs(argc, argv, &config)) {
+    fprintf(stderr, "usage: %s [--engine squares|squares-quantized|squares-unordered|partitioned|"
+                    "cross|quadtree|bvh|sorted_grid|simd_brute|adaptive|all] "
+                    "[--players 100,1000] "
+                    "[--map-sizes 50,1000] [--radius 100] [--big-radius 0] [--big-every 100] "
+                    "[--moving 0.1,1] [--leave-radius 0,120] "
+                    "[--warmup 5] [--ticks 50] "
+                    "[--runs 3] [--seed 20211118] [--format json|csv] "
+                    "[--resource heap|arena|huge|monotonic|pool|sync-pool]\n", argv[0]);
+    return 1;
+  }
+
+  PrintHeader(config);
+  for (const auto &engine : config.engines) {
+    if (engine == "squares") {
+      BenchEngine<squares::SquareAoi>(config, engine, [](float, MemoryResource *resource) {
+        return new squares::SquareAoi(200, resource);
+      });
+    } else if (engine == "squares-quantized") {
+      BenchEngine<squares::SquareAoi>(config, engine, [](float, MemoryResource *resource) {
+        auto aoi = new squares::SquareAoi(200, resource);
+        aoi->EnableQuantization();
+        return aoi;
+      });
+    } else if (engine == "squares-unordered") {
+      BenchEngine<squares::SquareAoi>(config, engine, [](float, MemoryResource *resource) {
+        auto aoi = new squares::SquareAoi(200, resource);
+        aoi->SetReorderInterval(0);
+        return aoi;
+      });
+    } else if (engine == "partitioned") {
+      if (config.resource == "monotonic" || config.resource == "pool") {
+        fprintf(stderr, "partitioned needs a thread-safe resource: %s\n", config.resource.c_str());
+        return 1;
+      }
+      BenchEngine<squares::PartitionedAoi>(config, engine, [](float, MemoryResource *resource) {
+        return new squares::PartitionedAoi(200, 2000, 0, resource);
+      });
+    } else if (engine == "cross") {
+      BenchEngine<cross::CrossAoi>(config, engine, [](float map_size, MemoryResource *resource) {
+        return new cross::CrossAoi(-map_size, map_size, -map_size, map_size, 3, 3, 100, resource);
+      });
+    } else if (engine == "quadtree") {
+      BenchEngine<quadtree::QuadTreeAoi>(config, engine, [](float map_size, MemoryResource *resource) {
+        return new quadtree::QuadTreeAoi(map_size * 2, 16, 12, resource);
+      });
+    } else if (engine == "bvh") {
+      BenchEngine<bvh::BvhAoi>(config, engine, [](float, MemoryResource *resource) {
+        return new bvh::BvhAoi(10, resource);
+      });
+    } else if (engine == "sorted_grid") {
+      BenchEngine<sorted_grid::SortedGridAoi>(config, engine, [](float, MemoryResource *resource) {
+        return new sorted_grid::SortedGridAoi(200, 0, resource);
+      });
+    } else if (engine == "simd_brute") {
+      BenchEngine<simd_brute::SimdBruteAoi>(config, engine, [](float, MemoryResource *resource) {
+        return new simd_brute::SimdBruteAoi(resource);
+      });
+    } else if (engine == "adaptive") {
+      BenchEngine<adaptive::AdaptiveAoi>(config, engine, [](float map_size, MemoryResource *resource) {
+        adaptive::AdaptiveConfig aoi_config;
+        aoi_config.map_bound_xmin = aoi_config.map_bound_zmin = -map_size;
+        aoi_config.map_bound_xmax = aoi_config.map_bound_zmax = map_size;
+        return new adaptive::AdaptiveAoi(aoi_config, adaptive::kEngineBrute, resource);
+      });
+    } else {
+      fprintf(stderr, "unknown engine: %s\n", engine.c_str());
+      return 1;
+    }
+  }
+  return 0;
+}
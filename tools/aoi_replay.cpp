@@ -0,0 +1,187 @@
+// Copyright <disenone>
+//
+// 把 TraceWriter 记录的操作回放到指定的 aoi 算法上，统计每次 Tick 的耗时分布。
+// Replay a recorded trace against one engine and report the per-tick latency distribution.
+// 同时把每次 Tick 的事件用 EventEncoder 编码，对比每个 nuid 8 个字节时的大小。
+// 支持直方图的算法（squares、cross）还会输出整个回放的场景形状分布，
+// 编译时定义了 AOI_ENABLE_PHASE_TIMER 时再输出 Tick 内各阶段的耗时。
+//
+// usage:
+//   aoi_replay <trace> squares [square_size]
+//   aoi_replay <trace> cross [xmin xmax zmin zmax beacon_x beacon_z beacon_radius]
+//   aoi_replay <trace> quadtree [world_size [split_threshold [max_depth]]]
+//   aoi_replay <trace> bvh [margin]
+//   aoi_replay <trace> sorted_grid [cell_size [thread_num]]
+//   aoi_replay <trace> simd_brute
+//   aoi_replay <trace> adaptive [square_size [check_interval]]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <common/latency.hpp>
+#include <adaptive/adaptive.hpp>
+#include <bvh/bvh.hpp>
+#include <common/event_codec.hpp>
+#include <common/phase_timer.hpp>
+#include <common/trace.hpp>
+#include <cross/cross.hpp>
+#include <quadtree/quadtree.hpp>
+#include <simd_brute/simd_brute.hpp>
+#include <sorted_grid/sorted_grid.hpp>
+#include <squares/squares.hpp>
+
+using namespace aoi;
+
+// 有 EnableHistograms 的算法打开直方图，其余的什么都不做
+template <typename Aoi>
+auto EnableHistograms(Aoi *aoi, int) -> decltype(aoi->EnableHistograms(true), void()) {
+  aoi->EnableHistograms(true);
+}
+template <typename Aoi>
+void EnableHistograms(Aoi*, long) {}
+
+template <typename Aoi>
+auto PrintHistograms(Aoi *aoi, int) -> decltype(aoi->TakeWindowHistograms(), void()) {
+  auto histograms = aoi->TakeWindowHistograms();
+  printf("visible    %s\n", histograms.visible.Format().c_str());
+  printf("candidates %s\n", histograms.candidates.Format().c_str());
+  if (histograms.occupancy.Count()) {
+    printf("occupancy  %s\n", histograms.occupancy.Format().c_str());
+  }
+  printf("enters     %s\n", histograms.enters.Format().c_str());
+  printf("leaves     %s\n", histograms.leaves.Format().c_str());
+}
+template <typename Aoi>
+void PrintHistograms(Aoi*, long) {}
+
+// 有 GetTickPhaseCycles 的算法累计每次 Tick 各阶段的周期数
+template <typename Aoi>
+auto AddPhaseCycles(const Aoi &aoi, PhaseCycles *cycles, int)
+    -> decltype(aoi.GetTickPhaseCycles(), void()) {
+  cycles->Merge(aoi.GetTickPhaseCycles());
+}
+template <typename Aoi>
+void AddPhaseCycles(const Aoi&, PhaseCycles*, long) {}
+
+template <typename Aoi>
+int Replay(const std::string &path, Aoi *aoi) {
+  TraceReader reader(path);
+  if (!reader.IsOpen()) {
+    fprintf(stderr, "can not open trace file: %s\n", path.c_str());
+    return 1;
+  }
+
+  LatencyStats tick_stats;
+  size_t op_num = 0;
+  size_t enter_num = 0;
+  size_t leave_num = 0;
+  size_t encoded_bytes = 0;
+  EventEncoder encoder;
+  PhaseCycles phase_cycles;
+  std::vector<Uint8> buffer;
+  TraceOp op;
+  EnableHistograms(aoi, 0);
+  while (reader.Next(&op)) {
+    ++op_num;
+    if (op.type != kTraceTick) {
+      ApplyTraceOp(aoi, op);
+      continue;
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    auto update_infos = aoi->Tick();
+    auto end = std::chrono::steady_clock::now();
+    tick_stats.Add(std::chrono::duration<double>(end - begin).count());
+    AddPhaseCycles(*aoi, &phase_cycles, 0);
+
+    for (const auto &elem : update_infos) {
+      for (const auto &sensor_info : elem.second.sensor_update_list) {
+        enter_num += sensor_info.enters.size();
+        leave_num += sensor_info.leaves.size();
+      }
+    }
+    buffer.resize(EventEncoder::MaxEncodedSize(update_infos));
+    encoded_bytes += encoder.Encode(&update_infos, buffer.data(), buffer.size());
+  }
+
+  printf("ops: %zu, ticks: %zu, enters: %zu, leaves: %zu\n",
+         op_num, tick_stats.Count(), enter_num, leave_num);
+  printf("event bytes: %zu encoded, %zu as raw nuids\n",
+         encoded_bytes, (enter_num + leave_num) * sizeof(Nuid));
+  printf("Tick %s\n", tick_stats.Format().c_str());
+  PrintHistograms(aoi, 0);
+  if (phase_cycles.Total()) printf("phases %s\n", phase_cycles.Format().c_str());
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <trace> squares [square_size]\n"
+                    "       %s <trace> cross [xmin xmax zmin zmax beacon_x beacon_z beacon_radius]\n"
+                    "       %s <trace> quadtree [world_size [split_threshold [max_depth]]]\n"
+                    "       %s <trace> bvh [margin]\n"
+                    "       %s <trace> sorted_grid [cell_size [thread_num]]\n"
+                    "       %s <trace> simd_brute\n"
+                    "       %s <trace> adaptive [square_size [check_interval]]\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+    return 1;
+  }
+
+  std::string path = argv[1];
+  std::string engine = argv[2];
+  if (engine == "squares") {
+    float square_size = argc > 3 ? std::atof(argv[3]) : 200;
+    squares::SquareAoi aoi(square_size);
+    return Replay(path, &aoi);
+  } else if (engine == "cross") {
+    if (argc > 3 && argc < 10) {
+      fprintf(stderr, "cross needs all of: xmin xmax zmin zmax beacon_x beacon_z beacon_radius\n");
+      return 1;
+    }
+    float bounds[4] = {0, 0, 0, 0};
+    size_t beacon_x = 0, beacon_z = 0;
+    float beacon_radius = 0;
+    if (argc >= 10) {
+      for (int i = 0; i < 4; ++i) bounds[i] = std::atof(argv[3 + i]);
+      beacon_x = std::atoi(argv[7]);
+      beacon_z = std::atoi(argv[8]);
+      beacon_radius = std::atof(argv[9]);
+    }
+    cross::CrossAoi aoi(bounds[0], bounds[1], bounds[2], bounds[3],
+                        beacon_x, beacon_z, beacon_radius);
+    return Replay(path, &aoi);
+  } else if (engine == "quadtree") {
+    float world_size = argc > 3 ? std::atof(argv[3]) : 20000;
+    Uint32 split_threshold = argc > 4 ? std::atoi(argv[4]) : 16;
+    Uint32 max_depth = argc > 5 ? std::atoi(argv[5]) : 12;
+    quadtree::QuadTreeAoi aoi(world_size, split_threshold, max_depth);
+    return Replay(path, &aoi);
+  } else if (engine == "bvh") {
+    float margin = argc > 3 ? std::atof(argv[3]) : 10;
+    bvh::BvhAoi aoi(margin);
+    return Replay(path, &aoi);
+  } else if (engine == "sorted_grid") {
+    float cell_size = argc > 3 ? std::atof(argv[3]) : 200;
+    size_t thread_num = argc > 4 ? std::atoi(argv[4]) : 0;
+    sorted_grid::SortedGridAoi aoi(cell_size, thread_num);
+    return Replay(path, &aoi);
+  } else if (engine == "simd_brute") {
+    simd_brute::SimdBruteAoi aoi;
+    return Replay(path, &aoi);
+  } else if (engine == "adaptive") {
+    adaptive::AdaptiveConfig config;
+    if (argc > 3) config.square_size = std::atof(argv[3]);
+    if (argc > 4) config.check_interval = std::atoi(argv[4]);
+    adaptive::AdaptiveAoi aoi(config);
+    int ret = Replay(path, &aoi);
+    printf("engine: %s, switches: %zu\n", adaptive::EngineKindName(aoi.GetEngineKind()),
+           aoi.GetSwitchCount());
+    return ret;
+  }
+
+  fprintf(stderr, "unknown engine: %s\n", engine.c_str());
+  return 1;
+}